@@ -20,13 +20,15 @@ extern "C" {
 typedef enum {
     TAU_METRIC_NULL=0,
     TAU_METRIC_COUNTER=1,    /**< counter_t */
-    TAU_METRIC_GAUGE=2       /**< gauge_t */
+    TAU_METRIC_GAUGE=2,      /**< gauge_t */
+    TAU_METRIC_HISTOGRAM=3   /**< counter_t sample of a histogram (name_bucket{le=...}, name_sum or name_count) */
 }tau_metric_type_t;
 
 static const char * const tau_metric_type_name[] =
 {
     "TAU_METRIC_COUNTER",
-    "TAU_METRIC_GAUGE"
+    "TAU_METRIC_GAUGE",
+    "TAU_METRIC_HISTOGRAM"
 };
 
 #define METRIC_STRING_SIZE 300
@@ -67,6 +69,59 @@ static inline void tau_metric_event_print(tau_metric_event_t *me)
     fprintf(stderr, "%s : %f\n", me->name, me->value);
 }
 
+/** Number of sliding windows maintained per series (1 s, 10 s and 60 s) */
+#define TAU_METRIC_WINDOW_COUNT 3
+
+/**
+ * @brief Aggregates of the updates received in each sliding window
+ *
+ * Updates are increments for counters and samples for gauges,
+ * min max and avg are NaN for windows without updates
+ */
+typedef struct {
+    double rate[TAU_METRIC_WINDOW_COUNT]; /**< Sum of the updates per second */
+    double avg[TAU_METRIC_WINDOW_COUNT];  /**< Mean update */
+    double min[TAU_METRIC_WINDOW_COUNT];  /**< Smallest update */
+    double max[TAU_METRIC_WINDOW_COUNT];  /**< Largest update */
+}tau_metric_window_stats_t;
+
+/**
+ * @brief This is a metric value with its sliding window aggregates
+ *
+ */
+typedef struct {
+    tau_metric_event_t event;
+    tau_metric_window_stats_t windows;
+}tau_metric_stats_t;
+
+/**
+ * @brief This is used to request the recent samples of a metric
+ *
+ */
+typedef struct {
+    char name[METRIC_STRING_SIZE];
+    double start; /**< First timestamp (0 for the oldest) */
+    double end;   /**< Last timestamp (0 for the newest) */
+}tau_metric_history_request_t;
+
+/**
+ * @brief This is used to select the metrics of a query
+ *
+ */
+typedef struct {
+    char pattern[METRIC_STRING_SIZE]; /**< Name prefix or regular expression anchored at the start (empty for all) */
+    char jobid[64];                   /**< Query the metrics of this running job (empty for the node) */
+}tau_metric_filter_request_t;
+
+/**
+ * @brief This is one sample from a metric history
+ *
+ */
+typedef struct {
+    double ts;
+    double value;
+}tau_metric_history_sample_t;
+
 typedef struct {
     char jobid[64];
     char command[512];
@@ -113,6 +168,16 @@ typedef enum
     TAU_METRIC_MSG_GET_ONE=4,       /**< Get one metric server side
                                         IN: tau_metric_descriptor_t OUT: tau_metric_event_t */
     TAU_METRIC_MSG_JOB_DESCRIPTION=5, /** IN: inside node piggybacked (tau_metric_job_descriptor_t) OUT: NONE*/
+    TAU_METRIC_MSG_GET_HISTORY=6,   /**< Get the recent samples of a metric
+                                        IN: tau_metric_history_request_t OUT: (int N) N*tau_metric_history_sample_t */
+    TAU_METRIC_MSG_GET_ONE_STATS=7, /**< Get one metric with its window aggregates
+                                        IN: tau_metric_descriptor_t OUT: tau_metric_stats_t */
+    TAU_METRIC_MSG_GET_ALL_STATS=8, /**< Get all metrics with their window aggregates
+                                        IN: (ignored) OUT: (int N) N*tau_metric_stats_t */
+    TAU_METRIC_MSG_LIST_MATCHING=9, /**< List the metrics matching a pattern
+                                        IN: tau_metric_filter_request_t OUT: (int N) N*tau_metric_descriptor_t */
+    TAU_METRIC_MSG_GET_MATCHING=10, /**< Get the values of the metrics matching a pattern
+                                        IN: tau_metric_filter_request_t OUT: (int N) N*tau_metric_event_t */
     TAU_METRIC_MSG_COUNT
 }tau_metric_msg_type_t;
 
@@ -122,7 +187,13 @@ static const char * const tau_metric_msg_type_name[] =
     "TAU_METRIC_MSG_VAL",
     "TAU_METRIC_MSG_LIST_ALL",
     "TAU_METRIC_MSG_GET_ALL",
-    "TAU_METRIC_MSG_GET_ONE"
+    "TAU_METRIC_MSG_GET_ONE",
+    "TAU_METRIC_MSG_JOB_DESCRIPTION",
+    "TAU_METRIC_MSG_GET_HISTORY",
+    "TAU_METRIC_MSG_GET_ONE_STATS",
+    "TAU_METRIC_MSG_GET_ALL_STATS",
+    "TAU_METRIC_MSG_LIST_MATCHING",
+    "TAU_METRIC_MSG_GET_MATCHING"
 };
 
 /**
@@ -134,6 +205,8 @@ typedef struct {
     union {
         tau_metric_descriptor_t desc;
         tau_metric_event_t event;
+        tau_metric_history_request_t history;
+        tau_metric_filter_request_t filter;
     }payload;
     char canary;
 }tau_metric_msg_t;
@@ -23,6 +23,7 @@ class metric_type(Enum):
     TAU_METRIC_NULL = 0
     TAU_METRIC_COUNTER = 1
     TAU_METRIC_GAUGE = 2
+    TAU_METRIC_HISTOGRAM = 3
 
 class tau_metric_descriptor(Structure):
     _fields_ = [("name", c_char*METRIC_STRING_SIZE),
@@ -32,6 +33,27 @@ class tau_metric_descriptor(Structure):
 class tau_metric_event_t(Structure):
     _fields_ = [("name", c_char*METRIC_STRING_SIZE), ("value", c_double), ("update_ts", c_double)]
 
+TAU_METRIC_WINDOW_COUNT=3
+TAU_METRIC_WINDOW_LENGTH=[1, 10, 60]
+
+class tau_metric_window_stats_t(Structure):
+    _fields_ = [("rate", c_double*TAU_METRIC_WINDOW_COUNT),
+                ("avg", c_double*TAU_METRIC_WINDOW_COUNT),
+                ("min", c_double*TAU_METRIC_WINDOW_COUNT),
+                ("max", c_double*TAU_METRIC_WINDOW_COUNT)]
+
+class tau_metric_stats_t(Structure):
+    _fields_ = [("event", tau_metric_event_t), ("windows", tau_metric_window_stats_t)]
+
+class tau_metric_history_request_t(Structure):
+    _fields_ = [("name", c_char*METRIC_STRING_SIZE), ("start", c_double), ("end", c_double)]
+
+class tau_metric_filter_request_t(Structure):
+    _fields_ = [("pattern", c_char*METRIC_STRING_SIZE), ("jobid", c_char*64)]
+
+class tau_metric_history_sample_t(Structure):
+    _fields_ = [("ts", c_double), ("value", c_double)]
+
 class metric_msg_type(Enum):
     # Send data
     TAU_METRIC_MSG_DESC=0
@@ -40,11 +62,17 @@ class metric_msg_type(Enum):
     TAU_METRIC_MSG_LIST_ALL=2
     TAU_METRIC_MSG_GET_ALL=3
     TAU_METRIC_MSG_GET_ONE=4
+    TAU_METRIC_MSG_JOB_DESCRIPTION=5
+    TAU_METRIC_MSG_GET_HISTORY=6
+    TAU_METRIC_MSG_GET_ONE_STATS=7
+    TAU_METRIC_MSG_GET_ALL_STATS=8
+    TAU_METRIC_MSG_LIST_MATCHING=9
+    TAU_METRIC_MSG_GET_MATCHING=10
     # Count
-    TAU_METRIC_MSG_COUNT=5
+    TAU_METRIC_MSG_COUNT=11
 
 class msg_payload(Union):
-    _fields_ = ("desc", tau_metric_descriptor), ("event", tau_metric_event_t)
+    _fields_ = ("desc", tau_metric_descriptor), ("event", tau_metric_event_t), ("history", tau_metric_history_request_t), ("filter", tau_metric_filter_request_t)
 
 class metric_msg(Structure):
     _fields_ = [("type", c_int), ("payload", msg_payload), ("canary", c_char) ]
@@ -69,15 +97,24 @@ class ProxyClient():
         self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
         self.sock.connect(server_socket)
 
-    def _do_count_request(self, operation):
-        m = metric_msg(canary=0x7, type=operation.value)
+    def _do_count_request(self, operation, match=None, job=None):
+        if match or job:
+            # Filtered server side
+            f = tau_metric_filter_request_t(pattern=bytes(match or "", encoding='utf-8'),
+                                            jobid=bytes(job or "", encoding='utf-8'))
+            m = metric_msg(canary=0x7, type=operation.value, payload=msg_payload(filter=f))
+        else:
+            m = metric_msg(canary=0x7, type=operation.value)
         self.sock.sendall(m)
         c_number_of_entries = c_int()
         self.sock.recv_into(c_number_of_entries)
         return c_number_of_entries.value
 
-    def list_metrics(self):
-        number_of_entries = self._do_count_request(metric_msg_type.TAU_METRIC_MSG_LIST_ALL)
+    def list_metrics(self, match=None, job=None):
+        if match or job:
+            number_of_entries = self._do_count_request(metric_msg_type.TAU_METRIC_MSG_LIST_MATCHING, match, job)
+        else:
+            number_of_entries = self._do_count_request(metric_msg_type.TAU_METRIC_MSG_LIST_ALL)
 
         metric_desc = tau_metric_descriptor()
 
@@ -97,8 +134,11 @@ class ProxyClient():
                         "value": metric_event.value}
 
 
-    def get_all(self):
-        number_of_entries = self._do_count_request(metric_msg_type.TAU_METRIC_MSG_GET_ALL)
+    def get_all(self, match=None, job=None):
+        if match or job:
+            number_of_entries = self._do_count_request(metric_msg_type.TAU_METRIC_MSG_GET_MATCHING, match, job)
+        else:
+            number_of_entries = self._do_count_request(metric_msg_type.TAU_METRIC_MSG_GET_ALL)
 
         metric_event = tau_metric_event_t()
 
@@ -110,6 +150,26 @@ class ProxyClient():
 
         return ret
 
+    def _parse_metric_stats(self, metric_stats):
+        ret = self._parse_metric_event(metric_stats.event)
+        for i in range(0, TAU_METRIC_WINDOW_COUNT):
+            w = "{}s".format(TAU_METRIC_WINDOW_LENGTH[i])
+            ret["rate_" + w] = metric_stats.windows.rate[i]
+            ret["min_" + w] = metric_stats.windows.min[i]
+            ret["max_" + w] = metric_stats.windows.max[i]
+        return ret
+
+    def get_all_stats(self):
+        number_of_entries = self._do_count_request(metric_msg_type.TAU_METRIC_MSG_GET_ALL_STATS)
+
+        ret = []
+
+        for _ in range(0, number_of_entries):
+            metric_stats = tau_metric_stats_t.from_buffer_copy(self._recv_exact(sizeof(tau_metric_stats_t)))
+            ret.append(self._parse_metric_stats(metric_stats))
+
+        return ret
+
     def get_one(self, name=""):
         d = tau_metric_descriptor(name=bytes(name, encoding='utf-8'))
         p = msg_payload(desc=d)
@@ -121,6 +181,31 @@ class ProxyClient():
         self.sock.recv_into(metric_event)
         return self._parse_metric_event(metric_event)
 
+    def _recv_exact(self, size):
+        data = bytearray()
+        while len(data) < size:
+            chunk = self.sock.recv(size - len(data))
+            if not chunk:
+                break
+            data += chunk
+        return bytes(data)
+
+    def get_history(self, name="", start=0, end=0):
+        r = tau_metric_history_request_t(name=bytes(name, encoding='utf-8'), start=start, end=end)
+        p = msg_payload(history=r)
+        m = metric_msg(canary=0x7,
+                       type=metric_msg_type.TAU_METRIC_MSG_GET_HISTORY.value, payload=p)
+        self.sock.sendall(m)
+
+        c_number_of_samples = c_int()
+        self.sock.recv_into(c_number_of_samples)
+
+        n = c_number_of_samples.value
+        samples = (tau_metric_history_sample_t * n).from_buffer_copy(
+            self._recv_exact(n * sizeof(tau_metric_history_sample_t)))
+
+        return [{"ts": x.ts, "value": x.value} for x in samples]
+
     def get_list(self, name_list):
         ret = [self.get_one(x) for x in name_list]
         return [ x for x in ret if x["name"]]
@@ -230,8 +315,8 @@ def _show_data(data, fmt="json"):
                 print("{} ".format(data[k]), end="")
             print("")
 
-def _do_list(client, fmt="md"):
-    metrics = client.list_metrics()
+def _do_list(client, fmt="md", match=None, job=None):
+    metrics = client.list_metrics(match, job)
 
     if fmt == "md":
         md = "# List of tau_metric_exporter Metrics\n\n" + "\n".join(["* **{}** ({}) : {}".format(x["name"], x["type"], x["doc"]) for x in metrics])
@@ -250,8 +335,26 @@ def __show_value_list(values, fmt="md"):
 
     return 0
 
-def _do_values(client, fmt="md"):
-    values = [ x for x in client.get_all() if x["value"] > 0 ]
+def _do_values(client, fmt="md", match=None, job=None):
+    values = [ x for x in client.get_all(match, job) if x["value"] > 0 ]
+    return __show_value_list(values, fmt)
+
+def _do_stats(client, fmt="md"):
+    values = [ x for x in client.get_all_stats() if x["value"] > 0 ]
+    if fmt == "md":
+        md = "# List of tau_metric_exporter Rates\n\n" + "\n".join(["* {} = **{}** @ {} ({:g}/s {:g}/s {:g}/s)".format(x["name"], x["value"], x["ts"], x["rate_1s"], x["rate_10s"], x["rate_60s"]) for x in values])
+        _show_md(md)
+    else:
+        _show_data(values, fmt=fmt)
+
+    return 0
+
+def _do_history(client, argument, fmt="md"):
+    name_list = [argument]
+
+    list_shell_escape(name_list)
+
+    values = [{"name": name_list[0], "ts": x["ts"], "value": x["value"]} for x in client.get_history(name_list[0])]
     return __show_value_list(values, fmt)
 
 def _do_get_list(client, argument, fmt="md"):
@@ -284,8 +387,15 @@ def run():
     parser.add_argument('-l', "--list",  action='store_true', help="List metrics in the tau_metric_proxy")
     parser.add_argument('-v', "--values",  action='store_true', help="List all values in the tau_metric_proxy")
 
+    parser.add_argument('-m', '--match', type=str, help="Only list metrics starting with this prefix or matching this regular expression")
+    parser.add_argument('-j', '--job', type=str, help="List the metrics of this running job instead of the node ones")
+
     parser.add_argument('-g', '--get', type=str, help="Get values by name (comma separated)")
 
+    parser.add_argument('-w', "--windows",  action='store_true', help="List all values with their 1s 10s and 60s rates (needs a proxy running with -W)")
+
+    parser.add_argument('-H', '--history', type=str, help="Get the recent samples of a value (needs a proxy running with -H)")
+
     parser.add_argument('-t', "--track",  action='store_true', help="Track all non-null counters over time")
     parser.add_argument('-T', '--track-list', type=str, help="Track a given list of values over time")
 
@@ -303,14 +413,20 @@ def run():
     client = ProxyClient(server_sock)
 
     if args.list:
-        return _do_list(client, fmt=args.format)
+        return _do_list(client, fmt=args.format, match=args.match, job=args.job)
 
     if args.values:
-        return _do_values(client, fmt=args.format)
+        return _do_values(client, fmt=args.format, match=args.match, job=args.job)
 
     if args.get:
         return _do_get_list(client, args.get, args.format)
 
+    if args.windows:
+        return _do_stats(client, args.format)
+
+    if args.history:
+        return _do_history(client, args.history, args.format)
+
     if args.track:
         if not args.output:
             print("Default output goes to log.js consider altering with -o")
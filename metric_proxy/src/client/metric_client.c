@@ -143,7 +143,8 @@ int tau_client_metric_send(int fd, struct tau_client_metric_s *m)
     switch(m->type)
     {
         case TAU_METRIC_COUNTER:
-            /* Get the value and reset to 0 */
+        case TAU_METRIC_HISTOGRAM:
+            /* Get the value and reset to 0 (the proxy sums histogram samples as counters) */
             msg.payload.event.value = m->value;
             m->value = 0;
         break;
@@ -152,6 +153,7 @@ int tau_client_metric_send(int fd, struct tau_client_metric_s *m)
             msg.payload.event.value = m->value;
         break;
         case TAU_METRIC_NULL:
+            pthread_spin_unlock(&m->lock);
             return -1;
     }
 
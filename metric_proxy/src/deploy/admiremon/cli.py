@@ -27,6 +27,7 @@ class ConfigserverLoop (Thread):
         self.client_list = server.client_list
         self.socket = socket
         self.first = True
+        self.root_host = None
 
     def _append_state(self, state):
         if "host" not in state:
@@ -48,9 +49,17 @@ class ConfigserverLoop (Thread):
             if self.first:
                 state["first"] = True
                 self.first = False
+                self.root_host = state["host"]
+                # The proxy of the first node is the root of the aggregation tree,
+                # known from its registration so that every later node joins it
+                if "tau_tree" in state:
+                    self.server.tree_root = state["tau_tree"]
             else:
                 state["first"] = False
 
+            if self.server.tree_root and state["host"] != self.root_host:
+                state["tree_root"] = self.server.tree_root
+
             self.client_list[state["host"]] = state
             return state
         else:
@@ -109,6 +118,7 @@ class ADMIRE_config_server():
         self.listensock.listen()
 
         self.client_list = {}
+        self.tree_root = None
 
         self.host = socket.gethostname()
         self.port = self.listensock.getsockname()[1]
@@ -280,10 +290,20 @@ scrape_configs:
             pass
 
 
+def free_port():
+    # Picked by the kernel among the free ones of this node, the proxy binds it right after
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.bind(("", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
 class ADMIRE_node():
 
     def __init__(self, args, command_runner):
         self.runner = command_runner
+        self.args = args
         # Configure and connect socket
         self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         root_server = args.setup
@@ -320,7 +340,7 @@ class ADMIRE_node():
         pid = os.getpid()
         random.seed(pid)
         proxy_path = "/tmp/tau_proxy_{}.unix".format(random.random())
-        exporter_port = 20000 + pid % 1000
+        exporter_port = free_port()
 
         self.config["tau_proxy"] = proxy_path
         self.config["tau_exporter"] = "{}:{}".format(
@@ -335,6 +355,15 @@ class ADMIRE_node():
 
         cmd += ["-u", proxy_path, "-p", str(exporter_port)]
 
+        if self.args.tree:
+            # Proxies join the root which redirects them down the tree,
+            # they retry until it listens
+            tree_port = self.config["tau_tree"].split(":")[-1]
+            cmd += ["-L", tree_port, "-k", str(self.args.tree)]
+
+            if not first:
+                cmd += ["-U", self.config["tree_root"]]
+
         self.runner.run(cmd)
         # Give it a second to start
         time.sleep(1)
@@ -358,6 +387,11 @@ class ADMIRE_node():
 
     def _register_config(self, args):
         self.config = {"host": socket.gethostname()}
+
+        if args.tree:
+            # Sent at registration: the first node is the root of the tree
+            self.config["tau_tree"] = "{}:{}".format(socket.gethostname(), free_port())
+
         self.config = self._exchange_config(self.config)
 
         if self.config["new"]:
@@ -395,6 +429,9 @@ def inject_proxies(runner, conf_server, args, left_args):
         if args.freq:
             extra_logging =  extra_logging + ["-f", str(args.freq)]
 
+    if args.tree:
+        extra_logging = extra_logging + ["-t", str(args.tree)]
+
     instrum = [SCRIPT, "-s", conf_server.address()] + extra_logging + ["-w", "--"]
 
     full_cmd = prefix + instrum + suffix
@@ -430,6 +467,9 @@ def run():
     parser.add_argument('-o', '--output', type=str,
                         help="File to store the result to")
 
+    parser.add_argument('-t', '--tree', type=int,
+                        help="Aggregate the proxies in a tree of this fan-out, the first one exposes the totals on /tree/metrics")
+
     parser.add_argument('-s', '--setup', type=str,
                         help="Pointer to the root node to proceed to node-level setup")
 
@@ -6,6 +6,8 @@ import glob
 import json
 import argparse
 import hashlib
+import struct
+import zlib
 from ctypes import *
 from enum import Enum
 import re
@@ -259,6 +261,7 @@ class metric_type(Enum):
     TAU_METRIC_NULL = 0
     TAU_METRIC_COUNTER = 1
     TAU_METRIC_GAUGE = 2
+    TAU_METRIC_HISTOGRAM = 3
 
 class tau_metric_job_descriptor_t(Structure):
     _fields_ = [("jobid", c_char*64),
@@ -280,6 +283,97 @@ class tau_metric_event_t(Structure):
 class tau_metric_snapshot_t(Structure):
     _fields_ = [("type", c_int), ("doc", c_char*METRIC_STRING_SIZE), ("event", tau_metric_event_t), ("canary", c_int)]
 
+TAU_METRIC_DUMP_MAGIC = b"TAUPROF\0"
+TAU_METRIC_DUMP_VERSION = 2
+
+class tau_metric_dump_codec(Enum):
+    NONE = 0
+    ZLIB = 1
+    SNAPPY = 2
+
+class tau_metric_dump_header_t(Structure):
+    _fields_ = [("magic", c_char*8),
+                ("version", c_uint32),
+                ("codec", c_uint32),
+                ("metric_count", c_uint64),
+                ("strings_len", c_uint64),
+                ("raw_len", c_uint64),
+                ("stored_len", c_uint64),
+                ("payload_crc", c_uint32),
+                ("header_crc", c_uint32),
+                ("desc", tau_metric_job_descriptor_t)]
+
+def _crc32c_table():
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82F63B78 if crc & 1 else 0)
+        table.append(crc)
+    return table
+
+_CRC32C_TABLE = _crc32c_table()
+
+def crc32c(data):
+    # The native module is much faster when installed
+    try:
+        import crc32c as native
+        return native.crc32c(data)
+    except ImportError:
+        pass
+    crc = 0xFFFFFFFF
+    table = _CRC32C_TABLE
+    for b in data:
+        crc = (crc >> 8) ^ table[(crc ^ b) & 0xFF]
+    return crc ^ 0xFFFFFFFF
+
+def snappy_uncompress(data):
+    # Length of the data then literals and copies
+    length = 0
+    shift = 0
+    pos = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        length |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            break
+
+    out = bytearray()
+    while pos < len(data):
+        tag = data[pos]
+        pos += 1
+        kind = tag & 3
+        if kind == 0:
+            size = tag >> 2
+            if size >= 60:
+                extra = size - 59
+                size = int.from_bytes(data[pos:pos+extra], "little")
+                pos += extra
+            size += 1
+            out += data[pos:pos+size]
+            pos += size
+            continue
+        if kind == 1:
+            size = 4 + ((tag >> 2) & 7)
+            offset = ((tag >> 5) << 8) | data[pos]
+            pos += 1
+        else:
+            extra = 2 if kind == 2 else 4
+            size = (tag >> 2) + 1
+            offset = int.from_bytes(data[pos:pos+extra], "little")
+            pos += extra
+        if offset == 0 or offset > len(out):
+            raise Exception("Corrupted snappy block")
+        # Copies may overlap their output
+        for _ in range(size):
+            out.append(out[-offset])
+
+    if len(out) != length:
+        raise Exception("Corrupted snappy block")
+    return bytes(out)
+
 # Done with the C API
 
 class SingleProfile():
@@ -289,8 +383,21 @@ class SingleProfile():
         self.dump = tau_metric_dump_t()
         if not os.path.isfile(path_to_prof):
             raise Exception("Cannot locate profile {}".format(path_to_prof))
+        self.segments = []
         with open(path_to_prof, "rb") as f:
-            f.readinto(self.dump)
+            if f.read(len(TAU_METRIC_DUMP_MAGIC)) == TAU_METRIC_DUMP_MAGIC:
+                f.seek(0)
+                self.segments = self.read_segments(f.read())
+                self.dump.desc = self.segments[0][0].desc
+                for h, _ in self.segments[1:]:
+                    self.merge_desc(h.desc)
+                if len(self.segments) == 1:
+                    self.dump.metric_count = self.segments[0][0].metric_count
+                else:
+                    self.dump.metric_count = len(self.get_values_v2(keep_zeros=True))
+            else:
+                f.seek(0)
+                f.readinto(self.dump)
         self.desc = self.json_desc()
 
     def size(self):
@@ -328,7 +435,85 @@ class SingleProfile():
             "rundir" : self.dump.desc.run_dir.decode("ascii")
         }
 
+    def read_segments(self, data):
+        # A base dump followed by the dumps appended to it, checked as the
+        # proxy does: reading stops at the first bad or torn segment
+        segments = []
+        offset = 0
+        hlen = sizeof(tau_metric_dump_header_t)
+        crc_offset = tau_metric_dump_header_t.header_crc.offset
+        while offset + hlen <= len(data):
+            h = tau_metric_dump_header_t.from_buffer_copy(data, offset)
+            if h.magic != TAU_METRIC_DUMP_MAGIC.rstrip(b"\0"):
+                break
+            if h.version != TAU_METRIC_DUMP_VERSION:
+                raise Exception("Unsupported version {} in {}".format(h.version, self.path))
+            raw = bytearray(data[offset:offset + hlen])
+            raw[crc_offset:crc_offset + 4] = b"\0\0\0\0"
+            if crc32c(raw) != h.header_crc:
+                break
+            payload = data[offset + hlen:offset + hlen + h.stored_len]
+            if len(payload) != h.stored_len or crc32c(payload) != h.payload_crc:
+                break
+            segments.append((h, payload))
+            offset += hlen + h.stored_len
+        if not segments:
+            raise Exception("Corrupted header in {}".format(self.path))
+        if offset < len(data):
+            print("Ignoring {} bytes after the last valid segment of {}".format(len(data) - offset, self.path), file=sys.stderr)
+        return segments
+
+    def merge_desc(self, run):
+        desc = self.dump.desc
+        if run.command not in desc.command:
+            desc.command = "{} : {}".format(desc.command.decode("ascii"),
+                                            run.command.decode("ascii")).encode("ascii")[:511]
+        desc.start_time = min(desc.start_time, run.start_time)
+        desc.end_time = max(desc.end_time, run.end_time)
+
+    def get_segment_values(self, h, payload):
+        codec = tau_metric_dump_codec(h.codec)
+        if codec == tau_metric_dump_codec.ZLIB:
+            payload = zlib.decompress(payload)
+        elif codec == tau_metric_dump_codec.SNAPPY:
+            payload = snappy_uncompress(payload)
+        if len(payload) != h.raw_len:
+            raise Exception("Corrupted payload in {}".format(self.path))
+        n = h.metric_count
+        vals = struct.unpack_from("{}d".format(n), payload, 0)
+        names = struct.unpack_from("{}I".format(n), payload, 16 * n)
+        docs = struct.unpack_from("{}I".format(n), payload, 20 * n)
+        types = payload[24 * n:25 * n]
+        strings = payload[25 * n:]
+
+        def string(offset):
+            return strings[offset:strings.index(b"\0", offset)].decode("ascii")
+
+        for i in range(0, n):
+            yield string(names[i]), string(docs[i]), metric_type(types[i]).name, vals[i]
+
+    def get_values_v2(self, keep_zeros=False):
+        # Segments merge as the proxy does: counters and histogram samples add up, gauges average
+        values = {}
+        for h, payload in self.segments:
+            for name, doc, mtype, value in self.get_segment_values(h, payload):
+                if name not in values:
+                    values[name] = {
+                        "doc" : doc,
+                        "type" : mtype,
+                        "value" : value
+                    }
+                elif values[name]["type"] in (metric_type.TAU_METRIC_COUNTER.name, metric_type.TAU_METRIC_HISTOGRAM.name):
+                    values[name]["value"] += value
+                else:
+                    values[name]["value"] = (values[name]["value"] + value) / 2
+        if keep_zeros:
+            return values
+        return { k: v for k, v in values.items() if v["value"] != 0 }
+
     def get_values(self):
+        if self.segments:
+            return self.get_values_v2()
         values = {}
         dump = tau_metric_dump_t()
         with open(self.path, "rb") as f:
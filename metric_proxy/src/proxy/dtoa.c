@@ -0,0 +1,542 @@
+#include "dtoa.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/* Shortest round trip conversion after Ulf Adams, "Ryu: fast
+   float-to-string conversion" (PLDI 2018), for IEEE 754 doubles */
+
+#define DTOA_MANTISSA_BITS 52
+#define DTOA_EXPONENT_BITS 11
+#define DTOA_BIAS 1023
+
+#define DTOA_POW5_INV_BITCOUNT 125
+#define DTOA_POW5_BITCOUNT 125
+#define DTOA_POW5_INV_TABLE_SIZE 342
+#define DTOA_POW5_TABLE_SIZE 326
+
+/*********************
+* MULTIPLIER TABLES *
+*********************/
+
+/* 125 most significant bits of 5^i (low word first) */
+static uint64_t __pow5_split[DTOA_POW5_TABLE_SIZE][2];
+/* floor(2^(bitlength(5^i) - 1 + 125) / 5^i) + 1 (low word first) */
+static uint64_t __pow5_inv_split[DTOA_POW5_INV_TABLE_SIZE][2];
+
+static pthread_once_t __tables_once = PTHREAD_ONCE_INIT;
+
+/* Big enough for 2 * 5^341 */
+#define DTOA_BIG_WORDS 26
+
+typedef struct
+{
+	uint32_t w[DTOA_BIG_WORDS]; /* Low word first */
+}dtoa_big_t;
+
+static int __big_bitlength(const dtoa_big_t *b)
+{
+	int i;
+
+	for(i = DTOA_BIG_WORDS - 1; 0 <= i; i--)
+	{
+		if(b->w[i])
+		{
+			return i * 32 + 32 - __builtin_clz(b->w[i]);
+		}
+	}
+
+	return 0;
+}
+
+static inline int __big_bit(const dtoa_big_t *b, int bit)
+{
+	return (b->w[bit / 32] >> (bit % 32) ) & 1;
+}
+
+static void __big_mul_small(dtoa_big_t *b, uint32_t factor)
+{
+	uint64_t carry = 0;
+	int i;
+
+	for(i = 0; i < DTOA_BIG_WORDS; i++)
+	{
+		carry   += (uint64_t)b->w[i] * factor;
+		b->w[i]  = (uint32_t)carry;
+		carry  >>= 32;
+	}
+}
+
+/* Shift left by one bit and add a low bit */
+static void __big_shift_in(dtoa_big_t *b, int bit)
+{
+	uint32_t carry = bit;
+	int i;
+
+	for(i = 0; i < DTOA_BIG_WORDS; i++)
+	{
+		uint32_t next = b->w[i] >> 31;
+		b->w[i] = (b->w[i] << 1) | carry;
+		carry   = next;
+	}
+}
+
+/* Subtract d from r if r >= d, returns 1 if it did */
+static int __big_sub_if_greater(dtoa_big_t *r, const dtoa_big_t *d)
+{
+	int i;
+
+	for(i = DTOA_BIG_WORDS - 1; 0 <= i; i--)
+	{
+		if(r->w[i] != d->w[i])
+		{
+			break;
+		}
+	}
+
+	if( (0 <= i) && (r->w[i] < d->w[i]) )
+	{
+		return 0;
+	}
+
+	int64_t borrow = 0;
+
+	for(i = 0; i < DTOA_BIG_WORDS; i++)
+	{
+		int64_t diff = (int64_t)r->w[i] - d->w[i] - borrow;
+		borrow  = diff < 0;
+		r->w[i] = (uint32_t)diff;
+	}
+
+	return 1;
+}
+
+/* Exact tables computed once instead of being shipped as constants */
+static void __tables_init(void)
+{
+	dtoa_big_t pow5;
+	int        i, bit;
+
+	memset(&pow5, 0, sizeof(dtoa_big_t) );
+	pow5.w[0] = 1;
+
+	for(i = 0; i < DTOA_POW5_INV_TABLE_SIZE; i++)
+	{
+		int bitlength = __big_bitlength(&pow5);
+
+		if(i < DTOA_POW5_TABLE_SIZE)
+		{
+			unsigned __int128 top   = 0;
+			int               shift = bitlength - DTOA_POW5_BITCOUNT;
+
+			for(bit = bitlength - 1; (0 <= bit) && (shift <= bit); bit--)
+			{
+				top = (top << 1) | __big_bit(&pow5, bit);
+			}
+
+			if(shift < 0)
+			{
+				top <<= -shift;
+			}
+
+			__pow5_split[i][0] = (uint64_t)top;
+			__pow5_split[i][1] = (uint64_t)(top >> 64);
+		}
+
+		/* Long division of 2^j bit by bit, the quotient has 126 bits at most */
+		int               j   = bitlength - 1 + DTOA_POW5_INV_BITCOUNT;
+		unsigned __int128 inv = 0;
+		dtoa_big_t        rem;
+
+		memset(&rem, 0, sizeof(dtoa_big_t) );
+
+		for(bit = j; 0 <= bit; bit--)
+		{
+			__big_shift_in(&rem, bit == j);
+			inv = (inv << 1) | __big_sub_if_greater(&rem, &pow5);
+		}
+
+		inv += 1;
+
+		__pow5_inv_split[i][0] = (uint64_t)inv;
+		__pow5_inv_split[i][1] = (uint64_t)(inv >> 64);
+
+		__big_mul_small(&pow5, 5);
+	}
+}
+
+/********
+* RYU *
+********/
+
+/* ceil(log2(5^e)) for 0 <= e <= 3528 (1 for e = 0) */
+static inline int32_t __pow5bits(int32_t e)
+{
+	return (int32_t)( ( (uint32_t)e * 1217359) >> 19) + 1;
+}
+
+/* floor(log10(2^e)) for 0 <= e <= 1650 */
+static inline uint32_t __log10_pow2(int32_t e)
+{
+	return ( (uint32_t)e * 78913) >> 18;
+}
+
+/* floor(log10(5^e)) for 0 <= e <= 2620 */
+static inline uint32_t __log10_pow5(int32_t e)
+{
+	return ( (uint32_t)e * 732923) >> 20;
+}
+
+static inline uint32_t __pow5_factor(uint64_t value)
+{
+	uint32_t count = 0;
+
+	while(value % 5 == 0)
+	{
+		value /= 5;
+		count++;
+	}
+
+	return count;
+}
+
+static inline int __multiple_of_pow5(uint64_t value, uint32_t p)
+{
+	return __pow5_factor(value) >= p;
+}
+
+static inline int __multiple_of_pow2(uint64_t value, uint32_t p)
+{
+	return (value & ( (1ull << p) - 1) ) == 0;
+}
+
+static inline uint64_t __mul_shift64(uint64_t m, const uint64_t *mul, int32_t j)
+{
+	unsigned __int128 b0 = (unsigned __int128)m * mul[0];
+	unsigned __int128 b2 = (unsigned __int128)m * mul[1];
+
+	return (uint64_t)( ( (b0 >> 64) + b2) >> (j - 64) );
+}
+
+/* Shortest decimal (digits, exponent) in the rounding interval of a finite non zero double */
+static void __ryu(uint64_t ieee_mantissa, uint32_t ieee_exponent, uint64_t *digits, int32_t *exponent)
+{
+	int32_t  e2;
+	uint64_t m2;
+
+	if(ieee_exponent == 0)
+	{
+		e2 = 1 - DTOA_BIAS - DTOA_MANTISSA_BITS - 2;
+		m2 = ieee_mantissa;
+	}
+	else
+	{
+		e2 = (int32_t)ieee_exponent - DTOA_BIAS - DTOA_MANTISSA_BITS - 2;
+		m2 = (1ull << DTOA_MANTISSA_BITS) | ieee_mantissa;
+	}
+
+	const int accept_bounds = (m2 & 1) == 0;
+
+	/* Step 2: the interval of the values rounding to the double, times 4 */
+	const uint64_t mv       = 4 * m2;
+	const uint32_t mm_shift = (ieee_mantissa != 0) || (ieee_exponent <= 1);
+
+	/* Step 3: the interval in base 10 */
+	uint64_t vr, vp, vm;
+	int32_t  e10;
+	int      vm_trailing_zeros = 0;
+	int      vr_trailing_zeros = 0;
+
+	if(0 <= e2)
+	{
+		const uint32_t q = __log10_pow2(e2) - (3 < e2);
+		const int32_t  k = DTOA_POW5_INV_BITCOUNT + __pow5bits(q) - 1;
+		const int32_t  i = -e2 + (int32_t)q + k;
+
+		e10 = q;
+		vr  = __mul_shift64(4 * m2, __pow5_inv_split[q], i);
+		vp  = __mul_shift64(4 * m2 + 2, __pow5_inv_split[q], i);
+		vm  = __mul_shift64(4 * m2 - 1 - mm_shift, __pow5_inv_split[q], i);
+
+		if(q <= 21)
+		{
+			/* Only one of mp mv and mm can be a multiple of 5 */
+			if(mv % 5 == 0)
+			{
+				vr_trailing_zeros = __multiple_of_pow5(mv, q);
+			}
+			else if(accept_bounds)
+			{
+				vm_trailing_zeros = __multiple_of_pow5(mv - 1 - mm_shift, q);
+			}
+			else
+			{
+				vp -= __multiple_of_pow5(mv + 2, q);
+			}
+		}
+	}
+	else
+	{
+		const uint32_t q = __log10_pow5(-e2) - (1 < -e2);
+		const int32_t  i = -e2 - (int32_t)q;
+		const int32_t  k = __pow5bits(i) - DTOA_POW5_BITCOUNT;
+		const int32_t  j = (int32_t)q - k;
+
+		e10 = (int32_t)q + e2;
+		vr  = __mul_shift64(4 * m2, __pow5_split[i], j);
+		vp  = __mul_shift64(4 * m2 + 2, __pow5_split[i], j);
+		vm  = __mul_shift64(4 * m2 - 1 - mm_shift, __pow5_split[i], j);
+
+		if(q <= 1)
+		{
+			/* mv has at least q trailing zero bits */
+			vr_trailing_zeros = 1;
+
+			if(accept_bounds)
+			{
+				vm_trailing_zeros = mm_shift == 1;
+			}
+			else
+			{
+				vp--;
+			}
+		}
+		else if(q < 63)
+		{
+			vr_trailing_zeros = __multiple_of_pow2(mv, q);
+		}
+	}
+
+	/* Step 4: drop the digits shared by the whole interval */
+	int32_t  removed      = 0;
+	uint8_t  last_removed = 0;
+	uint64_t output;
+
+	if(vm_trailing_zeros || vr_trailing_zeros)
+	{
+		/* Rare: exact bounds or ties */
+		while(vm / 10 < vp / 10)
+		{
+			vm_trailing_zeros &= vm % 10 == 0;
+			vr_trailing_zeros &= last_removed == 0;
+			last_removed       = vr % 10;
+			vr                /= 10;
+			vp                /= 10;
+			vm                /= 10;
+			removed++;
+		}
+
+		if(vm_trailing_zeros)
+		{
+			while(vm % 10 == 0)
+			{
+				vr_trailing_zeros &= last_removed == 0;
+				last_removed       = vr % 10;
+				vr                /= 10;
+				vp                /= 10;
+				vm                /= 10;
+				removed++;
+			}
+		}
+
+		/* Round half to even */
+		if(vr_trailing_zeros && (last_removed == 5) && (vr % 2 == 0) )
+		{
+			last_removed = 4;
+		}
+
+		output = vr + ( ( (vr == vm) && (!accept_bounds || !vm_trailing_zeros) ) || (5 <= last_removed) );
+	}
+	else
+	{
+		int round_up = 0;
+
+		while(vm / 10 < vp / 10)
+		{
+			round_up = 5 <= vr % 10;
+			vr      /= 10;
+			vp      /= 10;
+			vm      /= 10;
+			removed++;
+		}
+
+		output = vr + ( (vr == vm) || round_up);
+	}
+
+	*digits   = output;
+	*exponent = e10 + removed;
+}
+
+/**********
+* OUTPUT *
+**********/
+
+static const char __digit_pairs[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static inline int __decimal_length(uint64_t v)
+{
+	int ret = 1;
+
+	while(10 <= v)
+	{
+		v /= 10;
+		ret++;
+	}
+
+	return ret;
+}
+
+/* Write the len digits of v ending just before end */
+static inline void __write_digits(uint64_t v, char *end)
+{
+	while(100 <= v)
+	{
+		uint32_t pair = (v % 100) * 2;
+		v   /= 100;
+		end -= 2;
+		memcpy(end, __digit_pairs + pair, 2);
+	}
+
+	if(10 <= v)
+	{
+		end -= 2;
+		memcpy(end, __digit_pairs + v * 2, 2);
+	}
+	else
+	{
+		*(--end) = '0' + v;
+	}
+}
+
+int dtoa_u64(uint64_t value, char *out)
+{
+	int len = __decimal_length(value);
+
+	__write_digits(value, out + len);
+	out[len] = '\0';
+
+	return len;
+}
+
+/* Lay out digits * 10^exponent as %g would */
+static int __format_decimal(char *out, uint64_t digits, int32_t exponent)
+{
+	/* Rounding up may end on a zero */
+	while(digits % 10 == 0)
+	{
+		digits /= 10;
+		exponent++;
+	}
+
+	char    buff[20];
+	int     len        = dtoa_u64(digits, buff);
+	int32_t scientific = exponent + len - 1;
+	char *  w          = out;
+
+	if( (scientific < -4) || (17 <= scientific) )
+	{
+		*(w++) = buff[0];
+
+		if(1 < len)
+		{
+			*(w++) = '.';
+			memcpy(w, buff + 1, len - 1);
+			w += len - 1;
+		}
+
+		*(w++) = 'e';
+		*(w++) = (scientific < 0) ? '-' : '+';
+
+		uint32_t e = (scientific < 0) ? -scientific : scientific;
+
+		if(e < 10)
+		{
+			*(w++) = '0';
+		}
+
+		w += dtoa_u64(e, w);
+	}
+	else if(0 <= exponent)
+	{
+		/* Integer */
+		memcpy(w, buff, len);
+		w += len;
+		memset(w, '0', exponent);
+		w += exponent;
+	}
+	else if(0 <= scientific)
+	{
+		/* Point inside the digits */
+		memcpy(w, buff, scientific + 1);
+		w     += scientific + 1;
+		*(w++) = '.';
+		memcpy(w, buff + scientific + 1, len - scientific - 1);
+		w += len - scientific - 1;
+	}
+	else
+	{
+		/* Leading zeros */
+		*(w++) = '0';
+		*(w++) = '.';
+		memset(w, '0', -scientific - 1);
+		w += -scientific - 1;
+		memcpy(w, buff, len);
+		w += len;
+	}
+
+	*w = '\0';
+
+	return w - out;
+}
+
+int dtoa_shortest(double value, char *out)
+{
+	uint64_t bits;
+
+	memcpy(&bits, &value, sizeof(double) );
+
+	const int      sign          = (bits >> (DTOA_MANTISSA_BITS + DTOA_EXPONENT_BITS) ) & 1;
+	const uint64_t ieee_mantissa = bits & ( (1ull << DTOA_MANTISSA_BITS) - 1);
+	const uint32_t ieee_exponent = (bits >> DTOA_MANTISSA_BITS) & ( (1u << DTOA_EXPONENT_BITS) - 1);
+
+	if(ieee_exponent == (1u << DTOA_EXPONENT_BITS) - 1)
+	{
+		const char *special = ieee_mantissa ? "NaN" : (sign ? "-Inf" : "+Inf");
+		strcpy(out, special);
+		return strlen(special);
+	}
+
+	char *w = out;
+
+	if(sign)
+	{
+		*(w++) = '-';
+	}
+
+	/* Counters and most gauges hold integers */
+	double magnitude = sign ? -value : value;
+
+	if( (magnitude < 9007199254740992.0) && ( (double)(uint64_t)magnitude == magnitude) )
+	{
+		return (w - out) + dtoa_u64( (uint64_t)magnitude, w);
+	}
+
+	pthread_once(&__tables_once, __tables_init);
+
+	uint64_t digits;
+	int32_t  exponent;
+
+	__ryu(ieee_mantissa, ieee_exponent, &digits, &exponent);
+
+	return (w - out) + __format_decimal(w, digits, exponent);
+}
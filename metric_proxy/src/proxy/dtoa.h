@@ -0,0 +1,37 @@
+#ifndef TAU_METRIC_PROXY_DTOA_H
+#define TAU_METRIC_PROXY_DTOA_H
+
+#include <stdint.h>
+
+/*********************
+* NUMBER FORMATTING *
+*********************/
+
+/** Longest text written by the formatters (terminator included) */
+#define DTOA_BUFFER_SIZE 32
+
+/**
+ * @brief Write the shortest decimal text reading back as the same double
+ *
+ * Integers below 2^53 take a fast path. The other values are converted
+ * with the Ryu algorithm, locale independent. The layout follows %g
+ * (fixed point for decimal exponents in [-4, 17[ scientific otherwise)
+ * with as many digits as needed. Non finite values are NaN +Inf and -Inf
+ * as in the Prometheus exposition formats.
+ *
+ * @param value the value to format
+ * @param out at least DTOA_BUFFER_SIZE bytes, NUL terminated
+ * @return int length of the text
+ */
+int dtoa_shortest(double value, char *out);
+
+/**
+ * @brief Write an unsigned integer in decimal
+ *
+ * @param value the value to format
+ * @param out at least DTOA_BUFFER_SIZE bytes, NUL terminated
+ * @return int length of the text
+ */
+int dtoa_u64(uint64_t value, char *out);
+
+#endif /* TAU_METRIC_PROXY_DTOA_H */
@@ -1,8 +1,17 @@
+/* accept4 and memmem */
+#define _GNU_SOURCE
+
+#include "config.h"
 #include "exporter.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -12,14 +21,24 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
+#include <stdarg.h>
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+#include <zlib.h>
+#endif
 
+#include "dtoa.h"
 #include "log.h"
 #include "metrics.h"
 #include "server.h"
+#include "stats.h"
+#include "tree.h"
+#include "utils.h"
 
 
 
-static int __bind_listening_thread(const char *port)
+static int __bind_listening_socket(const char *port, int reuseport)
 {
 	struct addrinfo *res = NULL;
 	struct addrinfo  hints;
@@ -36,9 +55,9 @@ static int __bind_listening_thread(const char *port)
 	 * configurations demandées */
 	int ret = getaddrinfo(NULL, port, &hints, &res);
 
-	if(ret < 0)
+	if(ret != 0)
 	{
-		herror("getaddrinfo");
+		tau_metric_proxy_error("getaddrinfo: %s", gai_strerror(ret) );
 		return -1;
 	}
 
@@ -50,7 +69,7 @@ static int __bind_listening_thread(const char *port)
 
 	for(tmp = res; tmp != NULL; tmp = tmp->ai_next)
 	{
-		listen_sock = socket(tmp->ai_family, tmp->ai_socktype, tmp->ai_protocol);
+		listen_sock = socket(tmp->ai_family, tmp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, tmp->ai_protocol);
 
 		if(listen_sock < 0)
 		{
@@ -58,12 +77,25 @@ static int __bind_listening_thread(const char *port)
 			continue;
 		}
 
+		int one = 1;
+
+		/* Restarts do not wait for TIME_WAIT sockets */
+		setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int) );
+
+#ifdef SO_REUSEPORT
+		/* Each worker accepts on its own socket, the kernel balances them */
+		if(reuseport && (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(int) ) < 0) )
+		{
+			tau_metric_proxy_perror("setsockopt SO_REUSEPORT");
+		}
+#endif
+
 		ret = bind(listen_sock, tmp->ai_addr, tmp->ai_addrlen);
 
 		if(ret < 0)
 		{
 			close(listen_sock);
-			tau_metric_proxy_perror("bind");
+			tau_metric_proxy_log_verbose("bind: %s", strerror(errno) );
 			continue;
 		}
 
@@ -71,6 +103,8 @@ static int __bind_listening_thread(const char *port)
 		break;
 	}
 
+	freeaddrinfo(res);
+
 	if(!binded)
 	{
 		tau_metric_proxy_error("Failed to bind on 0.0.0.0:%s", port);
@@ -78,177 +112,161 @@ static int __bind_listening_thread(const char *port)
 	}
 
 	/* On commence a ecouter */
-	ret = listen(listen_sock, 2);
+	ret = listen(listen_sock, SOMAXCONN);
 
 	if(ret < 0)
 	{
 		tau_metric_proxy_perror("listen");
+		close(listen_sock);
 		return -1;
 	}
 
 	return listen_sock;
 }
 
-static void __write_http_header(size_t len, int code, char *content_type, int fd)
+static const char *__http_status(int code)
 {
-	char header_buffer[512];
-
-	char *response_type = NULL;
-
 	switch(code)
 	{
 		case 200:
-			response_type = "200 OK";
-			break;
+			return "200 OK";
+
+		case 400:
+			return "400 Bad Request";
 
 		case 404:
-			response_type = "404 Not Found";
-			break;
-	}
+			return "404 Not Found";
+
+		case 405:
+			return "405 Method Not Allowed";
 
-	snprintf(header_buffer, 512, "HTTP/1.1 %s\nContent-Type: %s\nContent-Length: %ld\n\n", response_type, content_type, len);
-	safe_write(fd, header_buffer, strlen(header_buffer) );
-	//printf(header_buffer);
+		case 431:
+			return "431 Request Header Fields Too Large";
+
+		default:
+			return "500 Internal Server Error";
+	}
 }
 
-#define METRIC_TREE_MAX_SIBLINGS    4096
+/******************
+* OUTPUT BUILDER *
+******************/
 
-struct metric_tree
+/* Append-only text buffer, always NUL terminated past current_offset */
+struct growing_string
 {
-	char                basename[METRIC_STRING_SIZE];
-	metric_t *          metrics[METRIC_TREE_MAX_SIBLINGS];
-	int                 siblings_count;
-	struct metric_tree *next;
+	char * buffer;
+	size_t current_offset; /**< Bytes of text */
+	size_t buffer_size;
 };
 
-
-char *metric_tree_get_basename(char *buff, metric_t *m)
+static void *growing_string_alloc(struct growing_string *gb, size_t init_size)
 {
-	snprintf(buff, METRIC_STRING_SIZE, "%s", m->name);
-	char *bracket = strchr(buff, '{');
+	/* Not zeroed: only the terminator is needed */
+	gb->buffer         = malloc(init_size);
+	gb->buffer_size    = init_size;
+	gb->current_offset = 0;
 
-	if(bracket)
+	if(!gb->buffer)
 	{
-		*bracket = '\0';
+		tau_metric_proxy_perror("malloc");
+		return NULL;
 	}
 
-	return buff;
+	gb->buffer[0] = '\0';
+
+	return gb->buffer;
 }
 
-struct metric_tree *metric_tree_regiter(struct metric_tree *current_tree, metric_t *metric)
+/* Make room for size more bytes (and the terminator), returns where to write them */
+static inline char *growing_string_reserve(struct growing_string *gb, size_t size)
 {
-	char metric_base[METRIC_STRING_SIZE];
-
-	metric_tree_get_basename(metric_base, metric);
-
-	tau_metric_proxy_log_verbose("Registering %s", metric->name);
-
-	/* Now look for metric in the tree */
-	struct metric_tree *tmp = current_tree;
-
-	while(tmp)
+	if( (gb->buffer_size - gb->current_offset) <= size)
 	{
-		if(!strcmp(metric_base, tmp->basename) )
-		{
-			/* DID Match*/
-			if(tmp->siblings_count < METRIC_TREE_MAX_SIBLINGS)
-			{
-				tmp->metrics[tmp->siblings_count] = metric;
-				tmp->siblings_count++;
-			}
-			else
-			{
-				tau_metric_proxy_error("submetric overflow some metrics were dropped :%s", metric->name);
-			}
+		size_t new_size = gb->buffer_size * 2;
 
-			return current_tree;
+		while( (new_size - gb->current_offset) <= size)
+		{
+			new_size *= 2;
 		}
 
-		tmp = tmp->next;
-	}
+		char *new_buffer = realloc(gb->buffer, new_size);
 
-	/* If we are here we do not known this base metric yet */
-	struct metric_tree *new = (struct metric_tree *)malloc(sizeof(struct metric_tree) );
+		if(!new_buffer)
+		{
+			tau_metric_proxy_perror("realloc");
+			return NULL;
+		}
 
-	if(!new)
-	{
-		tau_metric_proxy_perror("Failed to malloc new metric in tree");
-		return current_tree;
+		gb->buffer      = new_buffer;
+		gb->buffer_size = new_size;
 	}
 
-	snprintf(new->basename, METRIC_STRING_SIZE, "%s", metric_base);
-	new->metrics[0]     = metric;
-	new->siblings_count = 1;
-	new->next           = current_tree;
-
-	return new;
+	return gb->buffer + gb->current_offset;
 }
 
-void metric_tree_free(struct metric_tree *mt)
+static inline void growing_string_commit(struct growing_string *gb, size_t size)
 {
-	struct metric_tree *tmp = mt;
-
-	while(tmp)
-	{
-		struct metric_tree *to_free = tmp;
-		tmp = tmp->next;
-		free(to_free);
-	}
+	gb->current_offset += size;
+	gb->buffer[gb->current_offset] = '\0';
 }
 
-struct growing_string
-{
-	char * buffer;
-	size_t current_offset;
-	size_t buffer_size;
-};
-
-
-void *growing_string_alloc(struct growing_string *gb, size_t init_size)
+static inline void *growing_string_append_len(struct growing_string *gb, const char *to_add, size_t size)
 {
-	gb->buffer = malloc(init_size);
+	char *tail = growing_string_reserve(gb, size);
 
-	if(!gb->buffer)
+	if(!tail)
 	{
-		tau_metric_proxy_perror("malloc");
 		return NULL;
 	}
 
-	gb->buffer_size    = init_size;
-	gb->current_offset = 1;
-
-	memset(gb->buffer, 0, gb->buffer_size);
+	memcpy(tail, to_add, size);
+	growing_string_commit(gb, size);
 
 	return gb->buffer;
 }
 
-void *growing_string_append(struct growing_string *gb, const char *to_add)
+static inline void *growing_string_append(struct growing_string *gb, const char *to_add)
 {
-	int needed_size = strlen(to_add);
+	return growing_string_append_len(gb, to_add, strlen(to_add) );
+}
 
-	if( (gb->buffer_size - gb->current_offset) <= needed_size)
-	{
-		gb->buffer_size *= 2;
-		printf("New size %ld for %d", gb->buffer_size, needed_size);
-		gb->buffer = realloc(gb->buffer, gb->buffer_size);
+/* Formats straight in the buffer, retrying once after growing if needed */
+static void *growing_string_printf(struct growing_string *gb, const char *fmt, ...)
+{
+	va_list ap;
 
-		memset(gb->buffer + gb->buffer_size / 2, 0, gb->buffer_size / 2);
+	va_start(ap, fmt);
+	int len = vsnprintf(gb->buffer + gb->current_offset, gb->buffer_size - gb->current_offset, fmt, ap);
+	va_end(ap);
 
+	if(len < 0)
+	{
+		return NULL;
+	}
 
-		if(!gb->buffer)
+	if( (gb->buffer_size - gb->current_offset) <= (size_t)len)
+	{
+		if(!growing_string_reserve(gb, len) )
 		{
-			tau_metric_proxy_perror("realloc");
 			return NULL;
 		}
+
+		va_start(ap, fmt);
+		vsnprintf(gb->buffer + gb->current_offset, gb->buffer_size - gb->current_offset, fmt, ap);
+		va_end(ap);
 	}
 
-	strcat(gb->buffer + gb->current_offset - 1, to_add);
-	gb->current_offset += needed_size;
+	gb->current_offset += len;
 
 	return gb->buffer;
 }
 
-static char *__serialize_metric_type(metric_t *m, char *buff, int len)
+/*****************
+* SERIALIZATION *
+*****************/
+
+static char *__serialize_metric_type(metric_snapshot_entry_t *m, char *buff, int len)
 {
 	switch(m->type)
 	{
@@ -259,244 +277,3724 @@ static char *__serialize_metric_type(metric_t *m, char *buff, int len)
 		case TAU_METRIC_GAUGE:
 			snprintf(buff, len, "gauge");
 			break;
+
+		case TAU_METRIC_HISTOGRAM:
+			snprintf(buff, len, "histogram");
+			break;
 	}
 
 	return buff;
 }
 
-static char *__serialize_metric_value(metric_t *m, char *buff, int len)
+static void __serialize_metric_value(struct growing_string *gb, metric_snapshot_entry_t *m)
 {
-	switch(m->type)
-	{
-		case TAU_METRIC_COUNTER:
-			snprintf(buff, len, "%s %f\n", m->name, m->metrics.counter.value);
-			break;
+	size_t size = m->name_len + m->text_len + 2;
+	char * line = growing_string_reserve(gb, size);
 
-		case TAU_METRIC_GAUGE:
-			snprintf(buff, len, "%s %f\n", m->name, m->metrics.gauge.avg);
-			break;
+	if(!line)
+	{
+		return;
 	}
 
-	return buff;
+	/* Name and value text are both ready: only copies here */
+	memcpy(line, m->name, m->name_len);
+	line[m->name_len] = ' ';
+	memcpy(line + m->name_len + 1, m->text, m->text_len);
+	line[m->name_len + 1 + m->text_len] = '\n';
+
+	growing_string_commit(gb, size);
 }
 
-char *metric_tree_serialize(struct metric_tree *mt, size_t *len)
+static inline double __window_value(const tau_metric_window_stats_t *stats, const char *aggregate, int w)
 {
-	struct growing_string gb;
-	void *buff = growing_string_alloc(&gb, 1024 * 1024);
+	if(!strcmp(aggregate, "min") )
+	{
+		return stats->min[w];
+	}
+
+	if(!strcmp(aggregate, "max") )
+	{
+		return stats->max[w];
+	}
 
-	/* Now walk the metric array */
-	struct metric_tree *tmp = mt;
+	return stats->rate[w];
+}
+
+/* Derived series are named basename_aggregate with a window label */
+static char *__serialize_window_name(const char *name, const char *basename, const char *aggregate,
+                                     int window, char *buff, int len)
+{
+	const char *labels = strchr(name, '{');
+	size_t      inner  = labels ? strlen(labels) - 2 : 0;
 
-	while(tmp)
+	if(labels && (0 < (ssize_t)inner) )
 	{
-		tau_metric_proxy_log_verbose("%s has %d siblings", tmp->basename, tmp->siblings_count);
-		char buff[METRIC_STRING_SIZE * 2];
-		snprintf(buff, METRIC_STRING_SIZE * 2, "# HELP %s %s", tmp->basename, tmp->metrics[0]->doc);
-		/* Generate the metric header */
-		growing_string_append(&gb, buff);
+		snprintf(buff, len, "%s_%s{%.*s,window=\"%gs\"}", basename, aggregate, (int)inner, labels + 1,
+		         tau_metric_window_length[window]);
+	}
+	else
+	{
+		snprintf(buff, len, "%s_%s{window=\"%gs\"}", basename, aggregate, tau_metric_window_length[window]);
+	}
 
-		char type[64];
-		__serialize_metric_type(tmp->metrics[0], type, 64);
-		snprintf(buff, METRIC_STRING_SIZE * 2, "\n# TYPE %s %s\n", tmp->basename, type);
+	return buff;
+}
+
+/** Parts of a family in the text formats */
+typedef enum
+{
+	FAMILY_PART_HEADER,
+	FAMILY_PART_VALUES,
+	FAMILY_PART_WINDOWS /**< Then one part per window aggregate */
+}family_part_t;
+
+/* Position in a family serialized over several calls, families of the
+   text formats can be cut between two lines */
+typedef struct
+{
+	int      part;          /**< Next part to serialize (see @ref family_part_t) */
+	uint64_t member;        /**< Next member in this part */
+	int      window_header; /**< The header of the window family is out */
+	int      stop;          /**< Part to stop at (FAMILY_PART_HEADER for none) */
+}family_cursor_t;
+
+static void __serialize_windows(struct growing_string *gb, metric_snapshot_entry_t *members, uint64_t count,
+                                const char *basename, const char *aggregate, const char *doc,
+                                family_cursor_t *cursor, size_t limit)
+{
+	/* Name then value */
+	char name[METRIC_STRING_SIZE * 2 + DTOA_BUFFER_SIZE + 2];
+	int w;
 
+	for(; (cursor->member < count) && (gb->current_offset < limit); cursor->member++)
+	{
+		metric_snapshot_entry_t *m = &members[cursor->member];
+		const tau_metric_window_stats_t *stats = m->windows;
 
-		growing_string_append(&gb, buff);
-		int i;
-		for(i = 0; i < tmp->siblings_count; i++)
+		if(!stats)
 		{
-			tau_metric_proxy_log_verbose("%s is %d / %d", tmp->metrics[i]->name, i, tmp->siblings_count);
+			continue;
+		}
 
-			__serialize_metric_value(tmp->metrics[i], buff, METRIC_STRING_SIZE * 2);
-			growing_string_append(&gb, buff);
+		if(!cursor->window_header)
+		{
+			growing_string_printf(gb, "# HELP %s_%s %s %s\n# TYPE %s_%s gauge\n",
+			                      basename, aggregate, doc, basename, basename, aggregate);
+			cursor->window_header = 1;
 		}
 
-		tmp = tmp->next;
-	}
+		for(w = 0; w < TAU_METRIC_WINDOW_COUNT; w++)
+		{
+			double value = __window_value(stats, aggregate, w);
 
-	*len = gb.current_offset;
+			/* No sample in this window */
+			if(isnan(value) )
+			{
+				continue;
+			}
 
-	return gb.buffer;
+			__serialize_window_name(m->name, basename, aggregate, w, name, METRIC_STRING_SIZE * 2);
+
+			size_t len = strlen(name);
+
+			name[len++] = ' ';
+			len        += dtoa_shortest(value, name + len);
+			name[len++] = '\n';
+			growing_string_append_len(gb, name, len);
+		}
+	}
 }
 
-static int __build_metric_tree(metric_t *m, void *vppmt)
+/* Length of the name without labels (nor histogram sample suffix) */
+static inline size_t __entry_basename_len(const metric_snapshot_entry_t *m)
 {
-	struct metric_tree **ppmt = (struct metric_tree **)vppmt;
+	return m->family ? m->family_len : metric_family_basename_len(m->name, m->type);
+}
 
-	*ppmt = metric_tree_regiter(*ppmt, m);
+/* Length of the sample name, labels aside (histogram samples keep their suffix) */
+static inline size_t __entry_name_len(const metric_snapshot_entry_t *m)
+{
+	const char *labels = memchr(m->name, '{', m->name_len);
 
-	return 0;
+	return labels ? (size_t)(labels - m->name) : m->name_len;
 }
 
-static char *__generate_metrics(size_t *len)
+static inline int __entry_same_family(const metric_snapshot_entry_t *a, const metric_snapshot_entry_t *b)
 {
-	*len = 0;
+	if(a->family || b->family)
+	{
+		/* Basenames are interned */
+		return a->family == b->family;
+	}
 
-	struct metric_tree *mt = NULL;
+	size_t len = __entry_basename_len(a);
 
-	metric_array_iterate(metric_array_get_main(), __build_metric_tree, (void *)&mt);
+	return (len == __entry_basename_len(b) ) && !strncmp(a->name, b->name, len);
+}
 
-	char *ret = metric_tree_serialize(mt, len);
+/* Number of window families derived from a family of that type,
+   histogram samples are already aggregates */
+static inline int __window_families(int type)
+{
+	switch(type)
+	{
+		case TAU_METRIC_COUNTER:
+			return 1;
 
-	metric_tree_free(mt);
+		case TAU_METRIC_GAUGE:
+			return 2;
 
-	return ret;
+		default:
+			return 0;
+	}
 }
 
-static void *__send_metrics(void *pfd)
+/* Window families of gauges [0] and counters [1] */
+static const char *const __window_aggregate[2][2] = { { "min", "max" }, { "rate", NULL } };
+static const char *const __window_doc[2][2] =
 {
-	int fd = *( (int *)pfd);
-
-	/* First read what is requested */
-	char buffer[1024];
+	{ "Smallest sample over sliding windows of", "Largest sample over sliding windows of" },
+	{ "Per second increase over sliding windows of", NULL }
+};
 
-	FILE *socket = fdopen(fd, "rw+");
+/* Returns 1 once all the window families are out */
+static int __serialize_family_windows(struct growing_string *gb, metric_snapshot_entry_t *members, uint64_t count,
+                                      const char *basename, family_cursor_t *cursor, size_t limit)
+{
+	int counter = (members[0].type == TAU_METRIC_COUNTER);
+	int a;
 
-	if(!socket)
+	while( (cursor->part != cursor->stop) && ( (a = cursor->part - FAMILY_PART_WINDOWS) < __window_families(members[0].type) ) )
 	{
-		tau_metric_proxy_perror("fdopen");
-		close(fd);
-	}
+		__serialize_windows(gb, members, count, basename, __window_aggregate[counter][a], __window_doc[counter][a],
+		                    cursor, limit);
 
-	while(fgets(buffer, 1024, socket) )
-	{
-		if(strlen(buffer) < 6)
+		if(cursor->member < count)
 		{
-			continue;
+			return 0;
 		}
 
-		char *http = strstr(buffer, " HTTP");
+		cursor->part++;
+		cursor->member = 0;
 
-		if(http)
+		/* A family cut in slices goes on with the same aggregate */
+		if(cursor->part != cursor->stop)
 		{
-			*http = '\0';
+			cursor->window_header = 0;
 		}
+	}
 
-		if(buffer[0] == 'G' && buffer[1] == 'E' && buffer[2] == 'T')
-		{
-			char *file_path = &buffer[4];
+	return 1;
+}
 
-			if(*file_path == '/' && strlen(file_path) == 1)
-			{
-				/* Get root data */
-				static const char *const default_page = "\
-<html>\
-<head><title>Node Exporter</title></head>\
-<body>\
-<h1>TAU Metrics Proxy Exporter</h1>\
-<p><a href='/metrics'>Metrics</a></p>\
-</body>\
-</html>";
-				__write_http_header(strlen(default_page), 200, "text/html", fd);
-				safe_write(fd, (void *)default_page, strlen(default_page) );
-			}
-			else
-			{
-				/* Skip / */
-				file_path++;
-			}
+static int __serialize_family(struct growing_string *gb, metric_snapshot_entry_t *members, uint64_t count,
+                              family_cursor_t *cursor, size_t limit)
+{
+	char basename[METRIC_STRING_SIZE];
 
-			tau_metric_proxy_log_verbose("GET %s", file_path);
+	snprintf(basename, METRIC_STRING_SIZE, "%.*s", (int)__entry_basename_len(&members[0]), members[0].name);
 
-			if(strstr(file_path, "metrics") )
-			{
-				size_t len  = 0;
-				char * data = __generate_metrics(&len);
+	if(cursor->part == FAMILY_PART_HEADER)
+	{
+		tau_metric_proxy_log_verbose("%s has %ld siblings", basename, count);
 
-				__write_http_header(len, 200, "text/plain", fd);
-				safe_write(fd, (void *)data, len);
+		/* Generate the metric header */
+		char type[64];
+		__serialize_metric_type(&members[0], type, 64);
+		growing_string_printf(gb, "# HELP %s %s\n# TYPE %s %s\n", basename, members[0].doc, basename, type);
 
-				free(data);
-				break;
-			}
-			else
-			{
-				__write_http_header(0, 404, "text/html", fd);
-			}
+		cursor->part = FAMILY_PART_VALUES;
+	}
+
+	if(cursor->part == FAMILY_PART_VALUES)
+	{
+		for(; (cursor->member < count) && (gb->current_offset < limit); cursor->member++)
+		{
+			__serialize_metric_value(gb, &members[cursor->member]);
+		}
+
+		if(cursor->member < count)
+		{
+			return 0;
 		}
+
+		cursor->part   = FAMILY_PART_WINDOWS;
+		cursor->member = 0;
 	}
 
-	fclose(socket);
+	if(cursor->part == cursor->stop)
+	{
+		return 1;
+	}
 
+	return __serialize_family_windows(gb, members, count, basename, cursor, limit);
+}
 
-	close(fd);
+/**********************
+* OPENMETRICS FORMAT *
+**********************/
 
-	return NULL;
+/* Seconds rounded to the millisecond */
+static inline double __timestamp_ms(double ts)
+{
+	return (uint64_t)(ts * 1e3 + 0.5) / 1e3;
 }
 
-static void *__accept_loop(void *pexporter)
+/* Room for " <seconds>.<ms>\n" */
+#define OPENMETRICS_TS_SIZE (DTOA_BUFFER_SIZE + 2)
+
+static int __serialize_family_openmetrics(struct growing_string *gb, metric_snapshot_entry_t *members, uint64_t count,
+                                          family_cursor_t *cursor, size_t limit)
 {
-	tau_metric_exporter_t *exporter = (tau_metric_exporter_t *)pexporter;
+	char   basename[METRIC_STRING_SIZE];
+	size_t basename_len = __entry_basename_len(&members[0]);
+
+	snprintf(basename, METRIC_STRING_SIZE, "%.*s", (int)basename_len, members[0].name);
 
-	struct sockaddr client_info;
-	socklen_t       addr_len;
+	/* Counter samples end with _total, their family does not */
+	int    counter    = (members[0].type == TAU_METRIC_COUNTER);
+	size_t family_len = basename_len;
 
-	while(exporter->running)
+	if(counter && (6 <= basename_len) && !strcmp(basename + basename_len - 6, "_total") )
 	{
-		int client_socket = accept(exporter->listen_fd, &client_info, &addr_len);
+		family_len -= 6;
+	}
+
+	if(cursor->part == FAMILY_PART_HEADER)
+	{
+		char type[64];
+		__serialize_metric_type(&members[0], type, 64);
+		growing_string_printf(gb, "# TYPE %.*s %s\n# HELP %.*s %s\n", (int)family_len, basename, type,
+		                      (int)family_len, basename, members[0].doc);
+
+		cursor->part = FAMILY_PART_VALUES;
+	}
+
+	for(; (cursor->part == FAMILY_PART_VALUES) && (cursor->member < count) && (gb->current_offset < limit);
+	    cursor->member++)
+	{
+		metric_snapshot_entry_t *m = &members[cursor->member];
 
-		if(client_socket < 0)
+		size_t labels_len = m->name_len - basename_len;
+		size_t size       = family_len + 6 + labels_len + 1 + m->text_len + OPENMETRICS_TS_SIZE;
+		char * line       = growing_string_reserve(gb, size);
+
+		if(!line)
 		{
-			break;
+			return 1;
 		}
 
-		int *fd_copy = malloc(sizeof(int) );
+		char *w = line;
 
-		if(!fd_copy)
+		memcpy(w, basename, family_len);
+		w += family_len;
+
+		if(counter)
 		{
-			tau_metric_proxy_perror("malloc");
-			abort();
+			memcpy(w, "_total", 6);
+			w += 6;
 		}
 
-		*fd_copy = client_socket;
+		memcpy(w, m->name + basename_len, labels_len);
+		w += labels_len;
+		*(w++) = ' ';
+		memcpy(w, m->text, m->text_len);
+		w += m->text_len;
 
+		/* Timestamps are in seconds (milliseconds resolution) */
+		*(w++) = ' ';
+		w     += dtoa_shortest(__timestamp_ms(m->last_ts), w);
+		*(w++) = '\n';
 
-		/* Send metrics to client */
-		pthread_t req_th;
-		pthread_create(&req_th, NULL, __send_metrics, fd_copy);
-		pthread_detach(req_th);
+		growing_string_commit(gb, w - line);
 	}
 
-	tau_metric_proxy_log("Exporter thread leaving");
+	if(cursor->part == FAMILY_PART_VALUES)
+	{
+		if(cursor->member < count)
+		{
+			return 0;
+		}
 
-	return NULL;
+		cursor->part   = FAMILY_PART_WINDOWS;
+		cursor->member = 0;
+	}
+
+	if(cursor->part == cursor->stop)
+	{
+		return 1;
+	}
+
+	/* Derived gauges read the same as in the text format */
+	return __serialize_family_windows(gb, members, count, basename, cursor, limit);
 }
 
-int tau_metric_exporter_init(tau_metric_exporter_t *exporter, const char *port)
+/*******************
+* PROTOBUF FORMAT *
+*******************/
+
+/* Delimited io.prometheus.client.MetricFamily messages: each is
+   preceded by its length. Sizes are computed before writing so that
+   messages are encoded in place without intermediate buffers. */
+
+#define PB_VARINT  0
+#define PB_FIXED64 1
+#define PB_LEN     2
+
+/* From io.prometheus.client.MetricType */
+#define PB_TYPE_COUNTER   0
+#define PB_TYPE_GAUGE     1
+#define PB_TYPE_HISTOGRAM 4
+
+static inline size_t __pb_varint_size(uint64_t v)
 {
-	exporter->listen_fd = __bind_listening_thread(port);
+	size_t ret = 1;
 
-	if(exporter->listen_fd < 0)
+	while(0x80 <= v)
 	{
-		tau_metric_proxy_error("Failed to bind listening socket to 0.0.0.0:%s", port);
-		return -1;
+		v >>= 7;
+		ret++;
 	}
 
-	exporter->running = 1;
-	if(pthread_create(&exporter->listening_thread, NULL, __accept_loop, (void *)exporter) < 0)
+	return ret;
+}
+
+static inline char *__pb_varint(char *p, uint64_t v)
+{
+	while(0x80 <= v)
 	{
-		tau_metric_proxy_perror("pthread_create");
-		close(exporter->listen_fd);
-		return -1;
+		*(p++) = (v & 0x7F) | 0x80;
+		v    >>= 7;
 	}
 
-	tau_metric_proxy_log("now listening on 0.0.0.0:%s", port);
+	*(p++) = v;
 
+	return p;
+}
 
+/* All our field numbers fit in a single byte tag */
+static inline char *__pb_tag(char *p, int field, int wire)
+{
+	*(p++) = (field << 3) | wire;
+	return p;
+}
 
-	return 0;
+static inline size_t __pb_len_size(size_t len)
+{
+	return 1 + __pb_varint_size(len) + len;
 }
 
-int tau_metric_exporter_release(tau_metric_exporter_t *exporter)
+static inline char *__pb_len(char *p, int field, size_t len)
 {
-	if(exporter->running)
+	p = __pb_tag(p, field, PB_LEN);
+	return __pb_varint(p, len);
+}
+
+static inline char *__pb_bytes(char *p, int field, const char *data, size_t len)
+{
+	p = __pb_len(p, field, len);
+	memcpy(p, data, len);
+	return p + len;
+}
+
+static inline char *__pb_double(char *p, int field, double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(double) );
+
+	p = __pb_tag(p, field, PB_FIXED64);
+
+	/* Little endian on the wire */
+	int i;
+
+	for(i = 0; i < 8; i++)
 	{
-		exporter->running = 0;
-		shutdown(exporter->listen_fd, SHUT_RDWR);
-		close(exporter->listen_fd);
+		*(p++) = (bits >> (8 * i) ) & 0xFF;
+	}
+
+	return p;
+}
+
+typedef struct
+{
+	const char *key;
+	size_t      key_len;
+	const char *value;     /**< Escaped value in the name */
+	size_t      value_raw; /**< Escaped length */
+	size_t      value_len; /**< Unescaped length */
+}pb_label_t;
+
+/* Next label of a series name from *cursor, 0 when none is left */
+static int __pb_label_next(const char **cursor, const char *end, pb_label_t *label)
+{
+	const char *p = *cursor;
+
+	while( (p < end) && ( (*p == '{') || (*p == ',') || (*p == ' ') ) )
+	{
+		p++;
+	}
+
+	const char *eq = memchr(p, '=', end - p);
+
+	if( (p == end) || (*p == '}') || !eq || (end <= eq + 1) || (eq[1] != '"') )
+	{
+		return 0;
+	}
+
+	label->key     = p;
+	label->key_len = eq - p;
+	label->value   = eq + 2;
+
+	size_t unescaped = 0;
+
+	for(p = label->value; (p < end) && (*p != '"'); p++)
+	{
+		if( (*p == '\\') && (p + 1 < end) )
+		{
+			p++;
+		}
+
+		unescaped++;
+	}
+
+	label->value_raw = p - label->value;
+	label->value_len = unescaped;
+
+	*cursor = (p < end) ? p + 1 : end;
+
+	return 1;
+}
+
+static char *__pb_unescape(char *p, const pb_label_t *label)
+{
+	const char *v   = label->value;
+	const char *end = v + label->value_raw;
+
+	while(v < end)
+	{
+		if( (*v == '\\') && (v + 1 < end) )
+		{
+			v++;
+			*(p++) = (*v == 'n') ? '\n' : *v;
+		}
+		else
+		{
+			*(p++) = *v;
+		}
+
+		v++;
+	}
+
+	return p;
+}
+
+static inline size_t __pb_label_pair_size(size_t key_len, size_t value_len)
+{
+	return __pb_len_size(key_len) + __pb_len_size(value_len);
+}
+
+/* The window label added to derived series */
+static inline size_t __pb_window_label(int window, char *value)
+{
+	return snprintf(value, 32, "%gs", tau_metric_window_length[window]);
+}
+
+/* Size of the LabelPair messages of a label set ({...}) */
+static size_t __pb_labels_size(const char *cursor, const char *end)
+{
+	size_t     ret = 0;
+	pb_label_t label;
+
+	while(__pb_label_next(&cursor, end, &label) )
+	{
+		ret += __pb_len_size(__pb_label_pair_size(label.key_len, label.value_len) );
+	}
+
+	return ret;
+}
+
+static char *__pb_labels(char *p, const char *cursor, const char *end)
+{
+	pb_label_t label;
+
+	while(__pb_label_next(&cursor, end, &label) )
+	{
+		p = __pb_len(p, 1, __pb_label_pair_size(label.key_len, label.value_len) );
+		p = __pb_bytes(p, 1, label.key, label.key_len);
+		p = __pb_len(p, 2, label.value_len);
+		p = __pb_unescape(p, &label);
+	}
+
+	return p;
+}
+
+/* Size of a Metric message, window is -1 for the series itself */
+static size_t __pb_metric_size(const metric_snapshot_entry_t *m, size_t basename_len, int window, int64_t ts_ms)
+{
+	size_t ret = __pb_labels_size(m->name + basename_len, m->name + m->name_len);
+
+	if(0 <= window)
+	{
+		char value[32];
+		ret += __pb_len_size(__pb_label_pair_size(6, __pb_window_label(window, value) ) );
+	}
+
+	/* Gauge or Counter message holding a double */
+	ret += __pb_len_size(1 + 8);
+
+	if(0 < ts_ms)
+	{
+		ret += 1 + __pb_varint_size(ts_ms);
+	}
+
+	return ret;
+}
+
+static char *__pb_metric(char *p, const metric_snapshot_entry_t *m, size_t basename_len, int window,
+                         int type, double value, int64_t ts_ms, size_t size)
+{
+	p = __pb_len(p, 4, size);
+	p = __pb_labels(p, m->name + basename_len, m->name + m->name_len);
+
+	if(0 <= window)
+	{
+		char   wvalue[32];
+		size_t wlen = __pb_window_label(window, wvalue);
+
+		p = __pb_len(p, 1, __pb_label_pair_size(6, wlen) );
+		p = __pb_bytes(p, 1, "window", 6);
+		p = __pb_bytes(p, 2, wvalue, wlen);
+	}
+
+	/* Metric.counter is field 3 and Metric.gauge field 2 */
+	p = __pb_len(p, (type == PB_TYPE_COUNTER) ? 3 : 2, 1 + 8);
+	p = __pb_double(p, 1, value);
+
+	if(0 < ts_ms)
+	{
+		p = __pb_tag(p, 6, PB_VARINT);
+		p = __pb_varint(p, ts_ms);
+	}
+
+	return p;
+}
+
+static inline double __pb_member_value(const metric_snapshot_entry_t *m, const char *aggregate, int window)
+{
+	if(!aggregate)
+	{
+		return m->value;
+	}
+
+	return m->windows ? __window_value(m->windows, aggregate, window) : NAN;
+}
+
+/* One MetricFamily: the series themselves (aggregate NULL) or one of their window aggregates */
+static void __pb_family(struct growing_string *gb, metric_snapshot_entry_t *members, uint64_t count,
+                        const char *name, const char *help, int type, const char *aggregate)
+{
+	size_t   basename_len = __entry_basename_len(&members[0]);
+	size_t   name_len     = strlen(name);
+	size_t   help_len     = strlen(help);
+	size_t   size         = __pb_len_size(name_len) + __pb_len_size(help_len) + 2;
+	uint64_t metrics      = 0;
+	uint64_t i;
+	int      w;
+
+	int first = aggregate ? 0 : -1;
+	int last  = aggregate ? TAU_METRIC_WINDOW_COUNT : 0;
+
+	/* First pass for the length prefixes */
+	for(i = 0; i < count; i++)
+	{
+		for(w = first; w < last; w++)
+		{
+			if(isnan(__pb_member_value(&members[i], aggregate, w) ) && aggregate)
+			{
+				continue;
+			}
+
+			int64_t ts_ms = aggregate ? 0 : members[i].last_ts * 1000.0;
+
+			size += __pb_len_size(__pb_metric_size(&members[i], basename_len, w, ts_ms) );
+			metrics++;
+		}
+	}
+
+	if(!metrics)
+	{
+		return;
+	}
+
+	char *start = growing_string_reserve(gb, size + 10);
+
+	if(!start)
+	{
+		return;
+	}
+
+	char *p = __pb_varint(start, size);
+
+	p = __pb_bytes(p, 1, name, name_len);
+	p = __pb_bytes(p, 2, help, help_len);
+	p = __pb_tag(p, 3, PB_VARINT);
+	p = __pb_varint(p, type);
+
+	for(i = 0; i < count; i++)
+	{
+		for(w = first; w < last; w++)
+		{
+			double value = __pb_member_value(&members[i], aggregate, w);
+
+			if(isnan(value) && aggregate)
+			{
+				continue;
+			}
+
+			int64_t ts_ms = aggregate ? 0 : members[i].last_ts * 1000.0;
+
+			p = __pb_metric(p, &members[i], basename_len, w, type, value, ts_ms,
+			                __pb_metric_size(&members[i], basename_len, w, ts_ms) );
+		}
+	}
+
+	growing_string_commit(gb, p - start);
+}
+
+static void __pb_window_family(struct growing_string *gb, metric_snapshot_entry_t *members, uint64_t count,
+                               const char *basename, const char *aggregate, const char *doc)
+{
+	char name[METRIC_STRING_SIZE + 16];
+	char help[METRIC_STRING_SIZE * 2];
+
+	snprintf(name, sizeof(name), "%s_%s", basename, aggregate);
+	snprintf(help, sizeof(help), "%s %s", doc, basename);
+
+	__pb_family(gb, members, count, name, help, PB_TYPE_GAUGE, aggregate);
+}
+
+/* Samples of a histogram family */
+typedef enum
+{
+	HISTOGRAM_BUCKET,
+	HISTOGRAM_SUM,
+	HISTOGRAM_COUNT,
+	HISTOGRAM_SAMPLES
+}histogram_sample_t;
+
+static const char *const __histogram_suffix[HISTOGRAM_SAMPLES] = { "_bucket", "_sum", "_count" };
+
+/* Sample of a histogram member, sets where its labels start
+   (HISTOGRAM_SAMPLES when it is none of them) */
+static histogram_sample_t __histogram_sample(const metric_snapshot_entry_t *m, size_t basename_len, const char **labels)
+{
+	const char *suffix = m->name + basename_len;
+	int         i;
+
+	for(i = 0; i < HISTOGRAM_SAMPLES; i++)
+	{
+		size_t len = strlen(__histogram_suffix[i]);
+
+		if(!strncmp(suffix, __histogram_suffix[i], len) && ( (suffix[len] == '{') || !suffix[len] ) )
+		{
+			*labels = suffix + len;
+			return i;
+		}
+	}
+
+	return HISTOGRAM_SAMPLES;
+}
+
+static inline int __pb_label_is_le(const pb_label_t *label)
+{
+	return (label->key_len == 2) && !strncmp(label->key, "le", 2);
+}
+
+/* Whether a sample belongs to the series of a label set, le aside */
+static int __pb_histogram_labels_match(const char *a, const char *a_end, const char *b, const char *b_end)
+{
+	pb_label_t la, lb;
+
+	while(1)
+	{
+		int more_a, more_b;
+
+		while( (more_a = __pb_label_next(&a, a_end, &la) ) && __pb_label_is_le(&la) );
+		while( (more_b = __pb_label_next(&b, b_end, &lb) ) && __pb_label_is_le(&lb) );
+
+		if(!more_a || !more_b)
+		{
+			return more_a == more_b;
+		}
+
+		if( (la.key_len != lb.key_len) || (la.value_raw != lb.value_raw) || strncmp(la.key, lb.key, la.key_len)
+		    || strncmp(la.value, lb.value, la.value_raw) )
+		{
+			return 0;
+		}
+	}
+}
+
+static double __pb_histogram_bound(const char *cursor, const char *end)
+{
+	pb_label_t label;
+
+	while(__pb_label_next(&cursor, end, &label) )
+	{
+		if(__pb_label_is_le(&label) )
+		{
+			return strncmp(label.value, "+Inf", 4) ? strtod(label.value, NULL) : INFINITY;
+		}
+	}
+
+	return INFINITY;
+}
+
+static inline size_t __pb_bucket_size(double count)
+{
+	return 1 + __pb_varint_size( (uint64_t)count) + 1 + 8;
+}
+
+#define PB_HISTOGRAM_NONE UINT64_MAX
+
+/* Series of a histogram family: the members sharing a label set, le aside */
+typedef struct
+{
+	uint64_t    hash;
+	uint64_t    key;          /**< First member of the series (PB_HISTOGRAM_NONE for a free slot) */
+	const char *labels;       /**< Labels of that member */
+	const char *labels_end;
+	uint64_t    sum;          /**< Its _sum member */
+	uint64_t    first_bucket; /**< Its buckets chained in the order of the members */
+	uint64_t    last_bucket;
+	size_t      buckets_size; /**< Bytes of their Bucket messages */
+}pb_histogram_series_t;
+
+/* Members of a histogram family grouped by series */
+typedef struct
+{
+	pb_histogram_series_t *series; /**< Open addressing on the label sets */
+	uint64_t               mask;
+	uint64_t *             of;     /**< Series of each member (PB_HISTOGRAM_NONE if not a sample) */
+	uint64_t *             next;   /**< Next bucket of the same series */
+}pb_histogram_index_t;
+
+static uint64_t __pb_histogram_labels_hash(const char *cursor, const char *end)
+{
+	pb_label_t label;
+	uint64_t   ret = 0;
+
+	while(__pb_label_next(&cursor, end, &label) )
+	{
+		if(!__pb_label_is_le(&label) )
+		{
+			ret = ret * 31 + utils_string_hash_len( (const unsigned char *)label.key, label.key_len);
+			ret = ret * 31 + utils_string_hash_len( (const unsigned char *)label.value, label.value_raw);
+		}
+	}
+
+	return ret;
+}
+
+static void __pb_histogram_index_release(pb_histogram_index_t *index)
+{
+	free(index->series);
+	free(index->of);
+}
+
+/* Groups the samples of the family by series in a single pass */
+static int __pb_histogram_index(pb_histogram_index_t *index, metric_snapshot_entry_t *members, uint64_t count,
+                                size_t basename_len)
+{
+	uint64_t capacity = 2;
+	uint64_t i;
+
+	while(capacity < 2 * count)
+	{
+		capacity <<= 1;
+	}
+
+	index->series = malloc(capacity * sizeof(pb_histogram_series_t) );
+	index->of     = malloc(2 * count * sizeof(uint64_t) );
+
+	if(!index->series || !index->of)
+	{
+		tau_metric_proxy_perror("malloc");
+		__pb_histogram_index_release(index);
+		return 1;
+	}
+
+	index->next = index->of + count;
+	index->mask = capacity - 1;
+
+	for(i = 0; i < capacity; i++)
+	{
+		index->series[i].key = PB_HISTOGRAM_NONE;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		const char *       labels;
+		const char *       end    = members[i].name + members[i].name_len;
+		histogram_sample_t sample = __histogram_sample(&members[i], basename_len, &labels);
+
+		index->of[i]   = PB_HISTOGRAM_NONE;
+		index->next[i] = PB_HISTOGRAM_NONE;
+
+		if(sample == HISTOGRAM_SAMPLES)
+		{
+			continue;
+		}
+
+		uint64_t               hash = __pb_histogram_labels_hash(labels, end);
+		uint64_t               slot = hash & index->mask;
+		pb_histogram_series_t *s    = &index->series[slot];
+
+		while( (s->key != PB_HISTOGRAM_NONE)
+		       && ( (s->hash != hash) || !__pb_histogram_labels_match(labels, end, s->labels, s->labels_end) ) )
+		{
+			slot = (slot + 1) & index->mask;
+			s    = &index->series[slot];
+		}
+
+		if(s->key == PB_HISTOGRAM_NONE)
+		{
+			s->hash         = hash;
+			s->key          = i;
+			s->labels       = labels;
+			s->labels_end   = end;
+			s->sum          = PB_HISTOGRAM_NONE;
+			s->first_bucket = PB_HISTOGRAM_NONE;
+			s->last_bucket  = PB_HISTOGRAM_NONE;
+			s->buckets_size = 0;
+		}
+
+		index->of[i] = slot;
+
+		if( (sample == HISTOGRAM_SUM) && (s->sum == PB_HISTOGRAM_NONE) )
+		{
+			s->sum = i;
+		}
+		else if(sample == HISTOGRAM_BUCKET)
+		{
+			if(s->last_bucket == PB_HISTOGRAM_NONE)
+			{
+				s->first_bucket = i;
+			}
+			else
+			{
+				index->next[s->last_bucket] = i;
+			}
+
+			s->last_bucket   = i;
+			s->buckets_size += __pb_len_size(__pb_bucket_size(members[i].value) );
+		}
+	}
+
+	return 0;
+}
+
+/* Size of the Histogram message of the series of a _count member */
+static inline size_t __pb_histogram_size(const metric_snapshot_entry_t *c, const pb_histogram_series_t *s)
+{
+	return 1 + __pb_varint_size( (uint64_t)c->value) + 1 + 8 + s->buckets_size;
+}
+
+/* Size of the Metric message of the series of a _count member */
+static size_t __pb_histogram_metric_size(const metric_snapshot_entry_t *c, const char *labels,
+                                         const pb_histogram_series_t *s)
+{
+	int64_t ts_ms = c->last_ts * 1000.0;
+
+	return __pb_labels_size(labels, c->name + c->name_len) + __pb_len_size(__pb_histogram_size(c, s) ) + 1
+	       + __pb_varint_size(ts_ms);
+}
+
+static char *__pb_histogram_metric(char *p, metric_snapshot_entry_t *members, const pb_histogram_index_t *index,
+                                   size_t basename_len, uint64_t c, const char *labels)
+{
+	const pb_histogram_series_t *s = &index->series[index->of[c]];
+	const char *                 member_labels;
+	uint64_t                     i;
+
+	p = __pb_len(p, 4, __pb_histogram_metric_size(&members[c], labels, s) );
+	p = __pb_labels(p, labels, members[c].name + members[c].name_len);
+
+	/* Metric.histogram is field 7 */
+	p = __pb_len(p, 7, __pb_histogram_size(&members[c], s) );
+	p = __pb_tag(p, 1, PB_VARINT);
+	p = __pb_varint(p, (uint64_t)members[c].value);
+	p = __pb_double(p, 2, (s->sum == PB_HISTOGRAM_NONE) ? 0 : members[s->sum].value);
+
+	/* Buckets go in the order of the members, they are registered by
+	   increasing bounds */
+	for(i = s->first_bucket; i != PB_HISTOGRAM_NONE; i = index->next[i])
+	{
+		__histogram_sample(&members[i], basename_len, &member_labels);
+
+		p = __pb_len(p, 3, __pb_bucket_size(members[i].value) );
+		p = __pb_tag(p, 1, PB_VARINT);
+		p = __pb_varint(p, (uint64_t)members[i].value);
+		p = __pb_double(p, 2, __pb_histogram_bound(member_labels, members[i].name + members[i].name_len) );
+	}
+
+	p = __pb_tag(p, 6, PB_VARINT);
+	p = __pb_varint(p, (int64_t)(members[c].last_ts * 1000.0) );
+
+	return p;
+}
+
+/* One MetricFamily holding a Metric per series of the histogram (one
+   per _count member) */
+static void __pb_histogram_family(struct growing_string *gb, metric_snapshot_entry_t *members, uint64_t count,
+                                  const char *name, const char *help)
+{
+	size_t               basename_len = __entry_basename_len(&members[0]);
+	size_t               name_len     = strlen(name);
+	size_t               help_len     = strlen(help);
+	size_t               size         = __pb_len_size(name_len) + __pb_len_size(help_len) + 2;
+	uint64_t             metrics      = 0;
+	pb_histogram_index_t index;
+	const char *         labels;
+	uint64_t             i;
+
+	if(__pb_histogram_index(&index, members, count, basename_len) )
+	{
+		return;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		if(__histogram_sample(&members[i], basename_len, &labels) == HISTOGRAM_COUNT)
+		{
+			size += __pb_len_size(__pb_histogram_metric_size(&members[i], labels, &index.series[index.of[i]]) );
+			metrics++;
+		}
+	}
+
+	char *start = metrics ? growing_string_reserve(gb, size + 10) : NULL;
+
+	if(!start)
+	{
+		__pb_histogram_index_release(&index);
+		return;
+	}
+
+	char *p = __pb_varint(start, size);
+
+	p = __pb_bytes(p, 1, name, name_len);
+	p = __pb_bytes(p, 2, help, help_len);
+	p = __pb_tag(p, 3, PB_VARINT);
+	p = __pb_varint(p, PB_TYPE_HISTOGRAM);
+
+	for(i = 0; i < count; i++)
+	{
+		if(__histogram_sample(&members[i], basename_len, &labels) == HISTOGRAM_COUNT)
+		{
+			p = __pb_histogram_metric(p, members, &index, basename_len, i, labels);
+		}
+	}
+
+	growing_string_commit(gb, p - start);
+
+	__pb_histogram_index_release(&index);
+}
+
+/* Messages are sized before being written: the members are always sent
+   as whole messages (a family sliced by a stream gives several) */
+static void __serialize_family_protobuf(struct growing_string *gb, metric_snapshot_entry_t *members, uint64_t count)
+{
+	char basename[METRIC_STRING_SIZE];
+
+	snprintf(basename, METRIC_STRING_SIZE, "%.*s", (int)__entry_basename_len(&members[0]), members[0].name);
+
+	if(members[0].type == TAU_METRIC_HISTOGRAM)
+	{
+		__pb_histogram_family(gb, members, count, basename, members[0].doc);
+		return;
+	}
+
+	int counter = (members[0].type == TAU_METRIC_COUNTER);
+
+	__pb_family(gb, members, count, basename, members[0].doc, counter ? PB_TYPE_COUNTER : PB_TYPE_GAUGE, NULL);
+
+	if(counter)
+	{
+		__pb_window_family(gb, members, count, basename, "rate", "Per second increase over sliding windows of");
+	}
+	else
+	{
+		__pb_window_family(gb, members, count, basename, "min", "Smallest sample over sliding windows of");
+		__pb_window_family(gb, members, count, basename, "max", "Largest sample over sliding windows of");
+	}
+}
+
+/*************
+* RENDERING *
+*************/
+
+/* Serialize a family from a cursor until the body reaches limit bytes,
+   returns 1 once the family is complete */
+typedef int (*family_serializer_t)(struct growing_string *gb, metric_snapshot_entry_t *members, uint64_t count,
+                                   family_cursor_t *cursor, size_t limit);
+
+/* Text formats only, protobuf families are written whole */
+static const family_serializer_t __family_serializer[TAU_METRIC_FORMAT_PROTOBUF] =
+{
+	__serialize_family,
+	__serialize_family_openmetrics
+};
+
+static inline int __serialize_family_format(struct growing_string *gb, metric_snapshot_entry_t *members,
+                                            uint64_t count, tau_metric_format_t format, family_cursor_t *cursor,
+                                            size_t limit)
+{
+	if(format == TAU_METRIC_FORMAT_PROTOBUF)
+	{
+		__serialize_family_protobuf(gb, members, count);
+		return 1;
+	}
+
+	return (__family_serializer[format])(gb, members, count, cursor, limit);
+}
+
+const char *const tau_metric_format_content_type[TAU_METRIC_FORMAT_COUNT] =
+{
+	"text/plain; version=0.0.4; charset=utf-8",
+	"application/openmetrics-text; version=1.0.0; charset=utf-8",
+	"application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited"
+};
+
+/* Non zero if a label set ({...}) has a label of that name */
+static int __labels_have(const char *labels, const char *name, size_t name_len)
+{
+	const char *p        = labels + 1;
+	int         quoted   = 0;
+	int         at_start = 1;
+
+	for(; *p && (quoted || (*p != '}') ); p++)
+	{
+		if(at_start && !strncmp(p, name, name_len) && (p[name_len] == '=') )
+		{
+			return 1;
+		}
+
+		at_start = 0;
+
+		if(quoted && (*p == '\\') && p[1])
+		{
+			p++;
+		}
+		else if(*p == '"')
+		{
+			quoted = !quoted;
+		}
+		else if(!quoted && (*p == ',') )
+		{
+			at_start = 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Point the entry names to copies with an extra label pair first,
+   returns the buffer holding the copies (NULL on error) */
+static char *__snapshot_add_label(metric_array_snapshot_t *snap, const char *label)
+{
+	size_t label_len = strlen(label);
+	size_t name_len  = strcspn(label, "=");
+	size_t size      = 1;
+	uint64_t i;
+
+	for(i = 0; i < snap->count; i++)
+	{
+		size += snap->entries[i].name_len + label_len + 3;
+	}
+
+	char *ret = malloc(size);
+
+	if(!ret)
+	{
+		tau_metric_proxy_perror("malloc");
+		return NULL;
+	}
+
+	char *w = ret;
+
+	for(i = 0; i < snap->count; i++)
+	{
+		metric_snapshot_entry_t *e = &snap->entries[i];
+
+		size_t      name_len = __entry_name_len(e);
+		const char *labels   = e->name + name_len;
+
+		/* The series already has it */
+		if( (*labels == '{') && __labels_have(labels, label, name_len) )
+		{
+			continue;
+		}
+
+		char *name = w;
+
+		memcpy(w, e->name, name_len);
+		w += name_len;
+		*(w++) = '{';
+		memcpy(w, label, label_len);
+		w += label_len;
+
+		if( (*labels == '{') && (labels[1] != '}') )
+		{
+			*(w++) = ',';
+			memcpy(w, labels + 1, e->name_len - name_len - 1);
+			w += e->name_len - name_len - 1;
+		}
+		else
+		{
+			*(w++) = '}';
+		}
+
+		*w = '\0';
+
+		e->name     = name;
+		e->name_len = w - name;
+		w++;
+	}
+
+	return ret;
+}
+
+/* Where the serialization of a snapshot stopped */
+typedef struct
+{
+	uint64_t        start;  /**< First entry of the current family */
+	uint64_t        end;    /**< Past its last entry (0 until known) */
+	family_cursor_t family; /**< Position in the current family */
+}exposition_cursor_t;
+
+/* Serialize the families from a cursor until the body reaches limit
+   bytes, returns 1 once the snapshot is complete */
+static int __serialize_families(struct growing_string *gb, metric_array_snapshot_t *snap, tau_metric_format_t format,
+                                exposition_cursor_t *cursor, size_t limit)
+{
+	while( (cursor->start < snap->count) && (gb->current_offset < limit) )
+	{
+		/* Families come out as runs of consecutive entries */
+		if(!cursor->end)
+		{
+			metric_snapshot_entry_t *first = &snap->entries[cursor->start];
+
+			for(cursor->end = cursor->start + 1; cursor->end < snap->count; cursor->end++)
+			{
+				if(!__entry_same_family(first, &snap->entries[cursor->end]) )
+				{
+					break;
+				}
+			}
+		}
+
+		if(!__serialize_family_format(gb, &snap->entries[cursor->start], cursor->end - cursor->start, format,
+		                              &cursor->family, limit) )
+		{
+			return 0;
+		}
+
+		cursor->start = cursor->end;
+		cursor->end   = 0;
+		memset(&cursor->family, 0, sizeof(family_cursor_t) );
+	}
+
+	return (cursor->start == snap->count);
+}
+
+size_t tau_metric_exporter_label_escape(const char *value, char *out, size_t size)
+{
+	size_t len = 0;
+
+	for(; *value; value++)
+	{
+		char escaped = (*value == '\n') ? 'n' : *value;
+		int  escape  = (*value == '"') || (*value == '\\') || (*value == '\n');
+
+		if(escape && (len + 1 < size) )
+		{
+			out[len] = '\\';
+		}
+
+		len += escape;
+
+		if(len + 1 < size)
+		{
+			out[len] = escaped;
+		}
+
+		len++;
+	}
+
+	if(size)
+	{
+		out[(len < size) ? len : size - 1] = '\0';
+	}
+
+	return len;
+}
+
+char *tau_metric_exporter_render(metric_array_t *ma, metric_array_snapshot_t *snap, const metric_filter_t *filter,
+                                 const char *label, tau_metric_format_t format, size_t size_hint, size_t *len)
+{
+	*len = 0;
+
+	/* Serialize from a frozen copy so that ingestion is never blocked,
+	   only the values updated since the last scrape are rendered again
+	   (the binary format does not need them) */
+	snap->render = (format != TAU_METRIC_FORMAT_PROTOBUF);
+
+	if( metric_array_snapshot_take_filtered(ma, snap, filter) )
+	{
+		return NULL;
+	}
+
+	tau_metric_proxy_log_verbose("Exposition of %ld series, %ld values rendered", snap->count, snap->rendered);
+
+	char *names = NULL;
+
+	if(label && !(names = __snapshot_add_label(snap, label) ) )
+	{
+		metric_array_snapshot_release(snap);
+		return NULL;
+	}
+
+	struct growing_string gb;
+
+	if(!growing_string_alloc(&gb, (size_hint < 4096) ? 4096 : size_hint) )
+	{
+		metric_array_snapshot_release(snap);
+		free(names);
+		return NULL;
+	}
+
+	exposition_cursor_t cursor = { 0 };
+
+	__serialize_families(&gb, snap, format, &cursor, SIZE_MAX);
+
+	if(format == TAU_METRIC_FORMAT_OPENMETRICS)
+	{
+		growing_string_append(&gb, "# EOF\n");
+	}
+
+	*len = gb.current_offset;
+
+	proxy_stats_add(PROXY_STAT_RENDERED_BYTES, gb.current_offset);
+
+	/* Keep the buffer for the next scrape */
+	metric_array_snapshot_release(snap);
+	free(names);
+
+	return gb.buffer;
+}
+
+/*************************
+* REMOTE WRITE REQUESTS *
+*************************/
+
+/* A prometheus.WriteRequest holds a TimeSeries (field 1) per series made
+   of its Label pairs (field 1) sorted by name, __name__ included, and of
+   a single Sample (field 2) with its value and millisecond timestamp */
+
+/* Labels of a series beyond this are not sent */
+#define REMOTE_WRITE_MAX_LABELS 64
+
+static int __rw_label_cmp(const void *a, const void *b)
+{
+	const pb_label_t *la  = a;
+	const pb_label_t *lb  = b;
+	size_t            len = (la->key_len < lb->key_len) ? la->key_len : lb->key_len;
+	int               ret = memcmp(la->key, lb->key, len);
+
+	if(ret)
+	{
+		return ret;
+	}
+
+	return (lb->key_len < la->key_len) - (la->key_len < lb->key_len);
+}
+
+/* Sorted labels of a series with its extra label (NULL for none), returns their count */
+static int __rw_labels(const metric_snapshot_entry_t *m, const pb_label_t *extra, pb_label_t *labels)
+{
+	size_t      name_len = __entry_name_len(m);
+	const char *cursor   = m->name + name_len;
+	const char *end      = m->name + m->name_len;
+	int         count    = 1;
+	int         i;
+
+	labels[0].key       = "__name__";
+	labels[0].key_len   = 8;
+	labels[0].value     = m->name;
+	labels[0].value_raw = name_len;
+	labels[0].value_len = name_len;
+
+	while( (count < REMOTE_WRITE_MAX_LABELS - 1) && __pb_label_next(&cursor, end, &labels[count]) )
+	{
+		count++;
+	}
+
+	if(extra)
+	{
+		/* The series own label wins */
+		for(i = 1; i < count; i++)
+		{
+			if( (labels[i].key_len == extra->key_len) && !memcmp(labels[i].key, extra->key, extra->key_len) )
+			{
+				break;
+			}
+		}
+
+		if(i == count)
+		{
+			labels[count++] = *extra;
+		}
+	}
+
+	qsort(labels, count, sizeof(pb_label_t), __rw_label_cmp);
+
+	return count;
+}
+
+char *tau_metric_exporter_render_remote_write(metric_array_snapshot_t *snap, uint64_t *cursor, double since,
+                                              unsigned int shard, unsigned int shards, const char *label,
+                                              uint64_t max_samples, size_t *len, uint64_t *samples)
+{
+	pb_label_t  labels[REMOTE_WRITE_MAX_LABELS];
+	pb_label_t  extra;
+	const char *label_cursor = label;
+	int         has_extra    = label && __pb_label_next(&label_cursor, label + strlen(label), &extra);
+
+	*len     = 0;
+	*samples = 0;
+
+	struct growing_string gb;
+
+	if(!growing_string_alloc(&gb, 4096) )
+	{
+		return NULL;
+	}
+
+	for(; (*cursor < snap->count) && (*samples < max_samples); (*cursor)++)
+	{
+		metric_snapshot_entry_t *m = &snap->entries[*cursor];
+
+		/* Series keep their shard so that their samples stay ordered */
+		if( (m->last_ts <= since) ||
+		    (utils_string_hash_len( (const unsigned char *)m->name, m->name_len) % shards != shard) )
+		{
+			continue;
+		}
+
+		int     count  = __rw_labels(m, has_extra ? &extra : NULL, labels);
+		int64_t ts_ms  = m->last_ts * 1000.0;
+		size_t  sample = 1 + 8 + 1 + __pb_varint_size(ts_ms);
+		size_t  size   = __pb_len_size(sample);
+		int     i;
+
+		for(i = 0; i < count; i++)
+		{
+			size += __pb_len_size(__pb_label_pair_size(labels[i].key_len, labels[i].value_len) );
+		}
+
+		char *start = growing_string_reserve(&gb, __pb_len_size(size) );
+
+		if(!start)
+		{
+			free(gb.buffer);
+			return NULL;
+		}
+
+		char *p = __pb_len(start, 1, size);
+
+		for(i = 0; i < count; i++)
+		{
+			p = __pb_len(p, 1, __pb_label_pair_size(labels[i].key_len, labels[i].value_len) );
+			p = __pb_bytes(p, 1, labels[i].key, labels[i].key_len);
+			p = __pb_len(p, 2, labels[i].value_len);
+			p = __pb_unescape(p, &labels[i]);
+		}
+
+		p = __pb_len(p, 2, sample);
+		p = __pb_double(p, 1, m->value);
+		p = __pb_tag(p, 2, PB_VARINT);
+		p = __pb_varint(p, ts_ms);
+
+		growing_string_commit(&gb, p - start);
+		(*samples)++;
+	}
+
+	*len = gb.current_offset;
+
+	return gb.buffer;
+}
+
+/***********************
+* SHARED EXPOSITIONS *
+***********************/
+
+/** Content codings a body can be sent with */
+typedef enum
+{
+	EXPORTER_IDENTITY,
+	EXPORTER_GZIP,
+	EXPORTER_DEFLATE,
+	EXPORTER_ENCODING_COUNT
+}exporter_encoding_t;
+
+static const char *const __encoding_name[EXPORTER_ENCODING_COUNT] = { "identity", "gzip", "deflate" };
+
+struct tau_metric_exposition_s
+{
+	double          ts;
+	int             refcount;
+	pthread_mutex_t lock;                                          /**< Serializes the compressions */
+	char *          data[TAU_METRIC_FORMAT_COUNT];                 /**< Body in each format (rendered on demand) */
+	size_t          len[TAU_METRIC_FORMAT_COUNT];
+	char *          encoded[TAU_METRIC_FORMAT_COUNT][EXPORTER_ENCODING_COUNT]; /**< Compressed bodies (made on demand) */
+	size_t          encoded_len[TAU_METRIC_FORMAT_COUNT][EXPORTER_ENCODING_COUNT];
+};
+
+static void __exposition_release(struct tau_metric_exposition_s *e)
+{
+	if(!e)
+	{
+		return;
+	}
+
+	if(!__atomic_sub_fetch(&e->refcount, 1, __ATOMIC_ACQ_REL) )
+	{
+		int i, j;
+
+		for(i = 0; i < TAU_METRIC_FORMAT_COUNT; i++)
+		{
+			for(j = 0; j < EXPORTER_ENCODING_COUNT; j++)
+			{
+				free(e->encoded[i][j]);
+			}
+
+			free(e->data[i]);
+		}
+
+		pthread_mutex_destroy(&e->lock);
+		free(e);
+	}
+}
+
+/* Scrapes within the freshness window share the same body,
+   concurrent ones wait for a single generation */
+static struct tau_metric_exposition_s *__exposition_acquire(tau_metric_exporter_t *exporter, tau_metric_format_t format)
+{
+	pthread_mutex_lock(&exporter->exposition_lock);
+
+	struct tau_metric_exposition_s *ret = exporter->exposition;
+
+	if(!ret || (exporter->freshness <= utils_get_ts() - ret->ts) )
+	{
+		ret = calloc(1, sizeof(struct tau_metric_exposition_s) );
+
+		if(!ret)
+		{
+			tau_metric_proxy_perror("calloc");
+			pthread_mutex_unlock(&exporter->exposition_lock);
+			return NULL;
+		}
+
+		pthread_mutex_init(&ret->lock, NULL);
+		ret->ts       = utils_get_ts();
+		/* The reference of the cache */
+		ret->refcount = 1;
+
+		__exposition_release(exporter->exposition);
+		exporter->exposition = ret;
+	}
+
+	/* Formats are rendered by the first scrape asking for them */
+	if(!ret->data[format])
+	{
+		/* Size the buffer after the previous body so that it rarely grows */
+		size_t size_hint = exporter->last_len[format] + exporter->last_len[format] / 8;
+
+		ret->data[format] = tau_metric_exporter_render(metric_array_get_main(), &exporter->snapshot, NULL, NULL, format,
+		                                               size_hint ? size_hint : 1024 * 1024, &ret->len[format]);
+
+		if(!ret->data[format])
+		{
+			pthread_mutex_unlock(&exporter->exposition_lock);
+			return NULL;
+		}
+
+		exporter->last_len[format] = ret->len[format];
+	}
+
+	__atomic_add_fetch(&ret->refcount, 1, __ATOMIC_ACQ_REL);
+
+	pthread_mutex_unlock(&exporter->exposition_lock);
+
+	return ret;
+}
+
+/*******************
+* HISTORY ENDPOINT *
+*******************/
+
+static inline int __hex_value(char c)
+{
+	if( ('0' <= c) && (c <= '9') )
+	{
+		return c - '0';
+	}
+
+	if( ('a' <= c) && (c <= 'f') )
+	{
+		return c - 'a' + 10;
+	}
+
+	if( ('A' <= c) && (c <= 'F') )
+	{
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+/* Decode a query string token up to a stop character (truncated to len) */
+static const char *__query_decode(const char *p, const char *stop, char *out, size_t len)
+{
+	size_t i = 0;
+
+	while(*p && !strchr(stop, *p) )
+	{
+		char c;
+
+		if( (*p == '%') && (0 <= __hex_value(p[1]) ) && (0 <= __hex_value(p[2]) ) )
+		{
+			c  = __hex_value(p[1]) * 16 + __hex_value(p[2]);
+			p += 3;
+		}
+		else
+		{
+			c = (*p == '+') ? ' ' : *p;
+			p++;
+		}
+
+		if(i < len - 1)
+		{
+			out[i++] = c;
+		}
+	}
+
+	out[i] = '\0';
+
+	return p;
+}
+
+/* Decode the next parameter of a query string, returns 1 past the last one */
+static int __query_next(const char **query, char *key, size_t key_len, char *value, size_t value_len)
+{
+	const char *p = *query;
+
+	if(!p || !*p)
+	{
+		return 1;
+	}
+
+	p = __query_decode(p, "=&", key, key_len);
+
+	if(*p == '=')
+	{
+		p = __query_decode(p + 1, "&", value, value_len);
+	}
+	else
+	{
+		value[0] = '\0';
+	}
+
+	*query = (*p == '&') ? p + 1 : p;
+
+	return 0;
+}
+
+/* Extract and decode a parameter from a query string */
+static int __query_param(const char *query, const char *key, char *out, size_t len)
+{
+	char name[64];
+
+	while(!__query_next(&query, name, 64, out, len) )
+	{
+		if(!strcmp(name, key) )
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Append a quoted JSON string */
+static void __json_string(struct growing_string *gb, const char *str)
+{
+	char *w = growing_string_reserve(gb, strlen(str) * 6 + 2);
+
+	if(!w)
+	{
+		return;
+	}
+
+	char *      start = w;
+	const char *s;
+
+	*(w++) = '"';
+
+	for(s = str; *s; s++)
+	{
+		if( (*s == '"') || (*s == '\\') )
+		{
+			*(w++) = '\\';
+			*(w++) = *s;
+		}
+		else if( (unsigned char)*s < 0x20)
+		{
+			w += sprintf(w, "\\u%04x", *s);
+		}
+		else
+		{
+			*(w++) = *s;
+		}
+	}
+
+	*(w++) = '"';
+
+	growing_string_commit(gb, w - start);
+}
+
+static char *__generate_history(const char *query, size_t *len, int *code)
+{
+	*len  = 0;
+	*code = 404;
+
+	char name[METRIC_STRING_SIZE];
+	char value[64];
+
+	if(!query || __query_param(query, "name", name, METRIC_STRING_SIZE) )
+	{
+		return NULL;
+	}
+
+	double start = 0;
+	double end   = 0;
+
+	if(!__query_param(query, "start", value, 64) )
+	{
+		start = atof(value);
+	}
+
+	if(!__query_param(query, "end", value, 64) )
+	{
+		end = atof(value);
+	}
+
+	tau_metric_history_sample_t *samples = NULL;
+	size_t count = 0;
+
+	if(metric_array_history(metric_array_get_main(), name, start, end, &samples, &count) )
+	{
+		return NULL;
+	}
+
+	*code = 500;
+
+	struct growing_string gb;
+
+	if(!growing_string_alloc(&gb, 4096 + count * 64) )
+	{
+		free(samples);
+		return NULL;
+	}
+
+	/* Series names carry quoted label values */
+	growing_string_append(&gb, "{\"name\":");
+	__json_string(&gb, name);
+	growing_string_append(&gb, ",\"samples\":[");
+
+	size_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		char  sample[DTOA_BUFFER_SIZE * 2 + 8];
+		char *w = sample;
+
+		if(i)
+		{
+			*(w++) = ',';
+		}
+
+		*(w++) = '[';
+		w     += dtoa_shortest(__timestamp_ms(samples[i].ts), w);
+		*(w++) = ',';
+
+		if(isfinite(samples[i].value) )
+		{
+			w += dtoa_shortest(samples[i].value, w);
+		}
+		else
+		{
+			/* JSON has no NaN nor infinity */
+			memcpy(w, "null", 4);
+			w += 4;
+		}
+
+		*(w++) = ']';
+		growing_string_append_len(&gb, sample, w - sample);
+	}
+
+	growing_string_append(&gb, "]}\n");
+
+	free(samples);
+
+	*code = 200;
+	*len  = gb.current_offset;
+
+	return gb.buffer;
+}
+
+static char *__generate_jobs(size_t *len, int *code)
+{
+	*len  = 0;
+	*code = 500;
+
+	metric_array_list_job_t *jobs = NULL;
+	size_t count = 0;
+
+	if(metric_array_list_jobs(&jobs, &count) )
+	{
+		return NULL;
+	}
+
+	struct growing_string gb;
+
+	if(!growing_string_alloc(&gb, 4096 + count * 1024) )
+	{
+		free(jobs);
+		return NULL;
+	}
+
+	growing_string_append(&gb, "{\"jobs\":[");
+
+	size_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		tau_metric_job_descriptor_t *d = &jobs[i].desc;
+
+		growing_string_append(&gb, i ? ",{\"jobid\":" : "{\"jobid\":");
+		__json_string(&gb, d->jobid);
+		growing_string_append(&gb, ",\"command\":");
+		__json_string(&gb, d->command);
+		growing_string_printf(&gb, ",\"size\":%d,\"nodelist\":", d->size);
+		__json_string(&gb, d->nodelist);
+		growing_string_append(&gb, ",\"partition\":");
+		__json_string(&gb, d->partition);
+		growing_string_append(&gb, ",\"cluster\":");
+		__json_string(&gb, d->cluster);
+		growing_string_append(&gb, ",\"run_dir\":");
+		__json_string(&gb, d->run_dir);
+		growing_string_printf(&gb, ",\"start_time\":%lu,\"clients\":%lu,\"series\":%lu,\"footprint\":%lu}",
+		                      d->start_time, jobs[i].clients, jobs[i].series, jobs[i].footprint);
+	}
+
+	growing_string_append(&gb, "]}\n");
+
+	free(jobs);
+
+	*code = 200;
+	*len  = gb.current_offset;
+
+	return gb.buffer;
+}
+
+static char *__generate_tree(size_t *len, int *code)
+{
+	*len  = 0;
+	*code = 404;
+
+	tau_metric_tree_info_t info;
+
+	/* Not part of a tree */
+	if(tau_metric_tree_info(&info) )
+	{
+		return NULL;
+	}
+
+	*code = 500;
+
+	struct growing_string gb;
+
+	if(!growing_string_alloc(&gb, 4096 + info.child_count * 512 + info.scope_count * 1024) )
+	{
+		tau_metric_tree_info_free(&info);
+		return NULL;
+	}
+
+	growing_string_append(&gb, "{\"parent\":");
+	__json_string(&gb, info.parent);
+	/* The cluster comes first */
+	growing_string_printf(&gb, ",\"fanout\":%u,\"series\":%lu,\"children\":[", info.fanout, info.scopes[0].series);
+
+	size_t i;
+
+	for(i = 0; i < info.child_count; i++)
+	{
+		growing_string_append(&gb, i ? ",{\"node\":" : "{\"node\":");
+		__json_string(&gb, info.children[i].node);
+		growing_string_append(&gb, ",\"address\":");
+		__json_string(&gb, info.children[i].address);
+		growing_string_printf(&gb, ",\"received_bytes\":%lu}", info.children[i].received_bytes);
+	}
+
+	growing_string_append(&gb, "],\"jobs\":[");
+
+	for(i = 1; i < info.scope_count; i++)
+	{
+		tau_metric_tree_scope_t *s = &info.scopes[i];
+
+		growing_string_append(&gb, (i == 1) ? "{\"jobid\":" : ",{\"jobid\":");
+		__json_string(&gb, s->desc.jobid);
+		growing_string_append(&gb, ",\"command\":");
+		__json_string(&gb, s->desc.command);
+		growing_string_printf(&gb, ",\"series\":%lu,\"children\":%d,\"local\":%s}",
+		                      s->series, s->children, s->local ? "true" : "false");
+	}
+
+	growing_string_append(&gb, "]}\n");
+
+	tau_metric_tree_info_free(&info);
+
+	*code = 200;
+	*len  = gb.current_offset;
+
+	return gb.buffer;
+}
+
+/*****************
+* HTTP REQUESTS *
+*****************/
+
+/** Largest request (line and headers) accepted */
+#define EXPORTER_REQUEST_SIZE 8192
+/** Responses written by a single writev */
+#define EXPORTER_MAX_IOV 32
+
+struct exporter_response
+{
+	char                            header[512];
+	size_t                          header_len;
+	const char *                    body;       /**< Body to send (empty for HEAD) */
+	size_t                          body_len;
+	size_t                          sent;       /**< Bytes of header and body already sent */
+	struct tau_metric_exposition_s *exposition; /**< Reference on a shared body */
+	char *                          owned;      /**< Body to free */
+	int                             negotiated; /**< The body depends on the Accept headers */
+	struct exporter_stream *        stream;     /**< Body sent in chunks as it is rendered */
+	struct exporter_response *      next;
+};
+
+struct exporter_connection
+{
+	int                          fd;
+	char                         in[EXPORTER_REQUEST_SIZE];
+	size_t                       in_len;
+	int                          closing;       /**< Close once the queued responses are sent */
+	int                          writing;       /**< Waiting for the socket to drain */
+	double                       last_activity;
+	struct exporter_response *   head;          /**< Responses in request order */
+	struct exporter_response *   tail;
+	struct exporter_connection * prev;
+	struct exporter_connection * next;
+};
+
+struct tau_metric_exporter_worker_s
+{
+	tau_metric_exporter_t *      exporter;
+	pthread_t                    thread;
+	int                          epoll_fd;
+	int                          listen_fd;
+	int                          owns_listen_fd; /**< 0 when sharing the socket of the first worker */
+	struct exporter_connection * connections;    /**< Open connections for idle sweeps */
+	metric_array_snapshot_t      snapshot;       /**< Buffer of the filtered scrapes */
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	z_stream *                   streams[EXPORTER_ENCODING_COUNT]; /**< Compressors reused between bodies */
+#endif
+};
+
+static void __stream_free(struct exporter_stream *s);
+
+static void __response_free(struct exporter_response *r)
+{
+	__stream_free(r->stream);
+	__exposition_release(r->exposition);
+	free(r->owned);
+	free(r);
+}
+
+/***************
+* COMPRESSION *
+***************/
+
+/** Smaller bodies are always sent as is */
+#define EXPORTER_COMPRESS_MIN_SIZE 1024
+/** Input fed to the compressor at once */
+#define EXPORTER_COMPRESS_SLICE (1024 * 1024)
+
+/* Coding to use given an Accept-Encoding value, gzip is preferred */
+static exporter_encoding_t __negotiate_encoding(const char *accept)
+{
+	exporter_encoding_t ret = EXPORTER_IDENTITY;
+
+	if(!accept)
+	{
+		return ret;
+	}
+
+	const char *tok = accept;
+	const char *end = accept + strcspn(accept, "\r\n");
+
+	while(tok < end)
+	{
+		size_t len = strcspn(tok, ",\r\n");
+
+		/* coding [;q=weight] */
+		while( (*tok == ' ') || (*tok == '\t') )
+		{
+			tok++;
+			len--;
+		}
+
+		size_t name_len = strcspn(tok, " \t;,\r\n");
+		double q        = 1.0;
+
+		const char *param = memchr(tok, ';', len);
+
+		if(param)
+		{
+			param++;
+
+			while( (*param == ' ') || (*param == '\t') )
+			{
+				param++;
+			}
+
+			if( (param[0] == 'q') && (param[1] == '=') )
+			{
+				q = strtod(param + 2, NULL);
+			}
+		}
+
+		if(0 < q)
+		{
+			if( (name_len == 4) && !strncasecmp(tok, "gzip", 4) )
+			{
+				return EXPORTER_GZIP;
+			}
+
+			if( (name_len == 7) && !strncasecmp(tok, "deflate", 7) )
+			{
+				ret = EXPORTER_DEFLATE;
+			}
+		}
+
+		tok += len;
+
+		if(*tok == ',')
+		{
+			tok++;
+		}
+	}
+
+	return ret;
+}
+
+/* Format to answer with given an Accept value: the one with the
+   highest weight among those we serve, the text format by default */
+static tau_metric_format_t __negotiate_format(const char *accept)
+{
+	tau_metric_format_t ret    = TAU_METRIC_FORMAT_TEXT;
+	double              best_q = 0;
+
+	if(!accept)
+	{
+		return ret;
+	}
+
+	const char *range = accept;
+	const char *end   = accept + strcspn(accept, "\r\n");
+
+	while(range < end)
+	{
+		size_t len = strcspn(range, ",\r\n");
+
+		while( (*range == ' ') || (*range == '\t') )
+		{
+			range++;
+			len--;
+		}
+
+		size_t type_len = strcspn(range, " \t;,\r\n");
+		double q        = 1.0;
+		int    format   = -1;
+
+		const char *param = range + type_len;
+
+		/* Parameters of the media range */
+		while( (param < range + len) && (param = memchr(param, ';', range + len - param) ) )
+		{
+			param++;
+
+			while( (*param == ' ') || (*param == '\t') )
+			{
+				param++;
+			}
+
+			if( (param[0] == 'q') && (param[1] == '=') )
+			{
+				q = strtod(param + 2, NULL);
+			}
+		}
+
+		if( (type_len == 31) && !strncasecmp(range, "application/vnd.google.protobuf", 31) )
+		{
+			/* Only the delimited MetricFamily messages are served */
+			char media[512];
+			snprintf(media, 512, "%.*s", (int)len, range);
+
+			if(strstr(media, "io.prometheus.client.MetricFamily") && strstr(media, "delimited") )
+			{
+				format = TAU_METRIC_FORMAT_PROTOBUF;
+			}
+		}
+		else if( (type_len == 28) && !strncasecmp(range, "application/openmetrics-text", 28) )
+		{
+			format = TAU_METRIC_FORMAT_OPENMETRICS;
+		}
+		else if( ( (type_len == 10) && !strncasecmp(range, "text/plain", 10) ) ||
+		         ( (type_len == 3) && !strncmp(range, "*/*", 3) ) )
+		{
+			format = TAU_METRIC_FORMAT_TEXT;
+		}
+
+		/* Earlier ranges win ties */
+		if( (0 <= format) && (best_q < q) )
+		{
+			ret    = format;
+			best_q = q;
+		}
+
+		range += len;
+
+		if(*range == ',')
+		{
+			range++;
+		}
+	}
+
+	return ret;
+}
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+
+static z_stream *__deflate_new(exporter_encoding_t encoding, int level)
+{
+	z_stream *z = calloc(1, sizeof(z_stream) );
+
+	if(!z)
+	{
+		tau_metric_proxy_perror("calloc");
+		return NULL;
+	}
+
+	/* 16 more window bits select the gzip framing, deflate is zlib framed */
+	int window_bits = (encoding == EXPORTER_GZIP) ? 15 + 16 : 15;
+
+	if(deflateInit2(z, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		tau_metric_proxy_error("deflateInit2 failed: %s", z->msg ? z->msg : "no message");
+		free(z);
+		return NULL;
+	}
+
+	return z;
+}
+
+static z_stream *__worker_stream(struct tau_metric_exporter_worker_s *w, exporter_encoding_t encoding)
+{
+	z_stream *z = w->streams[encoding];
+
+	if(z)
+	{
+		/* Keeps the allocated state, the level may have changed */
+		deflateReset(z);
+		deflateParams(z, w->exporter->compression_level, Z_DEFAULT_STRATEGY);
+		return z;
+	}
+
+	w->streams[encoding] = __deflate_new(encoding, w->exporter->compression_level);
+
+	return w->streams[encoding];
+}
+
+static char *__compress(z_stream *z, const char *data, size_t len, size_t *out_len)
+{
+	size_t bound = deflateBound(z, len);
+	char * ret   = malloc(bound);
+
+	if(!ret)
+	{
+		tau_metric_proxy_perror("malloc");
+		return NULL;
+	}
+
+	z->next_out  = (Bytef *)ret;
+	z->avail_out = bound;
+
+	size_t fed = 0;
+	int    status;
+
+	/* Fed by slices as zlib counts in 32 bits */
+	do
+	{
+		size_t slice = len - fed;
+
+		if(EXPORTER_COMPRESS_SLICE < slice)
+		{
+			slice = EXPORTER_COMPRESS_SLICE;
+		}
+
+		z->next_in  = (Bytef *)data + fed;
+		z->avail_in = slice;
+		fed        += slice;
+
+		status = deflate(z, (fed == len) ? Z_FINISH : Z_NO_FLUSH);
+	}while( (status == Z_OK) && (fed < len) );
+
+	if(status != Z_STREAM_END)
+	{
+		tau_metric_proxy_error("deflate failed: %s", z->msg ? z->msg : "no message");
+		free(ret);
+		return NULL;
+	}
+
+	*out_len = z->total_out;
+
+	/* The bound is above the plain size */
+	char *shrunk = realloc(ret, *out_len);
+
+	return shrunk ? shrunk : ret;
+}
+
+static void __worker_streams_free(struct tau_metric_exporter_worker_s *w)
+{
+	int i;
+
+	for(i = 0; i < EXPORTER_ENCODING_COUNT; i++)
+	{
+		if(w->streams[i])
+		{
+			deflateEnd(w->streams[i]);
+			free(w->streams[i]);
+			w->streams[i] = NULL;
+		}
+	}
+}
+
+#endif
+
+/* Compressed copy of a body, NULL to send it as is */
+static char *__body_encoded(struct tau_metric_exporter_worker_s *w, const char *data, size_t len,
+                            exporter_encoding_t encoding, size_t *out_len)
+{
+	char *ret = NULL;
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	if( (encoding == EXPORTER_IDENTITY) || !w->exporter->compression_level || (len < EXPORTER_COMPRESS_MIN_SIZE) )
+	{
+		return NULL;
+	}
+
+	z_stream *z = __worker_stream(w, encoding);
+
+	if(z)
+	{
+		ret = __compress(z, data, len, out_len);
+	}
+
+	if(ret)
+	{
+		tau_metric_proxy_log_verbose("Exposition %s from %ld to %ld bytes", __encoding_name[encoding], len, *out_len);
+	}
+#endif
+
+	return ret;
+}
+
+/* Body of an exposition in a coding, compressed by the first scrape asking
+   for it and then shared, NULL to send it as is */
+static const char *__exposition_encoded(struct tau_metric_exporter_worker_s *w, struct tau_metric_exposition_s *e,
+                                        tau_metric_format_t format, exporter_encoding_t encoding, size_t *len)
+{
+	if(encoding == EXPORTER_IDENTITY)
+	{
+		return NULL;
+	}
+
+	pthread_mutex_lock(&e->lock);
+
+	if(!e->encoded[format][encoding])
+	{
+		e->encoded[format][encoding] = __body_encoded(w, e->data[format], e->len[format], encoding,
+		                                              &e->encoded_len[format][encoding]);
+	}
+
+	const char *ret = e->encoded[format][encoding];
+	*len = e->encoded_len[format][encoding];
+
+	pthread_mutex_unlock(&e->lock);
+
+	return ret;
+}
+
+/************************
+* STREAMED EXPOSITIONS *
+************************/
+
+/** Plain text rendered for each chunk of a streamed body */
+#define EXPORTER_CHUNK_SIZE (64 * 1024)
+/** Room left before the data of a chunk for its size line */
+#define EXPORTER_CHUNK_PREFIX 16
+/** Series copied at once from the array of a streamed body */
+#define EXPORTER_STREAM_PART 1024
+
+/* Body of a large exposition rendered as the client drains it: the
+   array is copied by parts and rendered through a chunk, neither the
+   body nor a snapshot of all the series is ever held. Each part is
+   detached as soon as it is taken, nothing pins the array while the
+   client drains the chunks and the next part resumes from the name
+   held in the cursor */
+struct exporter_stream
+{
+	metric_array_t *         array;
+	tau_metric_format_t      format;
+	metric_array_snapshot_t  snapshot;   /**< Part being rendered (detached) */
+	exposition_cursor_t      cursor;     /**< Position in the part */
+	metric_snapshot_cursor_t next;       /**< Where the next part starts */
+	metric_snapshot_cursor_t rewind;     /**< First slice of the family being sliced */
+	int                      slicing;    /**< The parts are slices of a family */
+	int                      last_slice; /**< The part ends the family */
+	int                      windows;    /**< Window families of the sliced family */
+	int                      done;       /**< The last chunk is framed */
+	uint64_t                 nsec;       /**< Time spent rendering */
+	struct growing_string    plain;      /**< Families of the chunk */
+	struct growing_string    chunk;      /**< Framed chunk being sent */
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	z_stream *               z;          /**< Compressor of the whole body (NULL to send it as is) */
+#endif
+};
+
+static void __stream_free(struct exporter_stream *s)
+{
+	if(!s)
+	{
+		return;
+	}
+
+	metric_array_snapshot_free(&s->snapshot);
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	if(s->z)
+	{
+		deflateEnd(s->z);
+		free(s->z);
+	}
+#endif
+
+	free(s->plain.buffer);
+	free(s->chunk.buffer);
+	free(s);
+}
+
+/* Copy the next part of the array, returns 1 on error */
+static int __stream_take(struct exporter_stream *s)
+{
+	family_cursor_t *f = &s->cursor.family;
+
+	/* Continues a family taken by slices */
+	int resumed = s->next.cut;
+
+	if(metric_array_snapshot_take_part(s->array, &s->snapshot, &s->next, EXPORTER_STREAM_PART)
+	   || metric_array_snapshot_detach(&s->snapshot) )
+	{
+		return 1;
+	}
+
+	if(!resumed && !s->next.cut)
+	{
+		memset(&s->cursor, 0, sizeof(exposition_cursor_t) );
+		return 0;
+	}
+
+	if(!s->slicing)
+	{
+		/* The header and the values go with the first pass */
+		memset(&s->cursor, 0, sizeof(exposition_cursor_t) );
+		f->stop = FAMILY_PART_WINDOWS;
+
+		s->slicing       = 1;
+		s->windows       = s->snapshot.count ? __window_families(s->snapshot.entries[0].type) : 0;
+		s->rewind        = s->next;
+		s->rewind.member = 0;
+	}
+	else
+	{
+		/* Each slice goes through the part of its pass */
+		f->part   = f->stop - 1;
+		f->member = 0;
+	}
+
+	s->last_slice = !s->next.cut;
+
+	return 0;
+}
+
+/* Render the part from its cursor until the chunk is full, returns 1
+   once the part is complete */
+static int __stream_render(struct exporter_stream *s)
+{
+	if(!s->slicing)
+	{
+		return __serialize_families(&s->plain, &s->snapshot, s->format, &s->cursor, EXPORTER_CHUNK_SIZE);
+	}
+
+	/* Members dropped meanwhile may leave an empty slice */
+	if(!s->snapshot.count)
+	{
+		return 1;
+	}
+
+	if(!__serialize_family_format(&s->plain, s->snapshot.entries, s->snapshot.count, s->format, &s->cursor.family,
+	                              EXPORTER_CHUNK_SIZE) )
+	{
+		return 0;
+	}
+
+	if(s->last_slice)
+	{
+		family_cursor_t *f = &s->cursor.family;
+
+		/* The window families of the text formats come after all the
+		   values: walk the slices again for each of them, protobuf
+		   slices are complete messages */
+		int passes = 0;
+
+		if(s->array->windows && (s->format != TAU_METRIC_FORMAT_PROTOBUF) )
+		{
+			passes = s->windows;
+		}
+
+		if(f->stop - FAMILY_PART_WINDOWS < passes)
+		{
+			s->next = s->rewind;
+			f->stop++;
+			f->window_header = 0;
+		}
+		else
+		{
+			s->slicing = 0;
+		}
+	}
+
+	return 1;
+}
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+
+/* Compress the families of the chunk, each chunk is flushed so that
+   clients can decode the body as it comes */
+static int __stream_deflate(struct exporter_stream *s, int flush)
+{
+	z_stream *z = s->z;
+	int       status;
+
+	z->next_in  = (Bytef *)s->plain.buffer;
+	z->avail_in = s->plain.current_offset;
+
+	do
+	{
+		/* Flush markers and trailer are not in the bound */
+		size_t room = deflateBound(z, z->avail_in) + 64;
+		char * out  = growing_string_reserve(&s->chunk, room);
+
+		if(!out)
+		{
+			return 1;
+		}
+
+		z->next_out  = (Bytef *)out;
+		z->avail_out = room;
+
+		status = deflate(z, flush);
+
+		s->chunk.current_offset += room - z->avail_out;
+	}while( (status == Z_OK) && !z->avail_out);
+
+	if( (status != Z_OK) && (status != Z_STREAM_END) )
+	{
+		tau_metric_proxy_error("deflate failed: %s", z->msg ? z->msg : "no message");
+		return 1;
+	}
+
+	return 0;
+}
+
+#endif
+
+/* Render and frame the next chunk of a streamed body, the zero sized
+   chunk ending the body comes with the last families */
+static int __stream_refill(struct exporter_response *r)
+{
+	struct exporter_stream *s     = r->stream;
+	uint64_t                start = proxy_stats_nsec();
+	int                     last  = 0;
+
+	s->plain.current_offset = 0;
+	s->chunk.current_offset = EXPORTER_CHUNK_PREFIX;
+
+	while(s->plain.current_offset < EXPORTER_CHUNK_SIZE)
+	{
+		if(!__stream_render(s) )
+		{
+			continue;
+		}
+
+		if(s->next.done && !s->slicing)
+		{
+			last = 1;
+			break;
+		}
+
+		if(__stream_take(s) )
+		{
+			return 1;
+		}
+	}
+
+	if(last && (s->format == TAU_METRIC_FORMAT_OPENMETRICS) )
+	{
+		growing_string_append(&s->plain, "# EOF\n");
+	}
+
+	proxy_stats_add(PROXY_STAT_RENDERED_BYTES, s->plain.current_offset);
+
+	int ret = 0;
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	if(s->z)
+	{
+		ret = __stream_deflate(s, last ? Z_FINISH : Z_SYNC_FLUSH);
+	}
+	else
+#endif
+	{
+		ret = !growing_string_append_len(&s->chunk, s->plain.buffer, s->plain.current_offset);
+	}
+
+	if(ret)
+	{
+		return 1;
+	}
+
+	size_t data_len = s->chunk.current_offset - EXPORTER_CHUNK_PREFIX;
+	char * body     = s->chunk.buffer + EXPORTER_CHUNK_PREFIX;
+
+	/* An empty chunk would end the body */
+	if(data_len)
+	{
+		char line[EXPORTER_CHUNK_PREFIX];
+		int  line_len = snprintf(line, EXPORTER_CHUNK_PREFIX, "%lx\r\n", data_len);
+
+		body -= line_len;
+		memcpy(body, line, line_len);
+
+		ret = !growing_string_append(&s->chunk, "\r\n");
+	}
+
+	if(last)
+	{
+		ret |= !growing_string_append(&s->chunk, "0\r\n\r\n");
+	}
+
+	if(ret)
+	{
+		return 1;
+	}
+
+	r->body     = body;
+	r->body_len = s->chunk.buffer + s->chunk.current_offset - body;
+
+	s->nsec += proxy_stats_nsec() - start;
+
+	if(last)
+	{
+		/* Accounted as a single scrape once whole */
+		proxy_stats_scrape(s->nsec);
+		s->done = 1;
+	}
+
+	return 0;
+}
+
+/* Whether the node exposition is large enough to be streamed */
+static int __stream_wanted(struct tau_metric_exporter_worker_s *w, int chunked)
+{
+	uint64_t min_series = w->exporter->stream_min_series;
+
+	return chunked && min_series && (min_series <= (uint64_t)metric_array_count(metric_array_get_main() ) );
+}
+
+/* Start streaming the exposition of an array, returns the HTTP code */
+static int __stream_open(struct tau_metric_exporter_worker_s *w, struct exporter_response *r, metric_array_t *ma,
+                         tau_metric_format_t format, exporter_encoding_t accepted, exporter_encoding_t *encoding)
+{
+	struct exporter_stream *s = calloc(1, sizeof(struct exporter_stream) );
+
+	if(!s)
+	{
+		tau_metric_proxy_perror("calloc");
+		return 500;
+	}
+
+	s->array           = ma;
+	s->format          = format;
+	s->snapshot.render = (format != TAU_METRIC_FORMAT_PROTOBUF);
+
+	if(!growing_string_alloc(&s->plain, EXPORTER_CHUNK_SIZE + EXPORTER_CHUNK_SIZE / 4)
+	   || !growing_string_alloc(&s->chunk, EXPORTER_CHUNK_PREFIX + EXPORTER_CHUNK_SIZE + EXPORTER_CHUNK_SIZE / 4)
+	   || __stream_take(s) )
+	{
+		__stream_free(s);
+		return 500;
+	}
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	/* Held along the body: cannot be one of the worker */
+	if( (accepted != EXPORTER_IDENTITY) && w->exporter->compression_level)
+	{
+		s->z = __deflate_new(accepted, w->exporter->compression_level);
+	}
+
+	if(s->z)
+	{
+		*encoding = accepted;
+	}
+#endif
+
+	r->stream = s;
+
+	if(__stream_refill(r) )
+	{
+		r->stream = NULL;
+		__stream_free(s);
+		*encoding = EXPORTER_IDENTITY;
+		return 500;
+	}
+
+	return 200;
+}
+
+static const char *const __default_page = "\
+<html>\
+<head><title>Node Exporter</title></head>\
+<body>\
+<h1>TAU Metrics Proxy Exporter</h1>\
+<p><a href='/metrics'>Metrics</a></p>\
+<p><a href='/jobs'>Jobs</a></p>\
+<p><a href='/tree'>Aggregation tree</a> (<a href='/tree/metrics'>Metrics</a>)</p>\
+</body>\
+</html>";
+
+/* Parameters selecting series on /metrics */
+static int __query_is_filtered(const char *query)
+{
+	char key[64];
+	char value[8];
+
+	while(!__query_next(&query, key, 64, value, 8) )
+	{
+		if(!strcmp(key, "match[]") || !strcmp(key, "match") || !strcmp(key, "job") )
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Arrays a filtered exposition is rendered from: the top one for an
+   empty jobid, jobs are held between get and relax */
+typedef struct
+{
+	metric_array_t *(*get)(const char *jobid);
+	int (*relax)(const char *jobid);
+}exporter_source_t;
+
+static metric_array_t *__node_get(const char *jobid)
+{
+	return strlen(jobid) ? metric_array_list_get(jobid) : metric_array_get_main();
+}
+
+static int __node_relax(const char *jobid)
+{
+	return strlen(jobid) ? metric_array_list_relax(jobid) : 0;
+}
+
+/* The node array and the jobs running on the node */
+static const exporter_source_t __node_source = { __node_get, __node_relax };
+
+/* The aggregates of the subtree of this proxy */
+static const exporter_source_t __tree_source = { tau_metric_tree_get, tau_metric_tree_relax };
+
+/* Longest job identifier a job descriptor holds */
+#define EXPORTER_JOBID_MAX_LEN (sizeof(((tau_metric_job_descriptor_t *)NULL)->jobid) - 1)
+
+/* Exposition of the series matching match[] patterns, from the array
+   of a job if given (in the path or the query) with its series labeled
+   by the job, rendered for the request only */
+static char *__generate_filtered(struct tau_metric_exporter_worker_s *w, const exporter_source_t *source,
+                                 const char *query, const char *jobid, tau_metric_format_t format,
+                                 size_t *len, int *code)
+{
+	*len  = 0;
+	*code = 400;
+
+	metric_filter_t filter;
+	metric_filter_init(&filter);
+
+	char key[64];
+	char value[METRIC_STRING_SIZE];
+	char job[METRIC_STRING_SIZE] = "";
+	int  invalid = 0;
+
+	if(jobid)
+	{
+		snprintf(job, METRIC_STRING_SIZE, "%s", jobid);
+	}
+
+	while(!__query_next(&query, key, 64, value, METRIC_STRING_SIZE) )
+	{
+		if(!strcmp(key, "match[]") || !strcmp(key, "match") )
+		{
+			invalid |= metric_filter_add(&filter, value);
+		}
+		else if(!jobid && !strcmp(key, "job") )
+		{
+			snprintf(job, METRIC_STRING_SIZE, "%s", value);
+		}
+	}
+
+	/* A longer id would be looked up truncated, possibly as another job */
+	invalid |= (EXPORTER_JOBID_MAX_LEN < strlen(job) );
+
+	metric_array_t *ma = NULL;
+
+	if(!invalid)
+	{
+		/* Kept alive until rendered */
+		ma = source->get(job);
+
+		if(!ma)
+		{
+			*code = 404;
+		}
+	}
+
+	char *ret = NULL;
+
+	if(!invalid && ma)
+	{
+		char  label[METRIC_STRING_SIZE * 2 + 16];
+		char *l = label + snprintf(label, 16, "jobid=\"");
+
+		l += tau_metric_exporter_label_escape(job, l, METRIC_STRING_SIZE * 2 + 1);
+		snprintf(l, 2, "\"");
+
+		ret   = tau_metric_exporter_render(ma, &w->snapshot, &filter, strlen(job) ? label : NULL, format, 0, len);
+		*code = ret ? 200 : 500;
+
+		source->relax(job);
+	}
+
+	metric_filter_release(&filter);
+
+	return ret;
+}
+
+/* Body rendered for a request, compressed if the client accepts it */
+static int __respond_filtered(struct tau_metric_exporter_worker_s *w, const exporter_source_t *source,
+                              const char *query, const char *jobid, tau_metric_format_t format,
+                              struct exporter_response *r, exporter_encoding_t accepted,
+                              exporter_encoding_t *encoding)
+{
+	int code = 0;
+
+	r->owned = __generate_filtered(w, source, query, jobid, format, &r->body_len, &code);
+	r->body  = r->owned;
+
+	size_t encoded_len = 0;
+	char * encoded     = r->owned ? __body_encoded(w, r->owned, r->body_len, accepted, &encoded_len) : NULL;
+
+	if(encoded)
+	{
+		free(r->owned);
+		r->owned    = encoded;
+		r->body     = encoded;
+		r->body_len = encoded_len;
+		*encoding   = accepted;
+	}
+
+	return code;
+}
+
+/* /<jobid>/metrics of a source, p is on the first slash */
+static int __route_job_metrics(struct tau_metric_exporter_worker_s *w, const exporter_source_t *source, char *p,
+                               tau_metric_format_t format, struct exporter_response *r, const char **content_type,
+                               exporter_encoding_t accepted, exporter_encoding_t *encoding)
+{
+	char jobid[METRIC_STRING_SIZE];
+
+	if(*p != '/')
+	{
+		return 404;
+	}
+
+	p = (char *)__query_decode(p + 1, "/?", jobid, METRIC_STRING_SIZE);
+
+	if(!strlen(jobid) || strncmp(p, "/metrics", 8) || ( (p[8] != '\0') && (p[8] != '?') ) )
+	{
+		return 404;
+	}
+
+	*content_type = tau_metric_format_content_type[format];
+	r->negotiated = 1;
+
+	return __respond_filtered(w, source, (p[8] == '?') ? p + 9 : "", jobid, format, r, accepted, encoding);
+}
+
+/* Fill the body of a response from the requested path, returns the HTTP code */
+static int __route(struct tau_metric_exporter_worker_s *w, char *path, tau_metric_format_t format, int chunked,
+                   struct exporter_response *r, const char **content_type, exporter_encoding_t *encoding)
+{
+	exporter_encoding_t accepted = *encoding;
+
+	*encoding = EXPORTER_IDENTITY;
+
+	tau_metric_proxy_log_verbose("GET %s", path);
+
+	*content_type = "text/html";
+
+	if(!strcmp(path, "/") )
+	{
+		r->body     = __default_page;
+		r->body_len = strlen(__default_page);
+		return 200;
+	}
+
+	if(!strncmp(path, "/history", 8) )
+	{
+		int   code  = 0;
+		char *query = strchr(path, '?');
+
+		r->owned    = __generate_history(query ? query + 1 : NULL, &r->body_len, &code);
+		r->body     = r->owned;
+		*content_type = "application/json";
+		return code;
+	}
+
+	if(!strncmp(path, "/jobs", 5) )
+	{
+		char *p = path + 5;
+
+		/* The listing */
+		if( (*p == '/') && ( (p[1] == '\0') || (p[1] == '?') ) )
+		{
+			p++;
+		}
+
+		if( (*p == '\0') || (*p == '?') )
+		{
+			int code = 0;
+
+			r->owned      = __generate_jobs(&r->body_len, &code);
+			r->body       = r->owned;
+			*content_type = "application/json";
+			return code;
+		}
+
+		return __route_job_metrics(w, &__node_source, p, format, r, content_type, accepted, encoding);
+	}
+
+	if(!strncmp(path, "/tree", 5) && ( (path[5] == '\0') || strchr("/?", path[5]) ) )
+	{
+		char *p = path + 5;
+
+		if(!strncmp(p, "/metrics", 8) && ( (p[8] == '\0') || (p[8] == '?') ) )
+		{
+			*content_type = tau_metric_format_content_type[format];
+			r->negotiated = 1;
+
+			return __respond_filtered(w, &__tree_source, (p[8] == '?') ? p + 9 : "", NULL, format, r, accepted, encoding);
+		}
+
+		if(!strncmp(p, "/jobs/", 6) )
+		{
+			return __route_job_metrics(w, &__tree_source, p + 5, format, r, content_type, accepted, encoding);
+		}
+
+		if( (*p == '/') && ( (p[1] == '\0') || (p[1] == '?') ) )
+		{
+			p++;
+		}
+
+		if( (*p != '\0') && (*p != '?') )
+		{
+			return 404;
+		}
+
+		int code = 0;
+
+		r->owned      = __generate_tree(&r->body_len, &code);
+		r->body       = r->owned;
+		*content_type = "application/json";
+		return code;
+	}
+
+	if(strstr(path, "metrics") )
+	{
+		char *query = strchr(path, '?');
+
+		*content_type = tau_metric_format_content_type[format];
+		r->negotiated = 1;
+
+		if(query && __query_is_filtered(query + 1) )
+		{
+			return __respond_filtered(w, &__node_source, query + 1, NULL, format, r, accepted, encoding);
+		}
+
+		/* Large bodies are not shared: they would be held whole */
+		if(__stream_wanted(w, chunked) )
+		{
+			return __stream_open(w, r, metric_array_get_main(), format, accepted, encoding);
+		}
+
+		r->exposition = __exposition_acquire(w->exporter, format);
+
+		if(!r->exposition)
+		{
+			return 500;
+		}
+
+		/* Shared with the other scrapes: no copy */
+		r->body = __exposition_encoded(w, r->exposition, format, accepted, &r->body_len);
+
+		if(r->body)
+		{
+			*encoding = accepted;
+		}
+		else
+		{
+			r->body     = r->exposition->data[format];
+			r->body_len = r->exposition->len[format];
+		}
+
+		return 200;
+	}
+
+	return 404;
+}
+
+/* Offset past the end of the first complete request, 0 if incomplete */
+static size_t __request_end(const char *buff, size_t len)
+{
+	size_t i;
+
+	for(i = 0; i + 1 < len; i++)
+	{
+		if(buff[i] != '\n')
+		{
+			continue;
+		}
+
+		/* Some clients only send LF */
+		if(buff[i + 1] == '\n')
+		{
+			return i + 2;
+		}
+
+		if( (buff[i + 1] == '\r') && (i + 2 < len) && (buff[i + 2] == '\n') )
+		{
+			return i + 3;
+		}
+	}
+
+	return 0;
+}
+
+/* Value of a header in a NUL terminated request, NULL if absent */
+static const char *__request_header(const char *request, const char *name)
+{
+	size_t      len  = strlen(name);
+	const char *line = strchr(request, '\n');
+
+	while(line)
+	{
+		line++;
+
+		if(!strncasecmp(line, name, len) && (line[len] == ':') )
+		{
+			return line + len + 1;
+		}
+
+		line = strchr(line, '\n');
+	}
+
+	return NULL;
+}
+
+static void __connection_queue(struct exporter_connection *c, struct exporter_response *r)
+{
+	if(c->tail)
+	{
+		c->tail->next = r;
+	}
+	else
+	{
+		c->head = r;
+	}
+
+	c->tail = r;
+}
+
+/* Handle one request (NUL terminated), 1 if the connection has to close after it */
+static int __connection_request(struct tau_metric_exporter_worker_s *w, struct exporter_connection *c, char *request)
+{
+	struct exporter_response *r = calloc(1, sizeof(struct exporter_response) );
+
+	if(!r)
+	{
+		tau_metric_proxy_perror("calloc");
+		return 1;
+	}
+
+	char method[16] = { 0 };
+	char path[METRIC_STRING_SIZE * 4] = { 0 };
+	char version[16] = { 0 };
+
+	/* Method target and version in the request line */
+	char *line_end = request + strcspn(request, "\r\n");
+	char  saved    = *line_end;
+
+	*line_end = '\0';
+	int fields = sscanf(request, "%15s %1023s %15s", method, path, version);
+	*line_end = saved;
+
+	int http10     = !strcmp(version, "HTTP/1.0");
+	int keep_alive = !http10;
+
+	const char *connection = __request_header(request, "Connection");
+
+	if(connection)
+	{
+		size_t len = strcspn(connection, "\r\n");
+
+		if(memmem(connection, len, "close", 5) )
+		{
+			keep_alive = 0;
+		}
+		else if(http10 && memmem(connection, len, "eep-alive", 9) )
+		{
+			keep_alive = 1;
+		}
+	}
+
+	/* A body would be taken for the next request */
+	if(__request_header(request, "Content-Length") || __request_header(request, "Transfer-Encoding") )
+	{
+		keep_alive = 0;
+	}
+
+	const char *        content_type = "text/plain";
+	int                 is_head      = !strcmp(method, "HEAD");
+	exporter_encoding_t encoding     = __negotiate_encoding(__request_header(request, "Accept-Encoding") );
+	tau_metric_format_t format       = __negotiate_format(__request_header(request, "Accept") );
+	int                 code;
+
+	if(fields < 2)
+	{
+		code       = 400;
+		keep_alive = 0;
+	}
+	else if(!strcmp(method, "GET") || is_head)
+	{
+		uint64_t start = proxy_stats_nsec();
+
+		/* HTTP/1.0 has no chunked bodies and HEAD only needs the headers */
+		int chunked = !http10 && !is_head;
+
+		code = __route(w, path, format, chunked, r, &content_type, &encoding);
+
+		/* Only metric routes negotiate their body, streams account for themselves */
+		if(r->negotiated && !r->stream)
+		{
+			proxy_stats_scrape(proxy_stats_nsec() - start);
+		}
+	}
+	else
+	{
+		code       = 405;
+		keep_alive = 0;
+	}
+
+	/* Errors carry no body */
+	if(code != 200)
+	{
+		r->body_len = 0;
+		encoding    = EXPORTER_IDENTITY;
+	}
+
+	char coding[96] = "";
+
+	if(r->negotiated)
+	{
+		/* Format and coding both depend on the request */
+		snprintf(coding, 96, "%s%s%sVary: Accept, Accept-Encoding\r\n",
+		         (encoding != EXPORTER_IDENTITY) ? "Content-Encoding: " : "",
+		         (encoding != EXPORTER_IDENTITY) ? __encoding_name[encoding] : "",
+		         (encoding != EXPORTER_IDENTITY) ? "\r\n" : "");
+	}
+
+	/* The size of a streamed body is only known at its end */
+	char length[48];
+
+	if(r->stream)
+	{
+		snprintf(length, 48, "Transfer-Encoding: chunked\r\n");
+	}
+	else
+	{
+		snprintf(length, 48, "Content-Length: %lu\r\n", r->body_len);
+	}
+
+	r->header_len = snprintf(r->header, sizeof(r->header),
+	                         "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s%s%s\r\n",
+	                         __http_status(code), content_type, length, coding,
+	                         keep_alive ? "" : "Connection: close\r\n");
+
+	if(is_head)
+	{
+		r->body_len = 0;
+	}
+
+	__connection_queue(c, r);
+
+	return !keep_alive;
+}
+
+/* Answer without parsing the request, the connection is closed once sent */
+static int __connection_reject(struct exporter_connection *c, int code)
+{
+	struct exporter_response *r = calloc(1, sizeof(struct exporter_response) );
+
+	if(!r)
+	{
+		tau_metric_proxy_perror("calloc");
+		return 1;
+	}
+
+	r->header_len = snprintf(r->header, sizeof(r->header),
+	                         "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+	                         __http_status(code) );
+
+	__connection_queue(c, r);
+
+	return 1;
+}
+
+/* Send queued responses, returns 0 when all sent 1 when the socket is full -1 on error */
+static int __connection_flush(struct exporter_connection *c)
+{
+	while(c->head)
+	{
+		struct iovec iov[EXPORTER_MAX_IOV];
+		int cnt = 0;
+
+		struct exporter_response *r;
+
+		for(r = c->head; r && (cnt + 2 <= EXPORTER_MAX_IOV); r = r->next)
+		{
+			size_t sent = (r == c->head) ? r->sent : 0;
+
+			if(sent < r->header_len)
+			{
+				iov[cnt].iov_base = r->header + sent;
+				iov[cnt].iov_len  = r->header_len - sent;
+				cnt++;
+				sent = r->header_len;
+			}
+
+			if(sent - r->header_len < r->body_len)
+			{
+				iov[cnt].iov_base = (char *)r->body + (sent - r->header_len);
+				iov[cnt].iov_len  = r->body_len - (sent - r->header_len);
+				cnt++;
+			}
+
+			/* Next responses wait for the end of the stream */
+			if(r->stream && !r->stream->done)
+			{
+				break;
+			}
+		}
+
+		ssize_t ret = writev(c->fd, iov, cnt);
+
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			if( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
+			{
+				return 1;
+			}
+
+			tau_metric_proxy_log_verbose("writev: %s", strerror(errno) );
+			return -1;
+		}
+
+		/* Retire the responses fully sent */
+		size_t written = ret;
+
+		while(c->head)
+		{
+			r = c->head;
+
+			size_t left = r->header_len + r->body_len - r->sent;
+
+			if(written < left)
+			{
+				r->sent += written;
+				break;
+			}
+
+			written -= left;
+
+			/* Nothing else was sent after the chunk */
+			if(r->stream && !r->stream->done)
+			{
+				if(__stream_refill(r) )
+				{
+					return -1;
+				}
+
+				r->sent = r->header_len;
+				continue;
+			}
+
+			c->head  = r->next;
+			__response_free(r);
+		}
+
+		if(!c->head)
+		{
+			c->tail = NULL;
+		}
+	}
+
+	return 0;
+}
+
+/*************************
+* EVENT DRIVEN EXPORTER *
+*************************/
+
+/* Tags the wake up event, connections are tagged with their state
+   and the listening socket with NULL */
+static char __wake_tag;
+
+static void __connection_close(struct tau_metric_exporter_worker_s *w, struct exporter_connection *c)
+{
+	if(c->prev)
+	{
+		c->prev->next = c->next;
+	}
+	else
+	{
+		w->connections = c->next;
+	}
+
+	if(c->next)
+	{
+		c->next->prev = c->prev;
+	}
+
+	/* Closing also removes it from the epoll set */
+	close(c->fd);
+
+	while(c->head)
+	{
+		struct exporter_response *r = c->head;
+		c->head = r->next;
+		__response_free(r);
+	}
+
+	free(c);
+}
+
+static void __worker_accept(struct tau_metric_exporter_worker_s *w)
+{
+	while(1)
+	{
+		int fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if(fd < 0)
+		{
+			if( (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) )
+			{
+				tau_metric_proxy_perror("accept");
+			}
+
+			return;
+		}
+
+		/* Responses are complete writes: do not delay them */
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int) );
+
+		struct exporter_connection *c = malloc(sizeof(struct exporter_connection) );
+
+		if(!c)
+		{
+			tau_metric_proxy_perror("malloc");
+			close(fd);
+			return;
+		}
+
+		c->fd            = fd;
+		c->in_len        = 0;
+		c->closing       = 0;
+		c->writing       = 0;
+		c->last_activity = utils_get_ts();
+		c->head          = NULL;
+		c->tail          = NULL;
+		c->prev          = NULL;
+		c->next          = w->connections;
+
+		struct epoll_event ev;
+		ev.events   = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = c;
+
+		if(epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			tau_metric_proxy_perror("epoll_ctl");
+			close(fd);
+			free(c);
+			continue;
+		}
+
+		if(w->connections)
+		{
+			w->connections->prev = c;
+		}
+
+		w->connections = c;
+	}
+}
+
+/* Returns 1 if the connection was closed */
+static int __worker_flush(struct tau_metric_exporter_worker_s *w, struct exporter_connection *c)
+{
+	int ret = __connection_flush(c);
+
+	if( (ret < 0) || (!ret && c->closing) )
+	{
+		__connection_close(w, c);
+		return 1;
+	}
+
+	/* Stop reading while the peer does not drain its responses */
+	int writing = (ret == 1);
+
+	if(writing != c->writing)
+	{
+		struct epoll_event ev;
+		ev.events   = writing ? EPOLLOUT : (EPOLLIN | EPOLLRDHUP);
+		ev.data.ptr = c;
+
+		epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->writing = writing;
+	}
+
+	return 0;
+}
+
+static void __worker_read(struct tau_metric_exporter_worker_s *w, struct exporter_connection *c)
+{
+	ssize_t ret = read(c->fd, c->in + c->in_len, EXPORTER_REQUEST_SIZE - 1 - c->in_len);
+
+	if(ret < 0)
+	{
+		if( (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR) )
+		{
+			return;
+		}
+
+		__connection_close(w, c);
+		return;
+	}
+
+	if(ret == 0)
+	{
+		/* The peer is gone, its pending responses too */
+		__connection_close(w, c);
+		return;
+	}
+
+	c->in_len       += ret;
+	c->last_activity = utils_get_ts();
+
+	/* Pipelined requests are answered in order */
+	size_t end;
+
+	while(!c->closing && (end = __request_end(c->in, c->in_len) ) )
+	{
+		char saved = c->in[end];
+		c->in[end] = '\0';
+
+		c->closing = __connection_request(w, c, c->in);
+
+		c->in[end] = saved;
+		memmove(c->in, c->in + end, c->in_len - end);
+		c->in_len -= end;
+	}
+
+	if(!c->closing && (c->in_len == EXPORTER_REQUEST_SIZE - 1) )
+	{
+		tau_metric_proxy_log_verbose("Dropping oversized HTTP request");
+		c->in_len  = 0;
+		c->closing = __connection_reject(c, 431);
+	}
+
+	__worker_flush(w, c);
+}
+
+static void __worker_sweep(struct tau_metric_exporter_worker_s *w, double now)
+{
+	struct exporter_connection *c = w->connections;
+
+	while(c)
+	{
+		struct exporter_connection *next = c->next;
+
+		if(TAU_METRIC_EXPORTER_IDLE_TIMEOUT < now - c->last_activity)
+		{
+			__connection_close(w, c);
+		}
+
+		c = next;
+	}
+}
+
+#define EXPORTER_MAX_EVENTS 64
+
+static void *__worker_loop(void *pworker)
+{
+	struct tau_metric_exporter_worker_s *w = (struct tau_metric_exporter_worker_s *)pworker;
+
+	struct epoll_event events[EXPORTER_MAX_EVENTS];
+	double last_sweep = utils_get_ts();
+
+	while(w->exporter->running)
+	{
+		int n = epoll_wait(w->epoll_fd, events, EXPORTER_MAX_EVENTS, 1000);
+
+		if( (n < 0) && (errno != EINTR) )
+		{
+			tau_metric_proxy_perror("epoll_wait");
+			break;
+		}
+
+		int i;
+
+		for(i = 0; i < n; i++)
+		{
+			void *tag = events[i].data.ptr;
+
+			if(tag == &__wake_tag)
+			{
+				continue;
+			}
+
+			if(!tag)
+			{
+				__worker_accept(w);
+				continue;
+			}
+
+			struct exporter_connection *c = (struct exporter_connection *)tag;
+
+			if(events[i].events & (EPOLLERR | EPOLLHUP) )
+			{
+				__connection_close(w, c);
+			}
+			else if(events[i].events & EPOLLOUT)
+			{
+				c->last_activity = utils_get_ts();
+				__worker_flush(w, c);
+			}
+			else if(events[i].events & (EPOLLIN | EPOLLRDHUP) )
+			{
+				__worker_read(w, c);
+			}
+		}
+
+		double now = utils_get_ts();
+
+		if(1.0 <= now - last_sweep)
+		{
+			__worker_sweep(w, now);
+			last_sweep = now;
+		}
+	}
+
+	while(w->connections)
+	{
+		__connection_close(w, w->connections);
+	}
+
+	return NULL;
+}
+
+static int __worker_init(tau_metric_exporter_t *exporter, struct tau_metric_exporter_worker_s *w,
+                         const char *port, int shared_listen_fd)
+{
+	w->exporter    = exporter;
+	w->connections = NULL;
+
+	w->listen_fd      = (shared_listen_fd < 0) ? __bind_listening_socket(port, 1) : shared_listen_fd;
+	w->owns_listen_fd = (shared_listen_fd < 0);
+
+	if(w->listen_fd < 0)
+	{
+		return 1;
+	}
+
+	w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if(w->epoll_fd < 0)
+	{
+		tau_metric_proxy_perror("epoll_create1");
+		goto INIT_FAIL;
+	}
+
+	struct epoll_event ev;
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+
+#ifdef EPOLLEXCLUSIVE
+	/* Only one of the workers sharing the socket is woken up */
+	if(!w->owns_listen_fd)
+	{
+		ev.events |= EPOLLEXCLUSIVE;
+	}
+#endif
+
+	if(epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0)
+	{
+		tau_metric_proxy_perror("epoll_ctl");
+		goto INIT_FAIL;
+	}
+
+	/* Never read: it wakes all the workers until they leave */
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &__wake_tag;
+
+	if(epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, exporter->wake_fd, &ev) < 0)
+	{
+		tau_metric_proxy_perror("epoll_ctl");
+		goto INIT_FAIL;
+	}
+
+	return 0;
+
+INIT_FAIL:
+	if(0 <= w->epoll_fd)
+	{
+		close(w->epoll_fd);
+	}
+
+	if(w->owns_listen_fd)
+	{
+		close(w->listen_fd);
+	}
+
+	return 1;
+}
+
+static void __worker_release(struct tau_metric_exporter_worker_s *w)
+{
+	close(w->epoll_fd);
+	metric_array_snapshot_free(&w->snapshot);
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	__worker_streams_free(w);
+#endif
+
+	if(w->owns_listen_fd)
+	{
+		close(w->listen_fd);
+	}
+}
+
+int tau_metric_exporter_init(tau_metric_exporter_t *exporter, const char *port, double freshness, int workers)
+{
+	exporter->freshness    = freshness;
+	exporter->exposition   = NULL;
+	exporter->compression_level = TAU_METRIC_EXPORTER_DEFAULT_COMPRESSION;
+	exporter->stream_min_series = TAU_METRIC_EXPORTER_DEFAULT_STREAM_SERIES;
+	exporter->worker_count = 0;
+	memset(&exporter->snapshot, 0, sizeof(metric_array_snapshot_t) );
+	memset(exporter->last_len, 0, sizeof(exporter->last_len) );
+	pthread_mutex_init(&exporter->exposition_lock, NULL);
+
+	if(workers < 1)
+	{
+		workers = 1;
+	}
+
+	exporter->workers = calloc(workers, sizeof(struct tau_metric_exporter_worker_s) );
+	exporter->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(!exporter->workers || (exporter->wake_fd < 0) )
+	{
+		tau_metric_proxy_perror("exporter init");
+		return -1;
+	}
+
+	exporter->running = 1;
+
+	int shared_listen_fd = -1;
+	int i;
+
+	for(i = 0; i < workers; i++)
+	{
+		struct tau_metric_exporter_worker_s *w = &exporter->workers[i];
+
+		if(__worker_init(exporter, w, port, shared_listen_fd) )
+		{
+			if(!i || (0 <= shared_listen_fd) )
+			{
+				tau_metric_proxy_error("Failed to bind listening socket to 0.0.0.0:%s", port);
+				tau_metric_exporter_release(exporter);
+				return -1;
+			}
+
+			/* No SO_REUSEPORT: the workers share the first socket */
+			shared_listen_fd = exporter->workers[0].listen_fd;
+			i--;
+			continue;
+		}
+
+		if(pthread_create(&w->thread, NULL, __worker_loop, (void *)w) != 0)
+		{
+			tau_metric_proxy_perror("pthread_create");
+			__worker_release(w);
+			tau_metric_exporter_release(exporter);
+			return -1;
+		}
+
+		exporter->worker_count++;
+	}
+
+	tau_metric_proxy_log("now listening on 0.0.0.0:%s with %d workers%s", port, workers,
+	                     (0 <= shared_listen_fd) ? " (shared socket)" : "");
+
+	return 0;
+}
+
+int tau_metric_exporter_set_compression(tau_metric_exporter_t *exporter, int level)
+{
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	exporter->compression_level = level;
+	return 0;
+#else
+	exporter->compression_level = 0;
+	return level ? -1 : 0;
+#endif
+}
+
+int tau_metric_exporter_set_streaming(tau_metric_exporter_t *exporter, uint64_t min_series)
+{
+	exporter->stream_min_series = min_series;
+	return 0;
+}
+
+int tau_metric_exporter_release(tau_metric_exporter_t *exporter)
+{
+	int i;
+
+	if(exporter->running)
+	{
+		exporter->running = 0;
+
+		uint64_t one = 1;
+
+		if(write(exporter->wake_fd, &one, sizeof(uint64_t) ) < 0)
+		{
+			tau_metric_proxy_perror("write");
+		}
+	}
+
+	for(i = 0; i < exporter->worker_count; i++)
+	{
+		pthread_join(exporter->workers[i].thread, NULL);
+	}
+
+	/* Shared sockets are closed by their owner, the first worker, last */
+	for(i = exporter->worker_count - 1; 0 <= i; i--)
+	{
+		__worker_release(&exporter->workers[i]);
+	}
+
+	exporter->worker_count = 0;
+	free(exporter->workers);
+	exporter->workers = NULL;
+
+	if(0 <= exporter->wake_fd)
+	{
+		close(exporter->wake_fd);
+		exporter->wake_fd = -1;
 	}
 
-	pthread_join(exporter->listening_thread, NULL);
+	pthread_mutex_lock(&exporter->exposition_lock);
+	__exposition_release(exporter->exposition);
+	exporter->exposition = NULL;
+	metric_array_snapshot_free(&exporter->snapshot);
+	pthread_mutex_unlock(&exporter->exposition_lock);
 
 	return 0;
 }
@@ -3,14 +3,142 @@
 
 #include <pthread.h>
 
+#include "metrics.h"
+
+/** Default time during which scrapes share the same body (seconds) */
+#define TAU_METRIC_EXPORTER_DEFAULT_FRESHNESS 1.0
+
+/** Default number of threads serving HTTP */
+#define TAU_METRIC_EXPORTER_DEFAULT_WORKERS 2
+
+/** Default zlib level of compressed scrapes (0 sends plain text) */
+#define TAU_METRIC_EXPORTER_DEFAULT_COMPRESSION 6
+
+/** Default number of node series from which /metrics is streamed in chunks (0 never streams) */
+#define TAU_METRIC_EXPORTER_DEFAULT_STREAM_SERIES 131072
+
+/** Keep-alive connections idle for this long are closed (seconds) */
+#define TAU_METRIC_EXPORTER_IDLE_TIMEOUT 60
+
+/** Exposition formats served on /metrics */
+typedef enum
+{
+	TAU_METRIC_FORMAT_TEXT,        /**< Prometheus text format 0.0.4 */
+	TAU_METRIC_FORMAT_OPENMETRICS, /**< OpenMetrics 1.0 text */
+	TAU_METRIC_FORMAT_PROTOBUF,    /**< Delimited io.prometheus.client.MetricFamily messages */
+	TAU_METRIC_FORMAT_COUNT
+}tau_metric_format_t;
+
+/** HTTP content type of each format */
+extern const char *const tau_metric_format_content_type[TAU_METRIC_FORMAT_COUNT];
+
+struct tau_metric_exposition_s;
+struct tau_metric_exporter_worker_s;
+
 typedef struct
 {
-    pthread_t listening_thread;
     int running;
-    int listen_fd;
+    int wake_fd;                                  /**< Signaled to stop the workers */
+    int worker_count;                             /**< Number of started workers */
+    struct tau_metric_exporter_worker_s *workers; /**< Event loops each with its listening socket */
+    double freshness;                           /**< Scrapes within this many seconds share a body */
+    int compression_level;                      /**< zlib level for clients accepting gzip or deflate */
+    uint64_t stream_min_series;                 /**< Stream /metrics from this many node series (0 disables) */
+    pthread_mutex_t exposition_lock;            /**< Serializes body generations */
+    struct tau_metric_exposition_s *exposition; /**< Last generated body */
+    metric_array_snapshot_t snapshot;           /**< Snapshot buffer reused between scrapes */
+    size_t last_len[TAU_METRIC_FORMAT_COUNT];   /**< Size of the previous body in each format */
 }tau_metric_exporter_t;
 
-int tau_metric_exporter_init(tau_metric_exporter_t * exporter, const char * port);
+/**
+ * @brief Start serving the exposition over HTTP
+ *
+ * Each worker runs an epoll loop over its own listening socket
+ * (SO_REUSEPORT) and keeps connections alive between requests.
+ *
+ * @param exporter the exporter to start
+ * @param port TCP port to listen on
+ * @param freshness scrapes within this many seconds share a body
+ * @param workers number of threads serving requests
+ * @return int 0 on success
+ */
+int tau_metric_exporter_init(tau_metric_exporter_t * exporter, const char * port, double freshness, int workers);
+/**
+ * @brief Set the compression of bodies for clients accepting it
+ *
+ * Compressed bodies are kept along with the plain one for the scrapes
+ * sharing it.
+ *
+ * @param exporter the exporter
+ * @param level zlib level from 1 to 9, 0 to always send plain text
+ * @return int 0 on success, -1 if built without zlib
+ */
+int tau_metric_exporter_set_compression(tau_metric_exporter_t *exporter, int level);
+
+/**
+ * @brief Set from which size scrapes are streamed
+ *
+ * When the node array holds at least that many series, /metrics is
+ * rendered part by part as HTTP/1.1 clients read it (chunked transfer
+ * coding) instead of being held whole. Streamed bodies are rendered
+ * for each scrape: they are not shared between concurrent scrapes.
+ * Filtered and per-job expositions are never streamed.
+ *
+ * @param exporter the exporter
+ * @param min_series number of node series, 0 never streams
+ * @return int 0 on success
+ */
+int tau_metric_exporter_set_streaming(tau_metric_exporter_t *exporter, uint64_t min_series);
+
 int tau_metric_exporter_release(tau_metric_exporter_t *exporter);
 
-#endif /* TAU_METRIC_PROXY_EXPORTER_H */
\ No newline at end of file
+/**
+ * @brief Render the exposition of an array
+ *
+ * @param ma the array to expose
+ * @param snap snapshot buffer (released on return, kept for reuse)
+ * @param filter the series to expose (NULL for all)
+ * @param label label pair added to each series (such as jobid="42", NULL for none)
+ * @param format the exposition format
+ * @param size_hint expected size of the body
+ * @param len where to store the length of the body
+ * @return char* the body to free, NULL on error
+ */
+char *tau_metric_exporter_render(metric_array_t *ma, metric_array_snapshot_t *snap, const metric_filter_t *filter,
+                                 const char *label, tau_metric_format_t format, size_t size_hint, size_t *len);
+
+/**
+ * @brief Escape a label value as in the exposition (backslashes, quotes and newlines)
+ *
+ * @param value the raw value
+ * @param out where to write the escaped value
+ * @param size size of out
+ * @return size_t length of the escaped value, size or more if it was truncated
+ */
+size_t tau_metric_exporter_label_escape(const char *value, char *out, size_t size);
+
+/**
+ * @brief Render updated series of a snapshot as a remote write request
+ *
+ * The body is an uncompressed prometheus.WriteRequest with one sample
+ * per series at its last update. Series are taken from the cursor on,
+ * skipping those not updated after since and those of other shards (a
+ * series always falls in the same shard). Window aggregates are left
+ * to the receiver.
+ *
+ * @param snap a snapshot of the series
+ * @param cursor first entry to look at, moved past the last one taken
+ * @param since only series updated after this timestamp are taken
+ * @param shard shard of the series to take
+ * @param shards number of shards
+ * @param label label pair added to each series (such as instance="node1", NULL for none)
+ * @param max_samples series taken at most
+ * @param len where to store the length of the body
+ * @param samples where to store the number of series taken (0 once the snapshot is done)
+ * @return char* the body to free, NULL on error
+ */
+char *tau_metric_exporter_render_remote_write(metric_array_snapshot_t *snap, uint64_t *cursor, double since,
+                                              unsigned int shard, unsigned int shards, const char *label,
+                                              uint64_t max_samples, size_t *len, uint64_t *samples);
+
+#endif /* TAU_METRIC_PROXY_EXPORTER_H */
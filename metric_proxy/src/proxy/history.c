@@ -0,0 +1,479 @@
+#include "history.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+/* Memory held by all the histories */
+static size_t __history_bytes = 0;
+
+size_t metric_history_total_bytes(void)
+{
+	return __atomic_load_n(&__history_bytes, __ATOMIC_RELAXED);
+}
+
+/***************
+* BIT STREAMS *
+***************/
+
+/* Largest encoded sample: 4 + 32 bits of timestamp
+   and 2 + 5 + 6 + 64 bits of value */
+#define HISTORY_MAX_SAMPLE_BITS 113
+
+/* Marks a chunk without previous XOR window */
+#define HISTORY_NO_WINDOW 0xFF
+
+static inline void __put_bits(metric_history_chunk_t *c, uint64_t v, int n)
+{
+	while(n)
+	{
+		int free_bits = 8 - (c->bits & 7);
+		int take      = (n < free_bits) ? n : free_bits;
+
+		uint8_t part = (v >> (n - take) ) & ( (1u << take) - 1);
+
+		c->data[c->bits >> 3] |= part << (free_bits - take);
+
+		c->bits += take;
+		n       -= take;
+	}
+}
+
+typedef struct
+{
+	const metric_history_chunk_t *chunk;
+	uint32_t                      bit;
+	uint32_t                      index;
+	int64_t                       ts;
+	int64_t                       delta;
+	uint64_t                      value;
+	uint8_t                       leading;
+	uint8_t                       trailing;
+}history_cursor_t;
+
+static inline uint64_t __get_bits(history_cursor_t *cur, int n)
+{
+	uint64_t ret = 0;
+
+	while(n)
+	{
+		int avail = 8 - (cur->bit & 7);
+		int take  = (n < avail) ? n : avail;
+
+		uint8_t byte = cur->chunk->data[cur->bit >> 3];
+
+		ret = (ret << take) | ( (byte >> (avail - take) ) & ( (1u << take) - 1) );
+
+		cur->bit += take;
+		n        -= take;
+	}
+
+	return ret;
+}
+
+/******************
+* CHUNK ENCODING *
+******************/
+
+static inline uint64_t __double_bits(double v)
+{
+	uint64_t ret;
+	memcpy(&ret, &v, sizeof(double) );
+	return ret;
+}
+
+static inline double __bits_double(uint64_t v)
+{
+	double ret;
+	memcpy(&ret, &v, sizeof(double) );
+	return ret;
+}
+
+static metric_history_chunk_t *__chunk_new(int64_t ts, uint64_t value)
+{
+	metric_history_chunk_t *ret = calloc(1, sizeof(metric_history_chunk_t) );
+
+	if(!ret)
+	{
+		tau_metric_proxy_perror("calloc");
+		return NULL;
+	}
+
+	ret->first_ts     = ts;
+	ret->last_ts      = ts;
+	ret->first_value  = value;
+	ret->last_value   = value;
+	ret->count        = 1;
+	ret->last_leading = HISTORY_NO_WINDOW;
+
+	return ret;
+}
+
+/* Returns 1 when the sample does not fit in the chunk */
+static int __chunk_append(metric_history_chunk_t *c, int64_t ts, uint64_t value)
+{
+	if( (METRIC_HISTORY_CHUNK_BYTES * 8) < (c->bits + HISTORY_MAX_SAMPLE_BITS) )
+	{
+		return 1;
+	}
+
+	int64_t delta = ts - c->last_ts;
+	int64_t dod   = delta - c->last_delta;
+
+	if( (dod < INT32_MIN) || (INT32_MAX < dod) )
+	{
+		return 1;
+	}
+
+	/* Timestamp as delta of delta */
+	if(dod == 0)
+	{
+		__put_bits(c, 0x0, 1);
+	}
+	else if( (-63 <= dod) && (dod <= 64) )
+	{
+		__put_bits(c, 0x2, 2);
+		__put_bits(c, dod + 63, 7);
+	}
+	else if( (-255 <= dod) && (dod <= 256) )
+	{
+		__put_bits(c, 0x6, 3);
+		__put_bits(c, dod + 255, 9);
+	}
+	else if( (-2047 <= dod) && (dod <= 2048) )
+	{
+		__put_bits(c, 0xE, 4);
+		__put_bits(c, dod + 2047, 12);
+	}
+	else
+	{
+		__put_bits(c, 0xF, 4);
+		__put_bits(c, (uint32_t)dod, 32);
+	}
+
+	/* Value as XOR with the previous one */
+	uint64_t xor = value ^ c->last_value;
+
+	if(!xor)
+	{
+		__put_bits(c, 0x0, 1);
+	}
+	else
+	{
+		int leading  = __builtin_clzll(xor);
+		int trailing = __builtin_ctzll(xor);
+
+		if(31 < leading)
+		{
+			leading = 31;
+		}
+
+		if( (c->last_leading != HISTORY_NO_WINDOW) &&
+		    (c->last_leading <= leading) && (c->last_trailing <= trailing) )
+		{
+			/* Fits in the previous window */
+			__put_bits(c, 0x2, 2);
+			__put_bits(c, xor >> c->last_trailing, 64 - c->last_leading - c->last_trailing);
+		}
+		else
+		{
+			int significant = 64 - leading - trailing;
+
+			__put_bits(c, 0x3, 2);
+			__put_bits(c, leading, 5);
+			/* 64 does not fit in 6 bits and is stored as 0 */
+			__put_bits(c, significant & 0x3F, 6);
+			__put_bits(c, xor >> trailing, significant);
+
+			c->last_leading  = leading;
+			c->last_trailing = trailing;
+		}
+	}
+
+	c->last_delta = delta;
+	c->last_ts    = ts;
+	c->last_value = value;
+	c->count++;
+
+	return 0;
+}
+
+static void __cursor_init(history_cursor_t *cur, const metric_history_chunk_t *c)
+{
+	memset(cur, 0, sizeof(history_cursor_t) );
+	cur->chunk   = c;
+	cur->leading = HISTORY_NO_WINDOW;
+}
+
+/* Returns 1 once the chunk is exhausted */
+static int __cursor_next(history_cursor_t *cur, int64_t *ts, double *value)
+{
+	const metric_history_chunk_t *c = cur->chunk;
+
+	if(c->count <= cur->index)
+	{
+		return 1;
+	}
+
+	if(!cur->index)
+	{
+		cur->ts    = c->first_ts;
+		cur->value = c->first_value;
+	}
+	else
+	{
+		int64_t dod = 0;
+
+		if(__get_bits(cur, 1) )
+		{
+			if(!__get_bits(cur, 1) )
+			{
+				dod = (int64_t)__get_bits(cur, 7) - 63;
+			}
+			else if(!__get_bits(cur, 1) )
+			{
+				dod = (int64_t)__get_bits(cur, 9) - 255;
+			}
+			else if(!__get_bits(cur, 1) )
+			{
+				dod = (int64_t)__get_bits(cur, 12) - 2047;
+			}
+			else
+			{
+				dod = (int32_t)__get_bits(cur, 32);
+			}
+		}
+
+		cur->delta += dod;
+		cur->ts    += cur->delta;
+
+		if(__get_bits(cur, 1) )
+		{
+			if(!__get_bits(cur, 1) )
+			{
+				int significant = 64 - cur->leading - cur->trailing;
+				cur->value ^= __get_bits(cur, significant) << cur->trailing;
+			}
+			else
+			{
+				int leading     = __get_bits(cur, 5);
+				int significant = __get_bits(cur, 6);
+
+				if(!significant)
+				{
+					significant = 64;
+				}
+
+				cur->leading  = leading;
+				cur->trailing = 64 - leading - significant;
+				cur->value   ^= __get_bits(cur, significant) << cur->trailing;
+			}
+		}
+	}
+
+	cur->index++;
+
+	*ts    = cur->ts;
+	*value = __bits_double(cur->value);
+
+	return 0;
+}
+
+/*********************
+* HISTORY INTERFACE *
+*********************/
+
+metric_history_t *metric_history_new(const metric_history_config_t *config)
+{
+	metric_history_t *ret = calloc(1, sizeof(metric_history_t) );
+
+	if(!ret)
+	{
+		tau_metric_proxy_perror("calloc");
+		return NULL;
+	}
+
+	ret->config = config;
+
+	return ret;
+}
+
+static void __history_drop_oldest(metric_history_t *h)
+{
+	metric_history_chunk_t *c = h->oldest;
+
+	h->oldest = c->next;
+
+	if(!h->oldest)
+	{
+		h->newest = NULL;
+	}
+
+	h->bytes -= sizeof(metric_history_chunk_t);
+	__atomic_sub_fetch(&__history_bytes, sizeof(metric_history_chunk_t), __ATOMIC_RELAXED);
+
+	free(c);
+}
+
+void metric_history_free(metric_history_t *h)
+{
+	if(!h)
+	{
+		return;
+	}
+
+	while(h->oldest)
+	{
+		__history_drop_oldest(h);
+	}
+
+	free(h);
+}
+
+static int __history_commit(metric_history_t *h, int64_t ts, double value)
+{
+	uint64_t bits = __double_bits(value);
+
+	if(!h->newest || __chunk_append(h->newest, ts, bits) )
+	{
+		metric_history_chunk_t *c = __chunk_new(ts, bits);
+
+		if(!c)
+		{
+			return 1;
+		}
+
+		if(h->newest)
+		{
+			h->newest->next = c;
+		}
+		else
+		{
+			h->oldest = c;
+		}
+
+		h->newest = c;
+
+		h->bytes += sizeof(metric_history_chunk_t);
+		__atomic_add_fetch(&__history_bytes, sizeof(metric_history_chunk_t), __ATOMIC_RELAXED);
+	}
+
+	/* Whole chunks leave once past the retention
+	   or the memory limit, the newest one stays */
+	int64_t retention = h->config->retention * 1000.0;
+
+	while(h->oldest != h->newest)
+	{
+		int too_old   = retention < (h->newest->last_ts - h->oldest->last_ts);
+		int too_large = h->config->max_bytes < h->bytes;
+
+		if(!too_old && !too_large)
+		{
+			break;
+		}
+
+		__history_drop_oldest(h);
+	}
+
+	return 0;
+}
+
+int metric_history_record(metric_history_t *h, double ts, double value)
+{
+	int64_t ts_ms      = ts * 1000.0;
+	int64_t resolution = h->config->resolution * 1000.0;
+
+	if(resolution < 1)
+	{
+		resolution = 1;
+	}
+
+	/* Same slot the latest value wins */
+	if(h->has_pending && ( (ts_ms / resolution) == (h->pending_ts / resolution) ) )
+	{
+		h->pending_ts = ts_ms;
+		h->pending    = value;
+		return 0;
+	}
+
+	if(h->has_pending)
+	{
+		if(__history_commit(h, h->pending_ts, h->pending) )
+		{
+			return 1;
+		}
+	}
+
+	h->has_pending = 1;
+	h->pending_ts  = ts_ms;
+	h->pending     = value;
+
+	return 0;
+}
+
+size_t metric_history_count(metric_history_t *h)
+{
+	size_t ret = h->has_pending;
+
+	metric_history_chunk_t *c;
+
+	for(c = h->oldest; c; c = c->next)
+	{
+		ret += c->count;
+	}
+
+	return ret;
+}
+
+size_t metric_history_read(metric_history_t *h, double start, double end,
+                           tau_metric_history_sample_t *out, size_t max)
+{
+	int64_t start_ms = start * 1000.0;
+	int64_t end_ms   = (0 < end) ? (int64_t)(end * 1000.0) : INT64_MAX;
+
+	size_t ret = 0;
+
+	metric_history_chunk_t *c;
+
+	for(c = h->oldest; c && (ret < max); c = c->next)
+	{
+		/* Chunk entirely before the range */
+		if(c->last_ts < start_ms)
+		{
+			continue;
+		}
+
+		history_cursor_t cur;
+		__cursor_init(&cur, c);
+
+		int64_t ts;
+		double  value;
+
+		while( (ret < max) && !__cursor_next(&cur, &ts, &value) )
+		{
+			if(end_ms < ts)
+			{
+				return ret;
+			}
+
+			if(ts < start_ms)
+			{
+				continue;
+			}
+
+			out[ret].ts    = ts / 1000.0;
+			out[ret].value = value;
+			ret++;
+		}
+	}
+
+	if(h->has_pending && (ret < max) && (start_ms <= h->pending_ts) && (h->pending_ts <= end_ms) )
+	{
+		out[ret].ts    = h->pending_ts / 1000.0;
+		out[ret].value = h->pending;
+		ret++;
+	}
+
+	return ret;
+}
@@ -0,0 +1,130 @@
+#ifndef TAU_METRIC_PROXY_HISTORY_H
+#define TAU_METRIC_PROXY_HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "tau_metric_proxy_client.h"
+
+/***********************
+* HISTORY CONFIGURATION *
+***********************/
+
+/**
+ * @brief Retention settings shared by all the series of an array
+ *
+ * History is disabled when retention is 0
+ */
+typedef struct
+{
+	double retention;  /**< Seconds of samples to keep */
+	double resolution; /**< Seconds between two stored samples */
+	size_t max_bytes;  /**< Compressed bytes kept per series */
+}metric_history_config_t;
+
+/** Default seconds between two stored samples */
+#define METRIC_HISTORY_DEFAULT_RESOLUTION 1.0
+/** Default compressed bytes kept per series */
+#define METRIC_HISTORY_DEFAULT_MAX_BYTES (16 * 1024)
+
+/******************
+* SAMPLE STORAGE *
+******************/
+
+/** Payload bytes of a compressed chunk */
+#define METRIC_HISTORY_CHUNK_BYTES 512
+
+/**
+ * @brief A block of samples compressed Gorilla-style
+ *
+ * Timestamps (in ms) are stored as delta-of-delta and values as
+ * the XOR with the previous value, both in variable bit lengths
+ */
+typedef struct metric_history_chunk_s
+{
+	int64_t                        first_ts;      /**< First timestamp (ms) stored raw */
+	int64_t                        last_ts;       /**< Last timestamp (ms) for the encoder */
+	int64_t                        last_delta;    /**< Last timestamp delta for the encoder */
+	uint64_t                       first_value;   /**< First value bits stored raw */
+	uint64_t                       last_value;    /**< Last value bits for the encoder */
+	uint32_t                       count;         /**< Number of samples in the chunk */
+	uint32_t                       bits;          /**< Number of bits used in data */
+	uint8_t                        last_leading;  /**< Leading zeros of the last XOR window */
+	uint8_t                        last_trailing; /**< Trailing zeros of the last XOR window */
+	struct metric_history_chunk_s *next;          /**< Next (more recent) chunk */
+	uint8_t                        data[METRIC_HISTORY_CHUNK_BYTES];
+}metric_history_chunk_t;
+
+/**
+ * @brief The recent samples of a series
+ *
+ * The last value seen in the current resolution slot is kept aside
+ * and only compressed once a later slot begins, so that the history
+ * ends on the latest value of each slot. Callers serialize accesses
+ * (the metric lock protects it).
+ */
+typedef struct
+{
+	const metric_history_config_t *config;      /**< Retention settings */
+	metric_history_chunk_t *       oldest;      /**< Head of the chunk list */
+	metric_history_chunk_t *       newest;      /**< Tail of the chunk list */
+	size_t                         bytes;       /**< Memory used by the chunks */
+	int                            has_pending; /**< Is a sample waiting */
+	int64_t                        pending_ts;  /**< Pending sample time (ms) */
+	double                         pending;     /**< Pending sample value */
+}metric_history_t;
+
+/**
+ * @brief Allocate an empty history
+ *
+ * @param config retention settings (must outlive the history)
+ * @return metric_history_t* new history NULL on error
+ */
+metric_history_t *metric_history_new(const metric_history_config_t *config);
+
+/**
+ * @brief Free a history and its samples
+ *
+ * @param h the history to free
+ */
+void metric_history_free(metric_history_t *h);
+
+/**
+ * @brief Record a sample
+ *
+ * @param h the target history
+ * @param ts timestamp in seconds
+ * @param value the value at this time
+ * @return int 0 on success
+ */
+int metric_history_record(metric_history_t *h, double ts, double value);
+
+/**
+ * @brief Upper bound of the samples held by a history
+ *
+ * @param h the history to count
+ * @return size_t number of samples
+ */
+size_t metric_history_count(metric_history_t *h);
+
+/**
+ * @brief Decode samples in a time range
+ *
+ * @param h the history to decode
+ * @param start first timestamp in seconds (0 for all)
+ * @param end last timestamp in seconds (0 for all)
+ * @param out where to store the samples
+ * @param max number of samples in out
+ * @return size_t number of samples stored in out
+ */
+size_t metric_history_read(metric_history_t *h, double start, double end,
+                           tau_metric_history_sample_t *out, size_t max);
+
+/**
+ * @brief Memory held by all histories in the process
+ *
+ * @return size_t bytes
+ */
+size_t metric_history_total_bytes(void);
+
+#endif /* TAU_METRIC_PROXY_HISTORY_H */
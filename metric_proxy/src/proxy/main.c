@@ -5,6 +5,7 @@
 #include <signal.h>
 #include <ctype.h>
 #include <string.h>
+#include <math.h>
 #include <sys/types.h>
 #include <pwd.h>
 
@@ -13,6 +14,10 @@
 #include "exporter.h"
 #include "utils.h"
 #include "server.h"
+#include "stats.h"
+#include "remote.h"
+#include "tree.h"
+#include "profile.h"
 #include "tau_metric_proxy_client.h"
 
 
@@ -34,193 +39,349 @@ static inline int __is_numeric(const char *s)
 
 
 
-struct _send_descs_state
+static void __metric_to_event(metric_t *m, tau_metric_event_t *desc)
 {
-	int target_fd;
-	int left_to_send;
-};
+	snprintf(desc->name, METRIC_STRING_SIZE, "%s", m->name);
+
+	desc->update_ts = m->last_ts;
 
-static int __send_metrics_desc(metric_t *m, void *arg)
+	switch (m->type)
+	{
+		case TAU_METRIC_COUNTER:
+		case TAU_METRIC_HISTOGRAM:
+			desc->value = m->metrics.counter.value;
+			break;
+		case TAU_METRIC_GAUGE:
+			desc->value = m->metrics.gauge.avg;
+			break;
+		case TAU_METRIC_NULL:
+			desc->value = 0;
+			break;
+	}
+}
+
+/* Replies are written by batches of this many records */
+#define QUERY_BATCH_SIZE 64
+
+/* Snapshot of the node array, or of a running job array, restricted to
+   the pattern of a request (NULL for all), unknown jobs and invalid
+   patterns give empty snapshots. It is detached: UNIX clients have no
+   timeout and must not pin the arrays while they read */
+static int __matching_snapshot_take(tau_metric_filter_request_t *req, metric_array_snapshot_t *snap)
 {
-	struct _send_descs_state * st = (struct _send_descs_state*)arg;
+	metric_array_t *ma = metric_array_get_main();
+
+	metric_filter_t filter;
+	metric_filter_init(&filter);
 
-	if(st->left_to_send == 0)
+	if(req)
 	{
-		return 1; /* DONE */
+		req->pattern[METRIC_STRING_SIZE - 1] = '\0';
+		req->jobid[63] = '\0';
+
+		if(strlen(req->pattern) && metric_filter_add(&filter, req->pattern) )
+		{
+			return 0;
+		}
+
+		if(strlen(req->jobid) )
+		{
+			/* Held until the snapshot is detached */
+			ma = metric_array_list_get(req->jobid);
+		}
 	}
 
-	tau_metric_descriptor_t desc;
-	snprintf(desc.doc, METRIC_STRING_SIZE, "%s", m->doc);
-	snprintf(desc.name, METRIC_STRING_SIZE, "%s", m->name);
-	desc.type = m->type;
+	int ret = 0;
 
-	/* Send the description */
-	if( safe_write(st->target_fd, &desc, sizeof(tau_metric_descriptor_t)) != 0)
+	if(ma)
 	{
-		return 1;
+		ret = metric_array_snapshot_take_filtered(ma, snap, &filter) || metric_array_snapshot_detach(snap);
+
+		if(ma != metric_array_get_main() )
+		{
+			metric_array_list_relax(req->jobid);
+		}
 	}
 
-	st->left_to_send--;
+	metric_filter_release(&filter);
 
-	return 0;
+	return ret;
 }
 
-static int __send_metrics_event(metric_t *m, void *arg)
+static int __list_metrics(int source_fd, tau_metric_filter_request_t *req)
 {
-	struct _send_descs_state * st = (struct _send_descs_state*)arg;
+	/* Reply from a detached copy: the count is exact and nothing
+	   is locked or pinned while the client reads */
+	metric_array_snapshot_t snap = { 0 };
 
-	if(st->left_to_send == 0)
+	if( __matching_snapshot_take(req, &snap) )
 	{
-		return 1; /* DONE */
+		metric_array_snapshot_free(&snap);
+		return 1;
 	}
 
-	tau_metric_event_t desc;
-	snprintf(desc.name, METRIC_STRING_SIZE, "%s", m->name);
+	int ret = 0;
+	int metric_count = snap.count;
 
-	desc.update_ts = m->last_ts;
+	/* Send the count */
+	if( safe_write(source_fd, &metric_count, sizeof(int)) != 0)
+	{
+		ret = 1;
+		goto LIST_DONE;
+	}
 
-	switch (m->type)
+	tau_metric_descriptor_t batch[QUERY_BATCH_SIZE];
+	uint64_t i;
+	int in_batch = 0;
+
+	for(i = 0; i < snap.count; i++)
 	{
-		case TAU_METRIC_COUNTER:
-			desc.value = m->metrics.counter.value;
-			break;
-		case TAU_METRIC_GAUGE:
-			desc.value = m->metrics.gauge.avg;
-			break;
-		case TAU_METRIC_NULL:
-			desc.value = 0;
-			break;
+		metric_snapshot_entry_t *e = &snap.entries[i];
+		tau_metric_descriptor_t *desc = &batch[in_batch++];
+
+		snprintf(desc->doc, METRIC_STRING_SIZE, "%s", e->doc);
+		snprintf(desc->name, METRIC_STRING_SIZE, "%s", e->name);
+		desc->type = e->type;
+
+		if( (in_batch == QUERY_BATCH_SIZE) || (i == snap.count - 1) )
+		{
+			/* Send the descriptions */
+			if( safe_write(source_fd, batch, in_batch * sizeof(tau_metric_descriptor_t)) != 0)
+			{
+				ret = 1;
+				goto LIST_DONE;
+			}
+
+			in_batch = 0;
+		}
 	}
 
-	tau_metric_proxy_log_verbose("Sending %s = %g", desc.name, desc.value);
+LIST_DONE:
+	metric_array_snapshot_free(&snap);
+	return ret;
+}
+
+static int __get_one(int source_fd, char * name)
+{
+	tau_metric_event_t ev;
+	memset(&ev, 0, sizeof(tau_metric_event_t));
+
+	/* Copy the value so that no lock is held while writing */
+	int token = metric_array_read_lock(metric_array_get_main());
+
+	metric_t *existing_metric = metric_array_get(metric_array_get_main(), name);
+
+	tau_metric_proxy_log_verbose("Get one : '%s' (%s)", name, existing_metric?"FOUND":"NOT FOUND");
 
-	/* Send the value  */
-	if( safe_write(st->target_fd, &desc, sizeof(tau_metric_event_t)) != 0)
+	if(existing_metric)
 	{
-		return 1;
+		pthread_spin_lock(&existing_metric->lock);
+		__metric_to_event(existing_metric, &ev);
+		pthread_spin_unlock(&existing_metric->lock);
 	}
 
-	st->left_to_send--;
+	metric_array_read_unlock(metric_array_get_main(), token);
+
+	if( safe_write(source_fd, &ev, sizeof(tau_metric_event_t)) != 0)
+	{
+		return 1;
+	}
 
 	return 0;
 }
 
 
-static int __list_metrics(int source_fd)
+static void __stats_from_entry(metric_snapshot_entry_t *e, tau_metric_stats_t *st)
 {
-	/* Fist get the metric count */
-	int metric_count = metric_array_count(metric_array_get_main());
+	memset(st, 0, sizeof(tau_metric_stats_t));
 
-	/* Send the count */
-	if( safe_write(source_fd, &metric_count, sizeof(int)) != 0)
+	snprintf(st->event.name, METRIC_STRING_SIZE, "%s", e->name);
+	st->event.value = e->value;
+	st->event.update_ts = e->last_ts;
+
+	if(e->windows)
+	{
+		st->windows = *e->windows;
+	}
+	else
+	{
+		int i;
+
+		/* Windows are disabled on this proxy */
+		for(i = 0; i < TAU_METRIC_WINDOW_COUNT; i++)
+		{
+			st->windows.avg[i] = NAN;
+			st->windows.min[i] = NAN;
+			st->windows.max[i] = NAN;
+		}
+	}
+}
+
+static int __get_one_stats(int source_fd, char * name)
+{
+	tau_metric_stats_t st;
+	memset(&st, 0, sizeof(tau_metric_stats_t));
+
+	metric_array_t *ma = metric_array_get_main();
+
+	int token = metric_array_read_lock(ma);
+
+	metric_t *existing_metric = metric_array_get(ma, name);
+
+	if(existing_metric)
+	{
+		metric_snapshot_entry_t e;
+		tau_metric_window_stats_t windows;
+
+		pthread_spin_lock(&existing_metric->lock);
+
+		e.name = existing_metric->name;
+		e.last_ts = existing_metric->last_ts;
+		e.value = (existing_metric->type == TAU_METRIC_GAUGE) ? existing_metric->metrics.gauge.avg : existing_metric->metrics.counter.value;
+		e.windows = NULL;
+
+		if(existing_metric->windows)
+		{
+			metric_windows_read(existing_metric->windows, utils_get_ts(), &windows);
+			e.windows = &windows;
+		}
+
+		pthread_spin_unlock(&existing_metric->lock);
+
+		__stats_from_entry(&e, &st);
+	}
+
+	metric_array_read_unlock(ma, token);
+
+	if( safe_write(source_fd, &st, sizeof(tau_metric_stats_t)) != 0)
 	{
 		return 1;
 	}
 
-	/* Now iterate to send the data up to count (in case there are newcomers) */
-	struct _send_descs_state state;
-	state.left_to_send = metric_count;
-	state.target_fd = source_fd;
+	return 0;
+}
+
+static int __get_all_stats(int source_fd)
+{
+	metric_array_snapshot_t snap = { 0 };
 
-	if( metric_array_iterate(metric_array_get_main(), __send_metrics_desc, &state) != 0)
+	if( metric_array_snapshot_take(metric_array_get_main(), &snap) || metric_array_snapshot_detach(&snap) )
 	{
+		metric_array_snapshot_free(&snap);
 		return 1;
 	}
 
-	/* Case were elements were removed during the walk
-		we still want to send the number of requested elements */
-	if(state.left_to_send > 0)
+	int ret = 0;
+	int metric_count = snap.count;
+
+	/* Send the count */
+	if( safe_write(source_fd, &metric_count, sizeof(int)) != 0)
 	{
-		while(state.left_to_send)
-		{
-			tau_metric_descriptor_t nulldesc;
-			nulldesc.type = TAU_METRIC_NULL;
+		ret = 1;
+		goto STATS_DONE;
+	}
+
+	tau_metric_stats_t batch[QUERY_BATCH_SIZE];
+	uint64_t i;
+	int in_batch = 0;
 
-			if( safe_write(source_fd, &nulldesc, sizeof(tau_metric_descriptor_t)) != 0)
+	for(i = 0; i < snap.count; i++)
+	{
+		__stats_from_entry(&snap.entries[i], &batch[in_batch++]);
+
+		if( (in_batch == QUERY_BATCH_SIZE) || (i == snap.count - 1) )
+		{
+			if( safe_write(source_fd, batch, in_batch * sizeof(tau_metric_stats_t)) != 0)
 			{
-				return 1;
+				ret = 1;
+				goto STATS_DONE;
 			}
 
-			state.left_to_send--;
+			in_batch = 0;
 		}
 	}
 
-	return 0;
+STATS_DONE:
+	metric_array_snapshot_free(&snap);
+	return ret;
 }
 
-static int __get_one(int source_fd, char * name)
+static int __get_history(int source_fd, tau_metric_history_request_t *req)
 {
-	metric_t *existing_metric = metric_array_get(metric_array_get_main(), name);
+	tau_metric_history_sample_t *samples = NULL;
+	size_t count = 0;
 
-	struct _send_descs_state st;
-	st.left_to_send = 1;
-	st.target_fd = source_fd;
+	/* Unknown series and series without history reply 0 samples */
+	metric_array_history(metric_array_get_main(), req->name, req->start, req->end, &samples, &count);
 
-	tau_metric_proxy_log_verbose("Get one : '%s' (%s)", name, existing_metric?"FOUND":"NOT FOUND");
+	tau_metric_proxy_log_verbose("Get history : '%s' (%ld samples)", req->name, count);
 
-	if(existing_metric)
+	int ret = 0;
+	int sample_count = count;
+
+	if( safe_write(source_fd, &sample_count, sizeof(int)) != 0)
 	{
-		return __send_metrics_event(existing_metric, &st);
+		ret = 1;
 	}
-	else
+	else if( count && (safe_write(source_fd, samples, count * sizeof(tau_metric_history_sample_t)) != 0) )
 	{
-		tau_metric_event_t nulldesc;
-		nulldesc.value = 0;
-		nulldesc.update_ts = 0;
-		snprintf(nulldesc.name, METRIC_STRING_SIZE, "");
-
-		if( safe_write(source_fd, &nulldesc, sizeof(tau_metric_event_t)) != 0)
-		{
-			return 1;
-		}
+		ret = 1;
 	}
 
-	return 0;
-}
+	free(samples);
 
+	return ret;
+}
 
-static int __get_metrics(int source_fd)
+static int __get_metrics(int source_fd, tau_metric_filter_request_t *req)
 {
-	/* Fist get the metric count */
-	int metric_count = metric_array_count(metric_array_get_main());
+	metric_array_snapshot_t snap = { 0 };
 
-	/* Send the count */
-	if( safe_write(source_fd, &metric_count, sizeof(int)) != 0)
+	if( __matching_snapshot_take(req, &snap) )
 	{
+		metric_array_snapshot_free(&snap);
 		return 1;
 	}
 
-	/* Now iterate to send the data up to count (in case there are newcomers) */
-	struct _send_descs_state state;
-	state.left_to_send = metric_count;
-	state.target_fd = source_fd;
+	int ret = 0;
+	int metric_count = snap.count;
 
-	if( metric_array_iterate(metric_array_get_main(), __send_metrics_event, &state) != 0)
+	/* Send the count */
+	if( safe_write(source_fd, &metric_count, sizeof(int)) != 0)
 	{
-		return 1;
+		ret = 1;
+		goto GET_DONE;
 	}
 
-	/* Case were elements were removed during the walk
-		we still want to send the number of requested elements */
-	if(state.left_to_send > 0)
+	tau_metric_event_t batch[QUERY_BATCH_SIZE];
+	uint64_t i;
+	int in_batch = 0;
+
+	for(i = 0; i < snap.count; i++)
 	{
-		while(state.left_to_send)
-		{
-			tau_metric_event_t nulldesc;
-			nulldesc.value = 0;
-			nulldesc.update_ts = 0;
-			snprintf(nulldesc.name, METRIC_STRING_SIZE, "");
+		metric_snapshot_entry_t *e = &snap.entries[i];
+		tau_metric_event_t *ev = &batch[in_batch++];
+
+		snprintf(ev->name, METRIC_STRING_SIZE, "%s", e->name);
+		ev->value = e->value;
+		ev->update_ts = e->last_ts;
 
-			if( safe_write(source_fd, &nulldesc, sizeof(tau_metric_event_t)) != 0)
+		if( (in_batch == QUERY_BATCH_SIZE) || (i == snap.count - 1) )
+		{
+			/* Send the values */
+			if( safe_write(source_fd, batch, in_batch * sizeof(tau_metric_event_t)) != 0)
 			{
-				return 1;
+				ret = 1;
+				goto GET_DONE;
 			}
 
-			state.left_to_send--;
+			in_batch = 0;
 		}
 	}
 
-	return 0;
+GET_DONE:
+	metric_array_snapshot_free(&snap);
+	return ret;
 }
 
 struct per_client_context
@@ -230,12 +391,14 @@ struct per_client_context
 	metric_array_t * metric_array;
 };
 
-void store_per_job_metrics(tau_metric_job_descriptor_t *desc, metric_array_t * metrics)
+int store_per_job_metrics(tau_metric_job_descriptor_t *desc, metric_array_t * metrics)
 {
 	tau_metric_proxy_log_verbose("Storing per job metrics");
 
-	metric_per_job_dump(desc, metrics);
+	/* Its last updates go up the tree before the array is freed */
+	tau_metric_tree_job_end(desc, metrics);
 
+	return metric_per_job_dump(desc, metrics);
 }
 
 void __client_leaving_callback(int source_fd, void * p_extra_ctx)
@@ -248,48 +411,83 @@ void __client_leaving_callback(int source_fd, void * p_extra_ctx)
 	}
 }
 
-static inline int __push_metric_desc(tau_metric_msg_t *msg, metric_array_t * ma)
+/** Series refused by the node array guard are folded instead of dropped */
+static int __fold_refused_series = 0;
+
+static inline int __push_metric_desc(tau_metric_msg_t *msg, metric_array_t * ma, int fold)
 {
+	int ret = 0;
+
+	/* Metrics may be evicted once we leave the read section */
+	int token = metric_array_read_lock(ma);
+
 	/* See if we need to register the new metric */
-	metric_t *existing_metric = metric_array_get(ma, msg->payload.desc.name);
+	metric_t *existing_metric = metric_array_get_or_register(ma, msg->payload.desc.name, msg->payload.desc.doc, msg->payload.desc.type);
+
+	if(!existing_metric && fold)
+	{
+		existing_metric = metric_array_get_folded(ma, msg->payload.desc.name, msg->payload.desc.doc, msg->payload.desc.type);
+	}
+
+	/* Check types do match (a refused series is just dropped) */
+	if(existing_metric && (existing_metric->type != msg->payload.desc.type) )
+	{
+		tau_metric_proxy_error("Mismatching types for metric %s, disconnecting client\n", existing_metric->name);
+		ret = 1;
+	}
+
+	metric_array_read_unlock(ma, token);
+
+	return ret;
+}
 
-	if(!existing_metric)
+static inline metric_t * __readmit_metric(const char * name, metric_array_t * ma, metric_array_t * job_array, int fold)
+{
+	metric_t *job_metric = job_array ? metric_array_get(job_array, name) : NULL;
+	metric_t *ret = NULL;
+
+	if(job_metric)
 	{
-		metric_t *new_metric = metric_init(msg->payload.desc.name, msg->payload.desc.doc, msg->payload.desc.type);
+		/* The series was evicted while idle: the job still knows it */
+		ret = metric_array_get_or_register(ma, job_metric->name, job_metric->doc, job_metric->type);
 
-		/* Try to insert */
-		if(metric_array_register(ma, new_metric) )
+		if(!ret && fold)
 		{
-			/* There was a race metric is already here */
-			metric_release(new_metric);
+			ret = metric_array_get_folded(ma, job_metric->name, job_metric->doc, job_metric->type);
 		}
-
-		/* Get the metric again */
-		existing_metric = metric_array_get(ma, msg->payload.desc.name);
 	}
-
-	/* Check types do match */
-	if(existing_metric->type != msg->payload.desc.type)
+	else if(fold)
 	{
-		tau_metric_proxy_error("Mismatching types for metric %s, disconnecting client\n", existing_metric->name);
-		return 1;
+		char folded[METRIC_STRING_SIZE];
+		ret = metric_array_get(ma, metric_fold_name(folded, name));
 	}
 
-	return 0;
+	return ret;
 }
 
-static inline int __update_metric_value(tau_metric_msg_t *msg, metric_array_t * ma)
+static inline int __update_metric_value(tau_metric_msg_t *msg, metric_array_t * ma, metric_array_t * job_array, int fold)
 {
+		int token = metric_array_read_lock(ma);
+
 		metric_t *existing_metric = metric_array_get(ma, msg->payload.event.name);
 
+		if(!existing_metric && (ma == metric_array_get_main()) )
+		{
+			existing_metric = __readmit_metric(msg->payload.event.name, ma, job_array, fold);
+		}
+
 		if(!existing_metric)
 		{
-			tau_metric_proxy_error("No such metric %s, disconnecting client\n", msg->payload.event.name);
-			return 1;
+			/* Refused by a budget or guard, or evicted */
+			tau_metric_proxy_log_verbose("No such metric %s, dropping value", msg->payload.event.name);
+			metric_array_read_unlock(ma, token);
+			return 0;
 		}
 
 		metric_update(existing_metric, &msg->payload.event);
 
+		metric_array_read_unlock(ma, token);
+
 		return 0;
 }
 
@@ -320,7 +518,7 @@ int __unix_server_callback(int source_fd, tau_metric_msg_t *msg, void * p_extra_
 		case TAU_METRIC_MSG_DESC:
 		{
 			/* Push in main array */
-			if( __push_metric_desc(msg, metric_array_get_main()) )
+			if( __push_metric_desc(msg, metric_array_get_main(), __fold_refused_series) )
 			{
 				return 1;
 			}
@@ -328,7 +526,7 @@ int __unix_server_callback(int source_fd, tau_metric_msg_t *msg, void * p_extra_
 			/* Push in per job array */
 			if(ctx->metric_array)
 			{
-				if( __push_metric_desc(msg, ctx->metric_array) )
+				if( __push_metric_desc(msg, ctx->metric_array, 0) )
 				{
 					return 1;
 				}
@@ -340,14 +538,14 @@ int __unix_server_callback(int source_fd, tau_metric_msg_t *msg, void * p_extra_
 
 		case TAU_METRIC_MSG_VAL:
 		{
-			if(__update_metric_value(msg, metric_array_get_main()))
+			if(__update_metric_value(msg, metric_array_get_main(), ctx->metric_array, __fold_refused_series))
 			{
 				return 1;
 			}
 
 			if(ctx->metric_array)
 			{
-				if(__update_metric_value(msg, ctx->metric_array))
+				if(__update_metric_value(msg, ctx->metric_array, NULL, 0))
 				{
 					return 1;
 				}
@@ -356,17 +554,37 @@ int __unix_server_callback(int source_fd, tau_metric_msg_t *msg, void * p_extra_
 		break;
 
 		case TAU_METRIC_MSG_LIST_ALL:
-			return __list_metrics(source_fd);
+			return __list_metrics(source_fd, NULL);
 		break;
 
 		case TAU_METRIC_MSG_GET_ALL:
-			return __get_metrics(source_fd);
+			return __get_metrics(source_fd, NULL);
+		break;
+
+		case TAU_METRIC_MSG_LIST_MATCHING:
+			return __list_metrics(source_fd, &msg->payload.filter);
+		break;
+
+		case TAU_METRIC_MSG_GET_MATCHING:
+			return __get_metrics(source_fd, &msg->payload.filter);
 		break;
 
 		case TAU_METRIC_MSG_GET_ONE:
 			return __get_one(source_fd, msg->payload.desc.name);
 		break;
 
+		case TAU_METRIC_MSG_GET_HISTORY:
+			return __get_history(source_fd, &msg->payload.history);
+		break;
+
+		case TAU_METRIC_MSG_GET_ONE_STATS:
+			return __get_one_stats(source_fd, msg->payload.desc.name);
+		break;
+
+		case TAU_METRIC_MSG_GET_ALL_STATS:
+			return __get_all_stats(source_fd);
+		break;
+
 		default:
 			if( (0 < msg->type) && (msg->type < TAU_METRIC_MSG_COUNT) )
 			{
@@ -392,10 +610,14 @@ void __server_stop_on_interupt(int sig)
 	tau_metric_proxy_log("Received SIGINT, stoping servers ... \n");
 	tau_metric_exporter_release(&prom_exporter);
 	tau_metric_server_stop(&unix_server);
-	/* Initialize metrics storage */
-	metric_array_release(metric_array_get_main());
+	metric_array_eviction_stop();
+	proxy_stats_stop();
+	tau_metric_remote_stop();
+	tau_metric_tree_stop();
+	/* Flush pending job dumps then release metrics storage */
 	metric_array_list_release();
 	metric_per_job_release();
+	metric_array_release(metric_array_get_main());
 	tau_metric_proxy_log("DONE will now exit.\n");
 	exit(1);
 }
@@ -409,6 +631,28 @@ A high performance push gateway for Prometeus.\n\
 -p [PORT]: where to run the prometheus exporter (default: 1337)\n\
 -u [PATH]: where to run the prometheus UNIX gateway (default: /tmp/tau_metric_proxy.[UID].unix)\n\
 -i: do not aggregate profiles (default yes) to be used for worker nodes\n\
+-D [CODEC]: compression of the job dumps and profiles: none, zlib or snappy (default: zlib, snappy if built without it)\n\
+-j [KB]: memory budget of each per-job metric array, 0 is unbounded (default: 1024)\n\
+-T [SECONDS]: drop node series not updated for this long, 0 disables (default: 0)\n\
+-M [SERIES]: drop least recently updated node series past this count, 0 disables (default: 262144)\n\
+-C [SERIES]: refuse new node series past this count, 0 disables (default: twice -M)\n\
+-F: fold refused series in a per-family tau_folded=\"true\" series instead of dropping them\n\
+-H [SECONDS]: keep a compressed history of node series for this long, 0 disables (default: 0)\n\
+-R [MS]: time between two history samples of a series (default: 1000)\n\
+-B [KB]: compressed history kept per series (default: 16)\n\
+-W: maintain 1s 10s and 60s window rates min and max of node series and export them\n\
+-S [MS]: scrapes within this time share the same /metrics body, 0 disables (default: 1000)\n\
+-E [THREADS]: threads serving HTTP scrapes (default: 2)\n\
+-Z [LEVEL]: zlib level of scrapes accepting gzip or deflate, 0 disables (default: 6)\n\
+-K [SERIES]: stream /metrics in chunks from this many node series instead of holding whole bodies, 0 disables (default: 131072)\n\
+-r [URL]: push updated node series to this remote write endpoint (http://host[:port][/path], repeatable)\n\
+-I [SECONDS]: time between two pushes (default: 15)\n\
+-c [CONNECTIONS]: concurrent pushes to each endpoint (default: 2)\n\
+-b [KB]: compressed pushes kept for each endpoint while it does not answer (default: 65536)\n\
+-U [HOST:PORT]: forward the series of this node and of its children to this parent proxy\n\
+-L [PORT]: accept child proxies on this port and expose their aggregate on /tree\n\
+-k [CHILDREN]: children accepted before redirecting the next ones to them, 0 accepts all (default: 4)\n\
+-A [SECONDS]: time between two forwards to the parent (default: 1)\n\
 -h: show this help\n");
 }
 
@@ -453,9 +697,38 @@ int main(int argc, char **argv)
 
 	int is_profile_merger = 1;
 
+	size_t job_max_footprint = METRIC_ARRAY_JOB_DEFAULT_FOOTPRINT;
+
+	double series_ttl = 0;
+	uint64_t max_series = 262144;
+	int64_t series_guard = -1;
+
+	double history_retention = 0;
+	double history_resolution = METRIC_HISTORY_DEFAULT_RESOLUTION;
+	size_t history_max_bytes = METRIC_HISTORY_DEFAULT_MAX_BYTES;
+
+	int windows = 0;
+
+	double exposition_freshness = TAU_METRIC_EXPORTER_DEFAULT_FRESHNESS;
+
+	int exporter_workers = TAU_METRIC_EXPORTER_DEFAULT_WORKERS;
+
+	int compression_level = TAU_METRIC_EXPORTER_DEFAULT_COMPRESSION;
+
+	uint64_t stream_min_series = TAU_METRIC_EXPORTER_DEFAULT_STREAM_SERIES;
+
+	double remote_period = TAU_METRIC_REMOTE_DEFAULT_PERIOD;
+	unsigned int remote_connections = TAU_METRIC_REMOTE_DEFAULT_CONNECTIONS;
+	size_t remote_max_bytes = TAU_METRIC_REMOTE_DEFAULT_MAX_BYTES;
+
+	char *tree_parent = NULL;
+	char *tree_port = NULL;
+	unsigned int tree_fanout = TAU_METRIC_TREE_DEFAULT_FANOUT;
+	double tree_period = TAU_METRIC_TREE_DEFAULT_PERIOD;
+
 	int opt;
 
-	while( (opt = getopt(argc, argv, ":p:u:P:ivh") ) != -1)
+	while( (opt = getopt(argc, argv, ":p:u:P:j:T:M:C:FH:R:B:WS:E:Z:K:r:I:c:b:U:L:k:A:D:ivh") ) != -1)
 	{
 		switch(opt)
 		{
@@ -489,6 +762,175 @@ int main(int argc, char **argv)
 				tau_metric_proxy_log("Profile aggregation on this proxy was inhibited");
 				is_profile_merger = 0;
 				break;
+			case 'j':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-j only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				job_max_footprint = strtoull(optarg, NULL, 10) * 1024;
+				tau_metric_proxy_log("Per-job metric budget set to %ld bytes", job_max_footprint);
+				break;
+			case 'T':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-T only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				series_ttl = atof(optarg);
+				tau_metric_proxy_log("Stale series TTL set to %g seconds", series_ttl);
+				break;
+			case 'M':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-M only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				max_series = strtoull(optarg, NULL, 10);
+				tau_metric_proxy_log("Maximum node series set to %ld", max_series);
+				break;
+			case 'C':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-C only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				series_guard = strtoll(optarg, NULL, 10);
+				tau_metric_proxy_log("Node series cardinality guard set to %ld", series_guard);
+				break;
+			case 'F':
+				tau_metric_proxy_log("Series refused by the cardinality guard are folded");
+				__fold_refused_series = 1;
+				break;
+			case 'H':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-H only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				history_retention = atof(optarg);
+				tau_metric_proxy_log("Series history kept for %g seconds", history_retention);
+				break;
+			case 'R':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-R only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				history_resolution = atof(optarg) / 1000.0;
+				tau_metric_proxy_log("Series history resolution set to %g seconds", history_resolution);
+				break;
+			case 'B':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-B only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				history_max_bytes = strtoull(optarg, NULL, 10) * 1024;
+				tau_metric_proxy_log("Series history budget set to %ld bytes", history_max_bytes);
+				break;
+			case 'W':
+				tau_metric_proxy_log("Sliding window aggregates enabled");
+				windows = 1;
+				break;
+			case 'S':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-S only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				exposition_freshness = atof(optarg) / 1000.0;
+				tau_metric_proxy_log("Scrapes share bodies for %g seconds", exposition_freshness);
+				break;
+			case 'E':
+				if(!__is_numeric(optarg) || (atoi(optarg) < 1) )
+				{
+					tau_metric_proxy_error("-E only takes a positive number of threads had: %s", optarg);
+					return 1;
+				}
+				exporter_workers = atoi(optarg);
+				break;
+			case 'Z':
+				if(!__is_numeric(optarg) || (9 < atoi(optarg) ) )
+				{
+					tau_metric_proxy_error("-Z only takes a level from 0 to 9 had: %s", optarg);
+					return 1;
+				}
+				compression_level = atoi(optarg);
+				break;
+			case 'K':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-K only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				stream_min_series = strtoull(optarg, NULL, 10);
+				tau_metric_proxy_log("Scrapes are streamed from %ld node series", stream_min_series);
+				break;
+			case 'r':
+				if(tau_metric_remote_add(optarg) )
+				{
+					return 1;
+				}
+				break;
+			case 'I':
+				if(!__is_numeric(optarg) || (atoi(optarg) < 1) )
+				{
+					tau_metric_proxy_error("-I only takes a positive number of seconds had: %s", optarg);
+					return 1;
+				}
+				remote_period = atof(optarg);
+				break;
+			case 'c':
+				if(!__is_numeric(optarg) || (atoi(optarg) < 1) )
+				{
+					tau_metric_proxy_error("-c only takes a positive number of connections had: %s", optarg);
+					return 1;
+				}
+				remote_connections = atoi(optarg);
+				break;
+			case 'b':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-b only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				remote_max_bytes = strtoull(optarg, NULL, 10) * 1024;
+				tau_metric_proxy_log("Remote write buffer set to %ld bytes per endpoint", remote_max_bytes);
+				break;
+			case 'U':
+				tree_parent = optarg;
+				break;
+			case 'L':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-L only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				tree_port = optarg;
+				break;
+			case 'k':
+				if(!__is_numeric(optarg) )
+				{
+					tau_metric_proxy_error("-k only takes numeric arguments had: %s", optarg);
+					return 1;
+				}
+				tree_fanout = atoi(optarg);
+				break;
+			case 'A':
+				if(!__is_numeric(optarg) || (atoi(optarg) < 1) )
+				{
+					tau_metric_proxy_error("-A only takes a positive number of seconds had: %s", optarg);
+					return 1;
+				}
+				tree_period = atof(optarg);
+				break;
+			case 'D':
+				if(tau_metric_dump_set_codec(optarg) )
+				{
+					return 1;
+				}
+				break;
 			case '?':
 				tau_metric_proxy_error("No such option: '-%c'", optopt);
 				return 1;
@@ -497,7 +939,27 @@ int main(int argc, char **argv)
 
 	/* Initialize main metrics storage */
 	metric_array_init(metric_array_get_main());
-	metric_array_list_init(store_per_job_metrics);
+	metric_array_set_max_series(metric_array_get_main(), (series_guard < 0) ? 2 * max_series : (uint64_t)series_guard);
+	metric_array_set_history(metric_array_get_main(), history_retention, history_resolution, history_max_bytes);
+	metric_array_set_windows(metric_array_get_main(), windows);
+
+	/* Before the list creates the pinned series */
+	if(metric_array_set_families(metric_array_get_main(), METRIC_FAMILY_TABLE_SIZE) )
+	{
+		return 1;
+	}
+
+	metric_array_list_init(store_per_job_metrics, job_max_footprint);
+
+	if( metric_array_eviction_start(series_ttl, max_series) )
+	{
+		return 1;
+	}
+
+	if( proxy_stats_start(1.0) )
+	{
+		return 1;
+	}
 
 	if( metric_per_job_init(profiles_path, is_profile_merger) )
 	{
@@ -505,12 +967,29 @@ int main(int argc, char **argv)
 	}
 
 	/* Start the exporter */
-	if(tau_metric_exporter_init(&prom_exporter, exporter_port) < 0)
+	if(tau_metric_exporter_init(&prom_exporter, exporter_port, exposition_freshness, exporter_workers) < 0)
 	{
 		tau_metric_proxy_error("Failed to start TAU Prometheus exporter\n");
 		return 1;
 	}
 
+	if(tau_metric_exporter_set_compression(&prom_exporter, compression_level) < 0)
+	{
+		tau_metric_proxy_error("Built without zlib: scrapes are not compressed");
+	}
+
+	tau_metric_exporter_set_streaming(&prom_exporter, stream_min_series);
+
+	if( tau_metric_remote_start(remote_period, remote_connections, remote_max_bytes) )
+	{
+		return 1;
+	}
+
+	if( tau_metric_tree_start(tree_parent, tree_port, tree_fanout, tree_period) )
+	{
+		return 1;
+	}
+
 	/* Start UNIX socket Server (block the process) */
 
 
@@ -1,24 +1,152 @@
 #include "metrics.h"
 
 #include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <utime.h>
+#include <poll.h>
 
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <sys/time.h>
 
+#include "dtoa.h"
 #include "log.h"
 #include "profile.h"
 #include "tau_metric_proxy_client.h"
 #include "utils.h"
 
+/***************************
+* METRIC STRING INTERNING *
+***************************/
+
+#define METRIC_STRING_INTERN_SIZE    1024
+
+struct metric_string_s
+{
+	uint64_t                refcount;
+	uint64_t                hash;
+	struct metric_string_s *next;
+	char                    str[0];
+};
+
+static struct
+{
+	struct metric_string_s *strings[METRIC_STRING_INTERN_SIZE];
+	pthread_spinlock_t      locks[METRIC_STRING_INTERN_SIZE];
+	pthread_once_t          once;
+}__metric_strings = { .once = PTHREAD_ONCE_INIT };
+
+static void __metric_string_intern_init(void)
+{
+	int i;
+
+	for(i = 0; i < METRIC_STRING_INTERN_SIZE; i++)
+	{
+		pthread_spin_init(&__metric_strings.locks[i], 0);
+		__metric_strings.strings[i] = NULL;
+	}
+}
+
+const char *metric_string_intern(const char *str)
+{
+	pthread_once(&__metric_strings.once, __metric_string_intern_init);
+
+	size_t len = strnlen(str, METRIC_STRING_SIZE - 1);
+
+	/* Hash the truncated string so that truncated names collapse */
+	char key[METRIC_STRING_SIZE];
+	memcpy(key, str, len);
+	key[len] = '\0';
+
+	uint64_t     hash = utils_string_hash((const unsigned char *)key);
+	unsigned int cell = hash % METRIC_STRING_INTERN_SIZE;
+
+	pthread_spin_lock(&__metric_strings.locks[cell]);
+
+	struct metric_string_s *s = __metric_strings.strings[cell];
+
+	while(s)
+	{
+		if( (s->hash == hash) && !strcmp(s->str, key) )
+		{
+			s->refcount++;
+			pthread_spin_unlock(&__metric_strings.locks[cell]);
+			return s->str;
+		}
+
+		s = s->next;
+	}
+
+	s = malloc(sizeof(struct metric_string_s) + len + 1);
+
+	if(!s)
+	{
+		pthread_spin_unlock(&__metric_strings.locks[cell]);
+		tau_metric_proxy_perror("malloc");
+		return NULL;
+	}
+
+	s->refcount = 1;
+	s->hash     = hash;
+	memcpy(s->str, key, len + 1);
+
+	s->next = __metric_strings.strings[cell];
+	__metric_strings.strings[cell] = s;
+
+	pthread_spin_unlock(&__metric_strings.locks[cell]);
+
+	return s->str;
+}
+
+void metric_string_release(const char *str)
+{
+	if(!str)
+	{
+		return;
+	}
+
+	struct metric_string_s *s    = (struct metric_string_s *)(str - offsetof(struct metric_string_s, str) );
+	unsigned int            cell = s->hash % METRIC_STRING_INTERN_SIZE;
+
+	pthread_spin_lock(&__metric_strings.locks[cell]);
+
+	s->refcount--;
+
+	if(s->refcount)
+	{
+		pthread_spin_unlock(&__metric_strings.locks[cell]);
+		return;
+	}
+
+	/* Last reference unlink it from the bucket */
+	struct metric_string_s **prev = &__metric_strings.strings[cell];
+
+	while(*prev)
+	{
+		if(*prev == s)
+		{
+			*prev = s->next;
+			break;
+		}
+
+		prev = &(*prev)->next;
+	}
+
+	pthread_spin_unlock(&__metric_strings.locks[cell]);
+
+	free(s);
+}
+
 /*********************
 * METRIC DEFINITION *
 *********************/
 
+const double tau_metric_window_length[TAU_METRIC_WINDOW_COUNT] = { 1.0, 10.0, 60.0 };
+
 metric_t *metric_init(const char *name, const char *doc, tau_metric_type_t type)
 {
 	metric_t *ret = malloc(sizeof(metric_t) );
@@ -31,11 +159,22 @@ metric_t *metric_init(const char *name, const char *doc, tau_metric_type_t type)
 
 	memset(ret, 0, sizeof(metric_t) );
 
-	snprintf(ret->name, METRIC_STRING_SIZE, "%s", name);
-	snprintf(ret->doc, METRIC_STRING_SIZE, "%s", doc);
+	ret->name = metric_string_intern(name);
+	ret->doc  = metric_string_intern(doc);
+
+	if(!ret->name || !ret->doc)
+	{
+		metric_release(ret);
+		return NULL;
+	}
 
 	ret->type = type;
 	ret->next = NULL;
+	ret->name_len = strlen(ret->name);
+	/* Render caches start at version 0 */
+	ret->version = 1;
+	/* Newcomers are not stale */
+	ret->last_ts = utils_get_ts();
 	pthread_spin_init(&ret->lock, 0);
 
 	return ret;
@@ -43,20 +182,80 @@ metric_t *metric_init(const char *name, const char *doc, tau_metric_type_t type)
 
 int metric_release(metric_t *m)
 {
+	metric_history_free(m->history);
+	free(m->windows);
+	free(m->render);
+	metric_string_release(m->name);
+	metric_string_release(m->doc);
+
 	memset(m, 0, sizeof(metric_t) );
 	free(m);
 
 	return 0;
 }
 
+int metric_type_cumulative(tau_metric_type_t type)
+{
+	return (type == TAU_METRIC_COUNTER) || (type == TAU_METRIC_HISTOGRAM);
+}
+
+/* Samples of a histogram, its family is named without them */
+static const char *const __histogram_suffix[] = { "_bucket", "_sum", "_count" };
+
+uint32_t metric_family_basename_len(const char *name, tau_metric_type_t type)
+{
+	uint32_t len = strcspn(name, "{");
+	int      i;
+
+	for(i = 0; (type == TAU_METRIC_HISTOGRAM) && (i < 3); i++)
+	{
+		uint32_t suffix_len = strlen(__histogram_suffix[i]);
+
+		if( (suffix_len < len) && !strncmp(name + len - suffix_len, __histogram_suffix[i], suffix_len) )
+		{
+			return len - suffix_len;
+		}
+	}
+
+	return len;
+}
+
+/* Called with the metric lock held */
+static inline void __metric_history_record(metric_t *m)
+{
+	double value = 0;
+
+	switch(m->type)
+	{
+		case TAU_METRIC_COUNTER:
+		case TAU_METRIC_HISTOGRAM:
+			value = m->metrics.counter.value;
+			break;
+		case TAU_METRIC_GAUGE:
+			value = m->metrics.gauge.avg;
+			break;
+		default:
+			return;
+	}
+
+	metric_history_record(m->history, m->last_ts, value);
+}
+
 int metric_update(metric_t *m, tau_metric_event_t *event)
 {
 	pthread_spin_lock(&m->lock);
    	m->last_ts = utils_get_ts();
+	m->version++;
+
+	if(m->windows)
+	{
+		metric_windows_update(m->windows, m->last_ts, event->value);
+	}
 
 	switch(m->type)
 	{
 		case TAU_METRIC_COUNTER:
+		case TAU_METRIC_HISTOGRAM:
 			m->metrics.counter.value += event->value;
 			//fprintf(stderr, "[COUNTER] %s == %g\n", m->name, m->metrics.counter.value);
 			break;
@@ -82,6 +281,60 @@ int metric_update(metric_t *m, tau_metric_event_t *event)
 		default:
 			tau_metric_proxy_error("Cannot update metric %s : not implemented", m->name);
 	}
+
+	if(m->history)
+	{
+		__metric_history_record(m);
+	}
+
+	pthread_spin_unlock(&m->lock);
+
+	return 0;
+}
+
+int metric_set(metric_t *m, double value)
+{
+	pthread_spin_lock(&m->lock);
+	m->last_ts = utils_get_ts();
+	m->version++;
+
+	if(m->windows)
+	{
+		/* Windows see counters by increments */
+		double update = metric_type_cumulative(m->type) ? value - m->metrics.counter.value : value;
+		metric_windows_update(m->windows, m->last_ts, update);
+	}
+
+	switch(m->type)
+	{
+		case TAU_METRIC_COUNTER:
+		case TAU_METRIC_HISTOGRAM:
+			m->metrics.counter.value = value;
+			break;
+
+		case TAU_METRIC_GAUGE:
+			m->metrics.gauge.avg = value;
+
+			if( (m->metrics.gauge.min == 0) || (value < m->metrics.gauge.min) )
+			{
+				m->metrics.gauge.min = value;
+			}
+
+			if(m->metrics.gauge.max < value)
+			{
+				m->metrics.gauge.max = value;
+			}
+			break;
+
+		default:
+			tau_metric_proxy_error("Cannot set metric %s : not implemented", m->name);
+	}
+
+	if(m->history)
+	{
+		__metric_history_record(m);
+	}
+
 	pthread_spin_unlock(&m->lock);
 
 	return 0;
@@ -108,6 +361,7 @@ metric_t * metric_from_snapshot(tau_metric_snapshot_t * snapshot)
 	switch (ret->type)
 	{
 		case TAU_METRIC_COUNTER:
+		case TAU_METRIC_HISTOGRAM:
 			ret->metrics.counter.value = snapshot->event.value;
 		break;
 		case TAU_METRIC_GAUGE:
@@ -136,336 +390,2622 @@ int metric_snapshot(metric_t *m, tau_metric_snapshot_t * snapshot)
 	snapshot->event.value = 0;
 	snapshot->canary = 0x1337;
 
-	switch (m->type)
-	{
-		case TAU_METRIC_COUNTER:
-			snapshot->event.value = m->metrics.counter.value;
-		break;
-		case TAU_METRIC_GAUGE:
-			snapshot->event.value = m->metrics.gauge.avg;
-		break;
-		default:
-			tau_metric_proxy_error("No such metric type");
+	switch (m->type)
+	{
+		case TAU_METRIC_COUNTER:
+		case TAU_METRIC_HISTOGRAM:
+			snapshot->event.value = m->metrics.counter.value;
+		break;
+		case TAU_METRIC_GAUGE:
+			snapshot->event.value = m->metrics.gauge.avg;
+		break;
+		default:
+			tau_metric_proxy_error("No such metric type");
+	}
+
+	return 0;
+}
+
+/******************************
+* METRICS STORAGE DEFINITION *
+******************************/
+
+metric_array_t * metric_array_get_main(void)
+{
+	static metric_array_t __metric_array;
+	return &__metric_array;
+}
+
+int metric_array_init_sized(metric_array_t *ma, unsigned int size, size_t max_footprint)
+{
+	ma->size          = size;
+	ma->metrics       = NULL;
+	ma->locks         = NULL;
+	ma->footprint     = 0;
+	ma->max_footprint = max_footprint;
+	ma->overflowed    = 0;
+	ma->count         = 0;
+	ma->max_series    = 0;
+	ma->rejected      = 0;
+	ma->snapshots     = 0;
+
+	memset(&ma->history, 0, sizeof(metric_history_config_t) );
+	ma->windows = 0;
+
+	ma->families     = NULL;
+	ma->family_locks = NULL;
+	ma->family_size  = 0;
+	ma->family_count = 0;
+
+	memset(&ma->family_index, 0, sizeof(metric_trie_t) );
+	pthread_spin_init(&ma->index_lock, 0);
+	pthread_spin_init(&ma->alloc_lock, 0);
+	utils_epoch_init(&ma->epoch);
+
+	return 0;
+}
+
+int metric_array_read_lock(metric_array_t *ma)
+{
+	return utils_epoch_enter(&ma->epoch);
+}
+
+void metric_array_read_unlock(metric_array_t *ma, int token)
+{
+	utils_epoch_exit(&ma->epoch, token);
+}
+
+void metric_array_set_history(metric_array_t *ma, double retention, double resolution, size_t max_bytes)
+{
+	ma->history.resolution = resolution;
+	ma->history.max_bytes  = max_bytes;
+	ma->history.retention  = retention;
+}
+
+void metric_array_set_windows(metric_array_t *ma, int enabled)
+{
+	ma->windows = enabled;
+}
+
+void metric_array_set_max_series(metric_array_t *ma, uint64_t max_series)
+{
+	ma->max_series = max_series;
+}
+
+int metric_array_init(metric_array_t *ma)
+{
+	return metric_array_init_sized(ma, METRIC_ARRAY_SIZE, 0);
+}
+
+static inline metric_t **__metric_array_buckets(metric_array_t *ma)
+{
+	return __atomic_load_n(&ma->metrics, __ATOMIC_ACQUIRE);
+}
+
+/* Family tables of a grouped array, called under the alloc lock */
+static int __metric_array_alloc_families(metric_array_t *ma)
+{
+	if(ma->families)
+	{
+		return 0;
+	}
+
+	pthread_spinlock_t *locks    = malloc(ma->family_size * sizeof(pthread_spinlock_t) );
+	metric_family_t **  families = calloc(ma->family_size, sizeof(metric_family_t *) );
+
+	if(!locks || !families || metric_trie_init(&ma->family_index) )
+	{
+		tau_metric_proxy_perror("malloc");
+		free( (void *)locks);
+		free(families);
+		return 1;
+	}
+
+	unsigned int i;
+
+	for(i = 0; i < ma->family_size; i++)
+	{
+		pthread_spin_init(&locks[i], 0);
+	}
+
+	ma->family_locks = locks;
+	ma->families     = families;
+
+	return 0;
+}
+
+static inline int __metric_array_alloc(metric_array_t *ma)
+{
+	pthread_spin_lock(&ma->alloc_lock);
+
+	if(ma->metrics)
+	{
+		/* Somebody else did it */
+		pthread_spin_unlock(&ma->alloc_lock);
+		return 0;
+	}
+
+	/* Families first, they are published with the buckets */
+	if(ma->family_size && __metric_array_alloc_families(ma) )
+	{
+		pthread_spin_unlock(&ma->alloc_lock);
+		return 1;
+	}
+
+	pthread_spinlock_t *locks   = malloc(ma->size * sizeof(pthread_spinlock_t) );
+	metric_t **         buckets = calloc(ma->size, sizeof(metric_t *) );
+
+	if(!locks || !buckets)
+	{
+		pthread_spin_unlock(&ma->alloc_lock);
+		tau_metric_proxy_perror("malloc");
+		free( (void *)locks);
+		free(buckets);
+		return 1;
+	}
+
+	unsigned int i;
+
+	for(i = 0; i < ma->size; i++)
+	{
+		pthread_spin_init(&locks[i], 0);
+	}
+
+	ma->locks = locks;
+	__atomic_add_fetch(&ma->footprint, ma->size * (sizeof(pthread_spinlock_t) + sizeof(metric_t *) ), __ATOMIC_RELAXED);
+	/* Publish buckets last as readers only check this pointer */
+	__atomic_store_n(&ma->metrics, buckets, __ATOMIC_RELEASE);
+
+	pthread_spin_unlock(&ma->alloc_lock);
+
+	return 0;
+}
+
+int metric_array_set_families(metric_array_t *ma, unsigned int size)
+{
+	if(ma->families)
+	{
+		/* Already grouped */
+		return 0;
+	}
+
+	ma->family_size = size;
+
+	if(!__metric_array_buckets(ma) )
+	{
+		/* Allocated along with the buckets on the first registration */
+		return 0;
+	}
+
+	pthread_spin_lock(&ma->alloc_lock);
+	int ret = __metric_array_alloc_families(ma);
+	pthread_spin_unlock(&ma->alloc_lock);
+
+	return ret;
+}
+
+/*******************
+* METRIC FAMILIES *
+*******************/
+
+static metric_family_t *__metric_family_new(const char *name, uint32_t len, uint64_t hash)
+{
+	metric_family_t *ret = calloc(1, sizeof(metric_family_t) );
+
+	if(!ret)
+	{
+		tau_metric_proxy_perror("calloc");
+		return NULL;
+	}
+
+	char basename[METRIC_STRING_SIZE];
+	snprintf(basename, METRIC_STRING_SIZE, "%.*s", (int)len, name);
+
+	ret->basename = metric_string_intern(basename);
+
+	if(!ret->basename)
+	{
+		free(ret);
+		return NULL;
+	}
+
+	ret->basename_len = len;
+	ret->hash         = hash;
+	pthread_spin_init(&ret->lock, 0);
+
+	return ret;
+}
+
+static void __metric_family_free(metric_family_t *f)
+{
+	metric_string_release(f->basename);
+	free(f->members);
+	free(f);
+}
+
+/* Called under the bucket lock of m, before it is linked */
+static int __metric_family_join(metric_array_t *ma, metric_t *m)
+{
+	uint32_t     len  = metric_family_basename_len(m->name, m->type);
+	uint64_t     hash = utils_string_hash_len( (const unsigned char *)m->name, len);
+	unsigned int cell = hash % ma->family_size;
+
+	pthread_spin_lock(&ma->family_locks[cell]);
+
+	metric_family_t *f = ma->families[cell];
+
+	while(f)
+	{
+		if( (f->hash == hash) && (f->basename_len == len) && !strncmp(f->basename, m->name, len) )
+		{
+			break;
+		}
+
+		f = f->next;
+	}
+
+	if(!f)
+	{
+		f = __metric_family_new(m->name, len, hash);
+
+		if(!f)
+		{
+			pthread_spin_unlock(&ma->family_locks[cell]);
+			return 1;
+		}
+
+		pthread_spin_lock(&ma->index_lock);
+		int indexed = !metric_trie_insert(&ma->family_index, f->basename, len, f);
+		pthread_spin_unlock(&ma->index_lock);
+
+		if(!indexed)
+		{
+			pthread_spin_unlock(&ma->family_locks[cell]);
+			__metric_family_free(f);
+			return 1;
+		}
+
+		f->next = ma->families[cell];
+		ma->families[cell] = f;
+		__atomic_add_fetch(&ma->family_count, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_spin_lock(&f->lock);
+
+	if(f->count == f->capacity)
+	{
+		uint32_t   capacity = f->capacity ? f->capacity * 2 : 4;
+		metric_t **members  = realloc(f->members, capacity * sizeof(metric_t *) );
+
+		if(!members)
+		{
+			/* An empty family is simply kept for later members */
+			pthread_spin_unlock(&f->lock);
+			pthread_spin_unlock(&ma->family_locks[cell]);
+			tau_metric_proxy_perror("realloc");
+			return 1;
+		}
+
+		f->members  = members;
+		f->capacity = capacity;
+	}
+
+	m->family_index = f->count;
+	m->family       = f;
+	f->members[f->count++] = m;
+
+	pthread_spin_unlock(&f->lock);
+	pthread_spin_unlock(&ma->family_locks[cell]);
+
+	return 0;
+}
+
+/* Called under the bucket lock of m once it is unlinked, returns
+   its family if it became empty (to be freed after a grace period) */
+static metric_family_t *__metric_family_leave(metric_array_t *ma, metric_t *m)
+{
+	metric_family_t *f = m->family;
+
+	if(!f)
+	{
+		return NULL;
+	}
+
+	unsigned int cell = f->hash % ma->family_size;
+
+	pthread_spin_lock(&ma->family_locks[cell]);
+	pthread_spin_lock(&f->lock);
+
+	/* Swap the last member in the hole */
+	uint32_t last = --f->count;
+
+	if(m->family_index != last)
+	{
+		metric_t *moved = f->members[last];
+		f->members[m->family_index] = moved;
+		moved->family_index         = m->family_index;
+	}
+
+	m->family = NULL;
+
+	int empty = !f->count;
+
+	pthread_spin_unlock(&f->lock);
+
+	if(empty)
+	{
+		metric_family_t **prev = &ma->families[cell];
+
+		while(*prev != f)
+		{
+			prev = &(*prev)->next;
+		}
+
+		*prev = f->next;
+		__atomic_sub_fetch(&ma->family_count, 1, __ATOMIC_RELAXED);
+
+		pthread_spin_lock(&ma->index_lock);
+		metric_trie_remove(&ma->family_index, f->basename, f->basename_len);
+		pthread_spin_unlock(&ma->index_lock);
+	}
+
+	pthread_spin_unlock(&ma->family_locks[cell]);
+
+	return empty ? f : NULL;
+}
+
+/* Frees the families and their tables, the array is no longer grouped */
+static void __metric_array_release_families(metric_array_t *ma)
+{
+	unsigned int i;
+
+	if(!ma->families)
+	{
+		return;
+	}
+
+	for(i = 0; i < ma->family_size; i++)
+	{
+		pthread_spin_lock(&ma->family_locks[i]);
+
+		metric_family_t *f = ma->families[i];
+
+		while(f)
+		{
+			metric_family_t *to_free = f;
+			f = f->next;
+			__metric_family_free(to_free);
+		}
+
+		ma->families[i] = NULL;
+
+		pthread_spin_unlock(&ma->family_locks[i]);
+	}
+
+	ma->family_count = 0;
+
+	pthread_spin_lock(&ma->index_lock);
+	metric_trie_release(&ma->family_index);
+	pthread_spin_unlock(&ma->index_lock);
+
+	free(ma->families);
+	free( (void *)ma->family_locks);
+	ma->families     = NULL;
+	ma->family_locks = NULL;
+	ma->family_size  = 0;
+}
+
+int metric_array_release(metric_array_t *ma)
+{
+	unsigned int i;
+
+	metric_t **buckets = __metric_array_buckets(ma);
+
+	if(!buckets)
+	{
+		__metric_array_release_families(ma);
+		return 0;
+	}
+
+	for(i = 0; i < ma->size; i++)
+	{
+		pthread_spin_lock(&ma->locks[i]);
+
+		metric_t *m = buckets[i];
+
+		while(m)
+		{
+			metric_t *to_free = m;
+			m = m->next;
+			metric_release(to_free);
+		}
+
+		buckets[i] = NULL;
+
+		pthread_spin_unlock(&ma->locks[i]);
+	}
+
+	__metric_array_release_families(ma);
+
+	pthread_spin_lock(&ma->alloc_lock);
+	ma->metrics   = NULL;
+	free(buckets);
+	free( (void *)ma->locks);
+	ma->locks     = NULL;
+	ma->footprint = 0;
+	ma->count     = 0;
+	pthread_spin_unlock(&ma->alloc_lock);
+
+	return 0;
+}
+
+int metric_array_iterate(metric_array_t *ma, int (*callback)(metric_t *m, void *arg), void *arg)
+{
+	unsigned int i;
+
+	metric_t **buckets = __metric_array_buckets(ma);
+
+	if(!buckets)
+	{
+		/* Nothing was ever registered */
+		return 0;
+	}
+
+	for(i = 0; i < ma->size; i++)
+	{
+		pthread_spin_lock(&ma->locks[i]);
+
+		metric_t *m = buckets[i];
+
+		int done = 0;
+
+		while(m && !done)
+		{
+			pthread_spin_lock(&m->lock);
+			done = (callback)(m, arg);
+			pthread_spin_unlock(&m->lock);
+			m = m->next;
+		}
+
+		pthread_spin_unlock(&ma->locks[i]);
+	}
+
+	return 0;
+}
+
+static inline metric_t *__metric_array_get(metric_array_t *ma, metric_t **buckets, unsigned int cell, const char *name)
+{
+	metric_t *m = buckets[cell];
+
+	while(m)
+	{
+		if(!strncmp(m->name, name, METRIC_STRING_SIZE) )
+		{
+			return m;
+		}
+		m = m->next;
+	}
+
+	return NULL;
+}
+
+metric_t *metric_array_get(metric_array_t *ma, const char *name)
+{
+	metric_t *ret = NULL;
+
+	metric_t **buckets = __metric_array_buckets(ma);
+
+	if(!buckets)
+	{
+		return NULL;
+	}
+
+	uint64_t     hash = utils_string_hash((const unsigned char *)name);
+	unsigned int cell = hash % ma->size;
+
+	pthread_spin_lock(&ma->locks[cell]);
+	ret = __metric_array_get(ma, buckets, cell, name);
+	pthread_spin_unlock(&ma->locks[cell]);
+
+	return ret;
+}
+
+static int __metric_array_register(metric_array_t *ma, metric_t *m, int force)
+{
+	if( (0 < ma->history.retention) && !m->history)
+	{
+		/* Freed with the metric if the registration fails */
+		m->history = metric_history_new(&ma->history);
+	}
+
+	if(ma->windows && !m->windows)
+	{
+		m->windows = metric_windows_new();
+	}
+
+	metric_t **buckets = __metric_array_buckets(ma);
+
+	if(!buckets)
+	{
+		if(__metric_array_alloc(ma) )
+		{
+			return 2;
+		}
+
+		buckets = __metric_array_buckets(ma);
+	}
+
+	uint64_t     hash = utils_string_hash((const unsigned char *)m->name);
+	unsigned int cell = hash % ma->size;
+
+	pthread_spin_lock(&ma->locks[cell]);
+
+	metric_t *existing = __metric_array_get(ma, buckets, cell, m->name);
+
+	if(existing)
+	{
+		//fprintf(stderr, "Metric %s is already registered\n", m->name);
+		/* The evictor checks pins under the bucket lock */
+		existing->pinned |= m->pinned;
+		pthread_spin_unlock(&ma->locks[cell]);
+		return 1;
+	}
+
+	size_t   footprint = __atomic_add_fetch(&ma->footprint, sizeof(metric_t), __ATOMIC_RELAXED);
+	uint64_t count     = __atomic_add_fetch(&ma->count, 1, __ATOMIC_RELAXED);
+
+	int over_budget = ma->max_footprint && (ma->max_footprint < footprint);
+	int over_guard  = ma->max_series && (ma->max_series < count);
+
+	if(!force && (over_budget || over_guard) )
+	{
+		__atomic_sub_fetch(&ma->footprint, sizeof(metric_t), __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&ma->count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ma->rejected, 1, __ATOMIC_RELAXED);
+		pthread_spin_unlock(&ma->locks[cell]);
+
+		if(!__atomic_exchange_n(&ma->overflowed, 1, __ATOMIC_RELAXED) )
+		{
+			if(over_budget)
+			{
+				tau_metric_proxy_error("Metric array reached its %ld bytes budget, dropping %s and later newcomers",
+				                       ma->max_footprint, m->name);
+			}
+			else
+			{
+				tau_metric_proxy_error("Metric array reached its %ld series limit, refusing %s and later newcomers",
+				                       ma->max_series, m->name);
+			}
+		}
+
+		return 2;
+	}
+
+	if(ma->families && __metric_family_join(ma, m) )
+	{
+		/* Out of memory: a series outside of any family would never be exposed */
+		__atomic_sub_fetch(&ma->footprint, sizeof(metric_t), __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&ma->count, 1, __ATOMIC_RELAXED);
+		pthread_spin_unlock(&ma->locks[cell]);
+		return 2;
+	}
+
+	m->next = buckets[cell];
+	buckets[cell] = m;
+
+	pthread_spin_unlock(&ma->locks[cell]);
+
+	return 0;
+}
+
+int metric_array_register(metric_array_t *ma, metric_t *m)
+{
+	return __metric_array_register(ma, m, 0);
+}
+
+char *metric_fold_name(char *buff, const char *name)
+{
+	snprintf(buff, METRIC_STRING_SIZE, "%s", name);
+
+	char *bracket = strchr(buff, '{');
+
+	if(bracket)
+	{
+		*bracket = '\0';
+	}
+
+	size_t len = strlen(buff);
+	snprintf(buff + len, METRIC_STRING_SIZE - len, "{tau_folded=\"true\"}");
+
+	return buff;
+}
+
+metric_t *metric_array_get_folded(metric_array_t *ma, const char *name, const char *doc, tau_metric_type_t type)
+{
+	char folded[METRIC_STRING_SIZE];
+	metric_fold_name(folded, name);
+
+	metric_t *ret = metric_array_get(ma, folded);
+
+	if(ret)
+	{
+		return ret;
+	}
+
+	metric_t *new_metric = metric_init(folded, doc, type);
+
+	if(!new_metric)
+	{
+		return NULL;
+	}
+
+	if(__metric_array_register(ma, new_metric, 1) )
+	{
+		metric_release(new_metric);
+	}
+
+	return metric_array_get(ma, folded);
+}
+
+static inline void __metric_snapshot_entry(metric_t *m, metric_snapshot_entry_t *e)
+{
+	e->windows  = NULL;
+	e->name_len = m->name_len;
+	e->family     = m->family ? m->family->basename : NULL;
+	e->family_len = m->family ? m->family->basename_len : 0;
+	e->text_len = 0;
+	e->name     = m->name;
+	e->doc     = m->doc;
+	e->type    = m->type;
+	e->last_ts = m->last_ts;
+	e->value   = 0;
+	e->min     = 0;
+	e->max     = 0;
+
+	switch(m->type)
+	{
+		case TAU_METRIC_COUNTER:
+		case TAU_METRIC_HISTOGRAM:
+			e->value = m->metrics.counter.value;
+			break;
+
+		case TAU_METRIC_GAUGE:
+			e->value = m->metrics.gauge.avg;
+			e->min   = m->metrics.gauge.min;
+			e->max   = m->metrics.gauge.max;
+			break;
+
+		default:
+			break;
+	}
+}
+
+static inline int __metric_render_text(double value, char *text)
+{
+	return dtoa_shortest(value, text);
+}
+
+/* Called with the metric lock held, returns 1 if the text was rendered */
+static inline int __metric_snapshot_render(metric_t *m, metric_snapshot_entry_t *e)
+{
+	if(!m->render)
+	{
+		/* Render without caching */
+		e->text_len = __metric_render_text(e->value, e->text);
+		return 1;
+	}
+
+	int ret = 0;
+
+	if(m->render->version != m->version)
+	{
+		m->render->len     = __metric_render_text(e->value, m->render->text);
+		m->render->version = m->version;
+		ret = 1;
+	}
+
+	memcpy(e->text, m->render->text, m->render->len + 1);
+	e->text_len = m->render->len;
+
+	return ret;
+}
+
+static int __metric_array_snapshot_reserve(metric_array_snapshot_t *snap, uint64_t capacity)
+{
+	metric_snapshot_entry_t *entries = realloc(snap->entries, capacity * sizeof(metric_snapshot_entry_t) );
+
+	if(!entries)
+	{
+		tau_metric_proxy_perror("realloc");
+		return 1;
+	}
+
+	snap->entries = entries;
+
+	if(snap->array->windows)
+	{
+		tau_metric_window_stats_t *windows = realloc(snap->windows, capacity * sizeof(tau_metric_window_stats_t) );
+
+		if(!windows)
+		{
+			tau_metric_proxy_perror("realloc");
+			return 1;
+		}
+
+		snap->windows = windows;
+	}
+
+	snap->capacity = capacity;
+
+	return 0;
+}
+
+/* First refill of the spare text caches in a take, later ones double */
+#define METRIC_SNAPSHOT_SPARE_RENDERS 64
+
+static int __metric_array_snapshot_spare(metric_array_snapshot_t *snap)
+{
+	uint64_t batch = snap->spare_batch ? 2 * snap->spare_batch : METRIC_SNAPSHOT_SPARE_RENDERS;
+
+	metric_render_t **spare = realloc(snap->spare, batch * sizeof(metric_render_t *) );
+
+	if(!spare)
+	{
+		tau_metric_proxy_perror("realloc");
+		return 1;
+	}
+
+	snap->spare       = spare;
+	snap->spare_batch = batch;
+
+	while(snap->spare_count < batch)
+	{
+		if(!(spare[snap->spare_count] = calloc(1, sizeof(metric_render_t) ) ) )
+		{
+			tau_metric_proxy_perror("calloc");
+			return 1;
+		}
+
+		snap->spare_count++;
+	}
+
+	return 0;
+}
+
+/* Rewinds to the entries taken before a list which did not fit, grows
+   the buffer or refills the spare text caches, called with no lock held */
+static int __metric_array_snapshot_grow(metric_array_snapshot_t *snap, uint64_t count, uint64_t rendered)
+{
+	int full = (snap->count == snap->capacity);
+
+	snap->count    = count;
+	snap->rendered = rendered;
+
+	if(snap->render && !snap->spare_count && __metric_array_snapshot_spare(snap) )
+	{
+		return 1;
+	}
+
+	return full ? __metric_array_snapshot_reserve(snap, snap->capacity * 2) : 0;
+}
+
+/* Copy one series, called under the lock of the list holding it: returns
+   1 when the buffer is full (more newcomers than expected) or when a text
+   cache is needed and none is spare, the caller then drops its locks,
+   grows the buffer and takes the list again */
+static inline int __metric_array_snapshot_one(metric_array_snapshot_t *snap, metric_t *m)
+{
+	if(snap->count == snap->capacity)
+	{
+		return 1;
+	}
+
+	/* Caches are never allocated under the locks which updates contend on */
+	if(snap->render && !snap->spare_count && !__atomic_load_n(&m->render, __ATOMIC_RELAXED) )
+	{
+		return 1;
+	}
+
+	pthread_spin_lock(&m->lock);
+
+	if(snap->render && !m->render && snap->spare_count)
+	{
+		m->render = snap->spare[--snap->spare_count];
+	}
+
+	__metric_snapshot_entry(m, &snap->entries[snap->count]);
+
+	if(snap->render)
+	{
+		snap->rendered += __metric_snapshot_render(m, &snap->entries[snap->count]);
+	}
+
+	if(m->windows && snap->windows)
+	{
+		metric_windows_read(m->windows, snap->ts, &snap->windows[snap->count]);
+		/* Flag it, pointers are set once the buffers stop moving */
+		snap->entries[snap->count].windows = &snap->windows[snap->count];
+	}
+
+	pthread_spin_unlock(&m->lock);
+
+	snap->count++;
+
+	return 0;
+}
+
+/* Enters the read section and sizes the buffer, returns 1 on error
+   (nothing to release) */
+static int __metric_array_snapshot_begin(metric_array_t *ma, metric_array_snapshot_t *snap, uint64_t needed)
+{
+	snap->array    = ma;
+	snap->count    = 0;
+	snap->rendered = 0;
+	snap->spare_batch = 0;
+	snap->ts    = utils_get_ts();
+	snap->epoch = __atomic_add_fetch(&ma->snapshots, 1, __ATOMIC_RELAXED);
+	snap->token = metric_array_read_lock(ma);
+
+	if( (snap->capacity < needed) || (ma->windows && !snap->windows) )
+	{
+		if(__metric_array_snapshot_reserve(snap, (snap->capacity < needed) ? needed : snap->capacity) )
+		{
+			metric_array_snapshot_release(snap);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Window pointers are set once the buffers stopped moving */
+static void __metric_array_snapshot_end(metric_array_snapshot_t *snap)
+{
+	uint64_t j;
+
+	for(j = 0; snap->windows && (j < snap->count); j++)
+	{
+		if(snap->entries[j].windows)
+		{
+			snap->entries[j].windows = &snap->windows[j];
+		}
+	}
+}
+
+/* Copy the members of a family matching the filter (NULL for all),
+   returns 1 when they did not fit */
+static int __metric_array_snapshot_family(metric_array_snapshot_t *snap, metric_family_t *f, const metric_filter_t *filter)
+{
+	pthread_spin_lock(&f->lock);
+
+	uint32_t j;
+
+	for(j = 0; j < f->count; j++)
+	{
+		if(filter && !metric_filter_match(filter, f->members[j]->name) )
+		{
+			continue;
+		}
+
+		if(__metric_array_snapshot_one(snap, f->members[j]) )
+		{
+			pthread_spin_unlock(&f->lock);
+			return 1;
+		}
+	}
+
+	pthread_spin_unlock(&f->lock);
+
+	return 0;
+}
+
+/* Copy the members of a family from the first one (at most max of
+   them), sets where the copy stopped, returns 1 when they did not fit */
+static int __metric_array_snapshot_slice(metric_array_snapshot_t *snap, metric_family_t *f, uint32_t first,
+                                         uint64_t max, uint32_t *stop)
+{
+	pthread_spin_lock(&f->lock);
+
+	uint32_t j;
+
+	for(j = first; (j < f->count) && (j - first < max); j++)
+	{
+		if(__metric_array_snapshot_one(snap, f->members[j]) )
+		{
+			pthread_spin_unlock(&f->lock);
+			return 1;
+		}
+	}
+
+	/* Members only come and go from the end or by swapping the last
+	   one in a hole: the ones left are past that point */
+	*stop = (j < f->count) ? j : 0;
+
+	pthread_spin_unlock(&f->lock);
+
+	return 0;
+}
+
+/* Copy the series of a hash table bucket matching the filter (NULL for all),
+   returns 1 when they did not fit */
+static int __metric_array_snapshot_bucket(metric_array_t *ma, metric_array_snapshot_t *snap, metric_t **buckets,
+                                          unsigned int i, const metric_filter_t *filter)
+{
+	pthread_spin_lock(&ma->locks[i]);
+
+	metric_t *m = buckets[i];
+
+	while(m)
+	{
+		if( (!filter || metric_filter_match(filter, m->name) ) && __metric_array_snapshot_one(snap, m) )
+		{
+			pthread_spin_unlock(&ma->locks[i]);
+			return 1;
+		}
+
+		m = m->next;
+	}
+
+	pthread_spin_unlock(&ma->locks[i]);
+
+	return 0;
+}
+
+/* Copy the series of the hash table matching the filter (NULL for all) */
+static int __metric_array_snapshot_buckets(metric_array_t *ma, metric_array_snapshot_t *snap, metric_t **buckets,
+                                           const metric_filter_t *filter)
+{
+	unsigned int i;
+
+	for(i = 0; i < ma->size; i++)
+	{
+		uint64_t count    = snap->count;
+		uint64_t rendered = snap->rendered;
+
+		while(__metric_array_snapshot_bucket(ma, snap, buckets, i, filter) )
+		{
+			if(__metric_array_snapshot_grow(snap, count, rendered) )
+			{
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Copy the families of a family bucket, returns 1 when they did not fit */
+static int __metric_array_snapshot_families(metric_array_t *ma, metric_array_snapshot_t *snap, unsigned int i)
+{
+	pthread_spin_lock(&ma->family_locks[i]);
+
+	metric_family_t *f = ma->families[i];
+
+	while(f)
+	{
+		if(__metric_array_snapshot_family(snap, f, NULL) )
+		{
+			pthread_spin_unlock(&ma->family_locks[i]);
+			return 1;
+		}
+
+		f = f->next;
+	}
+
+	pthread_spin_unlock(&ma->family_locks[i]);
+
+	return 0;
+}
+
+int metric_array_snapshot_take(metric_array_t *ma, metric_array_snapshot_t *snap)
+{
+	/* Some slack for newcomers while we walk */
+	uint64_t needed = __atomic_load_n(&ma->count, __ATOMIC_RELAXED) + 64;
+
+	if(__metric_array_snapshot_begin(ma, snap, needed) )
+	{
+		return 1;
+	}
+
+	metric_t **buckets = __metric_array_buckets(ma);
+
+	if(!buckets)
+	{
+		return 0;
+	}
+
+	unsigned int i;
+
+	if(ma->families)
+	{
+		/* Walk by family so that members come out grouped */
+		for(i = 0; i < ma->family_size; i++)
+		{
+			uint64_t count    = snap->count;
+			uint64_t rendered = snap->rendered;
+
+			while(__metric_array_snapshot_families(ma, snap, i) )
+			{
+				if(__metric_array_snapshot_grow(snap, count, rendered) )
+				{
+					metric_array_snapshot_release(snap);
+					return 1;
+				}
+			}
+		}
+	}
+	else if(__metric_array_snapshot_buckets(ma, snap, buckets, NULL) )
+	{
+		metric_array_snapshot_release(snap);
+		return 1;
+	}
+
+	__metric_array_snapshot_end(snap);
+
+	return 0;
+}
+
+/* Copy the families of a bucket from the cursor until max entries,
+   returns 1 when they did not fit (the cursor is then left moved) */
+static int __metric_array_snapshot_family_bucket(metric_array_t *ma, metric_array_snapshot_t *snap,
+                                                 metric_snapshot_cursor_t *cursor, uint64_t max)
+{
+	metric_family_t *f = ma->families[cursor->bucket];
+
+	/* Families before the cursor were taken by the previous parts */
+	if(strlen(cursor->family) )
+	{
+		while(f && strcmp(f->basename, cursor->family) )
+		{
+			f = f->next;
+		}
+
+		/* Gone since: the rest of the bucket is skipped rather than sent twice */
+		if(!f)
+		{
+			return 0;
+		}
+
+		if(!cursor->cut)
+		{
+			f = f->next;
+		}
+	}
+
+	for(; f; f = f->next)
+	{
+		uint32_t count = __atomic_load_n(&f->count, __ATOMIC_RELAXED);
+
+		if(!cursor->cut && snap->count && (max < snap->count + count) )
+		{
+			/* Next part */
+			return 0;
+		}
+
+		/* Too large for a part: taken alone by slices */
+		if(!cursor->cut && (max < count) )
+		{
+			cursor->cut    = 1;
+			cursor->member = 0;
+		}
+
+		snprintf(cursor->family, METRIC_STRING_SIZE, "%s", f->basename);
+
+		if(cursor->cut)
+		{
+			if(__metric_array_snapshot_slice(snap, f, cursor->member, max, &cursor->member) )
+			{
+				return 1;
+			}
+
+			cursor->cut = (cursor->member != 0);
+			return 0;
+		}
+
+		if(__metric_array_snapshot_family(snap, f, NULL) )
+		{
+			return 1;
+		}
+	}
+
+	/* Bucket done */
+	cursor->bucket++;
+	cursor->family[0] = '\0';
+
+	return 0;
+}
+
+int metric_array_snapshot_take_part(metric_array_t *ma, metric_array_snapshot_t *snap, metric_snapshot_cursor_t *cursor,
+                                    uint64_t max_entries)
+{
+	if(__metric_array_snapshot_begin(ma, snap, max_entries) )
+	{
+		return 1;
+	}
+
+	metric_t **buckets = __metric_array_buckets(ma);
+
+	if(!buckets)
+	{
+		cursor->done = 1;
+		return 0;
+	}
+
+	if(ma->families)
+	{
+		while( (cursor->bucket < ma->family_size) && (snap->count < max_entries) )
+		{
+			unsigned int             bucket   = cursor->bucket;
+			uint64_t                 count    = snap->count;
+			uint64_t                 rendered = snap->rendered;
+			metric_snapshot_cursor_t from     = *cursor;
+
+			pthread_spin_lock(&ma->family_locks[bucket]);
+
+			int ret = __metric_array_snapshot_family_bucket(ma, snap, cursor, max_entries);
+
+			pthread_spin_unlock(&ma->family_locks[bucket]);
+
+			if(ret)
+			{
+				/* Families grew since their count was read: retried from the same point */
+				*cursor = from;
+
+				if(__metric_array_snapshot_grow(snap, count, rendered) )
+				{
+					metric_array_snapshot_release(snap);
+					return 1;
+				}
+
+				continue;
+			}
+
+			/* The part is full or a slice */
+			if(bucket == cursor->bucket)
+			{
+				break;
+			}
+		}
+
+		cursor->done = (cursor->bucket == ma->family_size);
+	}
+	else
+	{
+		/* Buckets are short: taken whole */
+		while( (cursor->bucket < ma->size) && (snap->count < max_entries) )
+		{
+			uint64_t count    = snap->count;
+			uint64_t rendered = snap->rendered;
+
+			if(__metric_array_snapshot_bucket(ma, snap, buckets, cursor->bucket, NULL) )
+			{
+				if(__metric_array_snapshot_grow(snap, count, rendered) )
+				{
+					metric_array_snapshot_release(snap);
+					return 1;
+				}
+
+				continue;
+			}
+
+			cursor->bucket++;
+		}
+
+		cursor->done = (cursor->bucket == ma->size);
+	}
+
+	__metric_array_snapshot_end(snap);
+
+	return 0;
+}
+
+void metric_array_snapshot_release(metric_array_snapshot_t *snap)
+{
+	if(snap->array)
+	{
+		metric_array_read_unlock(snap->array, snap->token);
+		snap->array = NULL;
+	}
+}
+
+int metric_array_snapshot_detach(metric_array_snapshot_t *snap)
+{
+	size_t   len = 0;
+	uint64_t i;
+
+	for(i = 0; i < snap->count; i++)
+	{
+		metric_snapshot_entry_t *e = &snap->entries[i];
+
+		len += e->name_len + 1 + (e->doc ? strlen(e->doc) + 1 : 0) + (e->family ? e->family_len + 1 : 0);
+	}
+
+	free(snap->strings);
+	snap->strings = malloc(len + 1);
+
+	if(!snap->strings)
+	{
+		tau_metric_proxy_perror("malloc");
+		snap->count = 0;
+		metric_array_snapshot_release(snap);
+		return 1;
+	}
+
+	char *p = snap->strings;
+
+	for(i = 0; i < snap->count; i++)
+	{
+		metric_snapshot_entry_t *e = &snap->entries[i];
+
+		memcpy(p, e->name, e->name_len);
+		p[e->name_len] = '\0';
+		e->name        = p;
+		p             += e->name_len + 1;
+
+		if(e->doc)
+		{
+			size_t doc_len = strlen(e->doc);
+
+			memcpy(p, e->doc, doc_len + 1);
+			e->doc = p;
+			p     += doc_len + 1;
+		}
+
+		if(e->family)
+		{
+			memcpy(p, e->family, e->family_len);
+			p[e->family_len] = '\0';
+			e->family        = p;
+			p               += e->family_len + 1;
+		}
+	}
+
+	metric_array_snapshot_release(snap);
+
+	return 0;
+}
+
+void metric_array_snapshot_free(metric_array_snapshot_t *snap)
+{
+	metric_array_snapshot_release(snap);
+
+	while(snap->spare_count)
+	{
+		free(snap->spare[--snap->spare_count]);
+	}
+
+	free(snap->spare);
+	free(snap->entries);
+	free(snap->windows);
+	free(snap->strings);
+	snap->spare    = NULL;
+	snap->entries  = NULL;
+	snap->windows  = NULL;
+	snap->strings  = NULL;
+	snap->capacity = 0;
+	snap->count    = 0;
+}
+
+/******************
+* SERIES FILTERS *
+******************/
+
+/* Characters making a pattern a regular expression, '{' is not one
+   of them as plain patterns may reach into the labels */
+#define METRIC_FILTER_REGEX_CHARS ".[]()*+?|^$\\"
+
+void metric_filter_init(metric_filter_t *f)
+{
+	f->count = 0;
+}
+
+/* Literal characters all the names matching an expression start with */
+static size_t __metric_filter_literal_prefix(const char *expr, char *prefix)
+{
+	size_t len = 0;
+
+	/* Alternatives have no common start we could find cheaply */
+	if(strchr(expr, '|') )
+	{
+		prefix[0] = '\0';
+		return 0;
+	}
+
+	if(*expr == '^')
+	{
+		expr++;
+	}
+
+	while(*expr && !strchr(METRIC_FILTER_REGEX_CHARS "{}", *expr) && (len < METRIC_STRING_SIZE - 1) )
+	{
+		prefix[len++] = *(expr++);
+	}
+
+	/* A quantified last character may be absent */
+	if(len && ( (*expr == '*') || (*expr == '?') || (*expr == '{') ) )
+	{
+		len--;
+	}
+
+	prefix[len] = '\0';
+
+	return len;
+}
+
+int metric_filter_add(metric_filter_t *f, const char *pattern)
+{
+	if(METRIC_FILTER_MAX_PATTERNS <= f->count)
+	{
+		tau_metric_proxy_error("Filters hold at most %d patterns, ignoring %s", METRIC_FILTER_MAX_PATTERNS, pattern);
+		return 1;
+	}
+
+	metric_filter_pattern_t *p = &f->patterns[f->count];
+
+	p->is_regex = (strpbrk(pattern, METRIC_FILTER_REGEX_CHARS) != NULL);
+
+	if(!p->is_regex)
+	{
+		snprintf(p->prefix, METRIC_STRING_SIZE, "%s", pattern);
+		p->prefix_len = strlen(p->prefix);
+		f->count++;
+		return 0;
+	}
+
+	/* Anchored at the start of the name only so that an expression
+	   selects names the same way as a prefix does */
+	char anchored[METRIC_STRING_SIZE + 8];
+	snprintf(anchored, sizeof(anchored), "^(%s)", pattern);
+
+	int err = regcomp(&p->regex, anchored, REG_EXTENDED | REG_NOSUB);
+
+	if(err)
+	{
+		char msg[128];
+		regerror(err, &p->regex, msg, 128);
+		tau_metric_proxy_error("Invalid series pattern %s: %s", pattern, msg);
+		return 1;
+	}
+
+	p->prefix_len = __metric_filter_literal_prefix(pattern, p->prefix);
+	f->count++;
+
+	return 0;
+}
+
+int metric_filter_match(const metric_filter_t *f, const char *name)
+{
+	unsigned int i;
+
+	for(i = 0; i < f->count; i++)
+	{
+		const metric_filter_pattern_t *p = &f->patterns[i];
+
+		if(p->is_regex ? !regexec(&p->regex, name, 0, NULL, 0) : !strncmp(name, p->prefix, p->prefix_len) )
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void metric_filter_release(metric_filter_t *f)
+{
+	unsigned int i;
+
+	for(i = 0; i < f->count; i++)
+	{
+		if(f->patterns[i].is_regex)
+		{
+			regfree(&f->patterns[i].regex);
+		}
+	}
+
+	f->count = 0;
+}
+
+/* Families visited by a filtered snapshot */
+struct metric_family_matches
+{
+	metric_family_t **families;
+	uint64_t          count;
+	uint64_t          capacity;
+};
+
+static int __metric_family_matches_push(void *family, void *arg)
+{
+	struct metric_family_matches *fm = (struct metric_family_matches *)arg;
+
+	if(fm->count == fm->capacity)
+	{
+		uint64_t          capacity = fm->capacity ? fm->capacity * 2 : 64;
+		metric_family_t **families = realloc(fm->families, capacity * sizeof(metric_family_t *) );
+
+		if(!families)
+		{
+			tau_metric_proxy_perror("realloc");
+			return 1;
+		}
+
+		fm->families = families;
+		fm->capacity = capacity;
+	}
+
+	fm->families[fm->count++] = (metric_family_t *)family;
+
+	return 0;
+}
+
+static int __metric_family_compare(const void *pa, const void *pb)
+{
+	const metric_family_t *a = *( (metric_family_t * const *)pa);
+	const metric_family_t *b = *( (metric_family_t * const *)pb);
+
+	return strcmp(a->basename, b->basename);
+}
+
+/* The family of that exact name if any */
+static int __metric_family_matches_exact(metric_array_t *ma, const char *name, size_t len,
+                                         struct metric_family_matches *fm)
+{
+	uint64_t     hash = utils_string_hash_len( (const unsigned char *)name, len);
+	unsigned int cell = hash % ma->family_size;
+	int          ret  = 0;
+
+	pthread_spin_lock(&ma->family_locks[cell]);
+
+	metric_family_t *f;
+
+	for(f = ma->families[cell]; f; f = f->next)
+	{
+		if( (f->hash == hash) && (f->basename_len == len) && !strncmp(f->basename, name, len) )
+		{
+			ret = __metric_family_matches_push(f, fm);
+			break;
+		}
+	}
+
+	pthread_spin_unlock(&ma->family_locks[cell]);
+
+	return ret;
+}
+
+/* Histogram families whose samples may start with the prefix: they are
+   named without the suffix of their samples, shorter than the prefix */
+static int __metric_family_matches_histograms(metric_array_t *ma, const metric_filter_pattern_t *p, size_t basename_len,
+                                              struct metric_family_matches *fm)
+{
+	size_t len;
+	int    i;
+
+	for(len = 1; len < basename_len; len++)
+	{
+		if(p->prefix[len] != '_')
+		{
+			continue;
+		}
+
+		size_t rest = basename_len - len;
+
+		for(i = 0; i < 3; i++)
+		{
+			size_t suffix_len = strlen(__histogram_suffix[i]);
+
+			/* Reaching the labels the whole suffix is known */
+			if( ( (basename_len < p->prefix_len) ? (rest == suffix_len) : (rest <= suffix_len) )
+			    && !strncmp(p->prefix + len, __histogram_suffix[i], rest) )
+			{
+				if(__metric_family_matches_exact(ma, p->prefix, len, fm) )
+				{
+					return 1;
+				}
+
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Families which may hold series matching a pattern */
+static int __metric_family_matches_collect(metric_array_t *ma, const metric_filter_pattern_t *p,
+                                           struct metric_family_matches *fm)
+{
+	size_t basename_len = strcspn(p->prefix, "{");
+
+	if(__metric_family_matches_histograms(ma, p, basename_len, fm) )
+	{
+		return 1;
+	}
+
+	if(basename_len < p->prefix_len)
+	{
+		/* The prefix reaches the labels: a single family */
+		return __metric_family_matches_exact(ma, p->prefix, basename_len, fm);
+	}
+
+	pthread_spin_lock(&ma->index_lock);
+	int ret = metric_trie_walk_prefix(&ma->family_index, p->prefix, p->prefix_len, __metric_family_matches_push, fm);
+	pthread_spin_unlock(&ma->index_lock);
+
+	return ret;
+}
+
+int metric_array_snapshot_take_filtered(metric_array_t *ma, metric_array_snapshot_t *snap, const metric_filter_t *filter)
+{
+	if(!filter || !filter->count)
+	{
+		return metric_array_snapshot_take(ma, snap);
+	}
+
+	/* Grows with the matches */
+	if(__metric_array_snapshot_begin(ma, snap, 64) )
+	{
+		return 1;
+	}
+
+	metric_t **buckets = __metric_array_buckets(ma);
+
+	if(!buckets)
+	{
+		return 0;
+	}
+
+	if(!ma->families)
+	{
+		if(__metric_array_snapshot_buckets(ma, snap, buckets, filter) )
+		{
+			metric_array_snapshot_release(snap);
+			return 1;
+		}
+
+		__metric_array_snapshot_end(snap);
+
+		return 0;
+	}
+
+	/* Families are only freed once the read section of
+	   the snapshot is over: no need to pin them */
+	struct metric_family_matches fm = { 0 };
+
+	unsigned int i;
+	int          ret = 0;
+
+	for(i = 0; !ret && (i < filter->count); i++)
+	{
+		ret = __metric_family_matches_collect(ma, &filter->patterns[i], &fm);
+	}
+
+	if(!ret && (1 < filter->count) )
+	{
+		/* Patterns may overlap */
+		qsort(fm.families, fm.count, sizeof(metric_family_t *), __metric_family_compare);
+
+		uint64_t j, unique = 0;
+
+		for(j = 0; j < fm.count; j++)
+		{
+			if(!unique || (fm.families[unique - 1] != fm.families[j]) )
+			{
+				fm.families[unique++] = fm.families[j];
+			}
+		}
+
+		fm.count = unique;
+	}
+
+	uint64_t j;
+
+	for(j = 0; !ret && (j < fm.count); j++)
+	{
+		uint64_t count    = snap->count;
+		uint64_t rendered = snap->rendered;
+
+		while(!ret && __metric_array_snapshot_family(snap, fm.families[j], filter) )
+		{
+			ret = __metric_array_snapshot_grow(snap, count, rendered);
+		}
+	}
+
+	free(fm.families);
+
+	if(ret)
+	{
+		metric_array_snapshot_release(snap);
+		return 1;
+	}
+
+	__metric_array_snapshot_end(snap);
+
+	return 0;
+}
+
+metric_t *metric_array_get_or_register(metric_array_t *ma, const char *name, const char *doc, tau_metric_type_t type)
+{
+	metric_t *ret = metric_array_get(ma, name);
+
+	if(ret)
+	{
+		return ret;
+	}
+
+	if(ma->max_series && (ma->max_series <= __atomic_load_n(&ma->count, __ATOMIC_RELAXED) ) )
+	{
+		/* Do not allocate when we already know it is refused */
+		__atomic_add_fetch(&ma->rejected, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	metric_t *new_metric = metric_init(name, doc, type);
+
+	if(!new_metric)
+	{
+		return NULL;
+	}
+
+	if(metric_array_register(ma, new_metric) )
+	{
+		/* Raced or over budget */
+		metric_release(new_metric);
+	}
+
+	return metric_array_get(ma, name);
+}
+
+int metric_array_count(metric_array_t * ma)
+{
+	/* Maintained by register and evict, no need to walk the buckets */
+	return (int)__atomic_load_n(&ma->count, __ATOMIC_RELAXED);
+}
+
+size_t metric_array_footprint(metric_array_t * ma)
+{
+	return __atomic_load_n(&ma->footprint, __ATOMIC_RELAXED);
+}
+
+int metric_array_history(metric_array_t *ma, const char *name, double start, double end,
+                         tau_metric_history_sample_t **samples, size_t *count)
+{
+	*samples = NULL;
+	*count   = 0;
+
+	int token = metric_array_read_lock(ma);
+
+	metric_t *m = metric_array_get(ma, name);
+
+	if(!m || !m->history)
+	{
+		metric_array_read_unlock(ma, token);
+		return 1;
+	}
+
+	/* Size outside of the spinlock, samples recorded
+	   meanwhile are simply left for the next read */
+	pthread_spin_lock(&m->lock);
+	size_t max = metric_history_count(m->history);
+	pthread_spin_unlock(&m->lock);
+
+	if(max)
+	{
+		*samples = malloc(max * sizeof(tau_metric_history_sample_t) );
+
+		if(!*samples)
+		{
+			tau_metric_proxy_perror("malloc");
+			metric_array_read_unlock(ma, token);
+			return 1;
+		}
+
+		pthread_spin_lock(&m->lock);
+		*count = metric_history_read(m->history, start, end, *samples, max);
+		pthread_spin_unlock(&m->lock);
+	}
+
+	metric_array_read_unlock(ma, token);
+
+	return 0;
+}
+
+
+/*************************
+ * NODE SERIES EVICTION  *
+ *************************/
+
+static int __compare_ts(const void *pa, const void *pb)
+{
+	double a = *( (const double *)pa);
+	double b = *( (const double *)pb);
+
+	return (a > b) - (a < b);
+}
+
+/* Returns the update time under which series have to go
+   to keep at most max_series series (-1 if not needed) */
+static double __metric_array_lru_cutoff(metric_array_t *ma, metric_t **buckets, uint64_t max_series)
+{
+	uint64_t count = __atomic_load_n(&ma->count, __ATOMIC_RELAXED);
+
+	if(!max_series || (count <= max_series) )
+	{
+		return -1;
+	}
+
+	/* Some slack for newcomers while we walk */
+	double * stamps = malloc( (count + 64) * sizeof(double) );
+
+	if(!stamps)
+	{
+		tau_metric_proxy_perror("malloc");
+		return -1;
+	}
+
+	uint64_t     seen = 0;
+	unsigned int i;
+
+	for(i = 0; (i < ma->size) && (seen < count + 64); i++)
+	{
+		pthread_spin_lock(&ma->locks[i]);
+
+		metric_t *m = buckets[i];
+
+		while(m && (seen < count + 64) )
+		{
+			if(!m->pinned)
+			{
+				stamps[seen++] = m->last_ts;
+			}
+
+			m = m->next;
+		}
+
+		pthread_spin_unlock(&ma->locks[i]);
+	}
+
+	double cutoff = -1;
+
+	if(max_series < seen)
+	{
+		qsort(stamps, seen, sizeof(double), __compare_ts);
+		/* Everything up to this one goes */
+		cutoff = stamps[seen - max_series - 1];
+	}
+
+	free(stamps);
+
+	return cutoff;
+}
+
+uint64_t metric_array_evict(metric_array_t *ma, double ttl, uint64_t max_series)
+{
+	metric_t **buckets = __metric_array_buckets(ma);
+
+	if(!buckets)
+	{
+		return 0;
+	}
+
+	double stale_cutoff = ttl ? (utils_get_ts() - ttl) : -1;
+	double lru_cutoff   = __metric_array_lru_cutoff(ma, buckets, max_series);
+	double cutoff       = (stale_cutoff < lru_cutoff) ? lru_cutoff : stale_cutoff;
+
+	if(cutoff < 0)
+	{
+		return 0;
+	}
+
+	/* Unlink under the bucket locks so that walkers never see freed
+	   metrics and keep them aside until lookups are done with them */
+	metric_t *evicted = NULL;
+	uint64_t  ret     = 0;
+	unsigned int i;
+
+	metric_family_t *empty_families = NULL;
+
+	for(i = 0; i < ma->size; i++)
+	{
+		pthread_spin_lock(&ma->locks[i]);
+
+		metric_t **prev = &buckets[i];
+
+		while(*prev)
+		{
+			metric_t *m = *prev;
+
+			if(!m->pinned && (m->last_ts <= cutoff) )
+			{
+				*prev   = m->next;
+				m->next = evicted;
+				evicted = m;
+				ret++;
+
+				metric_family_t *empty = __metric_family_leave(ma, m);
+
+				if(empty)
+				{
+					empty->next    = empty_families;
+					empty_families = empty;
+				}
+
+				continue;
+			}
+
+			prev = &m->next;
+		}
+
+		pthread_spin_unlock(&ma->locks[i]);
+	}
+
+	if(!ret)
+	{
+		return 0;
+	}
+
+	__atomic_sub_fetch(&ma->count, ret, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&ma->footprint, ret * sizeof(metric_t), __ATOMIC_RELAXED);
+	/* Newcomers may be accepted again */
+	__atomic_store_n(&ma->overflowed, 0, __ATOMIC_RELAXED);
+
+	utils_epoch_synchronize(&ma->epoch);
+
+	while(evicted)
+	{
+		metric_t *to_free = evicted;
+		evicted = evicted->next;
+		metric_release(to_free);
+	}
+
+	while(empty_families)
+	{
+		metric_family_t *to_free = empty_families;
+		empty_families = empty_families->next;
+		__metric_family_free(to_free);
+	}
+
+	tau_metric_proxy_log_verbose("Evicted %ld series", ret);
+
+	return ret;
+}
+
+static metric_array_eviction_t __metric_eviction = { 0 };
+
+metric_t *metric_array_get_pinned(const char *name, const char *doc, tau_metric_type_t type)
+{
+	metric_array_t *ma = metric_array_get_main();
+
+	metric_t *new_metric = metric_init(name, doc, type);
+
+	if(!new_metric)
+	{
+		return NULL;
+	}
+
+	/* Pinned before being published so that the evictor never reclaims it */
+	new_metric->pinned = 1;
+
+	if(__metric_array_register(ma, new_metric, 1) )
+	{
+		/* Already there, it is now pinned too */
+		metric_release(new_metric);
+	}
+
+	return metric_array_get(ma, name);
+}
+
+static void *__eviction_thread(void *dummy)
+{
+	metric_array_t *ma = metric_array_get_main();
+
+	/* Check often enough for the TTL to be respected */
+	double period = 5.0;
+
+	if(__metric_eviction.ttl && (__metric_eviction.ttl / 4 < period) )
+	{
+		period = __metric_eviction.ttl / 4;
+	}
+
+	while(__metric_eviction.running)
+	{
+		__metric_eviction.evicted += metric_array_evict(ma, __metric_eviction.ttl, __metric_eviction.max_series);
+
+		metric_set(__metric_eviction.series_metric, __atomic_load_n(&ma->count, __ATOMIC_RELAXED) );
+		metric_set(__metric_eviction.evicted_metric, __metric_eviction.evicted);
+		metric_set(__metric_eviction.rejected_metric, __atomic_load_n(&ma->rejected, __ATOMIC_RELAXED) );
+		metric_set(__metric_eviction.history_metric, metric_history_total_bytes() );
+
+		double end = utils_get_ts() + period;
+
+		while(__metric_eviction.running && (utils_get_ts() < end) )
+		{
+			usleep(10000);
+		}
+	}
+
+	return NULL;
+}
+
+int metric_array_eviction_start(double ttl, uint64_t max_series)
+{
+	__metric_eviction.ttl        = ttl;
+	__metric_eviction.max_series = max_series;
+	__metric_eviction.evicted    = 0;
+
+	__metric_eviction.series_metric   = metric_array_get_pinned("tau_proxy_series", "Number of series in the node array", TAU_METRIC_GAUGE);
+	__metric_eviction.evicted_metric  = metric_array_get_pinned("tau_proxy_series_evicted_total", "Number of stale or least recently updated series dropped", TAU_METRIC_COUNTER);
+	__metric_eviction.rejected_metric = metric_array_get_pinned("tau_proxy_series_rejected_total", "Number of new series refused by the cardinality guard", TAU_METRIC_COUNTER);
+	__metric_eviction.history_metric  = metric_array_get_pinned("tau_proxy_history_bytes", "Memory held by the compressed series history", TAU_METRIC_GAUGE);
+
+	if(!__metric_eviction.series_metric || !__metric_eviction.evicted_metric || !__metric_eviction.rejected_metric || !__metric_eviction.history_metric)
+	{
+		return 1;
+	}
+
+	__metric_eviction.running = 1;
+
+	if(pthread_create(&__metric_eviction.thread, NULL, __eviction_thread, NULL) )
+	{
+		tau_metric_proxy_perror("pthread_create");
+		__metric_eviction.running = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+int metric_array_eviction_stop(void)
+{
+	if(!__metric_eviction.running)
+	{
+		return 0;
+	}
+
+	__metric_eviction.running = 0;
+	pthread_join(__metric_eviction.thread, NULL);
+
+	return 0;
+}
+
+/*************************
+ * PER JOB METRIC ARRAYS *
+ *************************/
+
+metric_array_list_t __metric_array_list;
+
+metric_array_list_entry_t * metric_array_list_entry_init(tau_metric_job_descriptor_t * desc)
+{
+	metric_array_list_entry_t * ret = malloc(sizeof(metric_array_list_entry_t));
+
+	if(!ret)
+	{
+		perror("malloc");
+		return NULL;
+	}
+
+	metric_array_init_sized(&ret->array, METRIC_ARRAY_JOB_SIZE, __metric_array_list.job_max_footprint);
+
+	/* Job scrapes are exposed by family too */
+	if(metric_array_set_families(&ret->array, METRIC_ARRAY_JOB_SIZE) )
+	{
+		free(ret);
+		return NULL;
+	}
+
+	ret->refcount = 0;
+	ret->next = NULL;
+	memcpy(&ret->desc, desc, sizeof(tau_metric_job_descriptor_t));
+	ret->hash = utils_string_hash((const unsigned char *)ret->desc.jobid);
+
+	tau_metric_proxy_log_verbose("New Job entry %p", ret);
+
+	return ret;
+}
+
+int metric_array_list_entry_release(metric_array_list_entry_t * malie)
+{
+	if(!malie)
+	{
+		return 1;
+	}
+
+	metric_array_release(&malie->array);
+	free(malie);
+
+	return 0;
+}
+
+static inline size_t __metric_array_list_entry_footprint(metric_array_list_entry_t * malie)
+{
+	return sizeof(metric_array_list_entry_t) + metric_array_footprint(&malie->array);
+}
+
+/* Leaving jobs go through a FIFO drained by a single writer thread
+   so that slow profile writes never stall clients in the proxy */
+
+static void __metric_array_list_synchronize(void);
+
+static inline void __dump_queue_update_metrics(metric_array_list_dump_queue_t *q)
+{
+	if(q->depth_metric)
+	{
+		metric_set(q->depth_metric, q->depth);
+	}
+
+	if(q->bytes_metric)
+	{
+		metric_set(q->bytes_metric, q->footprint);
+	}
+}
+
+/* Hands the entry to the writer without ever waiting for it: clients
+   and scrapes end jobs, over budget the dump is dropped and the writer
+   only frees the entry (a single job larger than the budget still goes
+   through). Returns 1 when the writer is not running, the caller then
+   dumps the entry itself */
+static int __dump_queue_push(metric_array_list_dump_queue_t *q, metric_array_list_entry_t *ent)
+{
+	size_t footprint = __metric_array_list_entry_footprint(ent);
+
+	pthread_mutex_lock(&q->lock);
+
+	if(!q->running)
+	{
+		pthread_mutex_unlock(&q->lock);
+		return 1;
+	}
+
+	if(q->depth && (q->max_footprint < q->footprint + footprint) )
+	{
+		tau_metric_proxy_error("Dropping the profile of job %s: %ld bytes of ended jobs are waiting for their dump",
+		                       ent->desc.jobid, q->footprint);
+
+		/* Freed by the writer as lookups may still walk through it */
+		ent->dump_next = q->discarded;
+		q->discarded   = ent;
+
+		pthread_cond_signal(&q->not_empty);
+		pthread_mutex_unlock(&q->lock);
+
+		if(q->dropped_metric)
+		{
+			tau_metric_event_t ev = { .value = 1 };
+			metric_update(q->dropped_metric, &ev);
+		}
+
+		return 0;
+	}
+
+	ent->dump_next = NULL;
+
+	if(q->tail)
+	{
+		q->tail->dump_next = ent;
+	}
+	else
+	{
+		q->head = ent;
+	}
+
+	q->tail = ent;
+	q->depth++;
+	q->footprint += footprint;
+
+	__dump_queue_update_metrics(q);
+
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+static void __dump_queue_process(metric_array_list_dump_queue_t *q, metric_array_list_entry_t *ent)
+{
+	int ret = 0;
+
+	if(__metric_array_list.release_callback)
+	{
+		ret = (__metric_array_list.release_callback)(&ent->desc, &ent->array);
+	}
+
+	double latency = utils_get_ts() - ent->released_ts;
+
+	tau_metric_proxy_log_verbose("Job %s dumped %g seconds after it ended", ent->desc.jobid, latency);
+
+	if(ret)
+	{
+		tau_metric_proxy_error("Failed to save metrics for job %s", ent->desc.jobid);
+
+		if(q->failure_metric)
+		{
+			tau_metric_event_t ev = { .value = 1 };
+			metric_update(q->failure_metric, &ev);
+		}
+	}
+
+	if(q->count_metric)
+	{
+		tau_metric_event_t ev = { .value = 1 };
+		metric_update(q->count_metric, &ev);
+	}
+
+	if(q->latency_metric)
+	{
+		metric_set(q->latency_metric, latency);
+	}
+
+	/* Wait for lookups which may still walk through the entry */
+	__metric_array_list_synchronize();
+
+	metric_array_list_entry_release(ent);
+}
+
+/* Frees the dropped entries, called and returning with the queue lock */
+static void __dump_queue_discard(metric_array_list_dump_queue_t *q)
+{
+	metric_array_list_entry_t *ent = q->discarded;
+	q->discarded = NULL;
+
+	pthread_mutex_unlock(&q->lock);
+
+	/* Wait for lookups which may still walk through the entries */
+	__metric_array_list_synchronize();
+
+	while(ent)
+	{
+		metric_array_list_entry_t *to_free = ent;
+		ent = ent->dump_next;
+		metric_array_list_entry_release(to_free);
+	}
+
+	pthread_mutex_lock(&q->lock);
+}
+
+static void *__dump_queue_writer(void *pq)
+{
+	metric_array_list_dump_queue_t *q = (metric_array_list_dump_queue_t *)pq;
+
+	pthread_mutex_lock(&q->lock);
+
+	while(1)
+	{
+		while(q->running && !q->head && !q->discarded)
+		{
+			pthread_cond_wait(&q->not_empty, &q->lock);
+		}
+
+		if(q->discarded)
+		{
+			__dump_queue_discard(q);
+			continue;
+		}
+
+		if(!q->head)
+		{
+			/* Stopped and drained */
+			break;
+		}
+
+		metric_array_list_entry_t *ent = q->head;
+		q->head = ent->dump_next;
+
+		if(!q->head)
+		{
+			q->tail = NULL;
+		}
+
+		/* Entry still counts in depth and footprint until written */
+		size_t footprint = __metric_array_list_entry_footprint(ent);
+
+		pthread_mutex_unlock(&q->lock);
+		__dump_queue_process(q, ent);
+		pthread_mutex_lock(&q->lock);
+
+		q->depth--;
+		q->footprint -= footprint;
+		__dump_queue_update_metrics(q);
 	}
 
-	return 0;
-}
+	pthread_mutex_unlock(&q->lock);
 
-/******************************
-* METRICS STORAGE DEFINITION *
-******************************/
+	return NULL;
+}
 
-metric_array_t * metric_array_get_main(void)
+static int __dump_queue_init(metric_array_list_dump_queue_t *q)
 {
-	static metric_array_t __metric_array;
-	return &__metric_array;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	q->head          = NULL;
+	q->tail          = NULL;
+	q->discarded     = NULL;
+	q->depth         = 0;
+	q->footprint     = 0;
+	q->max_footprint = METRIC_ARRAY_LIST_DUMP_QUEUE_FOOTPRINT;
+
+	q->depth_metric   = metric_array_get_pinned("tau_proxy_dump_queue_depth", "Number of ended jobs waiting for their profile dump", TAU_METRIC_GAUGE);
+	q->bytes_metric   = metric_array_get_pinned("tau_proxy_dump_queue_bytes", "Memory held by ended jobs waiting for their profile dump", TAU_METRIC_GAUGE);
+	q->latency_metric = metric_array_get_pinned("tau_proxy_dump_latency_seconds", "Time between the end of a job and the end of its profile dump", TAU_METRIC_GAUGE);
+	q->count_metric   = metric_array_get_pinned("tau_proxy_dumps_total", "Number of job profile dumps processed", TAU_METRIC_COUNTER);
+	q->failure_metric = metric_array_get_pinned("tau_proxy_dump_failures_total", "Number of job profile dumps which failed", TAU_METRIC_COUNTER);
+	q->dropped_metric = metric_array_get_pinned("tau_proxy_dumps_dropped_total", "Number of job profile dumps dropped while the dump queue was over its memory budget", TAU_METRIC_COUNTER);
+
+	q->running = 1;
+
+	if(pthread_create(&q->writer, NULL, __dump_queue_writer, (void *)q) )
+	{
+		tau_metric_proxy_perror("pthread_create");
+		q->running = 0;
+		return 1;
+	}
+
+	return 0;
 }
 
-int metric_array_init(metric_array_t *ma)
+static void __dump_queue_release(metric_array_list_dump_queue_t *q)
 {
-	int i;
+	pthread_mutex_lock(&q->lock);
+	int was_running = q->running;
+	q->running = 0;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
 
-	for(i = 0; i < METRIC_ARRAY_SIZE; i++)
+	if(was_running)
 	{
-		pthread_spin_init(&ma->locks[i], 0);
-		ma->metrics[i] = NULL;
+		/* The writer drains what is left before leaving */
+		pthread_join(q->writer, NULL);
 	}
-
-	return 0;
 }
 
-int metric_array_release(metric_array_t *ma)
+void metric_array_list_init(metric_array_list_release_callback_t release_callback, size_t job_max_footprint)
 {
 	int i;
 
-
-	for(i = 0; i < METRIC_ARRAY_SIZE; i++)
+	for(i = 0; i < METRIC_ARRAY_LIST_SIZE; i++)
 	{
-		pthread_spin_lock(&ma->locks[i]);
-
-		metric_t *m = ma->metrics[i];
+		pthread_spin_init(&__metric_array_list.locks[i], 0);
+		__metric_array_list.heads[i] = NULL;
+	}
 
-		while(m)
-		{
-			metric_t *to_free = m;
-			m = m->next;
-			metric_release(to_free);
-		}
+	utils_epoch_init(&__metric_array_list.epoch);
 
-		ma->metrics[i] = NULL;
+	__metric_array_list.job_max_footprint = job_max_footprint;
+	__metric_array_list.release_callback = release_callback;
 
-		pthread_spin_unlock(&ma->locks[i]);
+	if(__dump_queue_init(&__metric_array_list.dump_queue) )
+	{
+		tau_metric_proxy_error("Could not start the job dump writer, dumps are done inline");
 	}
-
-	return 0;
 }
 
-int metric_array_iterate(metric_array_t *ma, int (*callback)(metric_t *m, void *arg), void *arg)
+void metric_array_list_release(void)
 {
 	int i;
 
-	for(i = 0; i < METRIC_ARRAY_SIZE; i++)
+	__dump_queue_release(&__metric_array_list.dump_queue);
+
+	for(i = 0; i < METRIC_ARRAY_LIST_SIZE; i++)
 	{
-		pthread_spin_lock(&ma->locks[i]);
+		pthread_spin_lock(&__metric_array_list.locks[i]);
 
-		metric_t *m = ma->metrics[i];
+		metric_array_list_entry_t *tmp = __metric_array_list.heads[i];
+		__metric_array_list.heads[i] = NULL;
 
-		int done = 0;
+		pthread_spin_unlock(&__metric_array_list.locks[i]);
 
-		while(m && !done)
+		while(tmp)
 		{
-			pthread_spin_lock(&m->lock);
-			done = (callback)(m, arg);
-			pthread_spin_unlock(&m->lock);
-			m = m->next;
+			metric_array_list_entry_t *to_free = tmp;
+			tmp = tmp->next;
+			metric_array_list_entry_release(to_free);
 		}
-
-		pthread_spin_unlock(&ma->locks[i]);
 	}
+}
 
-	return 0;
+int metric_array_list_read_lock(void)
+{
+	return utils_epoch_enter(&__metric_array_list.epoch);
+}
+
+void metric_array_list_read_unlock(int token)
+{
+	utils_epoch_exit(&__metric_array_list.epoch, token);
 }
 
-static inline metric_t *__metric_array_get(metric_array_t *ma,const char *name)
+static void __metric_array_list_synchronize(void)
 {
-	uint64_t hash = utils_string_hash((const unsigned char *)name);
+	utils_epoch_synchronize(&__metric_array_list.epoch);
+}
 
-	metric_t *m = ma->metrics[hash % METRIC_ARRAY_SIZE];
+static inline metric_array_list_entry_t * __metric_array_list_lookup(const char * jobid, uint64_t hash)
+{
+	metric_array_list_entry_t *tmp = __atomic_load_n(&__metric_array_list.heads[hash % METRIC_ARRAY_LIST_SIZE], __ATOMIC_ACQUIRE);
 
-	while(m)
+	while(tmp)
 	{
-		if(!strncmp(m->name, name, METRIC_STRING_SIZE) )
+		/* Skip leaving jobs they are only waiting to be unlinked */
+		if( (tmp->hash == hash) && __atomic_load_n(&tmp->refcount, __ATOMIC_ACQUIRE) && !strcmp(jobid, tmp->desc.jobid) )
 		{
-			return m;
+			return tmp;
 		}
-		m = m->next;
+
+		tmp = __atomic_load_n(&tmp->next, __ATOMIC_ACQUIRE);
 	}
 
 	return NULL;
 }
 
-metric_t *metric_array_get(metric_array_t *ma, const char *name)
+metric_array_list_entry_t * metric_array_list_get_no_lock(const char * jobid)
 {
-	metric_t *ret = NULL;
+	return __metric_array_list_lookup(jobid, utils_string_hash((const unsigned char *)jobid) );
+}
+
+uint64_t metric_array_list_count(void)
+{
+	uint64_t ret = 0;
+	int i;
+
+	int token = metric_array_list_read_lock();
+
+	for(i = 0; i < METRIC_ARRAY_LIST_SIZE; i++)
+	{
+		metric_array_list_entry_t *tmp = __atomic_load_n(&__metric_array_list.heads[i], __ATOMIC_ACQUIRE);
+
+		while(tmp)
+		{
+			/* Leaving jobs only wait to be unlinked */
+			if(__atomic_load_n(&tmp->refcount, __ATOMIC_ACQUIRE) )
+			{
+				ret++;
+			}
 
-	uint64_t hash = utils_string_hash((const unsigned char *)name);
+			tmp = __atomic_load_n(&tmp->next, __ATOMIC_ACQUIRE);
+		}
+	}
 
-	pthread_spin_lock(&ma->locks[hash % METRIC_ARRAY_SIZE]);
-	ret = __metric_array_get(ma, name);
-	pthread_spin_unlock(&ma->locks[hash % METRIC_ARRAY_SIZE]);
+	metric_array_list_read_unlock(token);
 
 	return ret;
 }
 
-int metric_array_register(metric_array_t *ma, metric_t *m)
+size_t metric_array_list_footprint(void)
 {
-	uint64_t hash = utils_string_hash((const unsigned char *)m->name);
+	size_t ret = 0;
+	int i;
 
-	pthread_spin_lock(&ma->locks[hash % METRIC_ARRAY_SIZE]);
+	int token = metric_array_list_read_lock();
 
-	if(__metric_array_get(ma, m->name) )
+	for(i = 0; i < METRIC_ARRAY_LIST_SIZE; i++)
 	{
-		//fprintf(stderr, "Metric %s is already registered\n", m->name);
-		pthread_spin_unlock(&ma->locks[hash % METRIC_ARRAY_SIZE]);
-		return 1;
-	}
-
-	unsigned int cell = hash % METRIC_ARRAY_SIZE;
+		metric_array_list_entry_t *tmp = __atomic_load_n(&__metric_array_list.heads[i], __ATOMIC_ACQUIRE);
 
-	m->next = ma->metrics[cell];
-	ma->metrics[cell] = m;
+		while(tmp)
+		{
+			ret += __metric_array_list_entry_footprint(tmp);
+			tmp = __atomic_load_n(&tmp->next, __ATOMIC_ACQUIRE);
+		}
+	}
 
-	pthread_spin_unlock(&ma->locks[hash % METRIC_ARRAY_SIZE]);
+	metric_array_list_read_unlock(token);
 
-	return 0;
+	return ret;
 }
 
-
-static int __count_metrics(metric_t *m, void *arg)
+static int __metric_array_list_job_compare(const void *pa, const void *pb)
 {
-	int * v = (int*)arg;
-	*v = *v + 1;
+	const metric_array_list_job_t *a = (const metric_array_list_job_t *)pa;
+	const metric_array_list_job_t *b = (const metric_array_list_job_t *)pb;
 
-	return 0;
+	return strcmp(a->desc.jobid, b->desc.jobid);
 }
 
-int metric_array_count(metric_array_t * ma)
+int metric_array_list_jobs(metric_array_list_job_t **jobs, size_t *count)
 {
-	/* Fist get the metric count */
-	int metric_count = 0;
+	metric_array_list_job_t *ret      = NULL;
+	size_t                   capacity = 0;
+	int                      i;
 
-	if( metric_array_iterate(ma, __count_metrics, &metric_count) != 0)
+	*jobs  = NULL;
+	*count = 0;
+
+	int token = metric_array_list_read_lock();
+
+	for(i = 0; i < METRIC_ARRAY_LIST_SIZE; i++)
 	{
-		return 1;
-	}
+		metric_array_list_entry_t *tmp = __atomic_load_n(&__metric_array_list.heads[i], __ATOMIC_ACQUIRE);
 
-	return metric_count;
-}
+		for(; tmp; tmp = __atomic_load_n(&tmp->next, __ATOMIC_ACQUIRE) )
+		{
+			uint64_t clients = __atomic_load_n(&tmp->refcount, __ATOMIC_ACQUIRE);
 
+			/* Leaving jobs are only waiting to be unlinked */
+			if(!clients)
+			{
+				continue;
+			}
 
-/*************************
- * PER JOB METRIC ARRAYS *
- *************************/
+			if(*count == capacity)
+			{
+				capacity = capacity ? capacity * 2 : 16;
 
-metric_array_list_entry_t * metric_array_list_entry_init(tau_metric_job_descriptor_t * desc)
-{
-	metric_array_list_entry_t * ret = malloc(sizeof(metric_array_list_entry_t));
+				metric_array_list_job_t *grown = realloc(ret, capacity * sizeof(metric_array_list_job_t) );
 
-	if(!ret)
-	{
-		perror("malloc");
-		return NULL;
-	}
+				if(!grown)
+				{
+					tau_metric_proxy_perror("realloc");
+					metric_array_list_read_unlock(token);
+					free(ret);
+					*count = 0;
+					return 1;
+				}
 
-	metric_array_init(&ret->array);
+				ret = grown;
+			}
 
-	ret->refcount = 0;
-	ret->next = NULL;
-	memcpy(&ret->desc, desc, sizeof(tau_metric_job_descriptor_t));
+			metric_array_list_job_t *job = &ret[(*count)++];
 
-	tau_metric_proxy_log_verbose("New Job entry %p", ret);
+			memcpy(&job->desc, &tmp->desc, sizeof(tau_metric_job_descriptor_t) );
+			job->clients   = clients;
+			job->series    = metric_array_count(&tmp->array);
+			job->footprint = __metric_array_list_entry_footprint(tmp);
+		}
+	}
 
-	return ret;
-}
+	metric_array_list_read_unlock(token);
 
-int metric_array_list_entry_release(metric_array_list_entry_t * malie)
-{
-	if(!malie)
+	if(*count)
 	{
-		return 1;
+		qsort(ret, *count, sizeof(metric_array_list_job_t), __metric_array_list_job_compare);
 	}
 
-	metric_array_release(&malie->array);
-	free(malie);
+	*jobs = ret;
 
 	return 0;
 }
 
-metric_array_list_t __metric_array_list;
-
-void metric_array_list_init(void (*release_callback)(tau_metric_job_descriptor_t *, metric_array_t *))
-{
-	pthread_spin_init(&__metric_array_list.lock, 0);
-	__metric_array_list.head = NULL;
-	__metric_array_list.release_callback = release_callback;
-}
-
-void metric_array_list_release(void)
+/* Take a reference unless the job is already leaving */
+static inline int __metric_array_list_entry_ref(metric_array_list_entry_t * ent)
 {
-	metric_array_list_entry_t *tmp = __metric_array_list.head;
-	
-	while(tmp)
-	{
-		metric_array_list_entry_t *to_free = tmp;
-		tmp = tmp->next;
-		metric_array_list_entry_release(to_free);
-	}
-}
+	uint64_t ref = __atomic_load_n(&ent->refcount, __ATOMIC_ACQUIRE);
 
-metric_array_list_entry_t * metric_array_list_get_no_lock(const char * jobid)
-{
-	metric_array_list_entry_t *tmp = __metric_array_list.head;
-	
-	while(tmp)
+	while(ref)
 	{
-		if(!strcmp(jobid, tmp->desc.jobid))
+		if(__atomic_compare_exchange_n(&ent->refcount, &ref, ref + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
 		{
-			return tmp;
+			return 1;
 		}
-		tmp = tmp->next;
 	}
 
-	return NULL;
+	return 0;
 }
 
 metric_array_t * metric_array_list_acquire(tau_metric_job_descriptor_t * desc)
 {
-	metric_array_t * ret = NULL;
-
 	if(!strlen(desc->jobid))
 	{
 		/* No data not much to be done */
 		return NULL;
 	}
 
-	pthread_spin_lock(&__metric_array_list.lock);
+	uint64_t hash = utils_string_hash((const unsigned char *)desc->jobid);
+	unsigned int cell = hash % METRIC_ARRAY_LIST_SIZE;
 
-	metric_array_list_entry_t * ent = metric_array_list_get_no_lock(desc->jobid);
+	/* Fast path the job is already known */
+	int token = metric_array_list_read_lock();
 
-	if(!ent)
+	metric_array_list_entry_t * ent = __metric_array_list_lookup(desc->jobid, hash);
+
+	if(ent && __metric_array_list_entry_ref(ent))
 	{
-		ent = metric_array_list_entry_init(desc);
-		ent->next = __metric_array_list.head;
-		__metric_array_list.head = ent;
+		metric_array_list_read_unlock(token);
+		tau_metric_proxy_log_verbose("Joining existing job %s ref %ld", ent->desc.jobid, ent->refcount);
+		return &ent->array;
 	}
-	else
+
+	metric_array_list_read_unlock(token);
+
+	/* Slow path create it unless somebody raced us in the bucket */
+	pthread_spin_lock(&__metric_array_list.locks[cell]);
+
+	ent = __metric_array_list_lookup(desc->jobid, hash);
+
+	if(ent && __metric_array_list_entry_ref(ent))
 	{
-		tau_metric_proxy_log_verbose("Joining existing job %s ref %ld", ent->desc.jobid, ent->refcount);
+		pthread_spin_unlock(&__metric_array_list.locks[cell]);
+		return &ent->array;
 	}
 
-	ent->refcount++;
+	ent = metric_array_list_entry_init(desc);
+
+	if(!ent)
+	{
+		pthread_spin_unlock(&__metric_array_list.locks[cell]);
+		return NULL;
+	}
 
-	ret = &ent->array;
+	ent->refcount = 1;
+	ent->next = __metric_array_list.heads[cell];
+	__atomic_store_n(&__metric_array_list.heads[cell], ent, __ATOMIC_RELEASE);
 
-	pthread_spin_unlock(&__metric_array_list.lock);
+	pthread_spin_unlock(&__metric_array_list.locks[cell]);
 
-	return ret;
+	return &ent->array;
 }
 
-int metric_array_list_relax(const char * jobid)
+metric_array_t * metric_array_list_get(const char * jobid)
 {
-	int ret = 1;
-
-	pthread_spin_lock(&__metric_array_list.lock);
+	int token = metric_array_list_read_lock();
 
 	metric_array_list_entry_t * ent = metric_array_list_get_no_lock(jobid);
 
-	if(ent)
+	if(ent && !__metric_array_list_entry_ref(ent))
 	{
-		ent->refcount--;
+		/* Leaving meanwhile */
+		ent = NULL;
+	}
 
-		tau_metric_proxy_log_verbose("Leaving job %s ref %ld", ent->desc.jobid, ent->refcount);
+	metric_array_list_read_unlock(token);
 
-		if(!ent->refcount)
-		{
-			tau_metric_proxy_log_verbose("Last do release job %s", ent->desc.jobid);
+	return ent ? &ent->array : NULL;
+}
 
-			__metric_array_list.head->desc.end_time = time(NULL);
+int metric_array_list_relax(const char * jobid)
+{
+	uint64_t hash = utils_string_hash((const unsigned char *)jobid);
+	unsigned int cell = hash % METRIC_ARRAY_LIST_SIZE;
 
-			if(__metric_array_list.release_callback)
-			{
-				(__metric_array_list.release_callback)(&ent->desc, &ent->array);
-			}
+	int token = metric_array_list_read_lock();
 
-			/* Now work on removing myself from the JOB ID list*/
-			if(!strcmp(jobid, __metric_array_list.head->desc.jobid))
-			{
-				/* First element is ours remove it */
-				__metric_array_list.head = __metric_array_list.head->next;
-			}
+	metric_array_list_entry_t * ent = __metric_array_list_lookup(jobid, hash);
 
-			metric_array_list_entry_t * tmp = __metric_array_list.head;
+	if(!ent)
+	{
+		metric_array_list_read_unlock(token);
+		return 1;
+	}
 
-			while(tmp)
-			{
-				if(tmp->next)
-				{
-					if(!strcmp(jobid, tmp->next->desc.jobid))
-					{
-						/* First element is ours remove it */
-						tmp->next = tmp->next->next;
-					}
-				}
-				tmp = tmp->next;
-			}
+	uint64_t ref = __atomic_sub_fetch(&ent->refcount, 1, __ATOMIC_ACQ_REL);
+
+	metric_array_list_read_unlock(token);
+
+	tau_metric_proxy_log_verbose("Leaving job %s ref %ld", ent->desc.jobid, ref);
+
+	if(ref)
+	{
+		return 0;
+	}
+
+	/* We dropped the last reference, nobody can take a new
+	   one so the entry is ours: unlink it from its bucket */
+	pthread_spin_lock(&__metric_array_list.locks[cell]);
 
-			metric_array_list_entry_release(ent);
+	metric_array_list_entry_t ** prev = &__metric_array_list.heads[cell];
+
+	while(*prev)
+	{
+		if(*prev == ent)
+		{
+			__atomic_store_n(prev, ent->next, __ATOMIC_RELEASE);
+			break;
 		}
+
+		prev = &(*prev)->next;
 	}
 
-	pthread_spin_unlock(&__metric_array_list.lock);
+	pthread_spin_unlock(&__metric_array_list.locks[cell]);
 
-	return ret;
+	tau_metric_proxy_log_verbose("Releasing job %s (%ld bytes of per-job metrics)", ent->desc.jobid, __metric_array_list_entry_footprint(ent));
+
+	ent->desc.end_time = time(NULL);
+	ent->released_ts = utils_get_ts();
+
+	metric_array_list_dump_queue_t *q = &__metric_array_list.dump_queue;
+
+	/* The writer now owns the entry, or it is not running */
+	if(__dump_queue_push(q, ent) )
+	{
+		__dump_queue_process(q, ent);
+	}
+
+	return 0;
 }
 
 /**********************
@@ -561,32 +3101,103 @@ static inline int __check_lock_file(const char * path_to_prof)
 metric_per_job_t __per_job_metric = { 0 };
 
 
-static int __wait_and_watch()
+static int __profile_watch_open(const char * path)
+{
+	if(utils_is_network_fs(path))
+	{
+		tau_metric_proxy_log("%s is on a network filesystem, scanning it every %g seconds", path, TAU_METRIC_PROFILE_POLL_PERIOD);
+		return -1;
+	}
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if(fd < 0)
+	{
+		tau_metric_proxy_perror("inotify_init1");
+		return -1;
+	}
+
+	/* Dumps are renamed once written, copied ones are closed */
+	if(inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		tau_metric_proxy_perror("inotify_add_watch");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Merges the notified dumps, returns 1 if events were lost */
+static int __profile_watch_process(int fd)
 {
-	int to_wait = 3 * 1e6;
-	unsigned int period = 1000;
+	char buff[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int lost = 0;
+	ssize_t len;
 
-	while(0 < to_wait)
+	while( 0 < (len = read(fd, buff, sizeof(buff))) )
 	{
-		if(!__per_job_metric.is_running)
+		char * p = buff;
+
+		while(p < buff + len)
 		{
-			return 1;
+			struct inotify_event * ev = (struct inotify_event *)p;
+
+			if(ev->mask & IN_Q_OVERFLOW)
+			{
+				lost = 1;
+			}
+			else if(ev->len && !(ev->mask & IN_ISDIR))
+			{
+				tau_metric_profile_store_ingest(ev->name);
+			}
+
+			p += sizeof(struct inotify_event) + ev->len;
 		}
-		usleep(period);
-		to_wait -= period;
 	}
 
-	return 0;
+	return lost;
 }
 
 static void * __profile_merger_thread(void * dummy)
 {
+	int fd = __profile_watch_open(__per_job_metric.path);
+	double period = (0 <= fd) ? TAU_METRIC_PROFILE_RESCAN_PERIOD : TAU_METRIC_PROFILE_POLL_PERIOD;
+
+	/* Dumps written before the watch started are scanned right away */
+	double next_scan = 0;
+	double next_lock = utils_get_ts() + TAU_METRIC_PROFILE_LOCK_PERIOD;
+
+	/* A negative descriptor is ignored and poll only sleeps */
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
 	while(__per_job_metric.is_running)
 	{
-		tau_metric_proxy_log_verbose("Scanning for new profiles");
-		__check_lock_file(__per_job_metric.path);
-		tau_metric_profile_store_consolidate();
-		__wait_and_watch();
+		double now = utils_get_ts();
+
+		if(next_lock <= now)
+		{
+			__check_lock_file(__per_job_metric.path);
+			next_lock = now + TAU_METRIC_PROFILE_LOCK_PERIOD;
+		}
+
+		if(next_scan <= now)
+		{
+			tau_metric_proxy_log_verbose("Scanning for new profiles");
+			tau_metric_profile_store_consolidate();
+			next_scan = now + period;
+		}
+
+		/* Wake up regularly to notice the release */
+		if( (0 < poll(&pfd, 1, 100)) && __profile_watch_process(fd) )
+		{
+			next_scan = 0;
+		}
+	}
+
+	if(0 <= fd)
+	{
+		close(fd);
 	}
 
 	return NULL;
@@ -624,13 +3235,15 @@ int metric_per_job_init(const char * path, int is_leader)
 			return 1;
 		}
 
-		if( pthread_create(&__per_job_metric.merger_thread, NULL, __profile_merger_thread, NULL) < 0)
+		/* Set before the thread checks it */
+		__per_job_metric.is_running = 1;
+
+		if( pthread_create(&__per_job_metric.merger_thread, NULL, __profile_merger_thread, NULL) )
 		{
-			tau_metric_proxy_perror("pthread_create");
+			__per_job_metric.is_running = 0;
+			tau_metric_proxy_error("Could not start the profile merger thread");
 			return 1;
 		}
-
-		__per_job_metric.is_running = 1;
 	}
 
 	return 0;
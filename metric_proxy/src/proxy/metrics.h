@@ -5,8 +5,13 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <time.h>
+#include <regex.h>
 
 #include "tau_metric_proxy_client.h"
+#include "utils.h"
+#include "history.h"
+#include "window.h"
+#include "trie.h"
 
 /****************************
 * METRIC TYPES DEFINITIONS *
@@ -32,10 +37,49 @@ typedef struct
 	double avg; /**< Moving Average value from contributors */
 }gauge_t;
 
+/***************************
+* METRIC STRING INTERNING *
+***************************/
+
+/**
+ * @brief Get a shared copy of a string (names and docs are
+ *        stored once for the node and per-job arrays)
+ *
+ * @param str the string to intern (truncated to METRIC_STRING_SIZE)
+ * @return const char* reference counted string NULL on error
+ */
+const char *metric_string_intern(const char *str);
+
+/**
+ * @brief Drop a reference on a string from @ref metric_string_intern
+ *
+ * @param str the interned string to release
+ */
+void metric_string_release(const char *str);
+
 /*********************
 * METRIC DEFINITION *
 *********************/
 
+/** Length in seconds of each sliding window */
+extern const double tau_metric_window_length[TAU_METRIC_WINDOW_COUNT];
+
+struct metric_family_s;
+
+/** Room for the text of a value in the exposition */
+#define METRIC_VALUE_TEXT_SIZE 40
+
+/**
+ * @brief Exposition text of a value, re-rendered only when the metric changed
+ *
+ */
+typedef struct
+{
+	uint32_t version;                      /**< Metric version the text comes from */
+	uint32_t len;                          /**< Length of the text */
+	char     text[METRIC_VALUE_TEXT_SIZE]; /**< Value as exposed */
+}metric_render_t;
+
 /**
  * @brief This is the main storage for a metric
  *
@@ -43,10 +87,18 @@ typedef struct
 
 typedef struct metric_s
 {
-	char               name[METRIC_STRING_SIZE]; /**< Name of the given metric */
-	char               doc[METRIC_STRING_SIZE];  /**< Documentation of the metric */
+	const char *       name;                     /**< Name of the given metric (interned) */
+	const char *       doc;                      /**< Documentation of the metric (interned) */
 	tau_metric_type_t  type;                     /**< Type of the metric */
    double             last_ts;                  /**< Timestamp when last updated */
+	int                pinned;                   /**< Pinned metrics are never evicted */
+	metric_history_t * history;                  /**< Recent samples (NULL when disabled) */
+	metric_windows_t * windows;                  /**< Sliding window aggregates (NULL when disabled) */
+	uint32_t           name_len;                 /**< Length of the name (computed once) */
+	uint32_t           version;                  /**< Bumped on each update */
+	metric_render_t *  render;                   /**< Cached exposition text (allocated on first render) */
+	struct metric_family_s * family;             /**< Family of the series (NULL when not grouped) */
+	uint32_t           family_index;             /**< Position in the members of its family */
 	union
 	{
 		/* data */
@@ -63,16 +115,66 @@ int metric_release(metric_t *m);
 
 int metric_update(metric_t *m, tau_metric_event_t *event);
 
+/**
+ * @brief Overwrite the value of a metric (used for the proxy own gauges)
+ *
+ * @param m the metric to set
+ * @param value the new value
+ * @return int 0 on success
+ */
+int metric_set(metric_t *m, double value);
+
 
 metric_t * metric_from_snapshot(tau_metric_snapshot_t * snapshot);
 
 int metric_snapshot(metric_t *m, tau_metric_snapshot_t * snapshot);
 
+/**
+ * @brief Whether the values of a type only grow (counters and histogram samples)
+ *
+ * @param type the type of a metric
+ * @return int non zero for counters and histogram samples
+ */
+int metric_type_cumulative(tau_metric_type_t type);
+
+/**
+ * @brief Length of the family name of a series
+ *
+ * The family is the name without labels, histogram samples also lose
+ * their _bucket, _sum or _count suffix so that they share the family
+ * of the histogram.
+ *
+ * @param name the name of the series
+ * @param type its type
+ * @return uint32_t the length of its family name at the start of name
+ */
+uint32_t metric_family_basename_len(const char *name, tau_metric_type_t type);
+
 /******************************
 * METRICS STORAGE DEFINITION *
 ******************************/
 
-#define METRIC_ARRAY_SIZE    1024
+#define METRIC_ARRAY_SIZE        1024
+#define METRIC_ARRAY_JOB_SIZE    128
+#define METRIC_FAMILY_TABLE_SIZE 1024
+
+/**
+ * @brief Series sharing a name without labels
+ *
+ * Membership is maintained when series are registered and evicted so
+ * that the exposition never has to group series by itself.
+ */
+typedef struct metric_family_s
+{
+	const char *            basename;     /**< Interned name without labels */
+	uint32_t                basename_len; /**< Length of the basename */
+	uint64_t                hash;         /**< Hash of the basename */
+	metric_t **             members;      /**< Growable vector of series */
+	uint32_t                count;        /**< Number of members */
+	uint32_t                capacity;     /**< Allocated members */
+	pthread_spinlock_t      lock;         /**< Protects the members */
+	struct metric_family_s *next;         /**< Families are chained in their bucket */
+}metric_family_t;
 
 /**
  * @brief This is where metrics are stored server side
@@ -80,8 +182,26 @@ int metric_snapshot(metric_t *m, tau_metric_snapshot_t * snapshot);
  */
 typedef struct
 {
-	metric_t *         metrics[METRIC_ARRAY_SIZE];  /**< Hash table of metrics */
-	pthread_spinlock_t locks[METRIC_ARRAY_SIZE];    /**< Lock for each bucket */
+	unsigned int        size;          /**< Number of buckets */
+	metric_t **         metrics;       /**< Hash table of metrics (allocated on first register) */
+	pthread_spinlock_t *locks;         /**< Lock for each bucket */
+	pthread_spinlock_t  alloc_lock;    /**< Protects the lazy bucket allocation */
+	size_t              footprint;     /**< Bytes used by buckets and metrics */
+	size_t              max_footprint; /**< Memory budget in bytes (0 is unbounded) */
+	int                 overflowed;    /**< Set when the budget was reached once */
+	uint64_t            count;         /**< Number of series */
+	uint64_t            max_series;    /**< Cardinality guard (0 is unbounded) */
+	uint64_t            rejected;      /**< Registrations refused by the budget or the guard */
+	utils_epoch_t       epoch;         /**< Read sections protecting metrics from eviction */
+	uint64_t            snapshots;     /**< Snapshot generation counter */
+	metric_history_config_t history;   /**< History retention (disabled by default) */
+	int                 windows;       /**< Maintain sliding window aggregates (disabled by default) */
+	metric_family_t **  families;      /**< Hash table of families (NULL when not grouped) */
+	pthread_spinlock_t *family_locks;  /**< Lock for each family bucket */
+	unsigned int        family_size;   /**< Number of family buckets */
+	uint64_t            family_count;  /**< Number of families */
+	metric_trie_t       family_index;  /**< Families by basename for prefix lookups */
+	pthread_spinlock_t  index_lock;    /**< Protects the family index */
 }metric_array_t;
 
 /**
@@ -91,6 +211,16 @@ typedef struct
  */
 int metric_array_init(metric_array_t *ma);
 
+/**
+ * @brief Initialize a metric storage with a given geometry
+ *
+ * @param ma the array to initialize
+ * @param size number of hash buckets (allocated on first register)
+ * @param max_footprint memory budget in bytes (0 for unbounded)
+ * @return int 0 on success
+ */
+int metric_array_init_sized(metric_array_t *ma, unsigned int size, size_t max_footprint);
+
 /**
  * @brief Release metric storage
  *
@@ -98,6 +228,79 @@ int metric_array_init(metric_array_t *ma);
  */
 int metric_array_release(metric_array_t *ma);
 
+/**
+ * @brief Enter a read section on the array
+ *
+ * Metrics returned by @ref metric_array_get may be evicted and freed
+ * once the read section they were looked up in is over.
+ *
+ * @param ma the array to protect
+ * @return int token to pass to @ref metric_array_read_unlock
+ */
+int metric_array_read_lock(metric_array_t *ma);
+
+/**
+ * @brief Leave a read section on the array
+ *
+ * @param ma the array
+ * @param token value returned by @ref metric_array_read_lock
+ */
+void metric_array_read_unlock(metric_array_t *ma, int token);
+
+/**
+ * @brief Keep a compressed history of the series registered from now on
+ *
+ * @param ma the array
+ * @param retention seconds of samples to keep (0 disables)
+ * @param resolution seconds between two stored samples
+ * @param max_bytes compressed bytes kept per series
+ */
+void metric_array_set_history(metric_array_t *ma, double retention, double resolution, size_t max_bytes);
+
+/**
+ * @brief Maintain sliding window aggregates for the series registered from now on
+ *
+ * @param ma the array
+ * @param enabled non zero to enable
+ */
+void metric_array_set_windows(metric_array_t *ma, int enabled);
+
+/**
+ * @brief Group the series registered from now on by family
+ *
+ * Snapshots of a grouped array list the members of each family
+ * contiguously and filtered snapshots only visit the families
+ * which may match. The family tables are allocated along with the
+ * buckets, on the first registration.
+ *
+ * @param ma the array
+ * @param size number of family buckets
+ * @return int 0 on success
+ */
+int metric_array_set_families(metric_array_t *ma, unsigned int size);
+
+/**
+ * @brief Read the recent samples of a series
+ *
+ * @param ma the array to search
+ * @param name the series name
+ * @param start first timestamp in seconds (0 for the oldest)
+ * @param end last timestamp in seconds (0 for the newest)
+ * @param samples allocated sample array (to be freed by the caller)
+ * @param count number of samples
+ * @return int 0 on success 1 if the series is unknown or has no history
+ */
+int metric_array_history(metric_array_t *ma, const char *name, double start, double end,
+                         tau_metric_history_sample_t **samples, size_t *count);
+
+/**
+ * @brief Set the cardinality guard of an array
+ *
+ * @param ma the array
+ * @param max_series registrations fail past this number of series (0 is unbounded)
+ */
+void metric_array_set_max_series(metric_array_t *ma, uint64_t max_series);
+
 /**
  * @brief Get a metric from the metric array
  *
@@ -110,10 +313,42 @@ metric_t *metric_array_get(metric_array_t *ma, const char *name);
  * @brief Register a new metric
  *
  * @param m The new metric to register
- * @return int 1 if the metric is already present (same name); 0 on success
+ * @return int 1 if the metric is already present (same name); 2 if the array is over budget or full; 0 on success
  */
 int metric_array_register(metric_array_t *ma, metric_t *m);
 
+/**
+ * @brief Build the name of the series standing for a refused series
+ *
+ * @param buff output buffer of METRIC_STRING_SIZE
+ * @param name name of the refused series
+ * @return char* buff
+ */
+char *metric_fold_name(char *buff, const char *name);
+
+/**
+ * @brief Get the series standing for all the series of a family refused by the guard
+ *
+ * The folded series is named after the family with a tau_folded="true" label
+ * and is registered even when the array is full.
+ *
+ * @param name name of the refused series
+ * @param doc metric documentation (used only when registering)
+ * @param type metric type (used only when registering)
+ * @return metric_t* the folded series NULL on error
+ */
+metric_t *metric_array_get_folded(metric_array_t *ma, const char *name, const char *doc, tau_metric_type_t type);
+
+/**
+ * @brief Get a metric registering it if needed
+ *
+ * @param name metric name
+ * @param doc metric documentation (used only when registering)
+ * @param type metric type (used only when registering)
+ * @return metric_t* the metric NULL on error
+ */
+metric_t *metric_array_get_or_register(metric_array_t *ma, const char *name, const char *doc, tau_metric_type_t type);
+
 /**
  * @brief Scan all metrics invoking a callback
  *
@@ -123,14 +358,219 @@ int metric_array_register(metric_array_t *ma, metric_t *m);
  */
 int metric_array_iterate(metric_array_t *ma, int (*callback)(metric_t *m, void *arg), void *arg);
 
+/**
+ * @brief Frozen copy of the values of a series
+ *
+ */
+typedef struct
+{
+	const char *      name;    /**< Interned name (valid while the snapshot is held) */
+	const char *      doc;     /**< Interned doc (valid while the snapshot is held) */
+	tau_metric_type_t type;
+	double            last_ts;
+	double            value;   /**< Counter value or gauge average */
+	double            min;     /**< Gauge minimum */
+	double            max;     /**< Gauge maximum */
+	const tau_metric_window_stats_t * windows; /**< Window aggregates (NULL when disabled) */
+	uint32_t          name_len; /**< Length of the name */
+	const char *      family;   /**< Family basename (NULL when not grouped) */
+	uint32_t          family_len; /**< Length of the family basename */
+	uint32_t          text_len; /**< Length of the value text (0 if not rendered) */
+	char              text[METRIC_VALUE_TEXT_SIZE]; /**< Value text (when rendering) */
+}metric_snapshot_entry_t;
+
+/**
+ * @brief Flat copy of the numeric state of an array
+ *
+ * Values are copied series by series under their locks, the names are
+ * kept alive by a read section on the array: nothing is locked while
+ * the snapshot is being serialized.
+ */
+typedef struct
+{
+	metric_array_t *          array;
+	uint64_t                  epoch;    /**< Generation of the snapshot in its array */
+	double                    ts;       /**< When it was taken */
+	uint64_t                  count;    /**< Number of entries */
+	uint64_t                  capacity; /**< Allocated entries (kept between snapshots) */
+	metric_snapshot_entry_t * entries;
+	tau_metric_window_stats_t * windows; /**< Window aggregates of the entries (when enabled) */
+	int                       token;    /**< Read section pinning the names */
+	char *                    strings;  /**< Copies of the names once detached */
+	int                       render;   /**< Also copy the value texts (set before taking) */
+	uint64_t                  rendered; /**< Value texts re-rendered by the last take */
+	metric_render_t **        spare;    /**< Text caches for series rendered for the first time */
+	uint64_t                  spare_count; /**< Spare caches left */
+	uint64_t                  spare_batch; /**< Caches allocated by the last refill of this take */
+}metric_array_snapshot_t;
+
+/**
+ * @brief Take a snapshot of an array
+ *
+ * @param ma the array to copy
+ * Value texts are only rendered again for the series updated since the
+ * previous rendering, whichever snapshot did it. Members of a family
+ * are contiguous when the array groups families.
+ *
+ * @param snap a zeroed or previously released snapshot (its buffer is reused)
+ * @return int 0 on success
+ */
+int metric_array_snapshot_take(metric_array_t *ma, metric_array_snapshot_t *snap);
+
+/******************
+* SERIES FILTERS *
+******************/
+
+/** Patterns a filter can hold */
+#define METRIC_FILTER_MAX_PATTERNS 16
+
+/**
+ * @brief A series name pattern
+ *
+ * Plain patterns match the names they prefix, patterns with regular
+ * expression operators are POSIX extended expressions anchored at
+ * the start of the name.
+ */
+typedef struct
+{
+	char    prefix[METRIC_STRING_SIZE]; /**< Literal start of the matching names */
+	size_t  prefix_len;
+	int     is_regex;
+	regex_t regex;                      /**< Compiled expression (if is_regex) */
+}metric_filter_pattern_t;
+
+/**
+ * @brief Series matching any of a set of patterns
+ *
+ */
+typedef struct
+{
+	unsigned int            count;
+	metric_filter_pattern_t patterns[METRIC_FILTER_MAX_PATTERNS];
+}metric_filter_t;
+
+/**
+ * @brief Initialize an empty filter (which matches everything)
+ *
+ * @param f the filter to initialize
+ */
+void metric_filter_init(metric_filter_t *f);
+
+/**
+ * @brief Add a pattern to a filter
+ *
+ * @param f the filter
+ * @param pattern a name prefix or a regular expression
+ * @return int 0 on success 1 if the expression is invalid or the filter full
+ */
+int metric_filter_add(metric_filter_t *f, const char *pattern);
+
+/**
+ * @brief Check a series name against a filter
+ *
+ * @param f the filter
+ * @param name the series name
+ * @return int non zero if the name matches one of the patterns
+ */
+int metric_filter_match(const metric_filter_t *f, const char *name);
+
+/**
+ * @brief Free the expressions of a filter
+ *
+ * @param f the filter to release
+ */
+void metric_filter_release(metric_filter_t *f);
+
+/**
+ * @brief Take a snapshot of the series of an array matching a filter
+ *
+ * On arrays grouping families only the families whose basename may
+ * match are visited, looked up from the prefix of each pattern: the
+ * cost follows the number of matches instead of the array size.
+ *
+ * @param ma the array to copy
+ * @param snap a zeroed or previously released snapshot (its buffer is reused)
+ * @param filter the series to keep (NULL or empty for all of them)
+ * @return int 0 on success
+ */
+int metric_array_snapshot_take_filtered(metric_array_t *ma, metric_array_snapshot_t *snap, const metric_filter_t *filter);
+
+/**
+ * @brief Where a snapshot taken in parts stopped
+ *
+ */
+typedef struct
+{
+	unsigned int bucket;                     /**< Bucket to resume from */
+	char         family[METRIC_STRING_SIZE]; /**< Last family taken in the bucket ("" for none) */
+	int          cut;                        /**< The family was only taken up to member */
+	uint32_t     member;                     /**< First member left of a cut family */
+	int          done;                       /**< The whole array was taken */
+}metric_snapshot_cursor_t;
+
+/**
+ * @brief Take the next part of an array snapshot
+ *
+ * Families are taken whole while they fit in max_entries, a family
+ * larger than that is taken alone in slices of max_entries members.
+ * The read section only lasts for the part so that walking a large
+ * array in parts holds neither its names nor a copy of all of it.
+ * Series registered or dropped between two parts may be missed (or
+ * taken twice if dropped and registered again).
+ *
+ * @param ma the array to copy
+ * @param snap a zeroed or previously released snapshot (its buffer is reused)
+ * @param cursor zeroed for the first part, set to the next one on return
+ * @param max_entries entries of a part (buckets of arrays without families are taken whole)
+ * @return int 0 on success
+ */
+int metric_array_snapshot_take_part(metric_array_t *ma, metric_array_snapshot_t *snap, metric_snapshot_cursor_t *cursor,
+                                    uint64_t max_entries);
+
+/**
+ * @brief Release a snapshot (names are no longer valid, the buffer is kept)
+ *
+ * @param snap the snapshot to release
+ */
+void metric_array_snapshot_release(metric_array_snapshot_t *snap);
+
+/**
+ * @brief Copy the names of a snapshot and release it
+ *
+ * The entries stay valid without pinning the array: to be called
+ * before handing them to a peer which may be slow to read them.
+ *
+ * @param snap a taken snapshot
+ * @return int 0 on success (the snapshot is released in any case)
+ */
+int metric_array_snapshot_detach(metric_array_snapshot_t *snap);
+
+/**
+ * @brief Free the buffer of a released snapshot
+ *
+ * @param snap the snapshot to free
+ */
+void metric_array_snapshot_free(metric_array_snapshot_t *snap);
+
 /**
  * @brief Count the metrics in a give array
- * 
+ *
+ * This is a constant time read of the series counter, it may be
+ * stale by the time it returns: use a snapshot for an exact count
+ *
  * @param ma target metric array
  * @return int number of metrics
  */
 int metric_array_count(metric_array_t * ma);
 
+/**
+ * @brief Get the memory used by an array
+ *
+ * @param ma target metric array
+ * @return size_t bytes used by the buckets and the metrics
+ */
+size_t metric_array_footprint(metric_array_t * ma);
+
 /**
  * @brief Get the central metric array (the one per node)
  * 
@@ -138,6 +578,63 @@ int metric_array_count(metric_array_t * ma);
  */
 metric_array_t * metric_array_get_main(void);
 
+/*************************
+ * NODE SERIES EVICTION  *
+ *************************/
+
+/**
+ * @brief Drop stale and least recently updated series
+ *
+ * @param ma the array to prune
+ * @param ttl series not updated for ttl seconds are dropped (0 disables)
+ * @param max_series least recently updated series are dropped past this count (0 disables)
+ * @return uint64_t number of evicted series
+ */
+uint64_t metric_array_evict(metric_array_t *ma, double ttl, uint64_t max_series);
+
+/**
+ * @brief This periodically prunes the node level array
+ *
+ */
+typedef struct
+{
+	double             ttl;
+	uint64_t           max_series;
+	pthread_t          thread;
+	volatile int       running;
+	uint64_t           evicted;
+	metric_t *         series_metric;
+	metric_t *         evicted_metric;
+	metric_t *         rejected_metric;
+	metric_t *         history_metric;
+}metric_array_eviction_t;
+
+/**
+ * @brief Get or register a series of the node array which is never evicted
+ *
+ * @param name full name of the series
+ * @param doc documentation of the series
+ * @param type type of the series
+ * @return metric_t* the series NULL on error
+ */
+metric_t *metric_array_get_pinned(const char *name, const char *doc, tau_metric_type_t type);
+
+/**
+ * @brief Start the eviction thread on the node level array
+ *
+ * @param ttl series not updated for ttl seconds are dropped (0 disables)
+ * @param max_series least recently updated series are dropped past this count (0 disables)
+ * @return int 0 on success
+ */
+int metric_array_eviction_start(double ttl, uint64_t max_series);
+
+/**
+ * @brief Stop the eviction thread
+ *
+ * @return int 0 on success
+ */
+int metric_array_eviction_stop(void);
+
 /*************************
  * PER JOB METRIC ARRAYS *
  *************************/
@@ -149,9 +646,12 @@ metric_array_t * metric_array_get_main(void);
 typedef struct metric_array_list_entry_s
 {
 	tau_metric_job_descriptor_t desc;
-	uint64_t refcount;
+	uint64_t hash;      /**< Hash of the job ID */
+	uint64_t refcount;  /**< Number of clients in the job (0 means leaving) */
 	metric_array_t array;
 	struct metric_array_list_entry_s * next;
+	double released_ts; /**< When the last client left */
+	struct metric_array_list_entry_s * dump_next; /**< Link in the dump queue */
 }metric_array_list_entry_t;
 
 /**
@@ -170,32 +670,91 @@ metric_array_list_entry_t * metric_array_list_entry_init(tau_metric_job_descript
  */
 int metric_array_list_entry_release(metric_array_list_entry_t * malie);
 
+#define METRIC_ARRAY_LIST_SIZE    256
+
+/** Callback saving a job when it ends (returns 0 on success) */
+typedef int (*metric_array_list_release_callback_t)(tau_metric_job_descriptor_t *desc, metric_array_t *array);
+
+/**
+ * @brief Leaving jobs are handed to a writer thread which owns them
+ *        until their dump is done
+ */
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t  not_empty;   /**< Signaled when a job is queued */
+	struct metric_array_list_entry_s * head;
+	struct metric_array_list_entry_s * tail;
+	struct metric_array_list_entry_s * discarded; /**< Dropped jobs, freed by the writer */
+	size_t          depth;       /**< Number of queued jobs */
+	size_t          footprint;   /**< Bytes held by queued jobs */
+	size_t          max_footprint; /**< Dumps are dropped above this */
+	int             running;
+	pthread_t       writer;
+	metric_t *      depth_metric;
+	metric_t *      bytes_metric;
+	metric_t *      latency_metric;
+	metric_t *      count_metric;
+	metric_t *      failure_metric;
+	metric_t *      dropped_metric;
+}metric_array_list_dump_queue_t;
+
+/** Memory held by jobs waiting for their dump */
+#define METRIC_ARRAY_LIST_DUMP_QUEUE_FOOTPRINT (64 * 1024 * 1024)
+
 /**
  * @brief This is the main manager for per-job data
  * 
+ * Jobs are hashed by ID. Lookups do not lock: they run in a read
+ * section and writers only wait for readers when reclaiming an entry.
  */
 typedef struct metric_array_list_s
 {
-	pthread_spinlock_t lock;
-	struct metric_array_list_entry_s * head;
-	void (*release_callback)(tau_metric_job_descriptor_t *desc, metric_array_t *array);
+	pthread_spinlock_t locks[METRIC_ARRAY_LIST_SIZE];  /**< Writer lock for each bucket */
+	struct metric_array_list_entry_s * heads[METRIC_ARRAY_LIST_SIZE]; /**< Hash table of jobs */
+	utils_epoch_t epoch;             /**< Read sections (see @ref metric_array_list_read_lock) */
+	size_t job_max_footprint;
+	metric_array_list_release_callback_t release_callback;
+	metric_array_list_dump_queue_t dump_queue;
 }metric_array_list_t;
 
+/** Default memory budget of a per-job array */
+#define METRIC_ARRAY_JOB_DEFAULT_FOOTPRINT (1024 * 1024)
+
 /**
  * @brief Initializes the main per-job storage
  * 
+ * @param release_callback called from the dump writer thread when the last client of a job leaves
+ * @param job_max_footprint memory budget for each job array in bytes (0 is unbounded)
  */
-void metric_array_list_init(void (*release_callback)(tau_metric_job_descriptor_t * , metric_array_t *));
+void metric_array_list_init(metric_array_list_release_callback_t release_callback, size_t job_max_footprint);
 
 /**
  * @brief Releases the main per-job storage
  * 
+ * Pending dumps are written before returning.
  */
 void metric_array_list_release(void);
 
+/**
+ * @brief Enter a read section on the job list
+ * 
+ * @return int token to pass to @ref metric_array_list_read_unlock
+ */
+int metric_array_list_read_lock(void);
+
+/**
+ * @brief Leave a read section on the job list
+ * 
+ * @param token the value returned by @ref metric_array_list_read_lock
+ */
+void metric_array_list_read_unlock(int token);
+
 /**
  * @brief Get the metric array for a given job
-   @warning This does not lock it has to be done in parent function
+   @warning This does not lock, it has to be called in a read section
+            (@ref metric_array_list_read_lock) and the entry is only
+            valid until the section ends unless a reference is held
  * 
  * @param jobid the JOB ID we look for
  * @return metric_array_list_entry_t* the corresponding array entry or NULL if not found
@@ -211,19 +770,79 @@ metric_array_list_entry_t * metric_array_list_get_no_lock(const char * jobid);
  */
 metric_array_t * metric_array_list_acquire(tau_metric_job_descriptor_t *desc);
 
+/**
+ * @brief Get the array of a running job taking a reference on it
+ *
+ * The reference is dropped with @ref metric_array_list_relax, which
+ * also dumps the job if its clients all left meanwhile.
+ *
+ * @param jobid JOB ID to query
+ * @return metric_array_t* the job array NULL if the job is unknown or leaving
+ */
+metric_array_t * metric_array_list_get(const char * jobid);
+
 /**
  * @brief Conversely to @ref metric_array_list_acquire we release when reaching 0
  * 
+ * The last reference hands the job to the dump writer. When the writer
+ * is not running, the job is dumped and freed by the caller once the
+ * lookups walking through it are done: it must then not be called from
+ * a read section of the list.
+ *
  * @param jobid JOB ID to release
  * @return int 1 if the job is unknown 0 if all OK
  */
 int metric_array_list_relax(const char * jobid);
 
+/**
+ * @brief State of a running job
+ *
+ */
+typedef struct
+{
+	tau_metric_job_descriptor_t desc;
+	uint64_t                    clients;   /**< Connected clients */
+	uint64_t                    series;    /**< Series in the job array */
+	size_t                      footprint; /**< Bytes used by the job entry */
+}metric_array_list_job_t;
+
+/**
+ * @brief Copy the state of the running jobs sorted by ID
+ *
+ * @param jobs allocated array of jobs (to be freed by the caller)
+ * @param count number of jobs
+ * @return int 0 on success
+ */
+int metric_array_list_jobs(metric_array_list_job_t **jobs, size_t *count);
+
+/**
+ * @brief Get the number of running jobs
+ *
+ * @return uint64_t jobs with a live metric array
+ */
+uint64_t metric_array_list_count(void);
+
+/**
+ * @brief Get the memory used by all the per-job arrays
+ * 
+ * @return size_t bytes used by the live job entries
+ */
+size_t metric_array_list_footprint(void);
+
 
 /**********************
  * JOB METRIC STORAGE *
  **********************/
 
+/** Seconds between two scans of the job directory when its changes cannot be notified */
+#define TAU_METRIC_PROFILE_POLL_PERIOD 3.0
+
+/** Seconds between two scans catching the dumps notifications missed */
+#define TAU_METRIC_PROFILE_RESCAN_PERIOD 60.0
+
+/** Seconds between two refreshes of the lock file (held for 120 s) */
+#define TAU_METRIC_PROFILE_LOCK_PERIOD 60.0
+
 typedef struct {
 	char path[512];
 	int is_leader;
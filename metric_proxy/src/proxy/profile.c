@@ -1,3 +1,4 @@
+#include "config.h"
 #include "profile.h"
 
 #include <pthread.h>
@@ -10,188 +11,1133 @@
 #include <libgen.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+#include <zlib.h>
+#endif
 
 #include "log.h"
 #include "metrics.h"
+#include "snappy.h"
+#include "stats.h"
 #include "tau_metric_proxy_client.h"
 #include "utils.h"
 
 
-/*************************************
- * IMPLEMENTATION OF THE METRIC DUMP *
- *************************************/
+/*************************************
+ * IMPLEMENTATION OF THE METRIC DUMP *
+ *************************************/
+
+#define TAU_METRIC_DUMP_CANARY 0x77
+
+static const char *const __codec_name[TAU_METRIC_DUMP_CODEC_COUNT] = { "none", "zlib", "snappy" };
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+static tau_metric_dump_codec_t __dump_codec = TAU_METRIC_DUMP_CODEC_ZLIB;
+#else
+static tau_metric_dump_codec_t __dump_codec = TAU_METRIC_DUMP_CODEC_SNAPPY;
+#endif
+
+int tau_metric_dump_set_codec(const char * name)
+{
+	int i;
+
+	for(i = 0; i < TAU_METRIC_DUMP_CODEC_COUNT; i++)
+	{
+		if(!strcmp(name, __codec_name[i]) )
+		{
+			break;
+		}
+	}
+
+	if(i == TAU_METRIC_DUMP_CODEC_COUNT)
+	{
+		tau_metric_proxy_error("No such dump compression: %s", name);
+		return 1;
+	}
+
+#ifndef TAU_METRIC_PROXY_ZLIB_ENABLED
+	if(i == TAU_METRIC_DUMP_CODEC_ZLIB)
+	{
+		tau_metric_proxy_error("Built without zlib: dumps cannot be compressed with it");
+		return 1;
+	}
+#endif
+
+	__dump_codec = i;
+
+	return 0;
+}
+
+static uint32_t __dump_header_crc(tau_metric_dump_header_t * header)
+{
+	uint32_t crc = header->header_crc;
+
+	header->header_crc = 0;
+	uint32_t ret = utils_crc32c(0, header, sizeof(tau_metric_dump_header_t) );
+	header->header_crc = crc;
+
+	return ret;
+}
+
+/* Uncompress a stored payload in raw (of header->raw_len bytes) */
+static int __dump_inflate(const char * path, tau_metric_dump_header_t * header, const char * stored, char * raw)
+{
+	switch(header->codec)
+	{
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+		case TAU_METRIC_DUMP_CODEC_ZLIB:
+		{
+			uLongf raw_len = header->raw_len;
+
+			if( (uncompress( (Bytef *)raw, &raw_len, (const Bytef *)stored, header->stored_len) == Z_OK) &&
+			    (raw_len == header->raw_len) )
+			{
+				return 0;
+			}
+
+			break;
+		}
+#endif
+
+		case TAU_METRIC_DUMP_CODEC_SNAPPY:
+		{
+			size_t raw_len = 0;
+
+			if(!snappy_uncompressed_length(stored, header->stored_len, &raw_len) && (raw_len == header->raw_len) &&
+			   !snappy_uncompress(stored, header->stored_len, raw, raw_len) )
+			{
+				return 0;
+			}
+
+			break;
+		}
+
+		default:
+			tau_metric_proxy_error("Unsupported compression %u in %s", header->codec, path);
+			return 1;
+	}
+
+	tau_metric_proxy_error("Corrupted %s payload in %s", __codec_name[header->codec], path);
+
+	return 1;
+}
+
+/* A version 2 segment: the base of a file or a dump appended to it */
+typedef struct
+{
+	tau_metric_dump_header_t header;
+	const char *             stored;
+	const char *             payload; /* Uncompressed (NULL until inflated) */
+}dump_segment_t;
+
+/* Checks the segment starting at data, returns 0 if it is valid */
+static int __dump_segment_check(const char * path, const char * data, size_t len, dump_segment_t * seg)
+{
+	tau_metric_dump_header_t * header = &seg->header;
+
+	if(len < sizeof(tau_metric_dump_header_t) )
+	{
+		tau_metric_proxy_error("Truncated header in %s", path);
+		return 1;
+	}
+
+	memcpy(header, data, sizeof(tau_metric_dump_header_t) );
+
+	if(memcmp(header->magic, TAU_METRIC_DUMP_MAGIC, sizeof(TAU_METRIC_DUMP_MAGIC) ) )
+	{
+		tau_metric_proxy_error("Bad magic in %s", path);
+		return 1;
+	}
+
+	if(header->version != TAU_METRIC_DUMP_VERSION)
+	{
+		tau_metric_proxy_error("Unsupported version %u in %s", header->version, path);
+		return 1;
+	}
+
+	if(__dump_header_crc(header) != header->header_crc)
+	{
+		tau_metric_proxy_error("Bad header checksum in %s", path);
+		return 1;
+	}
+
+	seg->stored = data + sizeof(tau_metric_dump_header_t);
+
+	if( (len - sizeof(tau_metric_dump_header_t) < header->stored_len) ||
+	    (utils_crc32c(0, seg->stored, header->stored_len) != header->payload_crc) )
+	{
+		tau_metric_proxy_error("Bad payload checksum in %s", path);
+		return 1;
+	}
+
+	uint64_t count = header->metric_count;
+
+	if( (INT_MAX < count) || (header->raw_len / TAU_METRIC_DUMP_COLUMNS_SIZE < count) ||
+	    (header->raw_len - count * TAU_METRIC_DUMP_COLUMNS_SIZE != header->strings_len) ||
+	    (UINT32_MAX < header->strings_len) )
+	{
+		tau_metric_proxy_error("Bad metric count when reading");
+		return 1;
+	}
+
+	if(TAU_METRIC_DUMP_CODEC_COUNT <= header->codec)
+	{
+		tau_metric_proxy_error("Unsupported compression %u in %s", header->codec, path);
+		return 1;
+	}
+
+	seg->payload = NULL;
+
+	if(header->codec == TAU_METRIC_DUMP_CODEC_NONE)
+	{
+		if(header->stored_len != header->raw_len)
+		{
+			tau_metric_proxy_error("Corrupted none payload in %s", path);
+			return 1;
+		}
+
+		seg->payload = seg->stored;
+	}
+
+	return 0;
+}
+
+/* Points the columns of the view at an uncompressed segment */
+static void __dump_view_columns(tau_metric_dump_view_t * view, dump_segment_t * seg)
+{
+	uint64_t count = seg->header.metric_count;
+
+	view->count       = count;
+	view->values      = seg->payload;
+	view->ts          = view->values + count * sizeof(double);
+	view->names       = view->ts + count * sizeof(double);
+	view->docs        = view->names + count * sizeof(uint32_t);
+	view->types       = view->docs + count * sizeof(uint32_t);
+	view->strings     = view->types + count * sizeof(uint8_t);
+	view->strings_len = seg->header.strings_len;
+}
+
+/* Series of a merge, read in place from the views */
+typedef struct
+{
+	tau_metric_dump_entry_t * series;
+	uint64_t                  count;
+	uint32_t *                slots;     /* Index + 1 of the series by name hash, 0 if free */
+	uint64_t                  slot_mask;
+}dump_merge_t;
+
+static int __dump_merge_init(dump_merge_t * merge, uint64_t capacity)
+{
+	uint64_t slots = 64;
+
+	while(slots < 2 * capacity)
+	{
+		slots *= 2;
+	}
+
+	merge->count     = 0;
+	merge->slot_mask = slots - 1;
+	merge->series    = malloc( (capacity ? capacity : 1) * sizeof(tau_metric_dump_entry_t) );
+	merge->slots     = calloc(slots, sizeof(uint32_t) );
+
+	if(!merge->series || !merge->slots)
+	{
+		tau_metric_proxy_perror("malloc");
+		free(merge->series);
+		free(merge->slots);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void __dump_merge_release(dump_merge_t * merge)
+{
+	free(merge->series);
+	free(merge->slots);
+}
+
+/* Sums counters and averages gauges as client updates would */
+static int __dump_merge_apply(dump_merge_t * merge, tau_metric_dump_view_t * view)
+{
+	uint64_t i;
+
+	for(i = 0; i < view->count; i++)
+	{
+		tau_metric_dump_entry_t e;
+
+		if( tau_metric_dump_view_get(view, i, &e) )
+		{
+			return 1;
+		}
+
+		if( (e.type != TAU_METRIC_COUNTER) && (e.type != TAU_METRIC_GAUGE) && (e.type != TAU_METRIC_HISTOGRAM) )
+		{
+			tau_metric_proxy_error("Failed registering snapshoted metric");
+			continue;
+		}
+
+		uint64_t cell = utils_string_hash( (const unsigned char *)e.name) & merge->slot_mask;
+
+		while(merge->slots[cell] && strcmp(merge->series[merge->slots[cell] - 1].name, e.name) )
+		{
+			cell = (cell + 1) & merge->slot_mask;
+		}
+
+		if(!merge->slots[cell])
+		{
+			merge->series[merge->count] = e;
+			merge->slots[cell] = ++merge->count;
+			continue;
+		}
+
+		tau_metric_dump_entry_t * s = &merge->series[merge->slots[cell] - 1];
+
+		if(metric_type_cumulative(s->type) )
+		{
+			s->value += e.value;
+		}
+		else
+		{
+			s->value = (s->value + e.value) / 2;
+		}
+
+		if(s->update_ts < e.update_ts)
+		{
+			s->update_ts = e.update_ts;
+		}
+	}
+
+	return 0;
+}
+
+/* Keeps the commands of MPMD runs and the largest time span */
+static void __dump_desc_merge(tau_metric_job_descriptor_t * desc, tau_metric_job_descriptor_t * run)
+{
+	if(! strstr(desc->command, run->command))
+	{
+		/* Commands are different */
+		char tmp[512];
+		snprintf(tmp, 512, "%s : %s", desc->command, run->command);
+		snprintf(desc->command, 512, "%s", tmp);
+	}
+
+	if(run->start_time < desc->start_time)
+	{
+		desc->start_time = run->start_time;
+	}
+
+	if(desc->end_time < run->end_time)
+	{
+		desc->end_time = run->end_time;
+	}
+}
+
+static int __dump_view_open_v1(tau_metric_dump_view_t * view, const char * path)
+{
+	tau_metric_dump_t head;
+
+	if(view->map_len < sizeof(tau_metric_dump_t) )
+	{
+		tau_metric_proxy_error("Truncated header in %s", path);
+		return 1;
+	}
+
+	memcpy(&head, view->map, sizeof(tau_metric_dump_t) );
+
+	size_t records_len = head.metric_count * sizeof(tau_metric_snapshot_t);
+
+	if( (head.metric_count < 0) || (view->map_len < sizeof(tau_metric_dump_t) + records_len + sizeof(int) ) )
+	{
+		tau_metric_proxy_error("Bad metric count when reading");
+		return 1;
+	}
+
+	int canary = 0;
+
+	memcpy(&canary, (char *)view->map + sizeof(tau_metric_dump_t) + records_len, sizeof(int) );
+
+	if(canary != TAU_METRIC_DUMP_CANARY)
+	{
+		tau_metric_proxy_error("Bad canary in dump (%d != %d)", canary, TAU_METRIC_DUMP_CANARY);
+		return 1;
+	}
+
+	view->version   = 1;
+	view->count     = head.metric_count;
+	view->records   = (const tau_metric_snapshot_t *)( (char *)view->map + sizeof(tau_metric_dump_t) );
+	view->valid_len = view->map_len;
+	memcpy(&view->desc, &head.desc, sizeof(tau_metric_job_descriptor_t) );
+
+	return 0;
+}
+
+static int __dump_view_open_v2(tau_metric_dump_view_t * view, const char * path)
+{
+	const char *     data     = view->map;
+	dump_segment_t * segs     = NULL;
+	uint64_t         count    = 0;
+	uint64_t         capacity = 0;
+	uint64_t         series   = 0;
+	size_t           inflated = 0;
+	size_t           offset   = 0;
+	uint64_t         i;
+	int              ret      = 1;
+
+	while(offset < view->map_len)
+	{
+		if(count == capacity)
+		{
+			capacity = capacity ? 2 * capacity : 4;
+
+			dump_segment_t * tmp = realloc(segs, capacity * sizeof(dump_segment_t) );
+
+			if(!tmp)
+			{
+				tau_metric_proxy_perror("realloc");
+				goto VIEWV2END;
+			}
+
+			segs = tmp;
+		}
+
+		if(__dump_segment_check(path, data + offset, view->map_len - offset, &segs[count]) )
+		{
+			if(!count)
+			{
+				goto VIEWV2END;
+			}
+
+			/* A dump was being appended when its writer stopped */
+			tau_metric_proxy_error("Ignoring %lu bytes after the last valid segment of %s", view->map_len - offset, path);
+			break;
+		}
+
+		if(!segs[count].payload)
+		{
+			inflated += segs[count].header.raw_len;
+		}
+
+		series += segs[count].header.metric_count;
+		offset += sizeof(tau_metric_dump_header_t) + segs[count].header.stored_len;
+		count++;
+	}
+
+	/* Compressed payloads are uncompressed in a single buffer */
+	if(inflated)
+	{
+		if( !(view->inflated = malloc(inflated) ) )
+		{
+			tau_metric_proxy_perror("malloc");
+			goto VIEWV2END;
+		}
+
+		char * raw = view->inflated;
+
+		for(i = 0; i < count; i++)
+		{
+			if(segs[i].payload)
+			{
+				continue;
+			}
+
+			if(__dump_inflate(path, &segs[i].header, segs[i].stored, raw) )
+			{
+				goto VIEWV2END;
+			}
+
+			segs[i].payload = raw;
+			raw += segs[i].header.raw_len;
+		}
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		const char * strings = segs[i].payload + segs[i].header.metric_count * TAU_METRIC_DUMP_COLUMNS_SIZE;
+
+		if(segs[i].header.strings_len && strings[segs[i].header.strings_len - 1])
+		{
+			tau_metric_proxy_error("Unterminated string table in %s", path);
+			goto VIEWV2END;
+		}
+	}
+
+	view->version   = 2;
+	view->segments  = count;
+	view->valid_len = offset;
+	memcpy(&view->desc, &segs[0].header.desc, sizeof(tau_metric_job_descriptor_t) );
+
+	if(count == 1)
+	{
+		__dump_view_columns(view, &segs[0]);
+		ret = 0;
+		goto VIEWV2END;
+	}
+
+	/* Appended dumps are merged in the order they were appended */
+	dump_merge_t merge;
+
+	if(__dump_merge_init(&merge, series) )
+	{
+		goto VIEWV2END;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		__dump_view_columns(view, &segs[i]);
+
+		if(__dump_merge_apply(&merge, view) )
+		{
+			__dump_merge_release(&merge);
+			goto VIEWV2END;
+		}
+
+		if(i)
+		{
+			__dump_desc_merge(&view->desc, &segs[i].header.desc);
+		}
+	}
+
+	free(merge.slots);
+	view->merged = merge.series;
+	view->count  = merge.count;
+	ret = 0;
+
+VIEWV2END:
+	free(segs);
+
+	return ret;
+}
+
+int tau_metric_dump_view_open(tau_metric_dump_view_t * view, const char * path)
+{
+	memset(view, 0, sizeof(tau_metric_dump_view_t) );
+
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0)
+	{
+		tau_metric_proxy_perror("open");
+		return 1;
+	}
+
+	struct stat st;
+
+	if(fstat(fd, &st) < 0)
+	{
+		tau_metric_proxy_perror("fstat");
+		close(fd);
+		return 1;
+	}
+
+	if(!st.st_size)
+	{
+		tau_metric_proxy_error("Empty dump %s", path);
+		close(fd);
+		return 1;
+	}
+
+	view->map_len = st.st_size;
+	view->map     = mmap(NULL, view->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	/* The mapping holds its own reference on the file */
+	close(fd);
+
+	if(view->map == MAP_FAILED)
+	{
+		tau_metric_proxy_perror("mmap");
+		view->map = NULL;
+		return 1;
+	}
+
+	madvise(view->map, view->map_len, MADV_SEQUENTIAL);
+
+	int ret;
+
+	if( (sizeof(TAU_METRIC_DUMP_MAGIC) <= view->map_len) &&
+	    !memcmp(view->map, TAU_METRIC_DUMP_MAGIC, sizeof(TAU_METRIC_DUMP_MAGIC) ) )
+	{
+		ret = __dump_view_open_v2(view, path);
+	}
+	else
+	{
+		ret = __dump_view_open_v1(view, path);
+	}
+
+	if(ret)
+	{
+		tau_metric_dump_view_close(view);
+		return 1;
+	}
+
+	tau_metric_proxy_log_verbose("Viewing %lu metrics from %s (v%d)", view->count, path, view->version);
+
+	return 0;
+}
+
+int tau_metric_dump_view_get(tau_metric_dump_view_t * view, uint64_t i, tau_metric_dump_entry_t * entry)
+{
+	if(view->count <= i)
+	{
+		return 1;
+	}
+
+	if(view->merged)
+	{
+		*entry = view->merged[i];
+		return 0;
+	}
+
+	if(view->version == 1)
+	{
+		const tau_metric_snapshot_t * s = &view->records[i];
+
+		if(!memchr(s->event.name, '\0', METRIC_STRING_SIZE) || !memchr(s->doc, '\0', METRIC_STRING_SIZE) )
+		{
+			tau_metric_proxy_error("Unterminated string in metric %lu", i);
+			return 1;
+		}
+
+		entry->name      = s->event.name;
+		entry->doc       = s->doc;
+		entry->type      = s->type;
+		entry->value     = s->event.value;
+		entry->update_ts = s->event.update_ts;
+
+		return 0;
+	}
+
+	/* Columns may be unaligned in the payload */
+	uint32_t name, doc;
+
+	memcpy(&name, view->names + i * sizeof(uint32_t), sizeof(uint32_t) );
+	memcpy(&doc, view->docs + i * sizeof(uint32_t), sizeof(uint32_t) );
+
+	if( (view->strings_len <= name) || (view->strings_len <= doc) )
+	{
+		tau_metric_proxy_error("Bad string offset in metric %lu", i);
+		return 1;
+	}
+
+	entry->name = view->strings + name;
+	entry->doc  = view->strings + doc;
+	entry->type = (uint8_t)view->types[i];
+	memcpy(&entry->value, view->values + i * sizeof(double), sizeof(double) );
+	memcpy(&entry->update_ts, view->ts + i * sizeof(double), sizeof(double) );
+
+	return 0;
+}
+
+void tau_metric_dump_view_close(tau_metric_dump_view_t * view)
+{
+	if(view->map)
+	{
+		munmap(view->map, view->map_len);
+	}
+
+	free(view->inflated);
+	free(view->merged);
+	memset(view, 0, sizeof(tau_metric_dump_view_t) );
+}
+
+tau_metric_dump_t * tau_metric_dump_load(const char * path)
+{
+	tau_metric_dump_view_t view;
+
+	if(tau_metric_dump_view_open(&view, path) )
+	{
+		return NULL;
+	}
+
+	tau_metric_dump_t * dump = malloc(sizeof(tau_metric_dump_t) + view.count * sizeof(tau_metric_snapshot_t) );
+
+	if(!dump)
+	{
+		tau_metric_proxy_perror("malloc");
+		tau_metric_dump_view_close(&view);
+		return NULL;
+	}
+
+	dump->metric_count = view.count;
+	memcpy(&dump->desc, &view.desc, sizeof(tau_metric_job_descriptor_t) );
+
+	uint64_t i;
+
+	for(i = 0; i < view.count; i++)
+	{
+		tau_metric_snapshot_t * s = &dump->metrics[i];
+		tau_metric_dump_entry_t e;
+
+		if(tau_metric_dump_view_get(&view, i, &e) )
+		{
+			free(dump);
+			dump = NULL;
+			break;
+		}
+
+		s->type = e.type;
+		snprintf(s->doc, METRIC_STRING_SIZE, "%s", e.doc);
+		snprintf(s->event.name, METRIC_STRING_SIZE, "%s", e.name);
+		s->event.value     = e.value;
+		s->event.update_ts = e.update_ts;
+		s->canary          = 0x1337;
+	}
+
+	tau_metric_dump_view_close(&view);
+
+	return dump;
+}
+
+/* Builds the payload of a version 2 dump */
+typedef struct
+{
+	uint64_t   count;
+	char *     payload;      /* Columns, the strings are appended when done */
+	size_t     strings_len;
+	size_t     strings_size;
+	char *     strings;
+	uint32_t * slots;        /* Offset + 1 of the strings by hash, 0 if free */
+	uint64_t   slot_mask;
+}dump_encoder_t;
+
+static int __dump_encoder_init(dump_encoder_t * enc, uint64_t count)
+{
+	memset(enc, 0, sizeof(dump_encoder_t) );
+
+	enc->count = count;
+
+	/* Room for distinct names and docs below half load */
+	uint64_t slots = 64;
+
+	while(slots < 4 * count)
+	{
+		slots *= 2;
+	}
+
+	enc->slot_mask    = slots - 1;
+	enc->strings_size = 4096;
+
+	enc->payload = malloc(count * TAU_METRIC_DUMP_COLUMNS_SIZE + 1);
+	enc->strings = malloc(enc->strings_size);
+	enc->slots   = calloc(slots, sizeof(uint32_t) );
+
+	if(!enc->payload || !enc->strings || !enc->slots)
+	{
+		tau_metric_proxy_perror("malloc");
+		free(enc->payload);
+		free(enc->strings);
+		free(enc->slots);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void __dump_encoder_release(dump_encoder_t * enc)
+{
+	free(enc->payload);
+	free(enc->strings);
+	free(enc->slots);
+	memset(enc, 0, sizeof(dump_encoder_t) );
+}
+
+/* Offset of a string in the table, added if new (UINT32_MAX on error) */
+static uint32_t __dump_encoder_string(dump_encoder_t * enc, const char * str)
+{
+	uint64_t cell = utils_string_hash( (const unsigned char *)str) & enc->slot_mask;
+
+	while(enc->slots[cell])
+	{
+		if(!strcmp(enc->strings + enc->slots[cell] - 1, str) )
+		{
+			return enc->slots[cell] - 1;
+		}
+
+		cell = (cell + 1) & enc->slot_mask;
+	}
+
+	size_t len = strlen(str) + 1;
+
+	if(UINT32_MAX - 1 < enc->strings_len + len)
+	{
+		tau_metric_proxy_error("String table of the dump is too large");
+		return UINT32_MAX;
+	}
+
+	if(enc->strings_size < enc->strings_len + len)
+	{
+		while(enc->strings_size < enc->strings_len + len)
+		{
+			enc->strings_size *= 2;
+		}
+
+		char * strings = realloc(enc->strings, enc->strings_size);
+
+		if(!strings)
+		{
+			tau_metric_proxy_perror("realloc");
+			return UINT32_MAX;
+		}
+
+		enc->strings = strings;
+	}
+
+	uint32_t offset = enc->strings_len;
+
+	memcpy(enc->strings + offset, str, len);
+	enc->strings_len += len;
+	enc->slots[cell]  = offset + 1;
+
+	return offset;
+}
+
+static int __dump_encoder_add(dump_encoder_t * enc, uint64_t i, tau_metric_type_t type, const char * name,
+                              const char * doc, double value, double ts)
+{
+	uint32_t name_off = __dump_encoder_string(enc, name);
+	uint32_t doc_off  = __dump_encoder_string(enc, doc ? doc : "");
+
+	if( (name_off == UINT32_MAX) || (doc_off == UINT32_MAX) )
+	{
+		return 1;
+	}
+
+	char * values = enc->payload;
+	char * tss    = values + enc->count * sizeof(double);
+	char * names  = tss + enc->count * sizeof(double);
+	char * docs   = names + enc->count * sizeof(uint32_t);
+	char * types  = docs + enc->count * sizeof(uint32_t);
+
+	memcpy(values + i * sizeof(double), &value, sizeof(double) );
+	memcpy(tss + i * sizeof(double), &ts, sizeof(double) );
+	memcpy(names + i * sizeof(uint32_t), &name_off, sizeof(uint32_t) );
+	memcpy(docs + i * sizeof(uint32_t), &doc_off, sizeof(uint32_t) );
+	types[i] = (uint8_t)type;
+
+	return 0;
+}
+
+/* Compress the payload in the current codec, returns what to store */
+static char * __dump_encoder_compress(char * raw, tau_metric_dump_header_t * header)
+{
+	char * stored = NULL;
+
+	switch(header->codec)
+	{
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+		case TAU_METRIC_DUMP_CODEC_ZLIB:
+		{
+			uLongf stored_len = compressBound(header->raw_len);
+
+			if( !(stored = malloc(stored_len) ) )
+			{
+				tau_metric_proxy_perror("malloc");
+				return NULL;
+			}
+
+			if(compress2( (Bytef *)stored, &stored_len, (const Bytef *)raw, header->raw_len, TAU_METRIC_DUMP_ZLIB_LEVEL) != Z_OK)
+			{
+				tau_metric_proxy_error("Could not compress dump with zlib");
+				free(stored);
+				return NULL;
+			}
+
+			header->stored_len = stored_len;
+			return stored;
+		}
+#endif
+
+		case TAU_METRIC_DUMP_CODEC_SNAPPY:
+			if( !(stored = malloc(snappy_max_compressed_length(header->raw_len) ) ) )
+			{
+				tau_metric_proxy_perror("malloc");
+				return NULL;
+			}
+
+			header->stored_len = snappy_compress(raw, header->raw_len, stored);
+			return stored;
+
+		default:
+			header->stored_len = header->raw_len;
+			return raw;
+	}
+}
+
+/* Completes the header, returns the payload to store (to free if it is not enc->payload) */
+static char * __dump_encoder_seal(dump_encoder_t * enc, tau_metric_job_descriptor_t * desc, tau_metric_dump_header_t * header)
+{
+	size_t columns_len = enc->count * TAU_METRIC_DUMP_COLUMNS_SIZE;
+
+	char * raw = realloc(enc->payload, columns_len + enc->strings_len + 1);
 
-#define TAU_METRIC_DUMP_CANARY 0x77
+	if(!raw)
+	{
+		tau_metric_proxy_perror("realloc");
+		return NULL;
+	}
 
-tau_metric_dump_t * tau_metric_dump_load(const char * path)
-{
-    FILE * in = fopen(path, "r");
+	enc->payload = raw;
+	memcpy(raw + columns_len, enc->strings, enc->strings_len);
 
-    if(!in)
-    {
-		tau_metric_proxy_perror("fopen");
-        return NULL;
-    }
+	memset(header, 0, sizeof(tau_metric_dump_header_t) );
+	memcpy(header->magic, TAU_METRIC_DUMP_MAGIC, sizeof(TAU_METRIC_DUMP_MAGIC) );
+	header->version      = TAU_METRIC_DUMP_VERSION;
+	header->codec        = __dump_codec;
+	header->metric_count = enc->count;
+	header->strings_len  = enc->strings_len;
+	header->raw_len      = columns_len + enc->strings_len;
+	memcpy(&header->desc, desc, sizeof(tau_metric_job_descriptor_t) );
 
-    tau_metric_dump_t tmp;
+	char * stored = __dump_encoder_compress(raw, header);
 
-    int ret = fread(&tmp, sizeof(tau_metric_dump_t), 1, in);
+	if(!stored)
+	{
+		return NULL;
+	}
 
-    if(ret != 1)
-    {
-        tau_metric_proxy_perror("fread");
-        fclose(in);
-        return NULL;
-    }
+	header->payload_crc = utils_crc32c(0, stored, header->stored_len);
+	header->header_crc  = __dump_header_crc(header);
 
-    tau_metric_dump_t * dump = malloc(sizeof(tau_metric_dump_t) + tmp.metric_count * sizeof(tau_metric_snapshot_t));
+	return stored;
+}
 
-    if(!dump)
-    {
-        tau_metric_proxy_perror("malloc");
-        fclose(in);
-        return NULL;
-    }
+static int __dump_encoder_write(dump_encoder_t * enc, const char * path, tau_metric_job_descriptor_t * desc)
+{
+	tau_metric_dump_header_t header;
 
-    memcpy(dump, &tmp, sizeof(tau_metric_dump_t));
+	char * stored = __dump_encoder_seal(enc, desc, &header);
 
-    tau_metric_proxy_log_verbose("Reading %d metrics from %s", tmp.metric_count, path);
+	if(!stored)
+	{
+		return 1;
+	}
 
-    ret = fread(dump->metrics, sizeof(tau_metric_snapshot_t), tmp.metric_count, in);
+	/* Written aside then renamed: readers, including the views still
+	   mapping the previous file, never see a partial one. The name
+	   does not match the dump and profile scans. */
+	static uint64_t tmp_seq = 0;
 
-    if(ret != tmp.metric_count)
-    {
-        tau_metric_proxy_error("Bad metric count when reading");
-        goto DUMPREADFAIL;
-    }
+	char tmp[1024];
+	const char * slash = strrchr(path, '/');
 
-    int canary = 0;
+	snprintf(tmp, sizeof(tmp), "%.*s.tau_metric_dump.%d.%lu", slash ? (int)(slash - path + 1) : 0, path, getpid(),
+	         __atomic_fetch_add(&tmp_seq, 1, __ATOMIC_RELAXED) );
 
-    ret = fread(&canary, sizeof(int), 1, in);
+	int ret = 0;
 
-    if(ret != 1)
-    {
-        tau_metric_proxy_error("Could not read canary in dump");
-        goto DUMPREADFAIL;
-    }
+	FILE * out = fopen(tmp, "w");
 
-    if(canary != TAU_METRIC_DUMP_CANARY)
-    {
-        tau_metric_proxy_error("Bad canary in dump (%d != %d)", canary, TAU_METRIC_DUMP_CANARY);
-        goto DUMPREADFAIL;
-    }
+	if(!out)
+	{
+		tau_metric_proxy_perror("fopen");
+		ret = 1;
+	}
+	else
+	{
+		if( (fwrite(&header, sizeof(tau_metric_dump_header_t), 1, out) != 1) ||
+		    (header.stored_len && (fwrite(stored, header.stored_len, 1, out) != 1) ) )
+		{
+			tau_metric_proxy_perror("fwrite");
+			ret = 1;
+		}
+
+		if(fclose(out) )
+		{
+			tau_metric_proxy_perror("fclose");
+			ret = 1;
+		}
+
+		if(!ret && (rename(tmp, path) < 0) )
+		{
+			tau_metric_proxy_perror("rename");
+			ret = 1;
+		}
+
+		if(ret)
+		{
+			unlink(tmp);
+		}
+	}
 
-    fclose(in);
-    return dump;
+	if(stored != enc->payload)
+	{
+		free(stored);
+	}
 
-DUMPREADFAIL:
-    fclose(in);
-    free(dump);
-    return NULL;
+	return ret;
 }
 
-static inline int __write_a_metric(metric_t *m, void *pfile)
+int tau_metric_dump_save(const char * path, tau_metric_job_descriptor_t * desc, metric_array_t * metrics)
 {
-	FILE * f = (FILE*)pfile;
+	/* Freeze the array first so that the header count
+	   matches exactly the records that follow */
+	metric_array_snapshot_t snap = { 0 };
+
+	if( metric_array_snapshot_take(metrics, &snap) )
+	{
+		tau_metric_proxy_error("Could not snapshot metrics for %s", path);
+		return 1;
+	}
 
+	dump_encoder_t enc;
 
-    tau_metric_snapshot_t s;
+	if(__dump_encoder_init(&enc, snap.count) )
+	{
+		metric_array_snapshot_free(&snap);
+		return 1;
+	}
 
-    if(metric_snapshot(m, &s) )
-    {
-        return 1;
-    }
+	tau_metric_proxy_log_verbose("Saving %lu metrics to %s", snap.count, path);
 
-	int ret = fwrite(&s, sizeof(tau_metric_snapshot_t), 1, f);
+	int ret = 0;
+	uint64_t i;
 
-	if(ret != 1)
+	for(i = 0; !ret && (i < snap.count); i++)
 	{
-		return 1;
+		metric_snapshot_entry_t * e = &snap.entries[i];
+		ret = __dump_encoder_add(&enc, i, e->type, e->name, e->doc, e->value, e->last_ts);
 	}
 
-	return 0;
+	metric_array_snapshot_free(&snap);
+
+	if(!ret)
+	{
+		ret = __dump_encoder_write(&enc, path, desc);
+	}
+
+	if(ret)
+	{
+		tau_metric_proxy_error("There was an error writing some metrics to %s", path);
+	}
+
+	__dump_encoder_release(&enc);
+
+	return ret;
 }
 
-int tau_metric_dump_save(const char * path, tau_metric_job_descriptor_t * desc, metric_array_t * metrics)
+static int __dump_write_entries(const char * path, tau_metric_job_descriptor_t * desc, tau_metric_dump_entry_t * entries,
+                                uint64_t count)
 {
-    FILE * out = fopen(path, "w");
+	dump_encoder_t enc;
 
-	if(!out)
+	if(__dump_encoder_init(&enc, count) )
 	{
-		tau_metric_proxy_perror("fopen");
 		return 1;
 	}
 
-    tau_metric_dump_t dump;
+	int ret = 0;
+	uint64_t i;
+
+	for(i = 0; !ret && (i < count); i++)
+	{
+		tau_metric_dump_entry_t * e = &entries[i];
+		ret = __dump_encoder_add(&enc, i, e->type, e->name, e->doc, e->value, e->update_ts);
+	}
+
+	if(!ret)
+	{
+		ret = __dump_encoder_write(&enc, path, desc);
+	}
+
+	if(ret)
+	{
+		tau_metric_proxy_error("There was an error writing some metrics to %s", path);
+	}
+
+	__dump_encoder_release(&enc);
 
-    memcpy(&dump.desc, desc, sizeof(tau_metric_job_descriptor_t));
-    dump.metric_count = metric_array_count(metrics);
+	return ret;
+}
+
+int tau_metric_dump_view_write(const char * path, tau_metric_dump_view_t * view)
+{
+	dump_encoder_t enc;
+
+	if(__dump_encoder_init(&enc, view->count) )
+	{
+		return 1;
+	}
+
+	int ret = 0;
+	uint64_t i;
 
-    tau_metric_proxy_log_verbose("Saving %d metrics to %s", dump.metric_count,path);
+	for(i = 0; !ret && (i < view->count); i++)
+	{
+		tau_metric_dump_entry_t e;
 
-	fwrite(&dump, sizeof(tau_metric_dump_t), 1, out);
+		ret = tau_metric_dump_view_get(view, i, &e) ||
+		      __dump_encoder_add(&enc, i, e.type, e.name, e.doc, e.value, e.update_ts);
+	}
 
-	int ret = metric_array_iterate(metrics, __write_a_metric, (void*)out);
+	if(!ret)
+	{
+		ret = __dump_encoder_write(&enc, path, &view->desc);
+	}
 
 	if(ret)
 	{
-		tau_metric_proxy_error("There was an error writing some metrics");
+		tau_metric_proxy_error("There was an error writing some metrics to %s", path);
 	}
 
-    int canary = TAU_METRIC_DUMP_CANARY;
-	ret = fwrite(&canary, sizeof(int), 1, out);
+	__dump_encoder_release(&enc);
 
-    if(ret!=1)
-    {
-        fclose(out);
-		tau_metric_proxy_perror("fwrite");
+	return ret;
+}
+
+int tau_metric_dump_write(const char * path, tau_metric_dump_t * dump)
+{
+	dump_encoder_t enc;
+
+	if(__dump_encoder_init(&enc, dump->metric_count) )
+	{
 		return 1;
-    }
+	}
 
-	fclose(out);
+	int ret = 0;
+	int i;
 
-    return 0;
+	for(i = 0; !ret && (i < dump->metric_count); i++)
+	{
+		tau_metric_snapshot_t * s = &dump->metrics[i];
+		ret = __dump_encoder_add(&enc, i, s->type, s->event.name, s->doc, s->event.value, s->event.update_ts);
+	}
+
+	if(!ret)
+	{
+		ret = __dump_encoder_write(&enc, path, &dump->desc);
+	}
+
+	if(ret)
+	{
+		tau_metric_proxy_error("There was an error writing some metrics to %s", path);
+	}
+
+	__dump_encoder_release(&enc);
+
+	return ret;
 }
 
 /********************************************
  * IMPLEMENTATION OF A PROFILE ACCUMULATION *
  ********************************************/
 
-int tau_metric_profile_init_from_dump(char * path_to_profile, tau_metric_dump_t * dump)
+int tau_metric_profile_init_from_dump(char * path_to_profile, tau_metric_dump_view_t * dump)
 {
-    /* Here we just directly copy the dump */
+    /* Written in the current version whatever the one of the dump */
 
-    FILE * out = fopen(path_to_profile, "w");
-
-    if(!out)
-    {
-        tau_metric_proxy_perror("fopen");
-        return 1;
-    }
-
-    size_t total_size = sizeof(tau_metric_dump_t) + dump->metric_count * sizeof(tau_metric_snapshot_t);
-
-    size_t ret = fwrite(dump, sizeof(char), total_size, out);
-
-    if(ret != total_size)
+    if( tau_metric_dump_view_write(path_to_profile, dump) )
     {
         tau_metric_proxy_error("Error storing profile %s", path_to_profile);
-        fclose(out);
         return 1;
     }
 
-    int canary = TAU_METRIC_DUMP_CANARY;
-    ret = fwrite(&canary, sizeof(int), 1, out);
-
-    if(ret != 1)
-    {
-        tau_metric_proxy_error("Error storing profile canary %s", path_to_profile);
-    }
-
     tau_metric_proxy_log("Storing new job profile in %s", path_to_profile);
 
-    fclose(out);
-
     return 0;
 }
 
@@ -207,84 +1153,248 @@ tau_metric_profile_t * tau_metric_profile_load(char * path_to_profile)
 
     snprintf(ret->path, 512, "%s", path_to_profile);
 
-    ret->dump = tau_metric_dump_load(path_to_profile);
-
-    if(!ret->dump)
+    if( tau_metric_dump_view_open(&ret->view, path_to_profile) )
     {
         tau_metric_proxy_error("Could not load dump %s", path_to_profile);
+        free(ret);
         return  NULL;
     }
 
-    memcpy(&ret->desc, &ret->dump->desc, sizeof(tau_metric_job_descriptor_t));
+    memcpy(&ret->desc, &ret->view.desc, sizeof(tau_metric_job_descriptor_t));
 
     return ret;
 }
 
-static inline int __apply_dump_to_metrics(metric_array_t *metrics, tau_metric_dump_t * dump)
+int tau_metric_profile_consolidate(tau_metric_profile_t * prof, tau_metric_dump_view_t *dump)
 {
-    int i;
+    dump_merge_t merge;
+
+    if( __dump_merge_init(&merge, prof->view.count + dump->count) )
+    {
+        return 1;
+    }
+
+    /* Start with all values from the profile then merge the new run */
+    if( __dump_merge_apply(&merge, &prof->view) || __dump_merge_apply(&merge, dump) )
+    {
+        __dump_merge_release(&merge);
+        return 1;
+    }
+
+    /* And save if needed the MPMD status and the largest dynamic */
+    __dump_desc_merge(&prof->desc, &dump->desc);
+
+    /* And dump again ! */
+    int ret = __dump_write_entries(prof->path, &prof->desc, merge.series, merge.count);
+
+    __dump_merge_release(&merge);
+
+    return ret;
+}
 
-    for(i = 0 ; i < dump->metric_count; i++)
+static int __pwrite_all(int fd, const char * buff, size_t len, off_t offset)
+{
+    while(len)
     {
-        metric_t *new_m = metric_from_snapshot(&dump->metrics[i]);
-        if(!new_m)
+        ssize_t ret = pwrite(fd, buff, len, offset);
+
+        if(ret < 0)
         {
-            tau_metric_proxy_error("Failed registering snapshoted metric");
-            continue;
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            tau_metric_proxy_perror("pwrite");
+            return 1;
         }
 
-        metric_t * m = metric_array_get(metrics, dump->metrics[i].event.name);
+        buff   += ret;
+        len    -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+/* Writes the dump as a version 2 segment at offset, returns its length (0 on error) */
+static size_t __profile_append_segment(int fd, off_t offset, tau_metric_dump_view_t * dump)
+{
+    /* Dumps already in the format are copied as they are */
+    if( (dump->version == 2) && (dump->segments == 1) )
+    {
+        return __pwrite_all(fd, dump->map, dump->valid_len, offset) ? 0 : dump->valid_len;
+    }
+
+    dump_encoder_t enc;
+
+    if(__dump_encoder_init(&enc, dump->count) )
+    {
+        return 0;
+    }
+
+    tau_metric_dump_header_t header;
+    char * stored = NULL;
+    size_t ret = 0;
+    uint64_t i;
+    int err = 0;
+
+    for(i = 0; !err && (i < dump->count); i++)
+    {
+        tau_metric_dump_entry_t e;
+
+        err = tau_metric_dump_view_get(dump, i, &e) ||
+              __dump_encoder_add(&enc, i, e.type, e.name, e.doc, e.value, e.update_ts);
+    }
 
-        if(!m)
+    if(!err && (stored = __dump_encoder_seal(&enc, &dump->desc, &header) ) )
+    {
+        if(!__pwrite_all(fd, (char *)&header, sizeof(tau_metric_dump_header_t), offset) &&
+           !__pwrite_all(fd, stored, header.stored_len, offset + sizeof(tau_metric_dump_header_t) ) )
         {
-            /* Note the register carries the current value from the metric*/
-            metric_array_register(metrics, new_m);
+            ret = sizeof(tau_metric_dump_header_t) + header.stored_len;
         }
-        else
+
+        if(stored != enc.payload)
         {
-            metric_update(m, &dump->metrics[i].event);
+            free(stored);
         }
     }
 
-    return 0;
+    __dump_encoder_release(&enc);
+
+    return ret;
 }
 
-int tau_metric_profile_consolidate(tau_metric_profile_t * prof, tau_metric_dump_t *dump)
+int tau_metric_profile_append(char * path_to_profile, tau_metric_dump_view_t * dump)
 {
-    metric_array_t metrics;
-    metric_array_init(&metrics);
+    int fd = open(path_to_profile, O_RDWR);
+
+    if(fd < 0)
+    {
+        tau_metric_proxy_perror("open");
+        return 1;
+    }
+
+    struct stat st;
 
-    /* Start by inserting in the MA all values from the profile */
-    __apply_dump_to_metrics(&metrics, prof->dump);
+    if(fstat(fd, &st) < 0)
+    {
+        tau_metric_proxy_perror("fstat");
+        close(fd);
+        return 1;
+    }
 
-    /* Then merge the new run */
-    __apply_dump_to_metrics(&metrics, dump);
+    /* Version 1 profiles are rewritten instead */
+    char magic[sizeof(TAU_METRIC_DUMP_MAGIC)];
 
-    /* And save if needed the MPMD status*/
-    if(! strstr(prof->desc.command, dump->desc.command))
+    if( (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ) || memcmp(magic, TAU_METRIC_DUMP_MAGIC, sizeof(magic) ) )
     {
-        /* Commands are different */
-        char tmp[512];
-        snprintf(tmp, 512, "%s : %s", prof->desc.command, dump->desc.command);
-        snprintf(prof->desc.command, 512, "%s", tmp);
+        close(fd);
+        return 1;
     }
 
-    /* Update start and end times in the desc
-       to keep the largest dynamic */
-    if(dump->desc.start_time < prof->desc.start_time)
+    char * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if(map == MAP_FAILED)
     {
-        prof->desc.start_time = dump->desc.start_time;
+        tau_metric_proxy_perror("mmap");
+        close(fd);
+        return 1;
     }
 
-    if(prof->desc.end_time < dump->desc.end_time)
+    /* Walk the segments up to the end of the last one with valid checksums,
+       the dump would otherwise be appended after unreadable data */
+    off_t offset = 0;
+    size_t base_len = 0;
+    size_t appended_len = 0;
+    uint64_t segments = 0;
+    dump_segment_t seg;
+
+    while( (offset < st.st_size) && !__dump_segment_check(path_to_profile, map + offset, st.st_size - offset, &seg) )
     {
-        prof->desc.end_time = dump->desc.end_time;
+        size_t len = sizeof(tau_metric_dump_header_t) + seg.header.stored_len;
+
+        if(segments)
+        {
+            appended_len += len;
+        }
+        else
+        {
+            base_len = len;
+        }
+
+        offset += len;
+        segments++;
     }
 
-    /* And dump again ! */
-    tau_metric_dump_save(prof->path, &prof->desc, &metrics);
+    munmap(map, st.st_size);
+
+    if(!segments)
+    {
+        /* Corrupted from the start, the caller removes it */
+        close(fd);
+        return 1;
+    }
+
+    if(offset < st.st_size)
+    {
+        tau_metric_proxy_error("Dropping %ld bytes after the last valid segment of %s", st.st_size - offset, path_to_profile);
+
+        if(ftruncate(fd, offset) < 0)
+        {
+            tau_metric_proxy_perror("ftruncate");
+            close(fd);
+            return 1;
+        }
+    }
+
+    size_t len = __profile_append_segment(fd, offset, dump);
+
+    if(!len)
+    {
+        /* Drop what may have been written of it */
+        if(ftruncate(fd, offset) < 0)
+        {
+            tau_metric_proxy_perror("ftruncate");
+        }
+
+        close(fd);
+        tau_metric_proxy_error("Could not append %s to %s", dump->desc.jobid, path_to_profile);
+        return 1;
+    }
+
+    close(fd);
+
+    appended_len += len;
+    segments++;
+
+    tau_metric_proxy_log_verbose("Appended %lu bytes to %s (%lu segments)", len, path_to_profile, segments);
+
+    /* Rewriting once the appended dumps outweigh the base keeps the
+       cost of each dump proportional to its size */
+    if( (appended_len < TAU_METRIC_PROFILE_COMPACT_RATIO * base_len) && (segments < TAU_METRIC_PROFILE_MAX_SEGMENTS) )
+    {
+        return 0;
+    }
+
+    tau_metric_dump_view_t view;
+
+    if( tau_metric_dump_view_open(&view, path_to_profile) )
+    {
+        tau_metric_proxy_error("Could not compact %s", path_to_profile);
+        return 0;
+    }
+
+    tau_metric_proxy_log_verbose("Compacting %lu segments of %s", view.segments, path_to_profile);
+
+    if( tau_metric_dump_view_write(path_to_profile, &view) )
+    {
+        /* The dumps stay appended */
+        tau_metric_proxy_error("Could not compact %s", path_to_profile);
+    }
 
-    metric_array_release(&metrics);
+    tau_metric_dump_view_close(&view);
 
     return 0;
 }
@@ -296,11 +1406,7 @@ int tau_metric_profile_free(tau_metric_profile_t **profile)
         return 0;
     }
 
-    if((*profile)->dump)
-    {
-        free((*profile)->dump);
-        (*profile)->dump = NULL;
-    }
+    tau_metric_dump_view_close(&(*profile)->view);
 
     free(*profile);
     *profile = NULL;
@@ -523,9 +1629,9 @@ int tau_metric_profile_store_release();
 
 int __tau_metric_profile_store_insert(const char * dump_path)
 {
-    tau_metric_dump_t * dump = tau_metric_dump_load(dump_path);
+    tau_metric_dump_view_t dump;
 
-    if(!dump)
+    if( tau_metric_dump_view_open(&dump, dump_path) )
     {
         tau_metric_proxy_error("Failed to load %s", dump_path);
 
@@ -534,40 +1640,48 @@ int __tau_metric_profile_store_insert(const char * dump_path)
     }
 
 
-    char * path = tau_metric_profile_job_to_path(dump->desc.jobid);
+    char * path = tau_metric_profile_job_to_path(dump.desc.jobid);
 
     tau_metric_profile_t * profile = NULL;
 
     /* If we are here we did load it
        now check if an existing profile has this id */
-    if(__tau_metric_profile_store_is_present(dump->desc.jobid))
+    if(__tau_metric_profile_store_is_present(dump.desc.jobid))
     {
         /* It means we should be able to open it */
 
         if(!utils_isfile(path))
         {
-            free(dump);
+            tau_metric_dump_view_close(&dump);
             tau_metric_proxy_error("Could not locate profile file %s", path);
             return 1;
         }
 
+        /* Appended without reading the profile when it is in version 2 */
+        if( !tau_metric_profile_append(path, &dump) )
+        {
+            tau_metric_dump_view_close(&dump);
+            return 0;
+        }
+
         profile = tau_metric_profile_load(path);
 
         if(!profile)
         {
-            free(dump);
             tau_metric_proxy_error("Removing apparently corrupted profile %s", path);
             /* We are provably corruped in the profile better delete */
-            __tau_metric_profile_store_remove(dump->desc.jobid);
+            __tau_metric_profile_store_remove(dump.desc.jobid);
             unlink(path);
+            tau_metric_dump_view_close(&dump);
             return 1;
         }
 
 
         /* And now sum up variables */
-        if( tau_metric_profile_consolidate(profile, dump) )
+        if( tau_metric_profile_consolidate(profile, &dump) )
         {
-            free(dump);
+            tau_metric_profile_free(&profile);
+            tau_metric_dump_view_close(&dump);
             return 1;
         }
 
@@ -576,24 +1690,58 @@ int __tau_metric_profile_store_insert(const char * dump_path)
     else
     {
         /* We need to create it from scratch */
-        if( tau_metric_profile_init_from_dump(path, dump) )
+        if( tau_metric_profile_init_from_dump(path, &dump) )
         {
-            free(dump);
+            tau_metric_dump_view_close(&dump);
             return 1;
         }
 
         /* And now add it to known list */
-        __tau_metric_profile_store_add(dump->desc.jobid);
+        __tau_metric_profile_store_add(dump.desc.jobid);
 
     }
 
-    free(dump);
+    tau_metric_dump_view_close(&dump);
 
     return 0;
 }
 
 
 
+int tau_metric_profile_store_ingest(const char * dump_name)
+{
+    /* Only dumps, not the files being written before their rename */
+    if( (dump_name[0] == '.') || !strstr(dump_name, ".taumetric") )
+    {
+        return -1;
+    }
+
+    char fullpath[512];
+
+    if( 512 <= snprintf(fullpath, 512, "%s/%s", __profile_storage.job_directory, dump_name) )
+    {
+        tau_metric_proxy_error("Profiles: path of %s is too long, leaving it", dump_name);
+        return 1;
+    }
+
+    tau_metric_proxy_log_verbose("Profiles: Processing %s", fullpath);
+
+    struct stat st;
+    uint64_t merge_start = proxy_stats_nsec();
+
+    if( __tau_metric_profile_store_insert(fullpath) )
+    {
+        return 1;
+    }
+
+    proxy_stats_merge(proxy_stats_nsec() - merge_start, (stat(fullpath, &st) == 0) ? st.st_size : 0);
+
+    /* Processed it we can now delete ! */
+    unlink(fullpath);
+
+    return 0;
+}
+
 int tau_metric_profile_store_consolidate()
 {
     /* Here we do a scandir on the job path */
@@ -611,25 +1759,12 @@ int tau_metric_profile_store_consolidate()
 
     struct dirent *dir;
 
-    char fullpath[512];
-
     while ((dir = readdir(d)) != NULL)
     {
-        if(dir->d_type == DT_REG)
+        /* Only check regular files with extension */
+        if( (dir->d_type == DT_REG) && (0 <= tau_metric_profile_store_ingest(dir->d_name)) )
         {
-            /* Only check regular files with extension */
-            if(strstr(dir->d_name, ".taumetric"))
-            {
-                snprintf(fullpath, 512, "%s/%s", __profile_storage.job_directory, dir->d_name);
-                tau_metric_proxy_log_verbose("Profiles: Processing %s", fullpath);
-
-                if( __tau_metric_profile_store_insert(fullpath) == 0)
-                {
-                    /* Processed it we can now delete ! */
-                    unlink(fullpath);
-                }
-                counter++;
-            }
+            counter++;
         }
     }
 
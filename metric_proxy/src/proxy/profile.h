@@ -14,9 +14,159 @@ typedef struct
     tau_metric_snapshot_t metrics[0];
 }tau_metric_dump_t;
 
+/* Version 1 files are this structure followed by an int canary.
+   Version 2 files are a tau_metric_dump_header_t followed by the
+   payload: the columns of the values (double), update timestamps
+   (double), name and doc offsets in the string table (uint32_t) and
+   types (uint8_t), then the string table holding each distinct string
+   once with its NUL. The payload may be compressed. Profiles may be
+   followed by more such segments: dumps appended to them, which are
+   merged in order when reading. */
+
+#define TAU_METRIC_DUMP_MAGIC "TAUPROF"
+#define TAU_METRIC_DUMP_VERSION 2
+
+/** Bytes of the columns of a metric in the payload */
+#define TAU_METRIC_DUMP_COLUMNS_SIZE (2 * sizeof(double) + 2 * sizeof(uint32_t) + sizeof(uint8_t))
+
+/** Level of the zlib compressed payloads */
+#define TAU_METRIC_DUMP_ZLIB_LEVEL 6
+
+typedef enum
+{
+    TAU_METRIC_DUMP_CODEC_NONE = 0,
+    TAU_METRIC_DUMP_CODEC_ZLIB,
+    TAU_METRIC_DUMP_CODEC_SNAPPY,
+    TAU_METRIC_DUMP_CODEC_COUNT
+}tau_metric_dump_codec_t;
+
+typedef struct
+{
+    char                        magic[8];    /**< @ref TAU_METRIC_DUMP_MAGIC */
+    uint32_t                    version;     /**< @ref TAU_METRIC_DUMP_VERSION */
+    uint32_t                    codec;       /**< Compression of the payload */
+    uint64_t                    metric_count;
+    uint64_t                    strings_len; /**< Bytes of the string table ending the payload */
+    uint64_t                    raw_len;     /**< Payload length once uncompressed */
+    uint64_t                    stored_len;  /**< Payload length in the file */
+    uint32_t                    payload_crc; /**< CRC32C of the stored payload */
+    uint32_t                    header_crc;  /**< CRC32C of this header with this field zeroed */
+    tau_metric_job_descriptor_t desc;
+}tau_metric_dump_header_t;
+
+/**
+ * @brief Select the compression of the dumps and profiles written next
+ *
+ * @param name "none", "zlib" or "snappy"
+ * @return int 0 on success, 1 if unknown or not built
+ */
+int tau_metric_dump_set_codec(const char * name);
+
+/**
+ * @brief A metric read in place from a dump
+ *
+ */
+typedef struct
+{
+    const char *      name;      /**< In the view (valid until it is closed) */
+    const char *      doc;       /**< In the view (valid until it is closed) */
+    tau_metric_type_t type;
+    double            value;
+    double            update_ts;
+}tau_metric_dump_entry_t;
+
+/**
+ * @brief A dump or a profile mapped read-only
+ *
+ */
+typedef struct
+{
+    int                           version;     /**< Version of the file */
+    uint64_t                      count;       /**< Number of metrics */
+    tau_metric_job_descriptor_t   desc;
+    void *                        map;         /**< The whole file */
+    size_t                        map_len;
+    char *                        inflated;    /**< Uncompressed payload (NULL when read in the mapping) */
+    const tau_metric_snapshot_t * records;     /**< Version 1 records */
+    const char *                  values;      /**< Version 2 columns */
+    const char *                  ts;
+    const char *                  names;
+    const char *                  docs;
+    const char *                  types;
+    const char *                  strings;
+    uint64_t                      strings_len;
+    uint64_t                      segments;    /**< Version 2 segments: the base then the appended dumps */
+    size_t                        valid_len;   /**< Bytes of the file up to the end of the last valid segment */
+    tau_metric_dump_entry_t *     merged;      /**< Series merged over the segments (NULL for a single one) */
+}tau_metric_dump_view_t;
+
+/**
+ * @brief Map a dump or a profile of any version
+ *
+ * Checks the file then reads it in place: only compressed payloads
+ * are copied, once, when they are uncompressed. The dumps appended to
+ * a profile are merged in an array of entries. An incomplete trailing
+ * segment is ignored.
+ *
+ * @param view the view to open
+ * @param path file to map
+ * @return int 0 on success, 1 if unreadable or corrupted
+ */
+int tau_metric_dump_view_open(tau_metric_dump_view_t * view, const char * path);
+
+/**
+ * @brief Read a metric of a view
+ *
+ * @param view an open view
+ * @param i index of the metric (below view->count)
+ * @param entry filled with the metric, strings point in the view
+ * @return int 0 on success, 1 if out of range or corrupted
+ */
+int tau_metric_dump_view_get(tau_metric_dump_view_t * view, uint64_t i, tau_metric_dump_entry_t * entry);
+
+/**
+ * @brief Unmap a view
+ *
+ * @param view the view to close (entries read from it are invalidated)
+ */
+void tau_metric_dump_view_close(tau_metric_dump_view_t * view);
+
+/**
+ * @brief Load a dump or a profile of any version
+ *
+ * @param path file to load
+ * @return tau_metric_dump_t* the dump to free, NULL if unreadable or corrupted
+ */
 tau_metric_dump_t * tau_metric_dump_load(const char * path);
+
+/**
+ * @brief Save the series of an array
+ *
+ * @param path file to write
+ * @param desc job of the array
+ * @param metrics the series
+ * @return int 0 on success
+ */
 int tau_metric_dump_save(const char * path, tau_metric_job_descriptor_t * desc, metric_array_t * metrics);
 
+/**
+ * @brief Save a loaded dump in the current version
+ *
+ * @param path file to write
+ * @param dump the dump to write
+ * @return int 0 on success
+ */
+int tau_metric_dump_write(const char * path, tau_metric_dump_t * dump);
+
+/**
+ * @brief Save a mapped dump in the current version
+ *
+ * @param path file to write (may be the mapped one)
+ * @param view the dump to write
+ * @return int 0 on success
+ */
+int tau_metric_dump_view_write(const char * path, tau_metric_dump_view_t * view);
+
 /********************************************
  * IMPLEMENTATION OF A PROFILE ACCUMULATION *
  ********************************************/
@@ -25,11 +175,32 @@ typedef struct
 {
     char path[512];
     tau_metric_job_descriptor_t desc;
-    tau_metric_dump_t * dump;
+    tau_metric_dump_view_t view;
 }tau_metric_profile_t;
 
+/** Profiles are rewritten once the dumps appended to them outweigh their base by this ratio */
+#define TAU_METRIC_PROFILE_COMPACT_RATIO 4.0
+
+/** Or once they hold this many segments */
+#define TAU_METRIC_PROFILE_MAX_SEGMENTS 64
+
 tau_metric_profile_t * tau_metric_profile_load(char * path_to_profile);
-int tau_metric_profile_consolidate(tau_metric_profile_t * prof, tau_metric_dump_t *dump);
+
+/**
+ * @brief Merge a dump in a profile by appending it
+ *
+ * Only the segment headers of the profile are read and the dump is
+ * appended as a new segment (copied as is when already in version 2).
+ * The profile is rewritten with the merged series once the appended
+ * segments outweigh its base, see @ref TAU_METRIC_PROFILE_COMPACT_RATIO.
+ *
+ * @param path_to_profile the profile to extend
+ * @param dump the dump to merge
+ * @return int 0 on success, 1 on error or for a version 1 profile (use @ref tau_metric_profile_consolidate)
+ */
+int tau_metric_profile_append(char * path_to_profile, tau_metric_dump_view_t * dump);
+int tau_metric_profile_init_from_dump(char * path_to_profile, tau_metric_dump_view_t * dump);
+int tau_metric_profile_consolidate(tau_metric_profile_t * prof, tau_metric_dump_view_t *dump);
 int tau_metric_profile_free(tau_metric_profile_t **profile);
 
 /********************************
@@ -59,6 +230,17 @@ int tau_metric_profile_store_release();
 
 int tau_metric_profile_store_consolidate();
 
+/**
+ * @brief Merge a single dump of the job directory in its profile
+ *
+ * The dump is removed once merged. Names which are not dumps,
+ * including the temporary files dumps are written to, are ignored.
+ *
+ * @param dump_name name of the file in the job directory
+ * @return int 0 if merged, 1 on error (the dump is kept), -1 if ignored
+ */
+int tau_metric_profile_store_ingest(const char * dump_name);
+
 
 
 
@@ -0,0 +1,918 @@
+#include "remote.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "exporter.h"
+#include "log.h"
+#include "metrics.h"
+#include "snappy.h"
+#include "utils.h"
+
+/***********
+* BATCHES *
+***********/
+
+/**
+ * @brief A compressed request shared by all the endpoints
+ *
+ */
+typedef struct
+{
+	uint64_t refs;    /**< Endpoints still holding it */
+	uint64_t samples; /**< Series in the request */
+	size_t   len;     /**< Length of the compressed body */
+	char     data[];  /**< Snappy compressed prometheus.WriteRequest */
+}remote_batch_t;
+
+static void __remote_batch_release(remote_batch_t *b)
+{
+	if(!__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) )
+	{
+		free(b);
+	}
+}
+
+typedef struct remote_pending_s
+{
+	remote_batch_t *          batch;
+	struct remote_pending_s * next;
+}remote_pending_t;
+
+/*************
+* ENDPOINTS *
+*************/
+
+struct remote_endpoint_s;
+
+/**
+ * @brief Requests of a shard of the series to an endpoint
+ *
+ * Each shard has its thread and connection and sends its batches in
+ * order: the samples of a series are never reordered by retries.
+ */
+typedef struct
+{
+	struct remote_endpoint_s *endpoint;
+	pthread_t                 thread;
+	pthread_mutex_t           lock;
+	pthread_cond_t            cond;    /**< Signaled when a batch is queued or on stop */
+	remote_pending_t *        head;    /**< Oldest batch waiting */
+	remote_pending_t *        tail;
+	size_t                    bytes;   /**< Compressed bytes waiting or being sent */
+	int                       fd;      /**< Kept alive connection (-1 when closed) */
+}remote_shard_t;
+
+typedef struct remote_endpoint_s
+{
+	char             url[512];
+	char             host[256];
+	char             port[8];
+	char             path[512];
+	remote_shard_t * shards;
+	/* Recorded by the shards */
+	uint64_t         sent_samples;
+	uint64_t         sent_bytes;
+	uint64_t         failed_samples;
+	uint64_t         dropped_samples;
+	uint64_t         retries;
+	/* Published in the node array */
+	metric_t *       m_sent_samples;
+	metric_t *       m_sent_bytes;
+	metric_t *       m_failed_samples;
+	metric_t *       m_dropped_samples;
+	metric_t *       m_retries;
+	metric_t *       m_pending_bytes;
+}remote_endpoint_t;
+
+static struct
+{
+	int                running;
+	double             period;
+	unsigned int       connections;
+	size_t             shard_max_bytes;   /**< Share of the endpoint budget of each shard */
+	int                endpoint_count;
+	remote_endpoint_t  endpoints[TAU_METRIC_REMOTE_MAX_ENDPOINTS];
+	char               label[300];        /**< instance label of the series */
+	double             since;             /**< Snapshot time of the last push */
+	metric_array_snapshot_t snapshot;     /**< Reused between pushes */
+	pthread_t          thread;
+}__remote = { 0 };
+
+int tau_metric_remote_add(const char *url)
+{
+	if(__remote.endpoint_count == TAU_METRIC_REMOTE_MAX_ENDPOINTS)
+	{
+		tau_metric_proxy_error("Cannot push to more than %d endpoints", TAU_METRIC_REMOTE_MAX_ENDPOINTS);
+		return 1;
+	}
+
+	remote_endpoint_t *e = &__remote.endpoints[__remote.endpoint_count];
+
+	/* The url is also a label value */
+	if(strncmp(url, "http://", 7) || strpbrk(url, "\"\\") || (sizeof(e->url) <= strlen(url) ) )
+	{
+		tau_metric_proxy_error("Remote write endpoints are http://host[:port][/path] urls had: %s", url);
+		return 1;
+	}
+
+	const char *host     = url + 7;
+	size_t      host_len = strcspn(host, ":/");
+
+	if(!host_len || (sizeof(e->host) <= host_len) )
+	{
+		tau_metric_proxy_error("No host in remote write endpoint %s", url);
+		return 1;
+	}
+
+	snprintf(e->url, sizeof(e->url), "%s", url);
+	snprintf(e->host, sizeof(e->host), "%.*s", (int)host_len, host);
+	snprintf(e->port, sizeof(e->port), "80");
+
+	const char *p = host + host_len;
+
+	if(*p == ':')
+	{
+		size_t port_len = strspn(++p, "0123456789");
+
+		if(!port_len || (5 < port_len) )
+		{
+			tau_metric_proxy_error("Invalid port in remote write endpoint %s", url);
+			return 1;
+		}
+
+		snprintf(e->port, sizeof(e->port), "%.*s", (int)port_len, p);
+		p += port_len;
+	}
+
+	if(*p && (*p != '/') )
+	{
+		tau_metric_proxy_error("Invalid path in remote write endpoint %s", url);
+		return 1;
+	}
+
+	snprintf(e->path, sizeof(e->path), "%s", *p ? p : TAU_METRIC_REMOTE_DEFAULT_PATH);
+
+	__remote.endpoint_count++;
+
+	tau_metric_proxy_log("Series will be pushed to %s:%s%s", e->host, e->port, e->path);
+
+	return 0;
+}
+
+/********
+* HTTP *
+********/
+
+static int __remote_connect(remote_endpoint_t *e)
+{
+	struct addrinfo hints = { 0 };
+	struct addrinfo *res  = NULL;
+
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(e->host, e->port, &hints, &res);
+
+	if(ret)
+	{
+		tau_metric_proxy_log_verbose("Cannot resolve %s: %s", e->host, gai_strerror(ret) );
+		return -1;
+	}
+
+	struct timeval timeout = { .tv_sec = TAU_METRIC_REMOTE_TIMEOUT, .tv_usec = 0 };
+	int            fd      = -1;
+	struct addrinfo *tmp;
+
+	for(tmp = res; tmp; tmp = tmp->ai_next)
+	{
+		fd = socket(tmp->ai_family, tmp->ai_socktype, tmp->ai_protocol);
+
+		if(fd < 0)
+		{
+			continue;
+		}
+
+		/* The send timeout also bounds connect */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout) );
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+
+		if(!connect(fd, tmp->ai_addr, tmp->ai_addrlen) )
+		{
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if(0 <= fd)
+	{
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+	}
+
+	return fd;
+}
+
+static int __remote_send(int fd, struct iovec *iov, int count)
+{
+	while(count)
+	{
+		struct msghdr msg = { 0 };
+
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = count;
+
+		ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			return -1;
+		}
+
+		while(count && (iov->iov_len <= (size_t)ret) )
+		{
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if(count)
+		{
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Value of a header in a response head, NULL if absent */
+static const char *__remote_header(const char *head, const char *name)
+{
+	size_t      len  = strlen(name);
+	const char *line = strstr(head, "\r\n");
+
+	while(line)
+	{
+		line += 2;
+
+		if(!strncasecmp(line, name, len) && (line[len] == ':') )
+		{
+			return line + len + 1 + strspn(line + len + 1, " \t");
+		}
+
+		line = strstr(line, "\r\n");
+	}
+
+	return NULL;
+}
+
+/* Read the answer to a request, returns its status (-1 on error) and
+   clears keep when the connection cannot be used again */
+static int __remote_response(int fd, int *keep)
+{
+	char   buff[4096];
+	size_t have = 0;
+	char * end  = NULL;
+
+	*keep = 0;
+
+	while(!end)
+	{
+		if(have == sizeof(buff) - 1)
+		{
+			return -1;
+		}
+
+		ssize_t ret = recv(fd, buff + have, sizeof(buff) - 1 - have, 0);
+
+		if( (ret < 0) && (errno == EINTR) )
+		{
+			continue;
+		}
+
+		if(ret <= 0)
+		{
+			return -1;
+		}
+
+		have      += ret;
+		buff[have] = '\0';
+		end        = strstr(buff, "\r\n\r\n");
+	}
+
+	int code;
+
+	if(sscanf(buff, "HTTP/%*d.%*d %d", &code) != 1)
+	{
+		return -1;
+	}
+
+	size_t got = have - (end + 4 - buff);
+
+	end[2] = '\0';
+
+	const char *length     = __remote_header(buff, "Content-Length");
+	const char *connection = __remote_header(buff, "Connection");
+
+	/* Without a length the body ends with the connection */
+	if(!length)
+	{
+		return code;
+	}
+
+	size_t body = strtoull(length, NULL, 10);
+
+	while(got < body)
+	{
+		ssize_t ret = recv(fd, buff, sizeof(buff), 0);
+
+		if( (ret < 0) && (errno == EINTR) )
+		{
+			continue;
+		}
+
+		if(ret <= 0)
+		{
+			return -1;
+		}
+
+		got += ret;
+	}
+
+	*keep = !connection || strncasecmp(connection, "close", 5);
+
+	return code;
+}
+
+/* POST a batch, returns the HTTP status (-1 if no answer) */
+static int __remote_post(remote_shard_t *s, remote_batch_t *b)
+{
+	remote_endpoint_t *e = s->endpoint;
+	char               header[1024];
+
+	int header_len = snprintf(header, sizeof(header),
+	                          "POST %s HTTP/1.1\r\n"
+	                          "Host: %s:%s\r\n"
+	                          "User-Agent: tau_metric_proxy\r\n"
+	                          "Content-Type: application/x-protobuf\r\n"
+	                          "Content-Encoding: snappy\r\n"
+	                          "X-Prometheus-Remote-Write-Version: 0.1.0\r\n"
+	                          "Content-Length: %lu\r\n\r\n",
+	                          e->path, e->host, e->port, b->len);
+
+	int attempt;
+
+	for(attempt = 0; attempt < 2; attempt++)
+	{
+		/* The peer may have closed a kept alive connection
+		   meanwhile: try again once on a new one */
+		int reused = (0 <= s->fd);
+
+		if(!reused && ( (s->fd = __remote_connect(e) ) < 0) )
+		{
+			return -1;
+		}
+
+		struct iovec iov[2] =
+		{
+			{ .iov_base = header, .iov_len = header_len },
+			{ .iov_base = b->data, .iov_len = b->len }
+		};
+
+		int keep = 0;
+		int code = -1;
+
+		if(!__remote_send(s->fd, iov, 2) )
+		{
+			code = __remote_response(s->fd, &keep);
+		}
+
+		if( (code < 0) || !keep)
+		{
+			close(s->fd);
+			s->fd = -1;
+		}
+
+		if( (0 <= code) || !reused)
+		{
+			return code;
+		}
+	}
+
+	return -1;
+}
+
+/**********
+* SHARDS *
+**********/
+
+static void __remote_sleep(double seconds)
+{
+	double end = utils_get_ts() + seconds;
+
+	while(__remote.running && (utils_get_ts() < end) )
+	{
+		usleep(10000);
+	}
+}
+
+static void __remote_deliver(remote_shard_t *s, remote_batch_t *b)
+{
+	remote_endpoint_t *e       = s->endpoint;
+	double             backoff = TAU_METRIC_REMOTE_MIN_BACKOFF;
+
+	while(__remote.running)
+	{
+		int code = __remote_post(s, b);
+
+		if( (200 <= code) && (code < 300) )
+		{
+			__atomic_add_fetch(&e->sent_samples, b->samples, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&e->sent_bytes, b->len, __ATOMIC_RELAXED);
+			return;
+		}
+
+		/* The request itself is refused: sending it again would not help */
+		if( (400 <= code) && (code < 500) && (code != 429) )
+		{
+			tau_metric_proxy_error("%s refused %lu series (HTTP %d)", e->url, b->samples, code);
+			__atomic_add_fetch(&e->failed_samples, b->samples, __ATOMIC_RELAXED);
+			return;
+		}
+
+		if( (backoff == TAU_METRIC_REMOTE_MIN_BACKOFF) && (code < 0) )
+		{
+			tau_metric_proxy_error("Push to %s failed (no answer), retrying", e->url);
+		}
+		else if(backoff == TAU_METRIC_REMOTE_MIN_BACKOFF)
+		{
+			tau_metric_proxy_error("Push to %s failed (HTTP %d), retrying", e->url, code);
+		}
+
+		__atomic_add_fetch(&e->retries, 1, __ATOMIC_RELAXED);
+
+		__remote_sleep(backoff);
+
+		backoff *= 2;
+
+		if(TAU_METRIC_REMOTE_MAX_BACKOFF < backoff)
+		{
+			backoff = TAU_METRIC_REMOTE_MAX_BACKOFF;
+		}
+	}
+
+	/* Stopped before it went through */
+	__atomic_add_fetch(&e->dropped_samples, b->samples, __ATOMIC_RELAXED);
+}
+
+static void *__remote_shard_loop(void *pshard)
+{
+	remote_shard_t *s = (remote_shard_t *)pshard;
+
+	while(1)
+	{
+		pthread_mutex_lock(&s->lock);
+
+		while(__remote.running && !s->head)
+		{
+			pthread_cond_wait(&s->cond, &s->lock);
+		}
+
+		if(!__remote.running)
+		{
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+
+		/* Stays counted in bytes until sent */
+		remote_pending_t *p = s->head;
+
+		s->head = p->next;
+
+		if(!s->head)
+		{
+			s->tail = NULL;
+		}
+
+		pthread_mutex_unlock(&s->lock);
+
+		__remote_deliver(s, p->batch);
+
+		pthread_mutex_lock(&s->lock);
+		s->bytes -= p->batch->len;
+		pthread_mutex_unlock(&s->lock);
+
+		__remote_batch_release(p->batch);
+		free(p);
+	}
+
+	return NULL;
+}
+
+static void __remote_drop(remote_endpoint_t *e, remote_pending_t *list)
+{
+	while(list)
+	{
+		remote_pending_t *next = list->next;
+
+		__atomic_add_fetch(&e->dropped_samples, list->batch->samples, __ATOMIC_RELAXED);
+		__remote_batch_release(list->batch);
+		free(list);
+
+		list = next;
+	}
+}
+
+static void __remote_queue(remote_shard_t *s, remote_batch_t *b)
+{
+	remote_pending_t *p = malloc(sizeof(remote_pending_t) );
+
+	if(!p)
+	{
+		tau_metric_proxy_perror("malloc");
+		__atomic_add_fetch(&s->endpoint->dropped_samples, b->samples, __ATOMIC_RELAXED);
+		__remote_batch_release(b);
+		return;
+	}
+
+	p->batch = b;
+	p->next  = NULL;
+
+	remote_pending_t *dropped = NULL;
+
+	pthread_mutex_lock(&s->lock);
+
+	/* Make room dropping the oldest batches still waiting */
+	while(s->head && (__remote.shard_max_bytes < s->bytes + b->len) )
+	{
+		remote_pending_t *old = s->head;
+
+		s->head = old->next;
+
+		if(!s->head)
+		{
+			s->tail = NULL;
+		}
+
+		s->bytes -= old->batch->len;
+		old->next = dropped;
+		dropped   = old;
+	}
+
+	/* Only the batch being sent is left and there is no room besides it */
+	if(__remote.shard_max_bytes < s->bytes + b->len)
+	{
+		p->next = dropped;
+		dropped = p;
+	}
+	else
+	{
+		if(s->tail)
+		{
+			s->tail->next = p;
+		}
+		else
+		{
+			s->head = p;
+		}
+
+		s->tail   = p;
+		s->bytes += b->len;
+
+		pthread_cond_signal(&s->cond);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	__remote_drop(s->endpoint, dropped);
+}
+
+/**********
+* PUSHER *
+**********/
+
+/* Compress a rendered request for all the endpoints */
+static remote_batch_t *__remote_batch(const char *body, size_t len, uint64_t samples)
+{
+	remote_batch_t *ret = malloc(sizeof(remote_batch_t) + snappy_max_compressed_length(len) );
+
+	if(!ret)
+	{
+		tau_metric_proxy_perror("malloc");
+		return NULL;
+	}
+
+	ret->refs    = __remote.endpoint_count;
+	ret->samples = samples;
+	ret->len     = snappy_compress(body, len, ret->data);
+
+	remote_batch_t *shrunk = realloc(ret, sizeof(remote_batch_t) + ret->len);
+
+	return shrunk ? shrunk : ret;
+}
+
+static void __remote_push(void)
+{
+	metric_array_snapshot_t *snap = &__remote.snapshot;
+
+	/* Values only: the request encodes them in binary */
+	snap->render = 0;
+
+	if(metric_array_snapshot_take(metric_array_get_main(), snap) )
+	{
+		return;
+	}
+
+	uint64_t     series = 0;
+	size_t       bytes  = 0;
+	int          failed = 0;
+	unsigned int shard;
+	int          i;
+
+	for(shard = 0; shard < __remote.connections; shard++)
+	{
+		uint64_t cursor = 0;
+
+		while(1)
+		{
+			size_t   len;
+			uint64_t samples;
+			char *   body = tau_metric_exporter_render_remote_write(snap, &cursor, __remote.since, shard,
+			                                                        __remote.connections, __remote.label,
+			                                                        TAU_METRIC_REMOTE_BATCH_SERIES, &len, &samples);
+
+			if(!body || !samples)
+			{
+				failed |= !body;
+				free(body);
+				break;
+			}
+
+			remote_batch_t *b = __remote_batch(body, len, samples);
+
+			free(body);
+
+			if(!b)
+			{
+				failed = 1;
+				break;
+			}
+
+			series += samples;
+			bytes  += b->len;
+
+			for(i = 0; i < __remote.endpoint_count; i++)
+			{
+				__remote_queue(&__remote.endpoints[i].shards[shard], b);
+			}
+		}
+	}
+
+	/* Series left out are sent with the next push */
+	if(!failed)
+	{
+		__remote.since = snap->ts;
+	}
+
+	metric_array_snapshot_release(snap);
+
+	tau_metric_proxy_log_verbose("Pushing %ld updated series in %ld compressed bytes", series, bytes);
+}
+
+static void __remote_publish(void)
+{
+	int i;
+
+	for(i = 0; i < __remote.endpoint_count; i++)
+	{
+		remote_endpoint_t *e       = &__remote.endpoints[i];
+		size_t             pending = 0;
+		unsigned int       shard;
+
+		for(shard = 0; shard < __remote.connections; shard++)
+		{
+			pending += __atomic_load_n(&e->shards[shard].bytes, __ATOMIC_RELAXED);
+		}
+
+		metric_set(e->m_sent_samples, __atomic_load_n(&e->sent_samples, __ATOMIC_RELAXED) );
+		metric_set(e->m_sent_bytes, __atomic_load_n(&e->sent_bytes, __ATOMIC_RELAXED) );
+		metric_set(e->m_failed_samples, __atomic_load_n(&e->failed_samples, __ATOMIC_RELAXED) );
+		metric_set(e->m_dropped_samples, __atomic_load_n(&e->dropped_samples, __ATOMIC_RELAXED) );
+		metric_set(e->m_retries, __atomic_load_n(&e->retries, __ATOMIC_RELAXED) );
+		metric_set(e->m_pending_bytes, pending);
+	}
+}
+
+static void *__remote_thread_loop(void *dummy)
+{
+	while(__remote.running)
+	{
+		__remote_push();
+
+		double end = utils_get_ts() + __remote.period;
+		int    tick;
+
+		for(tick = 0; __remote.running && (utils_get_ts() < end); tick++)
+		{
+			/* Statistics once a second */
+			if(!(tick % 100) )
+			{
+				__remote_publish();
+			}
+
+			usleep(10000);
+		}
+	}
+
+	return NULL;
+}
+
+static metric_t *__remote_metric(remote_endpoint_t *e, const char *name, const char *doc, tau_metric_type_t type)
+{
+	char endpoint[2 * sizeof(e->url)];
+	char full_name[METRIC_STRING_SIZE];
+
+	tau_metric_exporter_label_escape(e->url, endpoint, sizeof(endpoint) );
+
+	/* Names are interned up to METRIC_STRING_SIZE: a longer one would lose its labels */
+	if(METRIC_STRING_SIZE <= snprintf(full_name, METRIC_STRING_SIZE, "%s{endpoint=\"%s\"}", name, endpoint) )
+	{
+		tau_metric_proxy_error("The URL of %s is too long to label %s", e->url, name);
+		return NULL;
+	}
+
+	return metric_array_get_pinned(full_name, doc, type);
+}
+
+static int __remote_endpoint_start(remote_endpoint_t *e)
+{
+	e->m_sent_samples    = __remote_metric(e, "tau_proxy_remote_samples_total", "Series samples accepted by the remote write endpoint", TAU_METRIC_COUNTER);
+	e->m_sent_bytes      = __remote_metric(e, "tau_proxy_remote_sent_bytes_total", "Compressed bytes accepted by the remote write endpoint", TAU_METRIC_COUNTER);
+	e->m_failed_samples  = __remote_metric(e, "tau_proxy_remote_failed_samples_total", "Series samples refused by the remote write endpoint", TAU_METRIC_COUNTER);
+	e->m_dropped_samples = __remote_metric(e, "tau_proxy_remote_dropped_samples_total", "Series samples dropped while the remote write endpoint was not answering", TAU_METRIC_COUNTER);
+	e->m_retries         = __remote_metric(e, "tau_proxy_remote_retries_total", "Remote write requests sent again after a failure", TAU_METRIC_COUNTER);
+	e->m_pending_bytes   = __remote_metric(e, "tau_proxy_remote_pending_bytes", "Compressed bytes waiting for the remote write endpoint", TAU_METRIC_GAUGE);
+
+	if(!e->m_sent_samples || !e->m_sent_bytes || !e->m_failed_samples || !e->m_dropped_samples ||
+	   !e->m_retries || !e->m_pending_bytes)
+	{
+		return 1;
+	}
+
+	e->shards = calloc(__remote.connections, sizeof(remote_shard_t) );
+
+	if(!e->shards)
+	{
+		tau_metric_proxy_perror("calloc");
+		return 1;
+	}
+
+	unsigned int shard;
+
+	for(shard = 0; shard < __remote.connections; shard++)
+	{
+		remote_shard_t *s = &e->shards[shard];
+
+		s->endpoint = e;
+		s->fd       = -1;
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+
+		if(pthread_create(&s->thread, NULL, __remote_shard_loop, s) )
+		{
+			tau_metric_proxy_perror("pthread_create");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int tau_metric_remote_start(double period, unsigned int connections, size_t max_bytes)
+{
+	if(!__remote.endpoint_count)
+	{
+		return 0;
+	}
+
+	char host[256];
+
+	if(gethostname(host, sizeof(host) ) )
+	{
+		tau_metric_proxy_perror("gethostname");
+		snprintf(host, sizeof(host), "unknown");
+	}
+
+	host[sizeof(host) - 1] = '\0';
+
+	snprintf(__remote.label, sizeof(__remote.label), "instance=\"%s\"", host);
+
+	__remote.period          = period;
+	__remote.connections     = connections ? connections : 1;
+	__remote.shard_max_bytes = max_bytes / __remote.connections;
+	__remote.since           = 0;
+	__remote.running         = 1;
+
+	int i;
+
+	for(i = 0; i < __remote.endpoint_count; i++)
+	{
+		if(__remote_endpoint_start(&__remote.endpoints[i]) )
+		{
+			tau_metric_remote_stop();
+			return 1;
+		}
+	}
+
+	if(pthread_create(&__remote.thread, NULL, __remote_thread_loop, NULL) )
+	{
+		tau_metric_proxy_perror("pthread_create");
+		tau_metric_remote_stop();
+		return 1;
+	}
+
+	tau_metric_proxy_log("Pushing series every %g seconds over %d connections per endpoint", period, __remote.connections);
+
+	return 0;
+}
+
+int tau_metric_remote_stop(void)
+{
+	if(!__remote.running)
+	{
+		return 0;
+	}
+
+	__remote.running = 0;
+
+	if(__remote.thread)
+	{
+		pthread_join(__remote.thread, NULL);
+		__remote.thread = 0;
+	}
+
+	int i;
+
+	for(i = 0; i < __remote.endpoint_count; i++)
+	{
+		remote_endpoint_t *e = &__remote.endpoints[i];
+		unsigned int       shard;
+
+		if(!e->shards)
+		{
+			continue;
+		}
+
+		for(shard = 0; shard < __remote.connections; shard++)
+		{
+			remote_shard_t *s = &e->shards[shard];
+
+			if(!s->thread)
+			{
+				continue;
+			}
+
+			pthread_mutex_lock(&s->lock);
+			pthread_cond_broadcast(&s->cond);
+			pthread_mutex_unlock(&s->lock);
+
+			pthread_join(s->thread, NULL);
+
+			__remote_drop(e, s->head);
+
+			if(0 <= s->fd)
+			{
+				close(s->fd);
+			}
+		}
+
+		free(e->shards);
+		e->shards = NULL;
+	}
+
+	metric_array_snapshot_free(&__remote.snapshot);
+
+	return 0;
+}
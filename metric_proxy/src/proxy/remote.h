@@ -0,0 +1,71 @@
+#ifndef TAU_METRIC_PROXY_REMOTE_H
+#define TAU_METRIC_PROXY_REMOTE_H
+
+#include <stddef.h>
+
+/****************
+* REMOTE WRITE *
+****************/
+
+/** Endpoints the series can be pushed to */
+#define TAU_METRIC_REMOTE_MAX_ENDPOINTS 8
+
+/** Default seconds between two pushes */
+#define TAU_METRIC_REMOTE_DEFAULT_PERIOD 15.0
+
+/** Default concurrent requests to each endpoint */
+#define TAU_METRIC_REMOTE_DEFAULT_CONNECTIONS 2
+
+/** Default compressed bytes kept for each endpoint while it does not answer */
+#define TAU_METRIC_REMOTE_DEFAULT_MAX_BYTES (64 * 1024 * 1024)
+
+/** Series sent at most in a request */
+#define TAU_METRIC_REMOTE_BATCH_SERIES 5000
+
+/** Requests without answer for this long are failed (seconds) */
+#define TAU_METRIC_REMOTE_TIMEOUT 10
+
+/** First delay before sending a failed request again, doubled up to the maximum (seconds) */
+#define TAU_METRIC_REMOTE_MIN_BACKOFF 0.5
+#define TAU_METRIC_REMOTE_MAX_BACKOFF 30.0
+
+/** Path of the endpoints given without one */
+#define TAU_METRIC_REMOTE_DEFAULT_PATH "/api/v1/write"
+
+/**
+ * @brief Add an endpoint to push to
+ *
+ * @param url http://host[:port][/path] of a remote write receiver
+ * @return int 0 on success, 1 on an invalid url or too many endpoints
+ */
+int tau_metric_remote_add(const char *url);
+
+/**
+ * @brief Start pushing the node series to the endpoints
+ *
+ * Every period the series updated since the previous push are sent as
+ * snappy compressed prometheus.WriteRequest messages, in batches of
+ * @ref TAU_METRIC_REMOTE_BATCH_SERIES series. Series are spread over
+ * the connections of each endpoint by name so that their samples are
+ * always sent in order. Failed requests are retried with a backoff,
+ * meanwhile the next batches wait up to max_bytes per endpoint, after
+ * which the oldest are dropped. Series get an instance label with the
+ * host name.
+ *
+ * Does nothing without endpoints.
+ *
+ * @param period seconds between two pushes
+ * @param connections concurrent requests to each endpoint
+ * @param max_bytes compressed bytes waiting for each endpoint at most
+ * @return int 0 on success
+ */
+int tau_metric_remote_start(double period, unsigned int connections, size_t max_bytes);
+
+/**
+ * @brief Stop pushing (waiting batches are dropped)
+ *
+ * @return int 0 on success
+ */
+int tau_metric_remote_stop(void);
+
+#endif /* TAU_METRIC_PROXY_REMOTE_H */
@@ -10,8 +10,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/ioctl.h>
 
 #include "log.h"
+#include "stats.h"
 
 /**********
 * HELPER *
@@ -81,6 +83,10 @@ static void *__client_polling(void *pctx)
 
 	tau_metric_proxy_log_verbose("New Proxy Client");
 
+	proxy_stats_clients(1);
+
+	uint64_t received = 0;
+
 	while(ctx->running)
 	{
 		tau_metric_msg_t msg;
@@ -107,16 +113,32 @@ static void *__client_polling(void *pctx)
 			goto CLIENT_REJECT;
 		}
 
+		proxy_stats_message(msg.type, sizeof(tau_metric_msg_t) );
+
+		/* Messages still in the socket are the client queue */
+		if(!(++received % PROXY_STATS_QUEUE_SAMPLING) )
+		{
+			int pending = 0;
+
+			if(!ioctl(ctx->client_fd, FIONREAD, &pending) )
+			{
+				proxy_stats_queue_depth(pending / sizeof(tau_metric_msg_t) );
+			}
+		}
+
 		/* Send message to upper layer */
 		if( (ctx->callback)(ctx->client_fd, &msg, ctx->extra_ctx) )
 		{
 			/* Upper layer disqualified client */
 			tau_metric_proxy_error("CLIENT : callback rejected");
+			proxy_stats_add(PROXY_STAT_CALLBACK_REJECTED, 1);
 			goto CLIENT_REJECT;
 		}
 	}
 
 CLIENT_REJECT:
+	proxy_stats_clients(-1);
+
 	if(ctx->exit_callback)
 	{
 		(ctx->exit_callback)(ctx->client_fd, ctx->extra_ctx);
@@ -0,0 +1,333 @@
+#include "snappy.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Block format of https://github.com/google/snappy/blob/main/format_description.txt:
+   the uncompressed length as a varint then literals and back references
+   each introduced by a tag byte whose two low bits give the element */
+
+#define SNAPPY_LITERAL 0
+#define SNAPPY_COPY_1  1 /* 4 to 11 bytes with an 11 bits offset */
+#define SNAPPY_COPY_2  2 /* 1 to 64 bytes with a 16 bits offset */
+#define SNAPPY_COPY_4  3 /* 1 to 64 bytes with a 32 bits offset */
+
+/* Input is matched in fragments of this size (offsets fit 16 bits) */
+#define SNAPPY_FRAGMENT (64 * 1024)
+
+#define SNAPPY_HASH_BITS 14
+
+/***************
+* COMPRESSION *
+***************/
+
+size_t snappy_max_compressed_length(size_t len)
+{
+	return 32 + len + len / 6;
+}
+
+static inline uint32_t __load32(const uint8_t *p)
+{
+	uint32_t ret;
+	memcpy(&ret, p, sizeof(uint32_t) );
+	return ret;
+}
+
+static inline uint32_t __hash(uint32_t v)
+{
+	return (v * 0x1e35a7bd) >> (32 - SNAPPY_HASH_BITS);
+}
+
+static uint8_t *__emit_literal(uint8_t *op, const uint8_t *lit, size_t len)
+{
+	size_t n = len - 1;
+
+	if(n < 60)
+	{
+		*(op++) = (n << 2) | SNAPPY_LITERAL;
+	}
+	else
+	{
+		/* The length follows in 1 to 4 little endian bytes */
+		uint8_t *tag   = op++;
+		int      bytes = 0;
+
+		while(n)
+		{
+			*(op++) = n & 0xFF;
+			n     >>= 8;
+			bytes++;
+		}
+
+		*tag = ( (59 + bytes) << 2) | SNAPPY_LITERAL;
+	}
+
+	memcpy(op, lit, len);
+
+	return op + len;
+}
+
+/* A single element, len from 4 to 64 */
+static uint8_t *__emit_copy_element(uint8_t *op, size_t offset, size_t len)
+{
+	if( (len < 12) && (offset < 2048) )
+	{
+		*(op++) = ( (offset >> 8) << 5) | ( (len - 4) << 2) | SNAPPY_COPY_1;
+		*(op++) = offset & 0xFF;
+	}
+	else
+	{
+		*(op++) = ( (len - 1) << 2) | SNAPPY_COPY_2;
+		*(op++) = offset & 0xFF;
+		*(op++) = offset >> 8;
+	}
+
+	return op;
+}
+
+static uint8_t *__emit_copy(uint8_t *op, size_t offset, size_t len)
+{
+	/* Leave at least 4 bytes for the last element */
+	while(68 <= len)
+	{
+		op   = __emit_copy_element(op, offset, 64);
+		len -= 64;
+	}
+
+	if(64 < len)
+	{
+		op   = __emit_copy_element(op, offset, 60);
+		len -= 60;
+	}
+
+	return __emit_copy_element(op, offset, len);
+}
+
+static uint8_t *__compress_fragment(const uint8_t *in, size_t len, uint8_t *op, uint16_t *table)
+{
+	const uint8_t *end = in + len;
+	const uint8_t *lit = in;
+	const uint8_t *ip  = in + 1;
+
+	memset(table, 0, sizeof(uint16_t) << SNAPPY_HASH_BITS);
+
+	/* Too short to hold anything worth a reference */
+	if(len < 16)
+	{
+		return __emit_literal(op, in, len);
+	}
+
+	const uint8_t *limit = end - 4;
+
+	while(ip <= limit)
+	{
+		uint32_t       v         = __load32(ip);
+		uint32_t       h         = __hash(v);
+		const uint8_t *candidate = in + table[h];
+
+		table[h] = ip - in;
+
+		if(__load32(candidate) != v)
+		{
+			/* Skip faster through data that does not compress */
+			ip += 1 + ( (ip - lit) >> 5);
+			continue;
+		}
+
+		size_t match = 4;
+
+		while( (ip + match < end) && (candidate[match] == ip[match]) )
+		{
+			match++;
+		}
+
+		if(lit < ip)
+		{
+			op = __emit_literal(op, lit, ip - lit);
+		}
+
+		op  = __emit_copy(op, ip - candidate, match);
+		ip += match;
+		lit = ip;
+
+		if(ip - 1 <= limit)
+		{
+			table[__hash(__load32(ip - 1) )] = ip - 1 - in;
+		}
+	}
+
+	if(lit < end)
+	{
+		op = __emit_literal(op, lit, end - lit);
+	}
+
+	return op;
+}
+
+size_t snappy_compress(const char *in, size_t len, char *out)
+{
+	uint16_t table[1 << SNAPPY_HASH_BITS];
+	uint8_t *op = (uint8_t *)out;
+	size_t   n  = len;
+
+	while(0x80 <= n)
+	{
+		*(op++) = (n & 0x7F) | 0x80;
+		n     >>= 7;
+	}
+
+	*(op++) = n;
+
+	size_t done = 0;
+
+	while(done < len)
+	{
+		size_t fragment = (len - done < SNAPPY_FRAGMENT) ? len - done : SNAPPY_FRAGMENT;
+
+		op    = __compress_fragment( (const uint8_t *)in + done, fragment, op, table);
+		done += fragment;
+	}
+
+	return op - (uint8_t *)out;
+}
+
+/*****************
+* DECOMPRESSION *
+*****************/
+
+/* Returns the length of the header, 0 if corrupted */
+static size_t __read_length(const uint8_t *in, size_t len, size_t *out_len)
+{
+	uint64_t ret = 0;
+	size_t   i;
+
+	for(i = 0; (i < len) && (i < 5); i++)
+	{
+		ret |= (uint64_t)(in[i] & 0x7F) << (7 * i);
+
+		if(!(in[i] & 0x80) )
+		{
+			*out_len = ret;
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+int snappy_uncompressed_length(const char *in, size_t len, size_t *out_len)
+{
+	return __read_length( (const uint8_t *)in, len, out_len) ? 0 : -1;
+}
+
+int snappy_uncompress(const char *in, size_t len, char *out, size_t out_len)
+{
+	const uint8_t *ip  = (const uint8_t *)in;
+	const uint8_t *end = ip + len;
+	size_t         expected;
+	size_t         header = __read_length(ip, len, &expected);
+
+	if(!header || (out_len < expected) )
+	{
+		return -1;
+	}
+
+	ip += header;
+
+	uint8_t *op     = (uint8_t *)out;
+	uint8_t *op_end = op + expected;
+
+	while(ip < end)
+	{
+		uint8_t tag = *(ip++);
+		size_t  n;
+		size_t  offset;
+
+		switch(tag & 3)
+		{
+			case SNAPPY_LITERAL:
+				n = tag >> 2;
+
+				if(60 <= n)
+				{
+					size_t bytes = n - 59;
+					size_t i;
+
+					if( (size_t)(end - ip) < bytes)
+					{
+						return -1;
+					}
+
+					for(n = 0, i = 0; i < bytes; i++)
+					{
+						n |= (size_t)ip[i] << (8 * i);
+					}
+
+					ip += bytes;
+				}
+
+				n++;
+
+				if( ( (size_t)(end - ip) < n) || ( (size_t)(op_end - op) < n) )
+				{
+					return -1;
+				}
+
+				memcpy(op, ip, n);
+				op += n;
+				ip += n;
+				continue;
+
+			case SNAPPY_COPY_1:
+				if(end - ip < 1)
+				{
+					return -1;
+				}
+
+				n      = 4 + ( (tag >> 2) & 7);
+				offset = ( (size_t)(tag >> 5) << 8) | ip[0];
+				ip    += 1;
+				break;
+
+			case SNAPPY_COPY_2:
+				if(end - ip < 2)
+				{
+					return -1;
+				}
+
+				n      = 1 + (tag >> 2);
+				offset = ip[0] | ( (size_t)ip[1] << 8);
+				ip    += 2;
+				break;
+
+			default:
+				if(end - ip < 4)
+				{
+					return -1;
+				}
+
+				n      = 1 + (tag >> 2);
+				offset = ip[0] | ( (size_t)ip[1] << 8) | ( (size_t)ip[2] << 16) | ( (size_t)ip[3] << 24);
+				ip    += 4;
+				break;
+		}
+
+		if(!offset || ( (size_t)(op - (uint8_t *)out) < offset) || ( (size_t)(op_end - op) < n) )
+		{
+			return -1;
+		}
+
+		/* References may overlap their own output */
+		const uint8_t *from = op - offset;
+		size_t         i;
+
+		for(i = 0; i < n; i++)
+		{
+			op[i] = from[i];
+		}
+
+		op += n;
+	}
+
+	return (op == op_end) ? 0 : -1;
+}
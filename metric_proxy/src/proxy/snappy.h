@@ -0,0 +1,53 @@
+#ifndef TAU_METRIC_PROXY_SNAPPY_H
+#define TAU_METRIC_PROXY_SNAPPY_H
+
+#include <stddef.h>
+
+/****************************
+* SNAPPY BLOCK COMPRESSION *
+****************************/
+
+/**
+ * @brief Largest output of @ref snappy_compress for an input
+ *
+ * @param len length of the input
+ * @return size_t bytes to provide for the compressed block
+ */
+size_t snappy_max_compressed_length(size_t len);
+
+/**
+ * @brief Compress in the snappy block format (no framing)
+ *
+ * This is the body encoding of the Prometheus remote write protocol.
+ * The input is processed in 64KB fragments matched against a hash of
+ * their 4 byte sequences: fast rather than tight.
+ *
+ * @param in data to compress
+ * @param len length of the data
+ * @param out at least @ref snappy_max_compressed_length bytes
+ * @return size_t length of the compressed block
+ */
+size_t snappy_compress(const char *in, size_t len, char *out);
+
+/**
+ * @brief Read the length of the data held by a compressed block
+ *
+ * @param in the compressed block
+ * @param len length of the block
+ * @param out_len where to store the length of the data
+ * @return int 0 on success, -1 on a corrupted header
+ */
+int snappy_uncompressed_length(const char *in, size_t len, size_t *out_len);
+
+/**
+ * @brief Uncompress a snappy block
+ *
+ * @param in the compressed block
+ * @param len length of the block
+ * @param out buffer of the length given by @ref snappy_uncompressed_length
+ * @param out_len length of out
+ * @return int 0 on success, -1 on a corrupted block
+ */
+int snappy_uncompress(const char *in, size_t len, char *out, size_t out_len);
+
+#endif /* TAU_METRIC_PROXY_SNAPPY_H */
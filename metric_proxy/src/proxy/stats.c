@@ -0,0 +1,325 @@
+#include "stats.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "utils.h"
+
+/*****************
+* THREAD BLOCKS *
+*****************/
+
+__thread proxy_stats_thread_t *__proxy_stats_local = NULL;
+
+static proxy_stats_thread_t *__proxy_stats_blocks = NULL;
+
+/* Used by threads which could not allocate theirs */
+static proxy_stats_thread_t __proxy_stats_fallback = { .in_use = 1 };
+
+static pthread_key_t  __proxy_stats_key;
+static pthread_once_t __proxy_stats_once = PTHREAD_ONCE_INIT;
+
+static uint64_t __proxy_stats_client_count = 0;
+
+/* The thread left: its counters stay and the block can be reused */
+static void __proxy_stats_thread_detach(void *pblock)
+{
+	proxy_stats_thread_t *t = (proxy_stats_thread_t *)pblock;
+
+	__atomic_store_n(&t->queue_depth, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void __proxy_stats_key_init(void)
+{
+	pthread_key_create(&__proxy_stats_key, __proxy_stats_thread_detach);
+}
+
+proxy_stats_thread_t *proxy_stats_thread_attach(void)
+{
+	pthread_once(&__proxy_stats_once, __proxy_stats_key_init);
+
+	proxy_stats_thread_t *t = __atomic_load_n(&__proxy_stats_blocks, __ATOMIC_ACQUIRE);
+
+	for(; t; t = t->next)
+	{
+		int free_block = 0;
+
+		if(__atomic_compare_exchange_n(&t->in_use, &free_block, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
+		{
+			break;
+		}
+	}
+
+	if(!t)
+	{
+		if(posix_memalign( (void **)&t, 64, sizeof(proxy_stats_thread_t) ) )
+		{
+			tau_metric_proxy_error("Could not allocate the statistics of a thread");
+			__proxy_stats_local = &__proxy_stats_fallback;
+			return __proxy_stats_local;
+		}
+
+		memset(t, 0, sizeof(proxy_stats_thread_t) );
+		t->in_use = 1;
+		t->next   = __atomic_load_n(&__proxy_stats_blocks, __ATOMIC_RELAXED);
+
+		while(!__atomic_compare_exchange_n(&__proxy_stats_blocks, &t->next, t, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED) )
+		{
+		}
+	}
+
+	pthread_setspecific(__proxy_stats_key, t);
+	__proxy_stats_local = t;
+
+	return t;
+}
+
+void proxy_stats_clients(int delta)
+{
+	__atomic_add_fetch(&__proxy_stats_client_count, delta, __ATOMIC_RELAXED);
+}
+
+static void __proxy_stats_accumulate(proxy_stats_thread_t *sum, proxy_stats_thread_t *t, uint64_t *max_queue_depth)
+{
+	int i;
+
+	for(i = 0; i <= TAU_METRIC_MSG_COUNT; i++)
+	{
+		sum->messages[i] += __atomic_load_n(&t->messages[i], __ATOMIC_RELAXED);
+	}
+
+	for(i = 0; i < PROXY_STAT_COUNT; i++)
+	{
+		sum->counters[i] += __atomic_load_n(&t->counters[i], __ATOMIC_RELAXED);
+	}
+
+	for(i = 0; i <= PROXY_STATS_SCRAPE_BUCKETS; i++)
+	{
+		sum->scrape_buckets[i] += __atomic_load_n(&t->scrape_buckets[i], __ATOMIC_RELAXED);
+	}
+
+	uint64_t depth = __atomic_load_n(&t->queue_depth, __ATOMIC_RELAXED);
+
+	sum->queue_depth += depth;
+
+	if(*max_queue_depth < depth)
+	{
+		*max_queue_depth = depth;
+	}
+}
+
+/* Sum of the blocks of all the threads */
+static void __proxy_stats_collect(proxy_stats_thread_t *sum, uint64_t *max_queue_depth)
+{
+	memset(sum, 0, sizeof(proxy_stats_thread_t) );
+	*max_queue_depth = 0;
+
+	proxy_stats_thread_t *t = __atomic_load_n(&__proxy_stats_blocks, __ATOMIC_ACQUIRE);
+
+	for(; t; t = t->next)
+	{
+		__proxy_stats_accumulate(sum, t, max_queue_depth);
+	}
+
+	__proxy_stats_accumulate(sum, &__proxy_stats_fallback, max_queue_depth);
+}
+
+/***************
+* PUBLICATION *
+***************/
+
+static struct
+{
+	int       running;
+	double    period;
+	pthread_t thread;
+	metric_t *messages[TAU_METRIC_MSG_COUNT + 1];
+	metric_t *bytes_read;
+	metric_t *rejected;
+	metric_t *queue_depth;
+	metric_t *queue_max;
+	metric_t *clients;
+	metric_t *jobs;
+	metric_t *job_bytes;
+	metric_t *scrape_buckets[PROXY_STATS_SCRAPE_BUCKETS + 1];
+	metric_t *scrape_sum;
+	metric_t *scrape_count;
+	metric_t *rendered_bytes;
+	metric_t *merges;
+	metric_t *merge_seconds;
+	metric_t *merged_bytes;
+	metric_t *merge_throughput;
+}__proxy_stats = { 0 };
+
+static void __proxy_stats_publish(void)
+{
+	proxy_stats_thread_t sum;
+	uint64_t             max_queue_depth;
+	int                  i;
+
+	__proxy_stats_collect(&sum, &max_queue_depth);
+
+	for(i = 0; i <= TAU_METRIC_MSG_COUNT; i++)
+	{
+		metric_set(__proxy_stats.messages[i], sum.messages[i]);
+	}
+
+	metric_set(__proxy_stats.bytes_read, sum.counters[PROXY_STAT_BYTES_READ]);
+	metric_set(__proxy_stats.rejected, sum.counters[PROXY_STAT_CALLBACK_REJECTED]);
+	metric_set(__proxy_stats.queue_depth, sum.queue_depth);
+	metric_set(__proxy_stats.queue_max, max_queue_depth);
+	metric_set(__proxy_stats.clients, __atomic_load_n(&__proxy_stats_client_count, __ATOMIC_RELAXED) );
+	metric_set(__proxy_stats.jobs, metric_array_list_count() );
+	metric_set(__proxy_stats.job_bytes, metric_array_list_footprint() );
+
+	/* Buckets are cumulative */
+	uint64_t scrapes = 0;
+
+	for(i = 0; i <= PROXY_STATS_SCRAPE_BUCKETS; i++)
+	{
+		scrapes += sum.scrape_buckets[i];
+		metric_set(__proxy_stats.scrape_buckets[i], scrapes);
+	}
+
+	metric_set(__proxy_stats.scrape_sum, sum.counters[PROXY_STAT_SCRAPE_NSEC] * 1e-9);
+	metric_set(__proxy_stats.scrape_count, sum.counters[PROXY_STAT_SCRAPES]);
+	metric_set(__proxy_stats.rendered_bytes, sum.counters[PROXY_STAT_RENDERED_BYTES]);
+
+	double merge_seconds = sum.counters[PROXY_STAT_MERGE_NSEC] * 1e-9;
+
+	metric_set(__proxy_stats.merges, sum.counters[PROXY_STAT_MERGES]);
+	metric_set(__proxy_stats.merge_seconds, merge_seconds);
+	metric_set(__proxy_stats.merged_bytes, sum.counters[PROXY_STAT_MERGED_BYTES]);
+	metric_set(__proxy_stats.merge_throughput, (0 < merge_seconds) ? sum.counters[PROXY_STAT_MERGED_BYTES] / merge_seconds : 0);
+}
+
+static void *__proxy_stats_thread_loop(void *dummy)
+{
+	while(__proxy_stats.running)
+	{
+		__proxy_stats_publish();
+
+		double end = utils_get_ts() + __proxy_stats.period;
+
+		while(__proxy_stats.running && (utils_get_ts() < end) )
+		{
+			usleep(10000);
+		}
+	}
+
+	return NULL;
+}
+
+/* Message type as a label value (TAU_METRIC_MSG_GET_ALL -> get_all) */
+static void __message_type_label(int type, char *out, size_t len)
+{
+	const char *name = (type < TAU_METRIC_MSG_COUNT) ? tau_metric_msg_type_name[type] + strlen("TAU_METRIC_MSG_") : "unknown";
+	size_t      i;
+
+	for(i = 0; name[i] && (i < len - 1); i++)
+	{
+		out[i] = tolower(name[i]);
+	}
+
+	out[i] = '\0';
+}
+
+int proxy_stats_start(double period)
+{
+	char name[METRIC_STRING_SIZE];
+	char label[64];
+	int  i;
+
+	__proxy_stats.period = period;
+
+	for(i = 0; i <= TAU_METRIC_MSG_COUNT; i++)
+	{
+		__message_type_label(i, label, 64);
+		snprintf(name, METRIC_STRING_SIZE, "tau_proxy_messages_total{type=\"%s\"}", label);
+		__proxy_stats.messages[i] = metric_array_get_pinned(name, "Number of messages received from the clients", TAU_METRIC_COUNTER);
+	}
+
+	for(i = 0; i <= PROXY_STATS_SCRAPE_BUCKETS; i++)
+	{
+		if(i < PROXY_STATS_SCRAPE_BUCKETS)
+		{
+			snprintf(name, METRIC_STRING_SIZE, "tau_proxy_scrape_duration_seconds_bucket{le=\"%g\"}", proxy_stats_scrape_bounds[i]);
+		}
+		else
+		{
+			snprintf(name, METRIC_STRING_SIZE, "tau_proxy_scrape_duration_seconds_bucket{le=\"+Inf\"}");
+		}
+
+		__proxy_stats.scrape_buckets[i] = metric_array_get_pinned(name, "Time spent serving scrapes", TAU_METRIC_HISTOGRAM);
+	}
+
+	__proxy_stats.bytes_read       = metric_array_get_pinned("tau_proxy_read_bytes_total", "Bytes received from the clients", TAU_METRIC_COUNTER);
+	__proxy_stats.rejected         = metric_array_get_pinned("tau_proxy_callback_rejections_total", "Number of clients dropped after a message was refused", TAU_METRIC_COUNTER);
+	__proxy_stats.queue_depth      = metric_array_get_pinned("tau_proxy_client_queue_messages", "Messages waiting to be read from all the clients", TAU_METRIC_GAUGE);
+	__proxy_stats.queue_max        = metric_array_get_pinned("tau_proxy_client_queue_max_messages", "Messages waiting to be read from the most loaded client", TAU_METRIC_GAUGE);
+	__proxy_stats.clients          = metric_array_get_pinned("tau_proxy_clients", "Number of connected clients", TAU_METRIC_GAUGE);
+	__proxy_stats.jobs             = metric_array_get_pinned("tau_proxy_jobs", "Number of running jobs with a metric array", TAU_METRIC_GAUGE);
+	__proxy_stats.job_bytes        = metric_array_get_pinned("tau_proxy_job_metrics_bytes", "Memory held by the metric arrays of the running jobs", TAU_METRIC_GAUGE);
+	__proxy_stats.scrape_sum       = metric_array_get_pinned("tau_proxy_scrape_duration_seconds_sum", "Time spent serving scrapes", TAU_METRIC_HISTOGRAM);
+	__proxy_stats.scrape_count     = metric_array_get_pinned("tau_proxy_scrape_duration_seconds_count", "Time spent serving scrapes", TAU_METRIC_HISTOGRAM);
+	__proxy_stats.rendered_bytes   = metric_array_get_pinned("tau_proxy_rendered_bytes_total", "Bytes of expositions rendered", TAU_METRIC_COUNTER);
+	__proxy_stats.merges           = metric_array_get_pinned("tau_proxy_profile_merges_total", "Number of job dumps merged in profiles", TAU_METRIC_COUNTER);
+	__proxy_stats.merge_seconds    = metric_array_get_pinned("tau_proxy_profile_merge_seconds_total", "Time spent merging job dumps in profiles", TAU_METRIC_COUNTER);
+	__proxy_stats.merged_bytes     = metric_array_get_pinned("tau_proxy_profile_merged_bytes_total", "Bytes of job dumps merged in profiles", TAU_METRIC_COUNTER);
+	__proxy_stats.merge_throughput = metric_array_get_pinned("tau_proxy_profile_merge_bytes_per_second", "Bytes of job dumps merged per second of merge", TAU_METRIC_GAUGE);
+
+	for(i = 0; i <= TAU_METRIC_MSG_COUNT; i++)
+	{
+		if(!__proxy_stats.messages[i])
+		{
+			return 1;
+		}
+	}
+
+	for(i = 0; i <= PROXY_STATS_SCRAPE_BUCKETS; i++)
+	{
+		if(!__proxy_stats.scrape_buckets[i])
+		{
+			return 1;
+		}
+	}
+
+	if(!__proxy_stats.bytes_read || !__proxy_stats.rejected || !__proxy_stats.queue_depth || !__proxy_stats.queue_max ||
+	   !__proxy_stats.clients || !__proxy_stats.jobs || !__proxy_stats.job_bytes || !__proxy_stats.scrape_sum || !__proxy_stats.scrape_count ||
+	   !__proxy_stats.rendered_bytes || !__proxy_stats.merges || !__proxy_stats.merge_seconds ||
+	   !__proxy_stats.merged_bytes || !__proxy_stats.merge_throughput)
+	{
+		return 1;
+	}
+
+	__proxy_stats.running = 1;
+
+	if(pthread_create(&__proxy_stats.thread, NULL, __proxy_stats_thread_loop, NULL) )
+	{
+		tau_metric_proxy_perror("pthread_create");
+		__proxy_stats.running = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+int proxy_stats_stop(void)
+{
+	if(!__proxy_stats.running)
+	{
+		return 0;
+	}
+
+	__proxy_stats.running = 0;
+	pthread_join(__proxy_stats.thread, NULL);
+
+	return 0;
+}
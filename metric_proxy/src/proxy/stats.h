@@ -0,0 +1,168 @@
+#ifndef TAU_METRIC_PROXY_STATS_H
+#define TAU_METRIC_PROXY_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "tau_metric_proxy_client.h"
+
+/************************
+* SELF INSTRUMENTATION *
+************************/
+
+/** Upper bounds in seconds of the scrape duration buckets (+Inf is implicit) */
+#define PROXY_STATS_SCRAPE_BUCKETS 8
+static const double proxy_stats_scrape_bounds[PROXY_STATS_SCRAPE_BUCKETS] =
+{ 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0 };
+
+/** Sample the pending messages of a client every that many messages */
+#define PROXY_STATS_QUEUE_SAMPLING 64
+
+/**
+ * @brief Counters recorded on the hot paths
+ *
+ */
+typedef enum
+{
+	PROXY_STAT_BYTES_READ = 0,     /**< Bytes read from the clients */
+	PROXY_STAT_CALLBACK_REJECTED,  /**< Clients dropped by the message callback */
+	PROXY_STAT_SCRAPES,            /**< Metric scrapes served */
+	PROXY_STAT_SCRAPE_NSEC,        /**< Time spent serving scrapes */
+	PROXY_STAT_RENDERED_BYTES,     /**< Bytes of expositions rendered */
+	PROXY_STAT_MERGES,             /**< Job dumps merged in profiles */
+	PROXY_STAT_MERGE_NSEC,         /**< Time spent merging dumps */
+	PROXY_STAT_MERGED_BYTES,       /**< Bytes of dumps merged */
+	PROXY_STAT_COUNT
+}proxy_stat_t;
+
+/**
+ * @brief Counters of one thread
+ *
+ * Only the owner thread writes them so that recording is a plain
+ * increment, the collector sums the blocks of all the threads. A block
+ * left by a thread keeps its values and is reused by a new thread.
+ */
+typedef struct proxy_stats_thread_s
+{
+	uint64_t                     messages[TAU_METRIC_MSG_COUNT + 1];          /**< Messages per type (last for unknown ones) */
+	uint64_t                     counters[PROXY_STAT_COUNT];                  /**< See @ref proxy_stat_t */
+	uint64_t                     scrape_buckets[PROXY_STATS_SCRAPE_BUCKETS + 1]; /**< Scrapes per duration bucket */
+	uint64_t                     queue_depth;                                 /**< Pending messages of the client served by the thread */
+	int                          in_use;                                      /**< Owned by a running thread */
+	struct proxy_stats_thread_s *next;                                        /**< All the blocks ever allocated */
+}__attribute__( (aligned(64) ) ) proxy_stats_thread_t;
+
+/** Block of the calling thread (NULL until its first record) */
+extern __thread proxy_stats_thread_t *__proxy_stats_local;
+
+/**
+ * @brief Get a block for the calling thread
+ *
+ * @return proxy_stats_thread_t* the block (a shared fallback if out of memory)
+ */
+proxy_stats_thread_t *proxy_stats_thread_attach(void);
+
+static inline proxy_stats_thread_t *__proxy_stats_thread(void)
+{
+	proxy_stats_thread_t *ret = __proxy_stats_local;
+
+	return ret ? ret : proxy_stats_thread_attach();
+}
+
+/* Single writer: no need for an atomic read-modify-write */
+static inline void __proxy_stats_bump(uint64_t *c, uint64_t value)
+{
+	__atomic_store_n(c, *c + value, __ATOMIC_RELAXED);
+}
+
+static inline void proxy_stats_add(proxy_stat_t stat, uint64_t value)
+{
+	__proxy_stats_bump(&__proxy_stats_thread()->counters[stat], value);
+}
+
+static inline void proxy_stats_message(int type, uint64_t bytes)
+{
+	proxy_stats_thread_t *t = __proxy_stats_thread();
+
+	if( (type < 0) || (TAU_METRIC_MSG_COUNT < type) )
+	{
+		type = TAU_METRIC_MSG_COUNT;
+	}
+
+	__proxy_stats_bump(&t->messages[type], 1);
+	__proxy_stats_bump(&t->counters[PROXY_STAT_BYTES_READ], bytes);
+}
+
+static inline void proxy_stats_queue_depth(uint64_t depth)
+{
+	__atomic_store_n(&__proxy_stats_thread()->queue_depth, depth, __ATOMIC_RELAXED);
+}
+
+/** Monotonic clock for durations */
+static inline uint64_t proxy_stats_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Account a scrape
+ *
+ * @param nsec time taken to serve it
+ */
+static inline void proxy_stats_scrape(uint64_t nsec)
+{
+	proxy_stats_thread_t *t = __proxy_stats_thread();
+	double                s = nsec * 1e-9;
+	int                   i;
+
+	for(i = 0; (i < PROXY_STATS_SCRAPE_BUCKETS) && (proxy_stats_scrape_bounds[i] < s); i++)
+	{
+	}
+
+	__proxy_stats_bump(&t->scrape_buckets[i], 1);
+	__proxy_stats_bump(&t->counters[PROXY_STAT_SCRAPES], 1);
+	__proxy_stats_bump(&t->counters[PROXY_STAT_SCRAPE_NSEC], nsec);
+}
+
+/**
+ * @brief Account a profile merge
+ *
+ * @param nsec time taken by the merge
+ * @param bytes size of the merged dump
+ */
+static inline void proxy_stats_merge(uint64_t nsec, uint64_t bytes)
+{
+	proxy_stats_thread_t *t = __proxy_stats_thread();
+
+	__proxy_stats_bump(&t->counters[PROXY_STAT_MERGES], 1);
+	__proxy_stats_bump(&t->counters[PROXY_STAT_MERGE_NSEC], nsec);
+	__proxy_stats_bump(&t->counters[PROXY_STAT_MERGED_BYTES], bytes);
+}
+
+/**
+ * @brief Account a client connecting (1) or leaving (-1)
+ *
+ * @param delta change of the number of clients
+ */
+void proxy_stats_clients(int delta);
+
+/**
+ * @brief Register the tau_proxy_* series and publish them periodically
+ *
+ * @param period seconds between two publications
+ * @return int 0 on success
+ */
+int proxy_stats_start(double period);
+
+/**
+ * @brief Stop publishing
+ *
+ * @return int 0 on success
+ */
+int proxy_stats_stop(void);
+
+#endif /* TAU_METRIC_PROXY_STATS_H */
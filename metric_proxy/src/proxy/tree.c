@@ -0,0 +1,2149 @@
+#include "tree.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "utils.h"
+
+/************
+* PROTOCOL *
+************/
+
+#define TREE_PROTOCOL_VERSION 2
+
+/** Largest message accepted from a child */
+#define TREE_MAX_MESSAGE (1024 * 1024)
+
+/** Updates sent at most in a message */
+#define TREE_DELTAS_PER_MESSAGE 4096
+
+/* A child sends HELLO and waits for WELCOME or REDIRECT, after that it
+   only sends. Series are defined once per connection with an id and
+   their updates refer to it. Counters carry on from what was forwarded
+   on previous connections. */
+typedef enum
+{
+	TREE_MSG_HELLO = 1, /**< tree_hello_t */
+	TREE_MSG_WELCOME,   /**< tree_welcome_t: the child is accepted */
+	TREE_MSG_REDIRECT,  /**< tree_redirect_t: join this proxy instead */
+	TREE_MSG_SCOPE,     /**< tree_scope_msg_t: an array the next series belong to */
+	TREE_MSG_SCOPE_END, /**< tree_scope_end_t: the job left the subtree of the child */
+	TREE_MSG_DEFINE,    /**< tree_define_t then the name and the doc */
+	TREE_MSG_DELTAS     /**< tree_delta_t records (none as a heartbeat) */
+}tree_msg_type_t;
+
+typedef struct
+{
+	uint32_t type;
+	uint32_t size; /**< Bytes following the header */
+}tree_msg_header_t;
+
+typedef struct
+{
+	uint32_t version;
+	uint32_t listen_port; /**< Where the child accepts children (0 for a leaf) */
+	uint64_t token;       /**< Random identifier of the child proxy */
+	uint64_t last_parent; /**< Token of the parent it fed before (0 if none) */
+	double   period;      /**< Seconds between two messages of the child */
+	char     node[64];
+}tree_hello_t;
+
+typedef struct
+{
+	uint64_t token; /**< Of the parent */
+}tree_welcome_t;
+
+typedef struct
+{
+	char address[300];
+}tree_redirect_t;
+
+typedef struct
+{
+	uint32_t                    scope; /**< Id given by the child, from 1 */
+	uint32_t                    pad;
+	tau_metric_job_descriptor_t desc;  /**< Empty jobid for the cluster */
+}tree_scope_msg_t;
+
+typedef struct
+{
+	uint32_t scope;
+}tree_scope_end_t;
+
+typedef struct
+{
+	uint32_t id;       /**< Id given by the child, from 1 */
+	uint32_t scope;
+	uint32_t type;
+	uint16_t name_len;
+	uint16_t doc_len;
+	double   base;     /**< Counter total forwarded on previous connections */
+}tree_define_t;
+
+/** Counters send increments and gauges samples */
+typedef struct __attribute__( (packed) )
+{
+	uint32_t id;
+	double   value;
+}tree_delta_t;
+
+/************
+* TRACKERS *
+************/
+
+/**
+ * @brief What was already merged of a series
+ *
+ */
+typedef struct tree_series_s
+{
+	const char *          name;    /**< Interned (a reference is held) */
+	double                value;   /**< Counter value or gauge average merged */
+	double                last_ts; /**< Update time of the last gauge sample merged */
+	uint32_t              id;      /**< Id on the uplink (0 until defined) */
+	uint32_t              seen;    /**< Last diff which saw the series */
+	metric_t *            metric;  /**< Subtree series it is merged in (local trackers) */
+	struct tree_series_s *next;
+}tree_series_t;
+
+/**
+ * @brief Series of an array by interned name
+ *
+ */
+typedef struct
+{
+	tree_series_t **buckets;
+	unsigned int    size;
+	uint64_t        count;
+	uint32_t        diff;    /**< Diffs made so far */
+	int             resend;  /**< The next diff sends unchanged counters too */
+}tree_tracker_t;
+
+static inline unsigned int __tracker_bucket(unsigned int size, const char *name)
+{
+	/* Interned names are compared by address */
+	uint64_t h = (uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ull;
+
+	return (h >> 32) % size;
+}
+
+static int __tracker_grow(tree_tracker_t *t)
+{
+	unsigned int    size    = t->size ? t->size * 2 : 256;
+	tree_series_t **buckets = calloc(size, sizeof(tree_series_t *) );
+
+	if(!buckets)
+	{
+		tau_metric_proxy_perror("calloc");
+		return 1;
+	}
+
+	unsigned int i;
+
+	for(i = 0; i < t->size; i++)
+	{
+		tree_series_t *s = t->buckets[i];
+
+		while(s)
+		{
+			tree_series_t *next = s->next;
+			unsigned int   b    = __tracker_bucket(size, s->name);
+
+			s->next    = buckets[b];
+			buckets[b] = s;
+			s          = next;
+		}
+	}
+
+	free(t->buckets);
+
+	t->buckets = buckets;
+	t->size    = size;
+
+	return 0;
+}
+
+static tree_series_t *__tracker_get(tree_tracker_t *t, const char *name, int *created)
+{
+	*created = 0;
+
+	if( (2 * t->size <= t->count) && __tracker_grow(t) && !t->size)
+	{
+		return NULL;
+	}
+
+	unsigned int   b = __tracker_bucket(t->size, name);
+	tree_series_t *s;
+
+	for(s = t->buckets[b]; s; s = s->next)
+	{
+		if(s->name == name)
+		{
+			return s;
+		}
+	}
+
+	s = calloc(1, sizeof(tree_series_t) );
+
+	if(!s)
+	{
+		tau_metric_proxy_perror("calloc");
+		return NULL;
+	}
+
+	s->name = metric_string_intern(name);
+
+	if(!s->name)
+	{
+		free(s);
+		return NULL;
+	}
+
+	s->next       = t->buckets[b];
+	t->buckets[b] = s;
+	t->count++;
+	*created = 1;
+
+	return s;
+}
+
+/* Forget the series the last diff did not see */
+static void __tracker_sweep(tree_tracker_t *t, int all)
+{
+	unsigned int i;
+
+	for(i = 0; i < t->size; i++)
+	{
+		tree_series_t **prev = &t->buckets[i];
+
+		while(*prev)
+		{
+			tree_series_t *s = *prev;
+
+			if(!all && (s->seen == t->diff) )
+			{
+				prev = &s->next;
+				continue;
+			}
+
+			*prev = s->next;
+			metric_string_release(s->name);
+			free(s);
+			t->count--;
+		}
+	}
+}
+
+static void __tracker_release(tree_tracker_t *t)
+{
+	__tracker_sweep(t, 1);
+	free(t->buckets);
+	memset(t, 0, sizeof(tree_tracker_t) );
+}
+
+/* Series keep what was merged but have to be defined again, counters
+   with their base so that the parent can merge what it did not get */
+static void __tracker_undefine(tree_tracker_t *t)
+{
+	unsigned int   i;
+	tree_series_t *s;
+
+	for(i = 0; i < t->size; i++)
+	{
+		for(s = t->buckets[i]; s; s = s->next)
+		{
+			s->id = 0;
+		}
+	}
+
+	t->resend = 1;
+}
+
+/**********
+* SCOPES *
+**********/
+
+/**
+ * @brief Counter totals of a child merged in a scope
+ *
+ * Kept when the child leaves so that counters never go down: if it
+ * joins again, what it forwarded but was lost with the connection is
+ * merged and nothing is merged twice.
+ *
+ */
+typedef struct tree_ledger_s
+{
+	uint64_t              token;    /**< The child */
+	int                   joined;   /**< A connection of the child feeds it */
+	double                left;     /**< When the child stopped feeding it */
+	tree_tracker_t        counters; /**< Totals merged, by series */
+	struct tree_ledger_s *next;
+}tree_ledger_t;
+
+/**
+ * @brief The aggregated series of the cluster or of a job
+ *
+ */
+typedef struct tree_scope_s
+{
+	tau_metric_job_descriptor_t desc;          /**< Empty jobid for the cluster */
+	metric_array_t              array;         /**< Series of the subtree (never evicted) */
+	tree_tracker_t              local;         /**< Node series merged in the array */
+	tree_tracker_t              up;            /**< Array series forwarded to the parent */
+	int                         local_running; /**< The job runs on this node */
+	int                         children;      /**< Children forwarding the scope */
+	int                         refs;          /**< Readers of the array */
+	double                      ended;         /**< When the last contributor left (0 while fed) */
+	uint32_t                    up_id;         /**< Scope id on the uplink (0 until announced) */
+	int                         up_ended;      /**< The end was sent to the parent */
+	tree_ledger_t *             ledgers;       /**< What each child merged */
+	struct tree_scope_s *       next;
+}tree_scope_t;
+
+/**
+ * @brief A series defined by a child
+ *
+ */
+typedef struct
+{
+	metric_t *     metric; /**< Where its updates go (NULL once its scope ended) */
+	uint32_t       scope;  /**< Its scope id */
+	int            first;  /**< No update received since its definition */
+	double         base;   /**< Counter total it forwarded before the definition */
+	tree_series_t *merged; /**< Counter total of the child merged, in the ledger */
+}tree_child_series_t;
+
+/**
+ * @brief A connection from a child proxy
+ *
+ */
+typedef struct tree_child_s
+{
+	int                   fd;
+	int                   joined;         /**< Accepted as a child */
+	uint64_t              token;
+	char                  address[300];   /**< Where it accepts children (empty for a leaf) */
+	char                  node[64];
+	uint64_t              received_bytes;
+	tree_scope_t **       scopes;         /**< By id (NULL once ended) */
+	tree_ledger_t **      ledgers;        /**< Of the child in each scope, by id */
+	uint32_t              scope_count;
+	tree_child_series_t * series;         /**< By id */
+	uint32_t              series_count;
+	uint32_t              series_capacity;
+	struct tree_child_s * prev;
+	struct tree_child_s * next;
+}tree_child_t;
+
+static struct
+{
+	int                     running;
+	double                  period;
+	unsigned int            fanout;
+	uint64_t                token;          /**< Identifies this proxy to its peers */
+	char                    node[64];
+	pthread_mutex_t         lock;           /**< Protects the scopes, their trackers and the children */
+	tree_scope_t *          scopes;         /**< The cluster scope comes first */
+	uint64_t                scope_count;
+	metric_array_snapshot_t snapshot;       /**< Reused by all the diffs */
+	pthread_t               thread;
+	/* Children */
+	int                     listen_fd;
+	uint32_t                listen_port;
+	pthread_t               listener;
+	tree_child_t *          children;       /**< All the connections */
+	unsigned int            child_count;    /**< Joined children */
+	unsigned int            connections;    /**< Running connection threads */
+	unsigned int            next_redirect;  /**< Round robin over the children */
+	/* Parent */
+	char                    parent[300];    /**< Given parent (empty for the root) */
+	char                    joined[300];    /**< Parent joined (empty when not connected) */
+	int                     up_fd;
+	uint32_t                up_scopes;      /**< Scope ids given on the uplink */
+	uint32_t                up_series;      /**< Series ids given on the uplink */
+	uint64_t                last_parent;    /**< Token of the parent last joined (0 if none) */
+	double                  next_join;
+	double                  backoff;
+	/* Statistics */
+	uint64_t                sent_bytes;
+	uint64_t                received_bytes;
+	metric_t *              m_children;
+	metric_t *              m_joined;
+	metric_t *              m_scopes;
+	metric_t *              m_sent_bytes;
+	metric_t *              m_received_bytes;
+}__tree = { .lock = PTHREAD_MUTEX_INITIALIZER, .listen_fd = -1, .up_fd = -1 };
+
+static tree_scope_t *__tree_scope_new(tau_metric_job_descriptor_t *desc)
+{
+	tree_scope_t *scope = calloc(1, sizeof(tree_scope_t) );
+
+	if(!scope)
+	{
+		tau_metric_proxy_perror("calloc");
+		return NULL;
+	}
+
+	memcpy(&scope->desc, desc, sizeof(tau_metric_job_descriptor_t) );
+	scope->desc.jobid[63] = '\0';
+
+	int is_cluster = !strlen(scope->desc.jobid);
+
+	metric_array_init_sized(&scope->array, is_cluster ? METRIC_ARRAY_SIZE : METRIC_ARRAY_JOB_SIZE, 0);
+
+	/* Exposed by family like the node and the job arrays */
+	if(metric_array_set_families(&scope->array, is_cluster ? METRIC_FAMILY_TABLE_SIZE : METRIC_ARRAY_JOB_SIZE) )
+	{
+		metric_array_release(&scope->array);
+		free(scope);
+		return NULL;
+	}
+
+	return scope;
+}
+
+static void __tree_ledger_free(tree_ledger_t *ledger)
+{
+	__tracker_release(&ledger->counters);
+	free(ledger);
+}
+
+/* Ledger of a child in a scope, found again when it joins again (lock held) */
+static tree_ledger_t *__tree_ledger_get(tree_scope_t *scope, uint64_t token)
+{
+	tree_ledger_t *ledger;
+
+	for(ledger = scope->ledgers; ledger; ledger = ledger->next)
+	{
+		/* A connection replacing one not closed yet starts its own */
+		if( (ledger->token == token) && !ledger->joined)
+		{
+			break;
+		}
+	}
+
+	if(!ledger)
+	{
+		ledger = calloc(1, sizeof(tree_ledger_t) );
+
+		if(!ledger)
+		{
+			tau_metric_proxy_perror("calloc");
+			return NULL;
+		}
+
+		ledger->token  = token;
+		ledger->next   = scope->ledgers;
+		scope->ledgers = ledger;
+	}
+
+	ledger->joined = 1;
+	ledger->left   = 0;
+
+	return ledger;
+}
+
+/* Drop the ledgers of a child in all the scopes (lock held) */
+static void __tree_ledgers_forget(uint64_t token)
+{
+	tree_scope_t *scope;
+
+	for(scope = __tree.scopes; scope; scope = scope->next)
+	{
+		tree_ledger_t **prev = &scope->ledgers;
+
+		while(*prev)
+		{
+			tree_ledger_t *ledger = *prev;
+
+			if( (ledger->token != token) || ledger->joined)
+			{
+				prev = &ledger->next;
+				continue;
+			}
+
+			*prev = ledger->next;
+			__tree_ledger_free(ledger);
+		}
+	}
+}
+
+static void __tree_scope_free(tree_scope_t *scope)
+{
+	while(scope->ledgers)
+	{
+		tree_ledger_t *next = scope->ledgers->next;
+
+		__tree_ledger_free(scope->ledgers);
+		scope->ledgers = next;
+	}
+
+	__tracker_release(&scope->local);
+	__tracker_release(&scope->up);
+	metric_array_release(&scope->array);
+	free(scope);
+}
+
+/* Scope of a job, created if needed (lock held) */
+static tree_scope_t *__tree_scope_get(tau_metric_job_descriptor_t *desc, int create)
+{
+	tree_scope_t *scope;
+
+	for(scope = __tree.scopes; scope; scope = scope->next)
+	{
+		if(!strncmp(scope->desc.jobid, desc->jobid, 64) )
+		{
+			return scope;
+		}
+	}
+
+	if(!create)
+	{
+		return NULL;
+	}
+
+	scope = __tree_scope_new(desc);
+
+	if(!scope)
+	{
+		return NULL;
+	}
+
+	tau_metric_proxy_log_verbose("New tree scope for job %s", scope->desc.jobid);
+
+	/* After the cluster */
+	scope->next         = __tree.scopes->next;
+	__tree.scopes->next = scope;
+	__tree.scope_count++;
+
+	return scope;
+}
+
+/*********
+* DIFFS *
+*********/
+
+/** Called for each series changed since the previous diff */
+typedef int (*tree_merge_t)(tree_scope_t *scope, metric_snapshot_entry_t *e, tree_series_t *s, double update, void *arg);
+
+/* Merge the changes of an array since the tracker last saw it: counters
+   by increment, gauges by their last average (lock held) */
+static int __tree_diff(tree_scope_t *scope, tree_tracker_t *t, metric_array_t *ma, int resets,
+                       tree_merge_t merge, void *arg)
+{
+	metric_array_snapshot_t *snap = &__tree.snapshot;
+
+	if(metric_array_snapshot_take(ma, snap) )
+	{
+		return 1;
+	}
+
+	int      ret = 0;
+	uint64_t i;
+
+	t->diff++;
+
+	for(i = 0; i < snap->count; i++)
+	{
+		metric_snapshot_entry_t *e = &snap->entries[i];
+		int                      created;
+		tree_series_t *          s = __tracker_get(t, e->name, &created);
+
+		if(!s)
+		{
+			ret = 1;
+			break;
+		}
+
+		s->seen = t->diff;
+
+		double update;
+
+		if(metric_type_cumulative(e->type) )
+		{
+			if(!created && !t->resend && (e->value == s->value) )
+			{
+				continue;
+			}
+
+			/* Node counters restart from 0 when readmitted after an eviction */
+			update = (resets && (e->value < s->value) ) ? e->value : e->value - s->value;
+		}
+		else
+		{
+			if(!created && (e->last_ts <= s->last_ts) )
+			{
+				continue;
+			}
+
+			update = e->value;
+		}
+
+		if(merge(scope, e, s, update, arg) )
+		{
+			ret = 1;
+			break;
+		}
+
+		s->value   = e->value;
+		s->last_ts = e->last_ts;
+	}
+
+	if(!ret)
+	{
+		__tracker_sweep(t, 0);
+		t->resend = 0;
+	}
+
+	metric_array_snapshot_release(snap);
+
+	return ret;
+}
+
+static int __tree_merge_local(tree_scope_t *scope, metric_snapshot_entry_t *e, tree_series_t *s, double update, void *arg)
+{
+	(void)arg;
+
+	/* Subtree arrays are never evicted: the metric is kept by the tracker */
+	if(!s->metric)
+	{
+		int token = metric_array_read_lock(&scope->array);
+
+		metric_t *m = metric_array_get_or_register(&scope->array, e->name, e->doc, e->type);
+
+		s->metric = (m && (m->type == e->type) ) ? m : NULL;
+
+		metric_array_read_unlock(&scope->array, token);
+	}
+
+	if(s->metric)
+	{
+		tau_metric_event_t ev = { .value = update };
+		metric_update(s->metric, &ev);
+	}
+
+	return 0;
+}
+
+/*****************
+* SEND BUFFERS *
+*****************/
+
+typedef struct
+{
+	char *  data;
+	size_t  len;
+	size_t  size;
+	ssize_t deltas; /**< Header of the DELTAS message being filled (-1 if none) */
+}tree_buffer_t;
+
+static char *__buffer_reserve(tree_buffer_t *b, size_t len)
+{
+	if(b->size < b->len + len)
+	{
+		size_t size = b->size ? b->size : 65536;
+
+		while(size < b->len + len)
+		{
+			size *= 2;
+		}
+
+		char *data = realloc(b->data, size);
+
+		if(!data)
+		{
+			tau_metric_proxy_perror("realloc");
+			return NULL;
+		}
+
+		b->data = data;
+		b->size = size;
+	}
+
+	char *ret = b->data + b->len;
+
+	b->len += len;
+
+	return ret;
+}
+
+/* Append a message, payload parts are concatenated */
+static int __buffer_message(tree_buffer_t *b, uint32_t type, const void *p1, size_t s1, const void *p2, size_t s2,
+                            const void *p3, size_t s3)
+{
+	tree_msg_header_t h = { .type = type, .size = s1 + s2 + s3 };
+	char *            p = __buffer_reserve(b, sizeof(h) + h.size);
+
+	if(!p)
+	{
+		return 1;
+	}
+
+	memcpy(p, &h, sizeof(h) );
+	p += sizeof(h);
+
+	if(s1)
+	{
+		memcpy(p, p1, s1);
+	}
+
+	if(s2)
+	{
+		memcpy(p + s1, p2, s2);
+	}
+
+	if(s3)
+	{
+		memcpy(p + s1 + s2, p3, s3);
+	}
+
+	/* Updates after this message start a new one */
+	b->deltas = -1;
+
+	return 0;
+}
+
+static int __buffer_delta(tree_buffer_t *b, uint32_t id, double value)
+{
+	if(b->deltas < 0)
+	{
+		if(__buffer_message(b, TREE_MSG_DELTAS, NULL, 0, NULL, 0, NULL, 0) )
+		{
+			return 1;
+		}
+
+		b->deltas = b->len - sizeof(tree_msg_header_t);
+	}
+
+	tree_delta_t d = { .id = id, .value = value };
+	char *       p = __buffer_reserve(b, sizeof(d) );
+
+	if(!p)
+	{
+		return 1;
+	}
+
+	memcpy(p, &d, sizeof(d) );
+
+	tree_msg_header_t *h = (tree_msg_header_t *)(b->data + b->deltas);
+
+	h->size += sizeof(d);
+
+	if(h->size == TREE_DELTAS_PER_MESSAGE * sizeof(tree_delta_t) )
+	{
+		b->deltas = -1;
+	}
+
+	return 0;
+}
+
+static int __tree_merge_up(tree_scope_t *scope, metric_snapshot_entry_t *e, tree_series_t *s, double update, void *arg)
+{
+	tree_buffer_t *b = (tree_buffer_t *)arg;
+
+	if(!s->id)
+	{
+		tree_define_t def = { 0 };
+		size_t        doc_len = e->doc ? strlen(e->doc) : 0;
+
+		def.id       = ++__tree.up_series;
+		def.scope    = scope->up_id;
+		def.type     = e->type;
+		def.name_len = e->name_len;
+		def.doc_len  = doc_len;
+		def.base     = metric_type_cumulative(e->type) ? s->value : 0;
+
+		if(__buffer_message(b, TREE_MSG_DEFINE, &def, sizeof(def), e->name, e->name_len, e->doc, doc_len) )
+		{
+			return 1;
+		}
+
+		s->id = def.id;
+	}
+
+	return __buffer_delta(b, s->id, update);
+}
+
+/***********
+* SOCKETS *
+***********/
+
+static int __tree_write(int fd, const char *data, size_t len)
+{
+	while(len)
+	{
+		ssize_t ret = send(fd, data, len, MSG_NOSIGNAL);
+
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			return 1;
+		}
+
+		data += ret;
+		len  -= ret;
+	}
+
+	return 0;
+}
+
+static int __tree_read(int fd, void *buff, size_t len)
+{
+	char *p = (char *)buff;
+
+	while(len)
+	{
+		ssize_t ret = recv(fd, p, len, 0);
+
+		if( (ret < 0) && (errno == EINTR) )
+		{
+			continue;
+		}
+
+		if(ret <= 0)
+		{
+			return 1;
+		}
+
+		p   += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void __tree_timeout(int fd, double seconds)
+{
+	struct timeval timeout = { .tv_sec = (time_t)seconds, .tv_usec = (seconds - (time_t)seconds) * 1e6 };
+
+	/* The send timeout also bounds connect */
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout) );
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+}
+
+/* host:port or [host]:port */
+static int __tree_address_split(const char *address, char *host, size_t host_len, char *port, size_t port_len)
+{
+	const char *colon = strrchr(address, ':');
+
+	if(!colon || (colon == address) || !strlen(colon + 1) || (port_len <= strlen(colon + 1) ) )
+	{
+		return 1;
+	}
+
+	const char *start = address;
+	size_t      len   = colon - address;
+
+	if( (*start == '[') && (start[len - 1] == ']') )
+	{
+		start++;
+		len -= 2;
+	}
+
+	if(!len || (host_len <= len) )
+	{
+		return 1;
+	}
+
+	snprintf(host, host_len, "%.*s", (int)len, start);
+	snprintf(port, port_len, "%s", colon + 1);
+
+	return 0;
+}
+
+static int __tree_connect(const char *address)
+{
+	char host[256];
+	char port[16];
+
+	if(__tree_address_split(address, host, sizeof(host), port, sizeof(port) ) )
+	{
+		tau_metric_proxy_error("Tree peers are host:port addresses had: %s", address);
+		return -1;
+	}
+
+	struct addrinfo hints = { 0 };
+	struct addrinfo *res  = NULL;
+
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(host, port, &hints, &res);
+
+	if(ret)
+	{
+		tau_metric_proxy_log_verbose("Cannot resolve %s: %s", host, gai_strerror(ret) );
+		return -1;
+	}
+
+	int              fd = -1;
+	struct addrinfo *tmp;
+
+	for(tmp = res; tmp; tmp = tmp->ai_next)
+	{
+		fd = socket(tmp->ai_family, tmp->ai_socktype | SOCK_CLOEXEC, tmp->ai_protocol);
+
+		if(fd < 0)
+		{
+			continue;
+		}
+
+		__tree_timeout(fd, TAU_METRIC_TREE_TIMEOUT);
+
+		if(!connect(fd, tmp->ai_addr, tmp->ai_addrlen) )
+		{
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if(0 <= fd)
+	{
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+	}
+
+	return fd;
+}
+
+/**********
+* PARENT *
+**********/
+
+/* A new uplink knows none of our ids: what was forwarded is kept and
+   only what changed since is sent, the old parent still holds the rest
+   and counters never count twice (lock held) */
+static void __tree_uplink_reset(void)
+{
+	tree_scope_t *scope;
+
+	for(scope = __tree.scopes; scope; scope = scope->next)
+	{
+		__tracker_undefine(&scope->up);
+		scope->up_id = 0;
+	}
+
+	__tree.up_scopes = 0;
+	__tree.up_series = 0;
+}
+
+static int __tree_join(void)
+{
+	char target[300];
+	int  hops;
+
+	snprintf(target, sizeof(target), "%s", __tree.parent);
+
+	for(hops = 0; hops <= TAU_METRIC_TREE_MAX_REDIRECTS; hops++)
+	{
+		int fd = __tree_connect(target);
+
+		if(fd < 0)
+		{
+			return 1;
+		}
+
+		tree_hello_t      hello  = { .version = TREE_PROTOCOL_VERSION, .listen_port = __tree.listen_port,
+		                             .token = __tree.token, .last_parent = __tree.last_parent,
+		                             .period = __tree.period };
+		tree_msg_header_t header = { .type = TREE_MSG_HELLO, .size = sizeof(hello) };
+
+		snprintf(hello.node, sizeof(hello.node), "%s", __tree.node);
+
+		if(__tree_write(fd, (char *)&header, sizeof(header) ) || __tree_write(fd, (char *)&hello, sizeof(hello) ) ||
+		   __tree_read(fd, &header, sizeof(header) ) )
+		{
+			close(fd);
+			return 1;
+		}
+
+		tree_welcome_t welcome;
+
+		if( (header.type == TREE_MSG_WELCOME) && (header.size == sizeof(welcome) ) )
+		{
+			if(__tree_read(fd, &welcome, sizeof(welcome) ) )
+			{
+				close(fd);
+				return 1;
+			}
+
+			pthread_mutex_lock(&__tree.lock);
+			__tree_uplink_reset();
+			__tree.last_parent = welcome.token;
+			__tree.up_fd       = fd;
+			snprintf(__tree.joined, sizeof(__tree.joined), "%s", target);
+			pthread_mutex_unlock(&__tree.lock);
+
+			tau_metric_proxy_log("Joined the aggregation tree under %s", target);
+
+			return 0;
+		}
+
+		tree_redirect_t redirect;
+
+		if( (header.type != TREE_MSG_REDIRECT) || (header.size != sizeof(redirect) ) ||
+		    __tree_read(fd, &redirect, sizeof(redirect) ) )
+		{
+			tau_metric_proxy_error("Unexpected answer from tree parent %s", target);
+			close(fd);
+			return 1;
+		}
+
+		close(fd);
+
+		redirect.address[sizeof(redirect.address) - 1] = '\0';
+
+		tau_metric_proxy_log_verbose("Tree parent %s redirected us to %s", target, redirect.address);
+
+		snprintf(target, sizeof(target), "%s", redirect.address);
+	}
+
+	tau_metric_proxy_error("Too many redirections joining the aggregation tree at %s", __tree.parent);
+
+	return 1;
+}
+
+static void __tree_leave(void)
+{
+	pthread_mutex_lock(&__tree.lock);
+
+	if(0 <= __tree.up_fd)
+	{
+		tau_metric_proxy_error("Lost tree parent %s", __tree.joined);
+		close(__tree.up_fd);
+	}
+
+	__tree.up_fd     = -1;
+	__tree.joined[0] = '\0';
+
+	pthread_mutex_unlock(&__tree.lock);
+}
+
+/********
+* TICK *
+********/
+
+static int __tree_scope_fed(tree_scope_t *scope)
+{
+	return (scope == __tree.scopes) || scope->local_running || scope->children;
+}
+
+/* Build what is sent to the parent (lock held) */
+static int __tree_forward(tree_buffer_t *b)
+{
+	tree_scope_t *scope;
+
+	for(scope = __tree.scopes; scope; scope = scope->next)
+	{
+		if(scope->up_ended)
+		{
+			continue;
+		}
+
+		if(!scope->up_id)
+		{
+			tree_scope_msg_t msg = { .scope = ++__tree.up_scopes };
+
+			memcpy(&msg.desc, &scope->desc, sizeof(tau_metric_job_descriptor_t) );
+
+			if(__buffer_message(b, TREE_MSG_SCOPE, &msg, sizeof(msg), NULL, 0, NULL, 0) )
+			{
+				return 1;
+			}
+
+			scope->up_id = msg.scope;
+		}
+
+		if(__tree_diff(scope, &scope->up, &scope->array, 0, __tree_merge_up, b) )
+		{
+			return 1;
+		}
+
+		if(!__tree_scope_fed(scope) )
+		{
+			tree_scope_end_t end = { .scope = scope->up_id };
+
+			if(__buffer_message(b, TREE_MSG_SCOPE_END, &end, sizeof(end), NULL, 0, NULL, 0) )
+			{
+				return 1;
+			}
+
+			scope->up_ended = 1;
+		}
+	}
+
+	/* Lets the parent know we are alive */
+	if(!b->len)
+	{
+		return __buffer_message(b, TREE_MSG_DELTAS, NULL, 0, NULL, 0, NULL, 0);
+	}
+
+	return 0;
+}
+
+/* Drop the ledgers of children gone for too long (lock held) */
+static void __tree_ledgers_cleanup(tree_scope_t *scope, double now)
+{
+	tree_ledger_t **prev = &scope->ledgers;
+
+	while(*prev)
+	{
+		tree_ledger_t *ledger = *prev;
+
+		if(ledger->joined || (now - ledger->left < TAU_METRIC_TREE_CHILD_LINGER) )
+		{
+			prev = &ledger->next;
+			continue;
+		}
+
+		*prev = ledger->next;
+		__tree_ledger_free(ledger);
+	}
+}
+
+/* Drop the jobs nobody feeds or reads anymore (lock held) */
+static void __tree_cleanup(double now)
+{
+	tree_scope_t *scope;
+
+	for(scope = __tree.scopes; scope; scope = scope->next)
+	{
+		__tree_ledgers_cleanup(scope, now);
+	}
+
+	tree_scope_t **prev = &__tree.scopes->next;
+
+	while(*prev)
+	{
+		tree_scope_t *scope = *prev;
+
+		if(__tree_scope_fed(scope) )
+		{
+			scope->ended = 0;
+			prev         = &scope->next;
+			continue;
+		}
+
+		if(!scope->ended)
+		{
+			scope->ended = now;
+		}
+
+		/* Kept until the parent got its last updates */
+		if(scope->refs || (strlen(__tree.parent) && !scope->up_ended && (now - scope->ended < TAU_METRIC_TREE_SCOPE_LINGER) ) )
+		{
+			prev = &scope->next;
+			continue;
+		}
+
+		tau_metric_proxy_log_verbose("Dropping tree scope for job %s", scope->desc.jobid);
+
+		*prev = scope->next;
+		__tree.scope_count--;
+		__tree_scope_free(scope);
+	}
+}
+
+static void __tree_publish(void)
+{
+	metric_set(__tree.m_children, __tree.child_count);
+	metric_set(__tree.m_joined, 0 <= __tree.up_fd);
+	metric_set(__tree.m_scopes, __tree.scope_count);
+	metric_set(__tree.m_sent_bytes, __atomic_load_n(&__tree.sent_bytes, __ATOMIC_RELAXED) );
+	metric_set(__tree.m_received_bytes, __atomic_load_n(&__tree.received_bytes, __ATOMIC_RELAXED) );
+}
+
+static void __tree_tick(void)
+{
+	double now = utils_get_ts();
+
+	if(strlen(__tree.parent) && (__tree.up_fd < 0) && (__tree.next_join <= now) )
+	{
+		if(__tree_join() )
+		{
+			__tree.next_join = now + __tree.backoff;
+			__tree.backoff   = (TAU_METRIC_TREE_MAX_BACKOFF < 2 * __tree.backoff) ? TAU_METRIC_TREE_MAX_BACKOFF : 2 * __tree.backoff;
+		}
+		else
+		{
+			__tree.backoff = TAU_METRIC_TREE_MIN_BACKOFF;
+		}
+	}
+
+	metric_array_list_job_t *jobs      = NULL;
+	size_t                   job_count = 0;
+	size_t                   i;
+
+	metric_array_list_jobs(&jobs, &job_count);
+
+	pthread_mutex_lock(&__tree.lock);
+
+	__tree_diff(__tree.scopes, &__tree.scopes->local, metric_array_get_main(), 1, __tree_merge_local, NULL);
+
+	for(i = 0; i < job_count; i++)
+	{
+		metric_array_t *ma    = metric_array_list_get(jobs[i].desc.jobid);
+		tree_scope_t *  scope = ma ? __tree_scope_get(&jobs[i].desc, 1) : NULL;
+
+		/* Left in the meantime */
+		jobs[i].clients = (ma != NULL);
+
+		if(scope)
+		{
+			/* Until the job end merges its last updates */
+			scope->local_running = 1;
+			__tree_diff(scope, &scope->local, ma, 1, __tree_merge_local, NULL);
+		}
+	}
+
+	tree_buffer_t buffer = { .deltas = -1 };
+	int           fd     = __tree.up_fd;
+	int           failed = (0 <= fd) && __tree_forward(&buffer);
+
+	__tree_cleanup(now);
+	__tree_publish();
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	/* Relaxing the last reference ends the job which takes the lock */
+	for(i = 0; i < job_count; i++)
+	{
+		if(jobs[i].clients)
+		{
+			metric_array_list_relax(jobs[i].desc.jobid);
+		}
+	}
+
+	free(jobs);
+
+	if(0 <= fd)
+	{
+		/* A partial forward would leave the parent with undefined series:
+		   joining again sends everything */
+		if(failed || __tree_write(fd, buffer.data, buffer.len) )
+		{
+			__tree_leave();
+		}
+		else
+		{
+			__atomic_add_fetch(&__tree.sent_bytes, buffer.len, __ATOMIC_RELAXED);
+		}
+	}
+
+	free(buffer.data);
+}
+
+static void *__tree_thread_loop(void *dummy)
+{
+	while(__tree.running)
+	{
+		__tree_tick();
+
+		double end = utils_get_ts() + __tree.period;
+
+		while(__tree.running && (utils_get_ts() < end) )
+		{
+			usleep(10000);
+		}
+	}
+
+	return NULL;
+}
+
+int tau_metric_tree_job_end(tau_metric_job_descriptor_t *desc, metric_array_t *array)
+{
+	pthread_mutex_lock(&__tree.lock);
+
+	if(!__tree.running)
+	{
+		pthread_mutex_unlock(&__tree.lock);
+		return 0;
+	}
+
+	tree_scope_t *scope = __tree_scope_get(desc, 1);
+	int           ret   = 1;
+
+	if(scope)
+	{
+		ret = __tree_diff(scope, &scope->local, array, 1, __tree_merge_local, NULL);
+		scope->local_running = 0;
+	}
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	return ret;
+}
+
+/************
+* CHILDREN *
+************/
+
+/* Accept the child or send it to one of ours */
+static int __tree_child_hello(tree_child_t *c, tree_hello_t *hello)
+{
+	if(hello->version != TREE_PROTOCOL_VERSION)
+	{
+		tau_metric_proxy_error("Tree child speaks protocol %d we speak %d", hello->version, TREE_PROTOCOL_VERSION);
+		return 1;
+	}
+
+	if(hello->token == __tree.token)
+	{
+		tau_metric_proxy_error("Refusing to join the aggregation tree under ourselves");
+		return 1;
+	}
+
+	hello->node[sizeof(hello->node) - 1] = '\0';
+	snprintf(c->node, sizeof(c->node), "%s", hello->node);
+	c->token = hello->token;
+
+	if(hello->last_parent != __tree.token)
+	{
+		/* It fed another parent since, which holds the rest of its totals */
+		pthread_mutex_lock(&__tree.lock);
+		__tree_ledgers_forget(c->token);
+		pthread_mutex_unlock(&__tree.lock);
+	}
+
+	if(hello->listen_port)
+	{
+		struct sockaddr_storage peer;
+		socklen_t               peer_len = sizeof(peer);
+		char                    ip[INET6_ADDRSTRLEN] = "";
+
+		if(!getpeername(c->fd, (struct sockaddr *)&peer, &peer_len) )
+		{
+			if(peer.ss_family == AF_INET6)
+			{
+				inet_ntop(AF_INET6, &( (struct sockaddr_in6 *)&peer)->sin6_addr, ip, sizeof(ip) );
+			}
+			else
+			{
+				inet_ntop(AF_INET, &( (struct sockaddr_in *)&peer)->sin_addr, ip, sizeof(ip) );
+			}
+		}
+
+		/* IPv4 clients of a dual stack socket */
+		const char *v4 = !strncmp(ip, "::ffff:", 7) ? ip + 7 : ip;
+
+		snprintf(c->address, sizeof(c->address), strchr(v4, ':') ? "[%s]:%u" : "%s:%u", v4, hello->listen_port);
+	}
+
+	/* Children notice they lost their parent later than we do */
+	__tree_timeout(c->fd, 3 * hello->period + TAU_METRIC_TREE_TIMEOUT);
+
+	tree_redirect_t redirect = { 0 };
+
+	pthread_mutex_lock(&__tree.lock);
+
+	if(__tree.fanout && (__tree.fanout <= __tree.child_count) )
+	{
+		unsigned int  candidates = 0;
+		unsigned int  pick;
+		tree_child_t *tmp;
+
+		for(tmp = __tree.children; tmp; tmp = tmp->next)
+		{
+			candidates += tmp->joined && strlen(tmp->address) && (tmp->token != c->token);
+		}
+
+		/* Otherwise all our children are leaves: we take it */
+		if(candidates)
+		{
+			pick = __tree.next_redirect++ % candidates;
+
+			for(tmp = __tree.children; tmp; tmp = tmp->next)
+			{
+				if(tmp->joined && strlen(tmp->address) && (tmp->token != c->token) && !(pick--) )
+				{
+					snprintf(redirect.address, sizeof(redirect.address), "%s", tmp->address);
+					break;
+				}
+			}
+		}
+	}
+
+	if(!strlen(redirect.address) )
+	{
+		c->joined = 1;
+		__tree.child_count++;
+	}
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	tree_msg_header_t header  = { .type = TREE_MSG_WELCOME, .size = sizeof(tree_welcome_t) };
+	tree_welcome_t    welcome = { .token = __tree.token };
+
+	if(strlen(redirect.address) )
+	{
+		tau_metric_proxy_log_verbose("Redirecting tree child %s to %s", c->node, redirect.address);
+
+		header.type = TREE_MSG_REDIRECT;
+		header.size = sizeof(redirect);
+
+		__tree_write(c->fd, (char *)&header, sizeof(header) );
+		__tree_write(c->fd, (char *)&redirect, sizeof(redirect) );
+
+		return 1;
+	}
+
+	tau_metric_proxy_log("Tree child %s joined (%s)", c->node, strlen(c->address) ? c->address : "leaf");
+
+	return __tree_write(c->fd, (char *)&header, sizeof(header) ) || __tree_write(c->fd, (char *)&welcome, sizeof(welcome) );
+}
+
+static int __tree_child_scope(tree_child_t *c, tree_scope_msg_t *msg)
+{
+	if(msg->scope != c->scope_count + 1)
+	{
+		return 1;
+	}
+
+	tree_scope_t **scopes = realloc(c->scopes, (msg->scope + 1) * sizeof(tree_scope_t *) );
+
+	if(!scopes)
+	{
+		tau_metric_proxy_perror("realloc");
+		return 1;
+	}
+
+	c->scopes = scopes;
+
+	tree_ledger_t **ledgers = realloc(c->ledgers, (msg->scope + 1) * sizeof(tree_ledger_t *) );
+
+	if(!ledgers)
+	{
+		tau_metric_proxy_perror("realloc");
+		return 1;
+	}
+
+	c->ledgers = ledgers;
+
+	pthread_mutex_lock(&__tree.lock);
+
+	tree_scope_t * scope  = __tree_scope_get(&msg->desc, 1);
+	tree_ledger_t *ledger = scope ? __tree_ledger_get(scope, c->token) : NULL;
+
+	if(ledger)
+	{
+		scope->children++;
+	}
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	c->scopes[msg->scope]  = ledger ? scope : NULL;
+	c->ledgers[msg->scope] = ledger;
+	c->scope_count++;
+
+	return ledger ? 0 : 1;
+}
+
+/* The child stops feeding the ledger (lock held) */
+static void __tree_child_ledger_leave(tree_child_t *c, uint32_t id)
+{
+	c->ledgers[id]->joined = 0;
+	c->ledgers[id]->left   = utils_get_ts();
+	c->ledgers[id]         = NULL;
+	c->scopes[id]->children--;
+	c->scopes[id] = NULL;
+}
+
+/* The child stops updating a scope, what it sent stays */
+static void __tree_child_scope_end(tree_child_t *c, uint32_t id)
+{
+	uint32_t i;
+
+	for(i = 1; i <= c->series_count; i++)
+	{
+		if(c->series[i].scope == id)
+		{
+			c->series[i].metric = NULL;
+			c->series[i].merged = NULL;
+		}
+	}
+
+	pthread_mutex_lock(&__tree.lock);
+	__tree_child_ledger_leave(c, id);
+	pthread_mutex_unlock(&__tree.lock);
+}
+
+static int __tree_child_define(tree_child_t *c, const char *payload, size_t size)
+{
+	tree_define_t def;
+
+	if(size < sizeof(def) )
+	{
+		return 1;
+	}
+
+	memcpy(&def, payload, sizeof(def) );
+
+	if( (size != sizeof(def) + def.name_len + def.doc_len) || (METRIC_STRING_SIZE <= def.name_len) ||
+	    (METRIC_STRING_SIZE <= def.doc_len) || (def.id != c->series_count + 1) || !def.scope ||
+	    (c->scope_count < def.scope) ||
+	    ( (def.type != TAU_METRIC_COUNTER) && (def.type != TAU_METRIC_GAUGE) && (def.type != TAU_METRIC_HISTOGRAM) ) )
+	{
+		return 1;
+	}
+
+	if(c->series_capacity <= def.id)
+	{
+		uint32_t             capacity = c->series_capacity ? 2 * c->series_capacity : 1024;
+		tree_child_series_t *series   = realloc(c->series, capacity * sizeof(tree_child_series_t) );
+
+		if(!series)
+		{
+			tau_metric_proxy_perror("realloc");
+			return 1;
+		}
+
+		c->series          = series;
+		c->series_capacity = capacity;
+	}
+
+	char name[METRIC_STRING_SIZE];
+	char doc[METRIC_STRING_SIZE];
+
+	snprintf(name, sizeof(name), "%.*s", (int)def.name_len, payload + sizeof(def) );
+	snprintf(doc, sizeof(doc), "%.*s", (int)def.doc_len, payload + sizeof(def) + def.name_len);
+
+	tree_child_series_t *s     = &c->series[def.id];
+	tree_scope_t *       scope = c->scopes[def.scope];
+
+	s->metric = NULL;
+	s->scope  = def.scope;
+	s->first  = 1;
+	s->base   = def.base;
+	s->merged = NULL;
+
+	if(scope)
+	{
+		/* Subtree arrays are never evicted: the metric can be kept */
+		int token = metric_array_read_lock(&scope->array);
+
+		s->metric = metric_array_get_or_register(&scope->array, name, doc, def.type);
+
+		if(s->metric && (s->metric->type != def.type) )
+		{
+			tau_metric_proxy_log_verbose("Mismatching types for tree series %s, dropping it", name);
+			s->metric = NULL;
+		}
+
+		metric_array_read_unlock(&scope->array, token);
+
+		/* Only the connection of the child uses its ledger */
+		if(s->metric && metric_type_cumulative(def.type) )
+		{
+			int created;
+
+			s->merged = __tracker_get(&c->ledgers[def.scope]->counters, s->metric->name, &created);
+
+			if(!s->merged)
+			{
+				s->metric = NULL;
+			}
+			else if(created)
+			{
+				/* Unknown here, the base went through another parent */
+				s->merged->value = def.base;
+			}
+		}
+	}
+
+	c->series_count++;
+
+	return 0;
+}
+
+static int __tree_child_deltas(tree_child_t *c, const char *payload, size_t size)
+{
+	if(size % sizeof(tree_delta_t) )
+	{
+		return 1;
+	}
+
+	tau_metric_event_t ev = { .value = 0 };
+	size_t             i;
+
+	for(i = 0; i < size / sizeof(tree_delta_t); i++)
+	{
+		tree_delta_t d;
+
+		memcpy(&d, payload + i * sizeof(tree_delta_t), sizeof(d) );
+
+		if(!d.id || (c->series_count < d.id) )
+		{
+			return 1;
+		}
+
+		tree_child_series_t *s = &c->series[d.id];
+
+		if(!s->metric)
+		{
+			continue;
+		}
+
+		ev.value = d.value;
+
+		if(s->merged)
+		{
+			/* Joining again, what was forwarded but lost is merged too */
+			if(s->first)
+			{
+				double total = s->base + d.value;
+
+				ev.value = (s->merged->value < total) ? total - s->merged->value : 0;
+			}
+
+			s->merged->value += ev.value;
+		}
+
+		s->first = 0;
+
+		if(ev.value || !metric_type_cumulative(s->metric->type) )
+		{
+			metric_update(s->metric, &ev);
+		}
+	}
+
+	return 0;
+}
+
+static int __tree_child_message(tree_child_t *c, tree_msg_header_t *header, char *payload)
+{
+	if(!c->joined)
+	{
+		return (header->type != TREE_MSG_HELLO) || (header->size != sizeof(tree_hello_t) ) ||
+		       __tree_child_hello(c, (tree_hello_t *)payload);
+	}
+
+	switch(header->type)
+	{
+		case TREE_MSG_SCOPE:
+			return (header->size != sizeof(tree_scope_msg_t) ) || __tree_child_scope(c, (tree_scope_msg_t *)payload);
+
+		case TREE_MSG_SCOPE_END:
+		{
+			tree_scope_end_t end;
+
+			if(header->size != sizeof(end) )
+			{
+				return 1;
+			}
+
+			memcpy(&end, payload, sizeof(end) );
+
+			if(!end.scope || (c->scope_count < end.scope) )
+			{
+				return 1;
+			}
+
+			if(c->scopes[end.scope])
+			{
+				__tree_child_scope_end(c, end.scope);
+			}
+
+			return 0;
+		}
+
+		case TREE_MSG_DEFINE:
+			return __tree_child_define(c, payload, header->size);
+
+		case TREE_MSG_DELTAS:
+			return __tree_child_deltas(c, payload, header->size);
+	}
+
+	return 1;
+}
+
+/* What the child merged stays, its ledgers wait for it to join again */
+static void __tree_child_leave(tree_child_t *c)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&__tree.lock);
+
+	for(i = 1; i <= c->scope_count; i++)
+	{
+		if(c->scopes[i])
+		{
+			__tree_child_ledger_leave(c, i);
+		}
+	}
+
+	if(c->joined)
+	{
+		__tree.child_count--;
+		tau_metric_proxy_log("Tree child %s left", c->node);
+	}
+
+	if(c->prev)
+	{
+		c->prev->next = c->next;
+	}
+	else
+	{
+		__tree.children = c->next;
+	}
+
+	if(c->next)
+	{
+		c->next->prev = c->prev;
+	}
+
+	__tree.connections--;
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	close(c->fd);
+	free(c->scopes);
+	free(c->ledgers);
+	free(c->series);
+	free(c);
+}
+
+static void *__tree_child_loop(void *pchild)
+{
+	tree_child_t *c       = (tree_child_t *)pchild;
+	char *        payload = malloc(TREE_MAX_MESSAGE);
+
+	while(payload && __tree.running)
+	{
+		tree_msg_header_t header;
+
+		if(__tree_read(c->fd, &header, sizeof(header) ) )
+		{
+			break;
+		}
+
+		if( (TREE_MAX_MESSAGE < header.size) || __tree_read(c->fd, payload, header.size) )
+		{
+			break;
+		}
+
+		__atomic_add_fetch(&c->received_bytes, sizeof(header) + header.size, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&__tree.received_bytes, sizeof(header) + header.size, __ATOMIC_RELAXED);
+
+		if(__tree_child_message(c, &header, payload) )
+		{
+			if(c->joined)
+			{
+				tau_metric_proxy_error("Invalid message %d from tree child %s, disconnecting it", header.type, c->node);
+			}
+
+			break;
+		}
+	}
+
+	free(payload);
+
+	__tree_child_leave(c);
+
+	return NULL;
+}
+
+static int __tree_listen(const char *port)
+{
+	struct addrinfo hints = { 0 };
+	struct addrinfo *res  = NULL;
+
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_PASSIVE;
+
+	int ret = getaddrinfo(NULL, port, &hints, &res);
+
+	if(ret)
+	{
+		tau_metric_proxy_error("getaddrinfo: %s", gai_strerror(ret) );
+		return -1;
+	}
+
+	int              fd = -1;
+	struct addrinfo *tmp;
+
+	for(tmp = res; tmp; tmp = tmp->ai_next)
+	{
+		fd = socket(tmp->ai_family, tmp->ai_socktype | SOCK_CLOEXEC, tmp->ai_protocol);
+
+		if(fd < 0)
+		{
+			continue;
+		}
+
+		int one = 1;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+
+		if(!bind(fd, tmp->ai_addr, tmp->ai_addrlen) && !listen(fd, SOMAXCONN) )
+		{
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if(fd < 0)
+	{
+		tau_metric_proxy_error("Failed to listen for tree children on port %s", port);
+	}
+
+	return fd;
+}
+
+static void *__tree_listen_loop(void *dummy)
+{
+	while(__tree.running)
+	{
+		struct pollfd p = { .fd = __tree.listen_fd, .events = POLLIN };
+
+		if(poll(&p, 1, 100) <= 0)
+		{
+			continue;
+		}
+
+		int fd = accept(__tree.listen_fd, NULL, NULL);
+
+		if(fd < 0)
+		{
+			continue;
+		}
+
+		tree_child_t *c = calloc(1, sizeof(tree_child_t) );
+
+		if(!c)
+		{
+			tau_metric_proxy_perror("calloc");
+			close(fd);
+			continue;
+		}
+
+		c->fd = fd;
+
+		/* Until it says hello */
+		__tree_timeout(fd, TAU_METRIC_TREE_TIMEOUT);
+
+		pthread_mutex_lock(&__tree.lock);
+
+		c->next = __tree.children;
+
+		if(c->next)
+		{
+			c->next->prev = c;
+		}
+
+		__tree.children = c;
+		__tree.connections++;
+
+		pthread_mutex_unlock(&__tree.lock);
+
+		pthread_t      thread;
+		pthread_attr_t attr;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		if(pthread_create(&thread, &attr, __tree_child_loop, c) )
+		{
+			tau_metric_proxy_perror("pthread_create");
+			__tree_child_leave(c);
+		}
+
+		pthread_attr_destroy(&attr);
+	}
+
+	return NULL;
+}
+
+/***********
+* READERS *
+***********/
+
+metric_array_t *tau_metric_tree_get(const char *jobid)
+{
+	tau_metric_job_descriptor_t desc;
+	metric_array_t *            ret = NULL;
+
+	snprintf(desc.jobid, sizeof(desc.jobid), "%s", jobid);
+
+	pthread_mutex_lock(&__tree.lock);
+
+	tree_scope_t *scope = __tree.running ? __tree_scope_get(&desc, 0) : NULL;
+
+	if(scope)
+	{
+		scope->refs++;
+		ret = &scope->array;
+	}
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	return ret;
+}
+
+int tau_metric_tree_relax(const char *jobid)
+{
+	tau_metric_job_descriptor_t desc;
+
+	snprintf(desc.jobid, sizeof(desc.jobid), "%s", jobid);
+
+	pthread_mutex_lock(&__tree.lock);
+
+	tree_scope_t *scope = __tree.scopes ? __tree_scope_get(&desc, 0) : NULL;
+
+	if(scope)
+	{
+		scope->refs--;
+	}
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	return scope ? 0 : 1;
+}
+
+int tau_metric_tree_info(tau_metric_tree_info_t *info)
+{
+	memset(info, 0, sizeof(tau_metric_tree_info_t) );
+
+	pthread_mutex_lock(&__tree.lock);
+
+	if(!__tree.running)
+	{
+		pthread_mutex_unlock(&__tree.lock);
+		return 1;
+	}
+
+	snprintf(info->parent, sizeof(info->parent), "%s", __tree.joined);
+	info->fanout   = __tree.fanout;
+	info->children = calloc(__tree.child_count + 1, sizeof(tau_metric_tree_child_t) );
+	info->scopes   = calloc(__tree.scope_count + 1, sizeof(tau_metric_tree_scope_t) );
+
+	if(!info->children || !info->scopes)
+	{
+		pthread_mutex_unlock(&__tree.lock);
+		tau_metric_proxy_perror("calloc");
+		tau_metric_tree_info_free(info);
+		return 1;
+	}
+
+	tree_child_t *c;
+
+	for(c = __tree.children; c; c = c->next)
+	{
+		if(!c->joined)
+		{
+			continue;
+		}
+
+		tau_metric_tree_child_t *child = &info->children[info->child_count++];
+
+		snprintf(child->address, sizeof(child->address), "%s", c->address);
+		snprintf(child->node, sizeof(child->node), "%s", c->node);
+		child->received_bytes = __atomic_load_n(&c->received_bytes, __ATOMIC_RELAXED);
+	}
+
+	tree_scope_t *scope;
+
+	for(scope = __tree.scopes; scope; scope = scope->next)
+	{
+		tau_metric_tree_scope_t *s = &info->scopes[info->scope_count++];
+
+		memcpy(&s->desc, &scope->desc, sizeof(tau_metric_job_descriptor_t) );
+		s->series   = metric_array_count(&scope->array);
+		s->children = scope->children;
+		s->local    = (scope == __tree.scopes) || scope->local_running;
+	}
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	return 0;
+}
+
+void tau_metric_tree_info_free(tau_metric_tree_info_t *info)
+{
+	free(info->children);
+	free(info->scopes);
+	memset(info, 0, sizeof(tau_metric_tree_info_t) );
+}
+
+/*************
+* LIFECYCLE *
+*************/
+
+int tau_metric_tree_start(const char *parent, const char *listen_port, unsigned int fanout, double period)
+{
+	if(!parent && !listen_port)
+	{
+		return 0;
+	}
+
+	if(gethostname(__tree.node, sizeof(__tree.node) ) )
+	{
+		tau_metric_proxy_perror("gethostname");
+		snprintf(__tree.node, sizeof(__tree.node), "unknown");
+	}
+
+	__tree.node[sizeof(__tree.node) - 1] = '\0';
+
+	char host[256];
+	char port[16];
+
+	if(parent && __tree_address_split(parent, host, sizeof(host), port, sizeof(port) ) )
+	{
+		tau_metric_proxy_error("Tree parents are host:port addresses had: %s", parent);
+		return 1;
+	}
+
+	snprintf(__tree.parent, sizeof(__tree.parent), "%s", parent ? parent : "");
+
+	__tree.period      = period;
+	__tree.fanout      = fanout;
+	__tree.token       = ( (uint64_t)getpid() << 32) ^ (uint64_t)(utils_get_ts() * 1e6);
+	__tree.backoff     = TAU_METRIC_TREE_MIN_BACKOFF;
+	__tree.listen_port = listen_port ? atoi(listen_port) : 0;
+
+	__tree.m_children       = metric_array_get_pinned("tau_proxy_tree_children", "Child proxies forwarding to this proxy", TAU_METRIC_GAUGE);
+	__tree.m_joined         = metric_array_get_pinned("tau_proxy_tree_joined", "1 when this proxy forwards to its parent", TAU_METRIC_GAUGE);
+	__tree.m_scopes         = metric_array_get_pinned("tau_proxy_tree_arrays", "Subtree arrays aggregated by this proxy (cluster and jobs)", TAU_METRIC_GAUGE);
+	__tree.m_sent_bytes     = metric_array_get_pinned("tau_proxy_tree_sent_bytes_total", "Bytes forwarded to the parent proxy", TAU_METRIC_COUNTER);
+	__tree.m_received_bytes = metric_array_get_pinned("tau_proxy_tree_received_bytes_total", "Bytes received from child proxies", TAU_METRIC_COUNTER);
+
+	if(!__tree.m_children || !__tree.m_joined || !__tree.m_scopes || !__tree.m_sent_bytes || !__tree.m_received_bytes)
+	{
+		return 1;
+	}
+
+	tau_metric_job_descriptor_t cluster = { 0 };
+
+	__tree.scopes = __tree_scope_new(&cluster);
+
+	if(!__tree.scopes)
+	{
+		return 1;
+	}
+
+	__tree.scope_count = 1;
+
+	if(listen_port)
+	{
+		__tree.listen_fd = __tree_listen(listen_port);
+
+		if(__tree.listen_fd < 0)
+		{
+			return 1;
+		}
+	}
+
+	__tree.running = 1;
+
+	if( (listen_port && pthread_create(&__tree.listener, NULL, __tree_listen_loop, NULL) ) ||
+	    pthread_create(&__tree.thread, NULL, __tree_thread_loop, NULL) )
+	{
+		tau_metric_proxy_perror("pthread_create");
+		tau_metric_tree_stop();
+		return 1;
+	}
+
+	tau_metric_proxy_log("Aggregation tree: parent %s, children on port %s (fanout %u), every %g seconds",
+	                     parent ? parent : "none", listen_port ? listen_port : "none", fanout, period);
+
+	return 0;
+}
+
+int tau_metric_tree_stop(void)
+{
+	if(!__tree.running)
+	{
+		return 0;
+	}
+
+	__tree.running = 0;
+
+	if(__tree.thread)
+	{
+		pthread_join(__tree.thread, NULL);
+		__tree.thread = 0;
+	}
+
+	if(__tree.listener)
+	{
+		pthread_join(__tree.listener, NULL);
+		__tree.listener = 0;
+	}
+
+	/* Wake the children threads and wait for them */
+	pthread_mutex_lock(&__tree.lock);
+
+	tree_child_t *c;
+
+	for(c = __tree.children; c; c = c->next)
+	{
+		shutdown(c->fd, SHUT_RDWR);
+	}
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	while(__atomic_load_n(&__tree.connections, __ATOMIC_ACQUIRE) )
+	{
+		usleep(10000);
+	}
+
+	if(0 <= __tree.listen_fd)
+	{
+		close(__tree.listen_fd);
+		__tree.listen_fd = -1;
+	}
+
+	pthread_mutex_lock(&__tree.lock);
+
+	if(0 <= __tree.up_fd)
+	{
+		close(__tree.up_fd);
+		__tree.up_fd = -1;
+	}
+
+	while(__tree.scopes)
+	{
+		tree_scope_t *next = __tree.scopes->next;
+
+		/* Readers still holding an array keep it */
+		if(!__tree.scopes->refs)
+		{
+			__tree_scope_free(__tree.scopes);
+		}
+
+		__tree.scopes = next;
+	}
+
+	__tree.scope_count = 0;
+
+	metric_array_snapshot_free(&__tree.snapshot);
+
+	pthread_mutex_unlock(&__tree.lock);
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+#ifndef TAU_METRIC_PROXY_TREE_H
+#define TAU_METRIC_PROXY_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+#include "tau_metric_proxy_client.h"
+
+/********************
+* AGGREGATION TREE *
+********************/
+
+/** Default seconds between two forwards to the parent */
+#define TAU_METRIC_TREE_DEFAULT_PERIOD 1.0
+
+/** Default children accepted before the next ones are redirected to them */
+#define TAU_METRIC_TREE_DEFAULT_FANOUT 4
+
+/** Redirections followed at most when joining the tree */
+#define TAU_METRIC_TREE_MAX_REDIRECTS 16
+
+/** Connections and answers taking longer are failed (seconds) */
+#define TAU_METRIC_TREE_TIMEOUT 10
+
+/** First delay before joining again, doubled up to the maximum (seconds) */
+#define TAU_METRIC_TREE_MIN_BACKOFF 0.5
+#define TAU_METRIC_TREE_MAX_BACKOFF 30.0
+
+/** Ended jobs not forwarded to the parent are dropped after this long (seconds) */
+#define TAU_METRIC_TREE_SCOPE_LINGER 60.0
+
+/** What a child merged is remembered this long after it left (seconds), it
+    is not merged again if the child joins back in the meantime */
+#define TAU_METRIC_TREE_CHILD_LINGER 3600.0
+
+/**
+ * @brief A child proxy as listed on /tree
+ *
+ */
+typedef struct
+{
+	char     address[300];   /**< Where it accepts children (empty for a leaf) */
+	char     node[64];       /**< Its host name */
+	uint64_t received_bytes; /**< Bytes received from it */
+}tau_metric_tree_child_t;
+
+/**
+ * @brief An aggregated array as listed on /tree
+ *
+ */
+typedef struct
+{
+	tau_metric_job_descriptor_t desc; /**< Job (empty jobid for the cluster) */
+	uint64_t                    series;
+	int                         children; /**< Children forwarding it */
+	int                         local;    /**< Also running on this node */
+}tau_metric_tree_scope_t;
+
+/**
+ * @brief State of this proxy in the tree
+ *
+ */
+typedef struct
+{
+	char                      parent[300]; /**< Parent currently joined (empty if none) */
+	unsigned int              fanout;
+	tau_metric_tree_child_t * children;
+	size_t                    child_count;
+	tau_metric_tree_scope_t * scopes;
+	size_t                    scope_count;
+}tau_metric_tree_info_t;
+
+/**
+ * @brief Start aggregating the subtree of this proxy
+ *
+ * Every period the updates of the node array and of the running job
+ * arrays are merged in the subtree arrays: one for the cluster and
+ * one per job. Children send their subtree arrays the same way over
+ * TCP as increments for counters and samples for gauges, which are
+ * merged like client updates. The subtree arrays are in turn
+ * forwarded to the parent, if any.
+ *
+ * Each proxy accepts up to fanout children, the next ones are
+ * redirected to its children which accept them or redirect them
+ * further: all the proxies can be given the same parent and a k-ary
+ * tree forms. What a child merged stays when it leaves, so counters
+ * never go down: when it joins again, only the part of its totals
+ * not merged yet is added. Peers exchange native structures and must
+ * share the same architecture.
+ *
+ * @param parent host:port of the parent (NULL for the root)
+ * @param listen_port port on which children are accepted (NULL for a leaf)
+ * @param fanout children accepted before redirecting (0 accepts them all)
+ * @param period seconds between two merges
+ * @return int 0 on success
+ */
+int tau_metric_tree_start(const char *parent, const char *listen_port, unsigned int fanout, double period);
+
+/**
+ * @brief Leave the tree and drop the subtree arrays
+ *
+ * @return int 0 on success
+ */
+int tau_metric_tree_stop(void);
+
+/**
+ * @brief Merge the last updates of a job leaving this node
+ *
+ * To be called from the job release callback, before the array is freed.
+ *
+ * @param desc the job
+ * @param array its per-job array
+ * @return int 0 on success (also when the tree is not running)
+ */
+int tau_metric_tree_job_end(tau_metric_job_descriptor_t *desc, metric_array_t *array);
+
+/**
+ * @brief Get a subtree array (kept until relaxed)
+ *
+ * @param jobid a job, empty for the cluster
+ * @return metric_array_t* the array, NULL if unknown or not running
+ */
+metric_array_t *tau_metric_tree_get(const char *jobid);
+
+/**
+ * @brief Release an array returned by @ref tau_metric_tree_get
+ *
+ * @param jobid the job given to get
+ * @return int 0 on success
+ */
+int tau_metric_tree_relax(const char *jobid);
+
+/**
+ * @brief Copy the state of this proxy in the tree
+ *
+ * @param info filled with arrays to release with @ref tau_metric_tree_info_free
+ * @return int 0 on success, 1 if not running
+ */
+int tau_metric_tree_info(tau_metric_tree_info_t *info);
+
+void tau_metric_tree_info_free(tau_metric_tree_info_t *info);
+
+#endif /* TAU_METRIC_PROXY_TREE_H */
@@ -0,0 +1,248 @@
+#include "trie.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+static metric_trie_node_t *__trie_node_new(const char *label, uint32_t len)
+{
+	metric_trie_node_t *ret = malloc(sizeof(metric_trie_node_t) + len);
+
+	if(!ret)
+	{
+		tau_metric_proxy_perror("malloc");
+		return NULL;
+	}
+
+	ret->value     = NULL;
+	ret->child     = NULL;
+	ret->sibling   = NULL;
+	ret->label_len = len;
+	memcpy(ret->label, label, len);
+
+	return ret;
+}
+
+static void __trie_node_free(metric_trie_node_t *n)
+{
+	while(n)
+	{
+		metric_trie_node_t *next = n->sibling;
+		__trie_node_free(n->child);
+		free(n);
+		n = next;
+	}
+}
+
+/* Link to the child starting with c, or to where it would be inserted */
+static inline metric_trie_node_t **__trie_child(metric_trie_node_t *n, char c)
+{
+	metric_trie_node_t **link = &n->child;
+
+	while(*link && ( (unsigned char)(*link)->label[0] < (unsigned char)c) )
+	{
+		link = &(*link)->sibling;
+	}
+
+	return link;
+}
+
+int metric_trie_init(metric_trie_t *t)
+{
+	t->count = 0;
+	t->root  = __trie_node_new("", 0);
+
+	return t->root ? 0 : 1;
+}
+
+void metric_trie_release(metric_trie_t *t)
+{
+	__trie_node_free(t->root);
+	t->root  = NULL;
+	t->count = 0;
+}
+
+int metric_trie_insert(metric_trie_t *t, const char *key, size_t len, void *value)
+{
+	metric_trie_node_t *n   = t->root;
+	size_t              pos = 0;
+
+	while(pos < len)
+	{
+		metric_trie_node_t **link = __trie_child(n, key[pos]);
+		metric_trie_node_t * c    = *link;
+
+		if(!c || (c->label[0] != key[pos]) )
+		{
+			metric_trie_node_t *leaf = __trie_node_new(key + pos, len - pos);
+
+			if(!leaf)
+			{
+				return 1;
+			}
+
+			leaf->value   = value;
+			leaf->sibling = c;
+			*link         = leaf;
+			t->count++;
+
+			return 0;
+		}
+
+		uint32_t common = 1;
+
+		while( (common < c->label_len) && (pos + common < len) && (c->label[common] == key[pos + common]) )
+		{
+			common++;
+		}
+
+		if(common < c->label_len)
+		{
+			/* Split the edge, the child keeps the end of its label */
+			metric_trie_node_t *mid = __trie_node_new(c->label, common);
+
+			if(!mid)
+			{
+				return 1;
+			}
+
+			mid->sibling = c->sibling;
+			mid->child   = c;
+			c->sibling   = NULL;
+			memmove(c->label, c->label + common, c->label_len - common);
+			c->label_len -= common;
+			*link         = mid;
+			c             = mid;
+		}
+
+		n    = c;
+		pos += common;
+	}
+
+	if(!n->value)
+	{
+		t->count++;
+	}
+
+	n->value = value;
+
+	return 0;
+}
+
+/* Removes the key below n, then prunes or merges the child it went through */
+static void *__trie_remove(metric_trie_node_t *n, const char *key, size_t len)
+{
+	if(!len)
+	{
+		void *ret = n->value;
+		n->value = NULL;
+		return ret;
+	}
+
+	metric_trie_node_t **link = __trie_child(n, key[0]);
+	metric_trie_node_t * c    = *link;
+
+	if(!c || (len < c->label_len) || memcmp(c->label, key, c->label_len) )
+	{
+		return NULL;
+	}
+
+	void *ret = __trie_remove(c, key + c->label_len, len - c->label_len);
+
+	if(!ret || c->value)
+	{
+		return ret;
+	}
+
+	if(!c->child)
+	{
+		*link = c->sibling;
+		free(c);
+	}
+	else if(!c->child->sibling)
+	{
+		/* A single child is merged in its parent edge, on allocation
+		   failure the tree is kept as is which is still correct */
+		metric_trie_node_t *g      = c->child;
+		metric_trie_node_t *merged = malloc(sizeof(metric_trie_node_t) + c->label_len + g->label_len);
+
+		if(merged)
+		{
+			merged->value     = g->value;
+			merged->child     = g->child;
+			merged->sibling   = c->sibling;
+			merged->label_len = c->label_len + g->label_len;
+			memcpy(merged->label, c->label, c->label_len);
+			memcpy(merged->label + c->label_len, g->label, g->label_len);
+
+			*link = merged;
+			free(g);
+			free(c);
+		}
+	}
+
+	return ret;
+}
+
+void *metric_trie_remove(metric_trie_t *t, const char *key, size_t len)
+{
+	void *ret = __trie_remove(t->root, key, len);
+
+	if(ret)
+	{
+		t->count--;
+	}
+
+	return ret;
+}
+
+static int __trie_walk(metric_trie_node_t *n, metric_trie_callback_t callback, void *arg)
+{
+	int ret;
+
+	if(n->value && (ret = callback(n->value, arg) ) )
+	{
+		return ret;
+	}
+
+	for(n = n->child; n; n = n->sibling)
+	{
+		if( (ret = __trie_walk(n, callback, arg) ) )
+		{
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int metric_trie_walk_prefix(metric_trie_t *t, const char *prefix, size_t len,
+                            metric_trie_callback_t callback, void *arg)
+{
+	metric_trie_node_t *n   = t->root;
+	size_t              pos = 0;
+
+	while(pos < len)
+	{
+		metric_trie_node_t *c = *__trie_child(n, prefix[pos]);
+
+		if(!c || (c->label[0] != prefix[pos]) )
+		{
+			return 0;
+		}
+
+		/* The prefix may end in the middle of an edge */
+		size_t span = (c->label_len < len - pos) ? c->label_len : len - pos;
+
+		if(memcmp(c->label, prefix + pos, span) )
+		{
+			return 0;
+		}
+
+		n    = c;
+		pos += span;
+	}
+
+	return __trie_walk(n, callback, arg);
+}
@@ -0,0 +1,89 @@
+#ifndef TAU_METRIC_PROXY_TRIE_H
+#define TAU_METRIC_PROXY_TRIE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/****************
+* PREFIX INDEX *
+****************/
+
+/**
+ * @brief A node of the radix tree, edges are labeled by byte strings
+ *
+ */
+typedef struct metric_trie_node_s
+{
+	void *                     value;     /**< Value of the key ending here (NULL if none) */
+	struct metric_trie_node_s *child;     /**< First child, children are sorted by first byte */
+	struct metric_trie_node_s *sibling;   /**< Next child of the parent */
+	uint32_t                   label_len; /**< Length of the edge label */
+	char                       label[];   /**< Bytes of the edge leading to the node */
+}metric_trie_node_t;
+
+/**
+ * @brief Radix tree mapping keys to values
+ *
+ * Walking the keys starting with a prefix costs the length of the
+ * prefix plus the size of the matching subtree. Callers serialize
+ * accesses.
+ */
+typedef struct
+{
+	metric_trie_node_t *root;
+	uint64_t            count; /**< Number of keys */
+}metric_trie_t;
+
+/**
+ * @brief Initialize an empty tree
+ *
+ * @param t the tree to initialize
+ * @return int 0 on success
+ */
+int metric_trie_init(metric_trie_t *t);
+
+/**
+ * @brief Free the nodes of a tree (values are left to the caller)
+ *
+ * @param t the tree to release
+ */
+void metric_trie_release(metric_trie_t *t);
+
+/**
+ * @brief Map a key to a value (replacing a previous one)
+ *
+ * @param t the tree
+ * @param key the key (no need for a NUL terminator)
+ * @param len length of the key
+ * @param value non NULL value to store
+ * @return int 0 on success 1 on allocation failure
+ */
+int metric_trie_insert(metric_trie_t *t, const char *key, size_t len, void *value);
+
+/**
+ * @brief Remove a key
+ *
+ * @param t the tree
+ * @param key the key
+ * @param len length of the key
+ * @return void* the value of the key NULL if it was absent
+ */
+void *metric_trie_remove(metric_trie_t *t, const char *key, size_t len);
+
+/** Called on each value of a walk, a non zero return stops it */
+typedef int (*metric_trie_callback_t)(void *value, void *arg);
+
+/**
+ * @brief Visit the values of the keys starting with a prefix in key order
+ *
+ * @param t the tree
+ * @param prefix the prefix (empty visits everything)
+ * @param len length of the prefix
+ * @param callback called on each value
+ * @param arg passed to the callback
+ * @return int 0 when all visited the callback return value if it stopped the walk
+ */
+int metric_trie_walk_prefix(metric_trie_t *t, const char *prefix, size_t len,
+                            metric_trie_callback_t callback, void *arg);
+
+#endif /* TAU_METRIC_PROXY_TRIE_H */
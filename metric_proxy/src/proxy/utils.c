@@ -1,8 +1,11 @@
 #include "utils.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sched.h>
+#include <string.h>
 
 /***************
  * TIME GETTER *
@@ -70,3 +73,211 @@ time_t utils_file_last_modif_delta(const char * path)
 
 	return time(NULL) - st.st_mtime;
 }
+
+static const unsigned long __network_fs_magics[] =
+{
+	0x6969,     /* NFS */
+	0x517B,     /* SMB */
+	0xFF534D42, /* CIFS */
+	0xFE534D42, /* SMB2 */
+	0x0BD00BD0, /* Lustre */
+	0x47504653, /* GPFS */
+	0x19830326, /* BeeGFS */
+	0x00C36400, /* Ceph */
+	0xAAD7AAEA, /* PanFS */
+	0x5346414F, /* AFS */
+	0x65735546, /* FUSE */
+};
+
+int utils_is_network_fs(const char * path)
+{
+	struct statfs st;
+
+	if( statfs(path, &st) < 0)
+	{
+		return 0;
+	}
+
+	unsigned int i;
+
+	for(i = 0; i < sizeof(__network_fs_magics) / sizeof(unsigned long); i++)
+	{
+		if( (unsigned long)(uint32_t)st.f_type == __network_fs_magics[i])
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/**********************
+ * DEFERRED RECLAIMING *
+ **********************/
+
+void utils_epoch_init(utils_epoch_t * e)
+{
+	e->epoch = 0;
+	e->readers[0] = 0;
+	e->readers[1] = 0;
+	pthread_mutex_init(&e->sync_lock, NULL);
+}
+
+int utils_epoch_enter(utils_epoch_t * e)
+{
+	while(1)
+	{
+		int token = __atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST) & 1;
+
+		__atomic_add_fetch(&e->readers[token], 1, __ATOMIC_SEQ_CST);
+
+		if( (__atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST) & 1) == token)
+		{
+			return token;
+		}
+
+		/* A grace period started in between retry in the new slot */
+		__atomic_sub_fetch(&e->readers[token], 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void utils_epoch_exit(utils_epoch_t * e, int token)
+{
+	__atomic_sub_fetch(&e->readers[token], 1, __ATOMIC_RELEASE);
+}
+
+void utils_epoch_synchronize(utils_epoch_t * e)
+{
+	pthread_mutex_lock(&e->sync_lock);
+
+	uint64_t previous = __atomic_fetch_add(&e->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+	while(__atomic_load_n(&e->readers[previous], __ATOMIC_ACQUIRE) )
+	{
+		sched_yield();
+	}
+
+	pthread_mutex_unlock(&e->sync_lock);
+}
+
+/******************
+ * CHECKSUM UTILS *
+ ******************/
+
+/* Reflected Castagnoli polynomial */
+#define UTILS_CRC32C_POLY 0x82F63B78
+
+static uint32_t __crc32c_table[8][256];
+static pthread_once_t __crc32c_once = PTHREAD_ONCE_INIT;
+
+static void __crc32c_table_init(void)
+{
+	uint32_t i, j;
+
+	for(i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+
+		for(j = 0; j < 8; j++)
+		{
+			crc = (crc >> 1) ^ ( (crc & 1) ? UTILS_CRC32C_POLY : 0);
+		}
+
+		__crc32c_table[0][i] = crc;
+	}
+
+	/* Table k advances a byte followed by k zero bytes */
+	for(i = 0; i < 256; i++)
+	{
+		for(j = 1; j < 8; j++)
+		{
+			uint32_t prev = __crc32c_table[j - 1][i];
+			__crc32c_table[j][i] = (prev >> 8) ^ __crc32c_table[0][prev & 0xFF];
+		}
+	}
+}
+
+static uint32_t __crc32c_sw(uint32_t crc, const uint8_t * p, size_t len)
+{
+	while(len && ( (uintptr_t)p & 7) )
+	{
+		crc = (crc >> 8) ^ __crc32c_table[0][(crc ^ *p++) & 0xFF];
+		len--;
+	}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while(len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, 8);
+
+		/* Little endian: the first four bytes are the low half of the word */
+		uint32_t lo = (uint32_t)word ^ crc;
+		uint32_t hi = (uint32_t)(word >> 32);
+
+		crc = __crc32c_table[7][lo & 0xFF] ^ __crc32c_table[6][(lo >> 8) & 0xFF] ^
+		      __crc32c_table[5][(lo >> 16) & 0xFF] ^ __crc32c_table[4][lo >> 24] ^
+		      __crc32c_table[3][hi & 0xFF] ^ __crc32c_table[2][(hi >> 8) & 0xFF] ^
+		      __crc32c_table[1][(hi >> 16) & 0xFF] ^ __crc32c_table[0][hi >> 24];
+
+		p   += 8;
+		len -= 8;
+	}
+#endif
+
+	while(len--)
+	{
+		crc = (crc >> 8) ^ __crc32c_table[0][(crc ^ *p++) & 0xFF];
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+__attribute__( (target("sse4.2") ) )
+static uint32_t __crc32c_hw(uint32_t crc, const uint8_t * p, size_t len)
+{
+	uint64_t crc64 = crc;
+
+	while(len && ( (uintptr_t)p & 7) )
+	{
+		crc64 = __builtin_ia32_crc32qi( (uint32_t)crc64, *p++);
+		len--;
+	}
+
+	while(len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+		p   += 8;
+		len -= 8;
+	}
+
+	while(len--)
+	{
+		crc64 = __builtin_ia32_crc32qi( (uint32_t)crc64, *p++);
+	}
+
+	return (uint32_t)crc64;
+}
+
+#endif
+
+uint32_t utils_crc32c(uint32_t crc, const void * data, size_t len)
+{
+	crc = ~crc;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	if(__builtin_cpu_supports("sse4.2") )
+	{
+		return ~__crc32c_hw(crc, data, len);
+	}
+#endif
+
+	pthread_once(&__crc32c_once, __crc32c_table_init);
+
+	return ~__crc32c_sw(crc, data, len);
+}
@@ -3,6 +3,8 @@
 
 #include <time.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 /***************
  * TIME GETTER *
@@ -47,6 +49,60 @@ int utils_isfile(const char * path);
  */
 time_t utils_file_last_modif_delta(const char * path);
 
+/**
+ * @brief Return true if path is on a network or cluster filesystem
+ *
+ * Changes made by other nodes on these filesystems are not notified
+ * locally, they have to be scanned for.
+ *
+ * @param path path to check
+ * @return int True for NFS, SMB, Lustre, GPFS, BeeGFS, Ceph, PanFS, AFS or FUSE
+ */
+int utils_is_network_fs(const char * path);
+
+/**********************
+ * DEFERRED RECLAIMING *
+ **********************/
+
+/**
+ * @brief Grace period tracker for lock-free readers
+ *
+ * Read sections are counted in one of two slots selected by the epoch
+ * parity. Synchronizing flips the parity and waits for the previous
+ * slot to drain: afterwards no reader can still see an unlinked element.
+ */
+typedef struct
+{
+	uint64_t        epoch;      /**< Current parity */
+	uint64_t        readers[2]; /**< Readers in each parity */
+	pthread_mutex_t sync_lock;  /**< Serializes grace periods */
+}utils_epoch_t;
+
+void utils_epoch_init(utils_epoch_t * e);
+
+/**
+ * @brief Enter a read section
+ *
+ * @param e the epoch to enter
+ * @return int token to pass to @ref utils_epoch_exit
+ */
+int utils_epoch_enter(utils_epoch_t * e);
+
+/**
+ * @brief Leave a read section
+ *
+ * @param e the epoch to leave
+ * @param token the value returned by @ref utils_epoch_enter
+ */
+void utils_epoch_exit(utils_epoch_t * e, int token);
+
+/**
+ * @brief Wait for all the read sections started before the call
+ *
+ * @param e the epoch to wait on
+ */
+void utils_epoch_synchronize(utils_epoch_t * e);
+
 /*****************
  * HASHING UTILS *
  *****************/
@@ -65,4 +121,36 @@ static inline uint64_t utils_string_hash(const unsigned char *str)
 	return hash;
 }
 
+/* Same hash over the first len characters */
+static inline uint64_t utils_string_hash_len(const unsigned char *str, size_t len)
+{
+	uint64_t hash = 5381;
+	size_t   i;
+
+	for(i = 0; (i < len) && str[i]; i++)
+	{
+		hash = ( (hash << 5) + hash) + str[i];
+	}
+
+	return hash;
+}
+
+/******************
+ * CHECKSUM UTILS *
+ ******************/
+
+/**
+ * @brief CRC32C (Castagnoli) of a buffer
+ *
+ * Uses the SSE4.2 instruction when the CPU has it, eight tables
+ * otherwise. Chains over several buffers by passing the previous
+ * result (start with 0).
+ *
+ * @param crc result for the previous bytes (0 for the first ones)
+ * @param data bytes to add
+ * @param len number of bytes
+ * @return uint32_t the checksum of all the bytes so far
+ */
+uint32_t utils_crc32c(uint32_t crc, const void * data, size_t len);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include "window.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "log.h"
+
+metric_windows_t *metric_windows_new(void)
+{
+	metric_windows_t *ret = calloc(1, sizeof(metric_windows_t) );
+
+	if(!ret)
+	{
+		tau_metric_proxy_perror("calloc");
+		return NULL;
+	}
+
+	return ret;
+}
+
+void metric_windows_update(metric_windows_t *w, double ts, double value)
+{
+	int i;
+
+	for(i = 0; i < TAU_METRIC_WINDOW_COUNT; i++)
+	{
+		uint64_t step = ts * METRIC_WINDOW_BUCKETS / tau_metric_window_length[i];
+
+		metric_window_bucket_t *b = &w->buckets[i][step % METRIC_WINDOW_BUCKETS];
+
+		/* The bucket held an older step: restart it */
+		if( (b->slot != (uint32_t)step) || !b->count)
+		{
+			b->slot  = step;
+			b->count = 0;
+			b->sum   = 0;
+			b->min   = value;
+			b->max   = value;
+		}
+
+		b->count++;
+		b->sum += value;
+
+		if(value < b->min)
+		{
+			b->min = value;
+		}
+
+		if(b->max < value)
+		{
+			b->max = value;
+		}
+	}
+}
+
+void metric_windows_read(metric_windows_t *w, double now, tau_metric_window_stats_t *stats)
+{
+	int i, j;
+
+	for(i = 0; i < TAU_METRIC_WINDOW_COUNT; i++)
+	{
+		double   step_len = tau_metric_window_length[i] / METRIC_WINDOW_BUCKETS;
+		uint64_t step     = now / step_len;
+
+		uint64_t count = 0;
+		double   sum   = 0;
+		double   min   = NAN;
+		double   max   = NAN;
+
+		for(j = 0; j < METRIC_WINDOW_BUCKETS; j++)
+		{
+			metric_window_bucket_t *b = &w->buckets[i][j];
+
+			/* Only the steps still covered by the window */
+			if(!b->count || ( (METRIC_WINDOW_BUCKETS - 1) < (uint32_t)( (uint32_t)step - b->slot) ) )
+			{
+				continue;
+			}
+
+			if(!count || (b->min < min) )
+			{
+				min = b->min;
+			}
+
+			if(!count || (max < b->max) )
+			{
+				max = b->max;
+			}
+
+			count += b->count;
+			sum   += b->sum;
+		}
+
+		/* The current step is partial: the window spans
+		   the elapsed part of it and the previous steps */
+		double span = now - (double)(step - (METRIC_WINDOW_BUCKETS - 1) ) * step_len;
+
+		stats->rate[i] = (0 < span) ? sum / span : 0;
+		stats->avg[i]  = count ? sum / count : NAN;
+		stats->min[i]  = min;
+		stats->max[i]  = max;
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef TAU_METRIC_PROXY_WINDOW_H
+#define TAU_METRIC_PROXY_WINDOW_H
+
+#include <stdint.h>
+
+#include "tau_metric_proxy_client.h"
+
+/*******************
+* SLIDING WINDOWS *
+*******************/
+
+/** Each window slides by steps of its length divided by this */
+#define METRIC_WINDOW_BUCKETS 4
+
+/**
+ * @brief Aggregates of the updates received during one step
+ *
+ */
+typedef struct
+{
+	uint32_t slot;  /**< Step index (modulo 2^32) the bucket holds */
+	uint32_t count; /**< Number of updates */
+	double   sum;   /**< Sum of the updates */
+	double   min;   /**< Smallest update */
+	double   max;   /**< Largest update */
+}metric_window_bucket_t;
+
+/**
+ * @brief Sliding window aggregates of a series
+ *
+ * Updates touch one bucket per window, reading folds the buckets of
+ * the steps still in the window. Callers serialize accesses (the
+ * metric lock protects it).
+ */
+typedef struct
+{
+	metric_window_bucket_t buckets[TAU_METRIC_WINDOW_COUNT][METRIC_WINDOW_BUCKETS];
+}metric_windows_t;
+
+/**
+ * @brief Allocate empty windows
+ *
+ * @return metric_windows_t* new windows NULL on error
+ */
+metric_windows_t *metric_windows_new(void);
+
+/**
+ * @brief Account an update in all the windows
+ *
+ * @param w the target windows
+ * @param ts time of the update in seconds
+ * @param value the update (increment for counters sample for gauges)
+ */
+void metric_windows_update(metric_windows_t *w, double ts, double value);
+
+/**
+ * @brief Compute the aggregates of each window
+ *
+ * @param w the windows to read
+ * @param now current time in seconds
+ * @param stats where to store the aggregates
+ */
+void metric_windows_read(metric_windows_t *w, double now, tau_metric_window_stats_t *stats);
+
+#endif /* TAU_METRIC_PROXY_WINDOW_H */
@@ -0,0 +1,132 @@
+/* Value formatting benchmark: printf against the shortest round trip
+ *
+ * usage: bench_format [VALUES] (default 1000000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dtoa.h"
+
+static double __now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+typedef enum
+{
+	BENCH_COUNTERS = 0, /* Event counts */
+	BENCH_BYTES,        /* Large byte counters */
+	BENCH_TIMINGS,      /* Durations in seconds */
+	BENCH_GAUGES,       /* Averages */
+	BENCH_KIND_COUNT
+}bench_kind_t;
+
+static const char *const __kind_name[BENCH_KIND_COUNT] = { "counters", "bytes", "timings", "gauges" };
+
+static uint64_t __rand_state = 88172645463325252ull;
+
+static uint64_t __rand(void)
+{
+	__rand_state ^= __rand_state << 13;
+	__rand_state ^= __rand_state >> 7;
+	__rand_state ^= __rand_state << 17;
+	return __rand_state;
+}
+
+static void __fill(double *values, uint64_t count, bench_kind_t kind)
+{
+	uint64_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		switch(kind)
+		{
+			case BENCH_COUNTERS:
+				values[i] = __rand() % 100000;
+				break;
+
+			case BENCH_BYTES:
+				values[i] = (double)(__rand() % (1ull << 50) );
+				break;
+
+			case BENCH_TIMINGS:
+				values[i] = (__rand() % 1000000) * 1e-9;
+				break;
+
+			default:
+				values[i] = (__rand() % 100000000) / (double)(1 + __rand() % 1000);
+				break;
+		}
+	}
+}
+
+typedef int (*bench_format_t)(double value, char *out);
+
+static int __printf_fixed(double value, char *out)
+{
+	return snprintf(out, 400, "%f", value);
+}
+
+static int __printf_round_trip(double value, char *out)
+{
+	return snprintf(out, 400, "%.17g", value);
+}
+
+static void __bench(const char *what, bench_format_t format, double *values, uint64_t count, bench_kind_t kind)
+{
+	char     out[400];
+	uint64_t bytes = 0;
+	uint64_t lost  = 0;
+	uint64_t i;
+
+	double start = __now();
+
+	for(i = 0; i < count; i++)
+	{
+		bytes += format(values[i], out);
+	}
+
+	double seconds = __now() - start;
+
+	for(i = 0; i < count; i++)
+	{
+		format(values[i], out);
+		lost += (strtod(out, NULL) != values[i]);
+	}
+
+	fprintf(stdout, "%-10s %-16s %10.1f %10.2f %10lu\n", __kind_name[kind], what,
+	        seconds * 1e9 / count, (double)bytes / count, lost);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t count = (argc < 2) ? 1000000 : strtoull(argv[1], NULL, 10);
+
+	double *values = malloc(count * sizeof(double) );
+
+	if(!values)
+	{
+		perror("malloc");
+		return 1;
+	}
+
+	fprintf(stdout, "%-10s %-16s %10s %10s %10s\n", "values", "formatter", "ns/value", "bytes", "inexact");
+
+	int kind;
+
+	for(kind = 0; kind < BENCH_KIND_COUNT; kind++)
+	{
+		__fill(values, count, kind);
+		__bench("printf %f", __printf_fixed, values, count, kind);
+		__bench("printf %.17g", __printf_round_trip, values, count, kind);
+		__bench("dtoa_shortest", dtoa_shortest, values, count, kind);
+	}
+
+	free(values);
+
+	return 0;
+}
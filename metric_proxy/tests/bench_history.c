@@ -0,0 +1,247 @@
+/* Series history benchmark: ingest rate and bytes per sample
+ *
+ * usage: bench_history [SERIES] [SAMPLES PER SERIES]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "history.h"
+#include "metrics.h"
+
+static double __now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+typedef enum
+{
+	SIGNAL_CONSTANT,
+	SIGNAL_COUNTER,
+	SIGNAL_GAUGE,
+	SIGNAL_NOISE,
+	SIGNAL_COUNT
+}signal_t;
+
+static const char * const signal_name[SIGNAL_COUNT] =
+{
+	"constant (regular ts)",
+	"counter (jittered ts)",
+	"gauge 2 decimals",
+	"random doubles",
+};
+
+static void __sample(signal_t sig, int i, double *ts, double *value)
+{
+	/* One sample per second, jittered by a few ms but for the constant */
+	double jitter = (sig == SIGNAL_CONSTANT) ? 0 : (rand() % 10) * 1e-3;
+
+	*ts = 1700000000.0 + i + jitter;
+
+	switch(sig)
+	{
+		case SIGNAL_CONSTANT:
+			*value = 42;
+			break;
+		case SIGNAL_COUNTER:
+			*value += rand() % 16;
+			break;
+		case SIGNAL_GAUGE:
+			*value = (double)(5000 + rand() % 1000) / 100.0;
+			break;
+		default:
+			*value = (double)rand() / RAND_MAX;
+			break;
+	}
+}
+
+static size_t __payload_bytes(metric_history_t *h)
+{
+	size_t ret = 0;
+	metric_history_chunk_t *c;
+
+	for(c = h->oldest; c; c = c->next)
+	{
+		/* Raw first timestamp and value plus the bit stream */
+		ret += 16 + (c->bits + 7) / 8;
+	}
+
+	return ret;
+}
+
+static int __bench_signal(signal_t sig, int series, int samples)
+{
+	metric_history_config_t config = { 0 };
+
+	config.retention  = samples * 2;
+	config.resolution = 1.0;
+	config.max_bytes  = (size_t)samples * 32;
+
+	metric_history_t **h = calloc(series, sizeof(metric_history_t *) );
+	double *values = calloc(series, sizeof(double) );
+
+	int s, i;
+
+	for(s = 0; s < series; s++)
+	{
+		h[s] = metric_history_new(&config);
+	}
+
+	/* Pre-generate so that only the encoder is timed */
+	double *ts  = malloc(samples * sizeof(double) );
+	double *val = malloc((size_t)series * samples * sizeof(double) );
+
+	for(i = 0; i < samples; i++)
+	{
+		for(s = 0; s < series; s++)
+		{
+			__sample(sig, i, &ts[i], &values[s]);
+			val[(size_t)s * samples + i] = values[s];
+		}
+	}
+
+	double start = __now();
+
+	for(i = 0; i < samples; i++)
+	{
+		for(s = 0; s < series; s++)
+		{
+			metric_history_record(h[s], ts[i], val[(size_t)s * samples + i]);
+		}
+	}
+
+	double ingest = __now() - start;
+
+	size_t payload  = 0;
+	size_t resident = 0;
+
+	for(s = 0; s < series; s++)
+	{
+		payload  += __payload_bytes(h[s]);
+		resident += h[s]->bytes;
+	}
+
+	/* Decode everything back and check it is lossless */
+	tau_metric_history_sample_t *out = malloc(samples * sizeof(tau_metric_history_sample_t) );
+	size_t decoded = 0;
+	int errors = 0;
+
+	start = __now();
+
+	for(s = 0; s < series; s++)
+	{
+		size_t n = metric_history_read(h[s], 0, 0, out, samples);
+
+		for(i = 0; i < (int)n; i++)
+		{
+			if(out[i].value != val[(size_t)s * samples + i])
+			{
+				errors++;
+			}
+		}
+
+		decoded += n;
+	}
+
+	double decode = __now() - start;
+
+	size_t total = (size_t)series * samples;
+
+	fprintf(stdout, "%-24s %10.2f %10.2f %10.2f %10.2f %8s\n",
+	        signal_name[sig],
+	        total / ingest / 1e6,
+	        decoded / decode / 1e6,
+	        (double)payload / total,
+	        (double)resident / total,
+	        (errors || (decoded != total) ) ? "LOSSY" : "ok");
+
+	for(s = 0; s < series; s++)
+	{
+		metric_history_free(h[s]);
+	}
+
+	free(out);
+	free(val);
+	free(ts);
+	free(values);
+	free(h);
+
+	return errors;
+}
+
+/* Cost of the history in the full ingestion path */
+static void __bench_update(int series, int samples, int with_history)
+{
+	metric_array_t ma;
+
+	metric_array_init(&ma);
+
+	if(with_history)
+	{
+		metric_array_set_history(&ma, 3600, 0.001, METRIC_HISTORY_DEFAULT_MAX_BYTES);
+	}
+
+	metric_t **m = calloc(series, sizeof(metric_t *) );
+	int s, i;
+
+	for(s = 0; s < series; s++)
+	{
+		char name[64];
+		snprintf(name, 64, "bench_counter{id=\"%d\"}", s);
+		m[s] = metric_array_get_or_register(&ma, name, "Benchmark counter", TAU_METRIC_COUNTER);
+	}
+
+	tau_metric_event_t ev;
+	memset(&ev, 0, sizeof(tau_metric_event_t) );
+	ev.value = 1;
+
+	double start = __now();
+
+	for(i = 0; i < samples; i++)
+	{
+		for(s = 0; s < series; s++)
+		{
+			metric_update(m[s], &ev);
+		}
+	}
+
+	double elapsed = __now() - start;
+
+	fprintf(stdout, "metric_update %-10s %10.2f Mupdates/s %8.1f ns/update history %ld KB\n",
+	        with_history ? "history" : "plain",
+	        (double)series * samples / elapsed / 1e6,
+	        elapsed * 1e9 / ( (double)series * samples),
+	        metric_history_total_bytes() / 1024);
+
+	metric_array_release(&ma);
+	free(m);
+}
+
+int main(int argc, char **argv)
+{
+	int series  = (1 < argc) ? atoi(argv[1]) : 1000;
+	int samples = (2 < argc) ? atoi(argv[2]) : 3600;
+
+	srand(1337);
+
+	fprintf(stdout, "%d series x %d samples\n\n", series, samples);
+	fprintf(stdout, "%-24s %10s %10s %10s %10s %8s\n", "signal", "enc M/s", "dec M/s", "B/sample", "RSS B/smp", "check");
+
+	int errors = 0;
+	int sig;
+
+	for(sig = 0; sig < SIGNAL_COUNT; sig++)
+	{
+		errors += __bench_signal(sig, series, samples);
+	}
+
+	fprintf(stdout, "\n");
+
+	__bench_update(series, samples / 10 + 1, 0);
+	__bench_update(series, samples / 10 + 1, 1);
+
+	return errors ? 1 : 0;
+}
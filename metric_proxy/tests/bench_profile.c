@@ -0,0 +1,413 @@
+/* Profile format benchmark: file size and load/save throughput per version
+ *
+ * usage: bench_profile [-n ITERATIONS] PATH... (default 20 iterations)
+ *
+ * PATH are profiles or dumps, directories are searched for *.profile
+ * and *.taumetric files. Each file is loaded then saved and loaded
+ * again in version 1 and in version 2 with each compression; the
+ * round trips are checked against the first load. Each saved file is
+ * also read in place through a view, and merged in a profile of the
+ * same content: by rewriting the profile, then by appending to it
+ * (compactions included). The appended counters are checked.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "profile.h"
+
+static double __now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+#define BENCH_MAX_FILES 4096
+
+static char *__files[BENCH_MAX_FILES];
+static int   __file_count = 0;
+
+static int __collect(const char *fpath, const struct stat *sb, int typeflag)
+{
+	(void)sb;
+
+	if( (typeflag == FTW_F) && (strstr(fpath, ".profile") || strstr(fpath, ".taumetric") ) &&
+	    (__file_count < BENCH_MAX_FILES) )
+	{
+		__files[__file_count++] = strdup(fpath);
+	}
+
+	return 0;
+}
+
+/* The version 1 writer as it was: the dump then the canary */
+static int __save_v1(const char *path, tau_metric_dump_t *dump)
+{
+	FILE *out = fopen(path, "w");
+
+	if(!out)
+	{
+		return 1;
+	}
+
+	int    canary = 0x77;
+	size_t len    = sizeof(tau_metric_dump_t) + dump->metric_count * sizeof(tau_metric_snapshot_t);
+	int    ret    = (fwrite(dump, len, 1, out) != 1) || (fwrite(&canary, sizeof(int), 1, out) != 1);
+
+	return fclose(out) || ret;
+}
+
+static int __same(tau_metric_dump_t *a, tau_metric_dump_t *b)
+{
+	int i;
+
+	if( (a->metric_count != b->metric_count) || memcmp(a->desc.jobid, b->desc.jobid, sizeof(a->desc.jobid) ) ||
+	    (a->desc.end_time != b->desc.end_time) )
+	{
+		return 0;
+	}
+
+	for(i = 0; i < a->metric_count; i++)
+	{
+		tau_metric_snapshot_t *x = &a->metrics[i];
+		tau_metric_snapshot_t *y = &b->metrics[i];
+
+		if( (x->type != y->type) || strcmp(x->doc, y->doc) || strcmp(x->event.name, y->event.name) ||
+		    memcmp(&x->event.value, &y->event.value, sizeof(double) ) ||
+		    memcmp(&x->event.update_ts, &y->event.update_ts, sizeof(double) ) )
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+typedef struct
+{
+	const char *name;
+	const char *codec; /* NULL for version 1 */
+	size_t      bytes;
+	double      save;
+	double      load;
+	double      view;
+	double      merge;
+	double      append;
+	int         failed;
+}bench_format_t;
+
+static bench_format_t __formats[] =
+{
+	{ "v1", NULL, 0, 0, 0, 0, 0, 0, 0 },
+	{ "v2 none", "none", 0, 0, 0, 0, 0, 0, 0 },
+	{ "v2 snappy", "snappy", 0, 0, 0, 0, 0, 0, 0 },
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	{ "v2 zlib", "zlib", 0, 0, 0, 0, 0, 0, 0 },
+#endif
+};
+
+#define BENCH_FORMAT_COUNT (sizeof(__formats) / sizeof(bench_format_t) )
+
+/* Reads all the values in place */
+static int __view(const char *path, double *sum)
+{
+	tau_metric_dump_view_t  view;
+	tau_metric_dump_entry_t e;
+	uint64_t                i;
+
+	if(tau_metric_dump_view_open(&view, path) )
+	{
+		return 1;
+	}
+
+	for(i = 0; i < view.count; i++)
+	{
+		if(tau_metric_dump_view_get(&view, i, &e) )
+		{
+			break;
+		}
+
+		*sum += e.value;
+	}
+
+	int ret = (i != view.count);
+
+	tau_metric_dump_view_close(&view);
+
+	return ret;
+}
+
+/* Merges the dump in a profile holding the same series */
+static int __merge(const char *profile_path, const char *path)
+{
+	tau_metric_dump_view_t view;
+
+	if(tau_metric_dump_view_open(&view, path) )
+	{
+		return 1;
+	}
+
+	tau_metric_profile_t *profile = tau_metric_profile_load( (char *)profile_path);
+	int                   ret     = !profile || tau_metric_profile_consolidate(profile, &view);
+
+	tau_metric_profile_free(&profile);
+	tau_metric_dump_view_close(&view);
+
+	return ret;
+}
+
+/* Appends the dump to a profile holding the same series */
+static int __append(const char *profile_path, const char *path)
+{
+	tau_metric_dump_view_t view;
+
+	if(tau_metric_dump_view_open(&view, path) )
+	{
+		return 1;
+	}
+
+	int ret = tau_metric_profile_append( (char *)profile_path, &view);
+
+	tau_metric_dump_view_close(&view);
+
+	return ret;
+}
+
+/* Counters of the profile must be copies times those of the reference */
+static int __check_counters(const char *profile_path, tau_metric_dump_t *ref, int copies)
+{
+	tau_metric_dump_view_t  view;
+	tau_metric_dump_entry_t e;
+	uint64_t                i;
+	int                     j;
+	int                     ret = 0;
+
+	if(tau_metric_dump_view_open(&view, profile_path) )
+	{
+		return 1;
+	}
+
+	for(i = 0; !ret && (i < view.count); i++)
+	{
+		ret = tau_metric_dump_view_get(&view, i, &e);
+
+		for(j = 0; !ret && (j < ref->metric_count); j++)
+		{
+			tau_metric_snapshot_t *s = &ref->metrics[j];
+
+			if( (s->type == TAU_METRIC_COUNTER) && !strcmp(s->event.name, e.name) )
+			{
+				/* Sums may round differently than the product */
+				ret = (fabs(e.value - copies * s->event.value) > 1e-9 * fabs(copies * s->event.value) );
+				break;
+			}
+		}
+	}
+
+	tau_metric_dump_view_close(&view);
+
+	return ret;
+}
+
+static void __bench(const char *path, tau_metric_dump_t *ref, const char *tmp, const char *prof, int iterations)
+{
+	unsigned int f;
+	int          i;
+
+	for(f = 0; f < BENCH_FORMAT_COUNT; f++)
+	{
+		bench_format_t *fmt = &__formats[f];
+
+		if(fmt->codec)
+		{
+			tau_metric_dump_set_codec(fmt->codec);
+		}
+
+		double start = __now();
+
+		for(i = 0; i < iterations; i++)
+		{
+			if(fmt->codec ? tau_metric_dump_write(tmp, ref) : __save_v1(tmp, ref) )
+			{
+				fprintf(stderr, "%s: could not save %s\n", fmt->name, path);
+				fmt->failed = 1;
+				return;
+			}
+		}
+
+		fmt->save += (__now() - start) / iterations;
+
+		struct stat st;
+		stat(tmp, &st);
+		fmt->bytes += st.st_size;
+
+		tau_metric_dump_t *dump = NULL;
+
+		start = __now();
+
+		for(i = 0; i < iterations; i++)
+		{
+			free(dump);
+			dump = tau_metric_dump_load(tmp);
+		}
+
+		fmt->load += (__now() - start) / iterations;
+
+		if(!dump || !__same(ref, dump) )
+		{
+			fprintf(stderr, "%s: %s does not round trip\n", fmt->name, path);
+			fmt->failed = 1;
+		}
+
+		free(dump);
+
+		double sum = 0;
+
+		start = __now();
+
+		for(i = 0; i < iterations; i++)
+		{
+			if(__view(tmp, &sum) )
+			{
+				fprintf(stderr, "%s: could not view %s\n", fmt->name, path);
+				fmt->failed = 1;
+				break;
+			}
+		}
+
+		fmt->view += (__now() - start) / iterations;
+
+		/* Merges always write the current version */
+		if(!fmt->codec)
+		{
+			continue;
+		}
+
+		if(tau_metric_dump_write(prof, ref) )
+		{
+			fmt->failed = 1;
+			continue;
+		}
+
+		start = __now();
+
+		for(i = 0; i < iterations; i++)
+		{
+			if(__merge(prof, tmp) )
+			{
+				fprintf(stderr, "%s: could not merge %s\n", fmt->name, path);
+				fmt->failed = 1;
+				break;
+			}
+		}
+
+		fmt->merge += (__now() - start) / iterations;
+
+		if(tau_metric_dump_write(prof, ref) )
+		{
+			fmt->failed = 1;
+			continue;
+		}
+
+		start = __now();
+
+		for(i = 0; i < iterations; i++)
+		{
+			if(__append(prof, tmp) )
+			{
+				fprintf(stderr, "%s: could not append %s\n", fmt->name, path);
+				fmt->failed = 1;
+				break;
+			}
+		}
+
+		fmt->append += (__now() - start) / iterations;
+
+		if(__check_counters(prof, ref, iterations + 1) )
+		{
+			fprintf(stderr, "%s: bad counters after appending %s\n", fmt->name, path);
+			fmt->failed = 1;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = 20;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "n:") ) != -1)
+	{
+		switch(opt)
+		{
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n ITERATIONS] PATH...\n", argv[0]);
+				return 1;
+		}
+	}
+
+	for(; optind < argc; optind++)
+	{
+		ftw(argv[optind], __collect, 16);
+	}
+
+	if(!__file_count || (iterations < 1) )
+	{
+		fprintf(stderr, "usage: %s [-n ITERATIONS] PATH...\n", argv[0]);
+		return 1;
+	}
+
+	char tmp[64];
+	char prof[64];
+	snprintf(tmp, sizeof(tmp), "/tmp/bench_profile.%d", getpid() );
+	snprintf(prof, sizeof(prof), "/tmp/bench_profile.%d.profile", getpid() );
+
+	uint64_t metrics = 0;
+	int      f;
+
+	for(f = 0; f < __file_count; f++)
+	{
+		tau_metric_dump_t *ref = tau_metric_dump_load(__files[f]);
+
+		if(!ref)
+		{
+			fprintf(stderr, "Could not load %s\n", __files[f]);
+			continue;
+		}
+
+		metrics += ref->metric_count;
+		__bench(__files[f], ref, tmp, prof, iterations);
+		free(ref);
+	}
+
+	unlink(tmp);
+	unlink(prof);
+
+	fprintf(stdout, "%d files %lu metrics, %d iterations\n", __file_count, metrics, iterations);
+	fprintf(stdout, "%-10s %12s %7s %10s %10s %10s %10s %10s %12s %12s %12s\n", "format", "bytes", "ratio", "save ms",
+	        "load ms", "view ms", "merge ms", "append ms", "save Mm/s", "load Mm/s", "view Mm/s");
+
+	unsigned int i;
+
+	for(i = 0; i < BENCH_FORMAT_COUNT; i++)
+	{
+		bench_format_t *fmt = &__formats[i];
+
+		fprintf(stdout, "%-10s %12lu %7.2f %10.3f %10.3f %10.3f %10.3f %10.3f %12.2f %12.2f %12.2f%s\n", fmt->name,
+		        fmt->bytes, (double)__formats[0].bytes / fmt->bytes, fmt->save * 1e3, fmt->load * 1e3, fmt->view * 1e3,
+		        fmt->merge * 1e3, fmt->append * 1e3, metrics / fmt->save * 1e-6, metrics / fmt->load * 1e-6, metrics / fmt->view * 1e-6,
+		        fmt->failed ? " FAILED" : "");
+	}
+
+	return 0;
+}
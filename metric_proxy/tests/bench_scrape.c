@@ -0,0 +1,219 @@
+/* Exposition benchmark: scrape latency and allocator calls
+ *
+ * usage: bench_scrape [SERIES ...] (default 10000 100000 1000000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "exporter.h"
+#include "metrics.h"
+
+/* Count allocator calls by interposing the libc entry points */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t __mallocs  = 0;
+static uint64_t __callocs  = 0;
+static uint64_t __reallocs = 0;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&__mallocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&__callocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&__reallocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+static uint64_t __alloc_calls(void)
+{
+	return __atomic_load_n(&__mallocs, __ATOMIC_RELAXED) +
+	       __atomic_load_n(&__callocs, __ATOMIC_RELAXED) +
+	       __atomic_load_n(&__reallocs, __ATOMIC_RELAXED);
+}
+
+static double __now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* Series per family */
+#define BENCH_FAMILY_SIZE 1000
+/* Scrapes averaged for the steady state */
+#define BENCH_SCRAPES 5
+
+typedef struct
+{
+	double   seconds;
+	uint64_t allocs;
+	uint64_t reallocs;
+	size_t   len;
+}scrape_t;
+
+static int __scrape(metric_array_t *ma, metric_array_snapshot_t *snap, size_t size_hint, scrape_t *out)
+{
+	uint64_t allocs   = __alloc_calls();
+	uint64_t reallocs = __atomic_load_n(&__reallocs, __ATOMIC_RELAXED);
+	double   start    = __now();
+
+	char *body = tau_metric_exporter_render(ma, snap, NULL, NULL, TAU_METRIC_FORMAT_TEXT, size_hint, &out->len);
+
+	out->seconds  = __now() - start;
+	out->allocs   = __alloc_calls() - allocs;
+	out->reallocs = __atomic_load_n(&__reallocs, __ATOMIC_RELAXED) - reallocs;
+
+	if(!body)
+	{
+		return 1;
+	}
+
+	free(body);
+
+	return 0;
+}
+
+static void __print(const char *what, uint64_t series, scrape_t *s)
+{
+	fprintf(stdout, "%10lu %-22s %10.2f %10.1f %10.2f %8lu %8lu\n",
+	        series, what,
+	        s->seconds * 1e3,
+	        s->len / 1e6,
+	        s->len / 1e6 / s->seconds,
+	        s->allocs,
+	        s->reallocs);
+}
+
+static int __bench(uint64_t series)
+{
+	metric_array_t ma;
+
+	metric_array_init_sized(&ma, 1 << 16, 0);
+	metric_array_set_families(&ma, METRIC_FAMILY_TABLE_SIZE);
+
+	metric_t **m = malloc(series * sizeof(metric_t *) );
+
+	tau_metric_event_t ev;
+	memset(&ev, 0, sizeof(tau_metric_event_t) );
+
+	uint64_t i;
+
+	for(i = 0; i < series; i++)
+	{
+		char name[128];
+		snprintf(name, 128, "bench_metric_%lu{node=\"node%lu\",rank=\"%lu\"}",
+		         i / BENCH_FAMILY_SIZE, i % 64, i);
+		m[i] = metric_array_get_or_register(&ma, name, "Benchmark series",
+		                                    (i / BENCH_FAMILY_SIZE) % 2 ? TAU_METRIC_GAUGE : TAU_METRIC_COUNTER);
+
+		if(!m[i])
+		{
+			fprintf(stderr, "Failed to register %s\n", name);
+			return 1;
+		}
+
+		ev.value = i * 0.25;
+		metric_update(m[i], &ev);
+	}
+
+	metric_array_snapshot_t snap;
+	memset(&snap, 0, sizeof(metric_array_snapshot_t) );
+
+	scrape_t s;
+
+	/* Renders every value and sizes the snapshot */
+	if(__scrape(&ma, &snap, 0, &s) )
+	{
+		return 1;
+	}
+
+	__print("cold (no size hint)", series, &s);
+
+	size_t hint = s.len + s.len / 8;
+
+	/* Nothing updated: only copies */
+	scrape_t avg = { 0 };
+	int k;
+
+	for(k = 0; k < BENCH_SCRAPES; k++)
+	{
+		__scrape(&ma, &snap, hint, &s);
+		avg.seconds += s.seconds / BENCH_SCRAPES;
+		avg.allocs  += s.allocs;
+		avg.reallocs += s.reallocs;
+		avg.len      = s.len;
+	}
+
+	avg.allocs   /= BENCH_SCRAPES;
+	avg.reallocs /= BENCH_SCRAPES;
+	__print("steady idle", series, &avg);
+
+	/* A tenth of the series updated between scrapes */
+	memset(&avg, 0, sizeof(scrape_t) );
+
+	for(k = 0; k < BENCH_SCRAPES; k++)
+	{
+		for(i = k; i < series; i += 10)
+		{
+			ev.value = 1.5;
+			metric_update(m[i], &ev);
+		}
+
+		__scrape(&ma, &snap, hint, &s);
+		avg.seconds += s.seconds / BENCH_SCRAPES;
+		avg.allocs  += s.allocs;
+		avg.reallocs += s.reallocs;
+		avg.len      = s.len;
+	}
+
+	avg.allocs   /= BENCH_SCRAPES;
+	avg.reallocs /= BENCH_SCRAPES;
+	__print("steady 10% updated", series, &avg);
+
+	metric_array_snapshot_free(&snap);
+	metric_array_release(&ma);
+	free(m);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const uint64_t default_series[] = { 10000, 100000, 1000000 };
+
+	fprintf(stdout, "%10s %-22s %10s %10s %10s %8s %8s\n",
+	        "series", "scrape", "ms", "MB", "MB/s", "allocs", "reallocs");
+
+	int ret = 0;
+	int i;
+
+	if(argc < 2)
+	{
+		for(i = 0; i < 3; i++)
+		{
+			ret |= __bench(default_series[i]);
+		}
+	}
+	else
+	{
+		for(i = 1; i < argc; i++)
+		{
+			ret |= __bench(strtoull(argv[i], NULL, 10) );
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,460 @@
+/* Stand-in remote write receiver to test the pushes of the proxy
+ *
+ * usage: remote_receiver [-p PORT] [-f N] [-e STATUS] [-s MS] [-d]
+ *
+ * -p: port to listen on (default 9201)
+ * -f: fail every Nth request (default 0 never fails)
+ * -e: HTTP status of the failed requests (default 503)
+ * -s: delay each answer by this many milliseconds
+ * -d: print the samples as exposition lines
+ *
+ * Each request is checked (snappy body, WriteRequest with sorted labels
+ * and a __name__) and reported on stdout.
+ */
+/* memmem and strcasestr */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "snappy.h"
+
+static int __fail_every  = 0;
+static int __fail_status = 503;
+static int __delay_ms    = 0;
+static int __dump        = 0;
+
+static uint64_t __requests = 0;
+static uint64_t __samples  = 0;
+
+static pthread_mutex_t __output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*********************
+* WRITE REQUEST DUMP *
+*********************/
+
+typedef struct
+{
+	const uint8_t *p;
+	const uint8_t *end;
+}pb_reader_t;
+
+static int __pb_varint(pb_reader_t *r, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+
+	while( (r->p < r->end) && (shift < 64) )
+	{
+		uint8_t b = *(r->p++);
+
+		*v    |= (uint64_t)(b & 0x7F) << shift;
+		shift += 7;
+
+		if(!(b & 0x80) )
+		{
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Next field, the payload of length delimited ones is in sub */
+static int __pb_field(pb_reader_t *r, int *field, int *wire, uint64_t *value, pb_reader_t *sub)
+{
+	uint64_t tag;
+
+	if(__pb_varint(r, &tag) )
+	{
+		return -1;
+	}
+
+	*field = tag >> 3;
+	*wire  = tag & 7;
+
+	switch(*wire)
+	{
+		case 0:
+			return __pb_varint(r, value);
+
+		case 1:
+			if(r->end - r->p < 8)
+			{
+				return -1;
+			}
+
+			memcpy(value, r->p, 8);
+			r->p += 8;
+			return 0;
+
+		case 2:
+			if(__pb_varint(r, value) || ( (uint64_t)(r->end - r->p) < *value) )
+			{
+				return -1;
+			}
+
+			sub->p   = r->p;
+			sub->end = r->p + *value;
+			r->p    += *value;
+			return 0;
+	}
+
+	return -1;
+}
+
+/* Check and print a TimeSeries, returns its number of samples (-1 if invalid) */
+static int __timeseries(pb_reader_t *r, char *line, size_t line_len)
+{
+	char        labels[4096];
+	size_t      labels_len = 0;
+	char        name[512]  = "";
+	char        previous[256] = "";
+	int         samples = 0;
+	int         field, wire;
+	uint64_t    value;
+	pb_reader_t sub;
+
+	labels[0] = '\0';
+
+	while(r->p < r->end)
+	{
+		if(__pb_field(r, &field, &wire, &value, &sub) || (wire != 2) )
+		{
+			return -1;
+		}
+
+		if(field == 1)
+		{
+			pb_reader_t pair = sub;
+			char        key[256] = "";
+			char        val[512] = "";
+
+			while(pair.p < pair.end)
+			{
+				pb_reader_t str;
+
+				if(__pb_field(&pair, &field, &wire, &value, &str) || (wire != 2) )
+				{
+					return -1;
+				}
+
+				snprintf( (field == 1) ? key : val, (field == 1) ? sizeof(key) : sizeof(val), "%.*s",
+				          (int)(str.end - str.p), str.p);
+			}
+
+			if(strcmp(previous, key) >= 0)
+			{
+				fprintf(stderr, "Labels not sorted: %s after %s\n", key, previous);
+				return -1;
+			}
+
+			snprintf(previous, sizeof(previous), "%s", key);
+
+			if(!strcmp(key, "__name__") )
+			{
+				snprintf(name, sizeof(name), "%s", val);
+			}
+			else if(labels_len < sizeof(labels) )
+			{
+				labels_len += snprintf(labels + labels_len, sizeof(labels) - labels_len, "%s%s=\"%s\"",
+				                       labels_len ? "," : "", key, val);
+			}
+		}
+		else if(field == 2)
+		{
+			double      v  = 0;
+			int64_t     ts = 0;
+			pb_reader_t unused;
+
+			while(sub.p < sub.end)
+			{
+				if(__pb_field(&sub, &field, &wire, &value, &unused) )
+				{
+					return -1;
+				}
+
+				if(field == 1)
+				{
+					memcpy(&v, &value, sizeof(double) );
+				}
+				else
+				{
+					ts = value;
+				}
+			}
+
+			snprintf(line, line_len, "%s{%s} %.17g %ld", name, labels, v, ts);
+			samples++;
+		}
+	}
+
+	if(!strlen(name) )
+	{
+		fprintf(stderr, "Series without __name__\n");
+		return -1;
+	}
+
+	return samples;
+}
+
+static int __write_request(const char *body, size_t len, int *series)
+{
+	pb_reader_t r = { (const uint8_t *)body, (const uint8_t *)body + len };
+	int         samples = 0;
+	int         field, wire;
+	uint64_t    value;
+	pb_reader_t sub;
+	char        line[8192];
+
+	*series = 0;
+
+	while(r.p < r.end)
+	{
+		if(__pb_field(&r, &field, &wire, &value, &sub) )
+		{
+			return -1;
+		}
+
+		if(field != 1)
+		{
+			continue;
+		}
+
+		int ret = __timeseries(&sub, line, sizeof(line) );
+
+		if(ret < 0)
+		{
+			return -1;
+		}
+
+		if(__dump)
+		{
+			fprintf(stdout, "%s\n", line);
+		}
+
+		samples += ret;
+		(*series)++;
+	}
+
+	return samples;
+}
+
+/********
+* HTTP *
+********/
+
+static int __read_request(int fd, char *buff, size_t size, size_t *have, size_t *head, size_t *body)
+{
+	char *end;
+
+	while(!(end = memmem(buff, *have, "\r\n\r\n", 4) ) )
+	{
+		if(*have == size)
+		{
+			return -1;
+		}
+
+		ssize_t ret = read(fd, buff + *have, size - *have);
+
+		if(ret <= 0)
+		{
+			return -1;
+		}
+
+		*have += ret;
+	}
+
+	*head = end + 4 - buff;
+	*end  = '\0';
+
+	char *length = strcasestr(buff, "\r\nContent-Length:");
+
+	if(!length)
+	{
+		return -1;
+	}
+
+	*body = strtoull(length + 17, NULL, 10);
+
+	if(size < *head + *body)
+	{
+		return -1;
+	}
+
+	while(*have < *head + *body)
+	{
+		ssize_t ret = read(fd, buff + *have, size - *have);
+
+		if(ret <= 0)
+		{
+			return -1;
+		}
+
+		*have += ret;
+	}
+
+	return 0;
+}
+
+#define RECEIVER_BUFFER (64 * 1024 * 1024)
+
+static void *__connection(void *pfd)
+{
+	int    fd   = (int)(intptr_t)pfd;
+	char * buff = malloc(RECEIVER_BUFFER);
+	size_t have = 0;
+
+	while(buff)
+	{
+		size_t head, body;
+
+		if(__read_request(fd, buff, RECEIVER_BUFFER, &have, &head, &body) )
+		{
+			break;
+		}
+
+		int      status  = 204;
+		int      series  = 0;
+		int      samples = -1;
+		size_t   plain   = 0;
+		char *   data    = NULL;
+		uint64_t request = __atomic_add_fetch(&__requests, 1, __ATOMIC_RELAXED);
+
+		if(!strcasestr(buff, "\r\nContent-Encoding: snappy") ||
+		   snappy_uncompressed_length(buff + head, body, &plain) ||
+		   !(data = malloc(plain + 1) ) ||
+		   snappy_uncompress(buff + head, body, data, plain) )
+		{
+			status = 400;
+		}
+
+		pthread_mutex_lock(&__output_lock);
+
+		if( (status == 204) && ( (samples = __write_request(data, plain, &series) ) < 0) )
+		{
+			status = 400;
+		}
+
+		if( (status == 204) && __fail_every && !(request % __fail_every) )
+		{
+			status = __fail_status;
+		}
+
+		if(status == 204)
+		{
+			__samples += samples;
+		}
+
+		fprintf(stdout, "request %lu: %lu bytes %lu plain %d series %d samples -> %d (total %lu samples)\n",
+		        request, body, plain, series, samples, status, __samples);
+		fflush(stdout);
+
+		pthread_mutex_unlock(&__output_lock);
+
+		free(data);
+
+		if(__delay_ms)
+		{
+			usleep(__delay_ms * 1000);
+		}
+
+		char answer[128];
+		int  len = snprintf(answer, sizeof(answer), "HTTP/1.1 %d Status\r\nContent-Length: 0\r\n\r\n", status);
+
+		if(write(fd, answer, len) != len)
+		{
+			break;
+		}
+
+		/* Keep what was read of the next request */
+		memmove(buff, buff + head + body, have - head - body);
+		have -= head + body;
+	}
+
+	free(buff);
+	close(fd);
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int port = 9201;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "p:f:e:s:d") ) != -1)
+	{
+		switch(opt)
+		{
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'f':
+				__fail_every = atoi(optarg);
+				break;
+			case 'e':
+				__fail_status = atoi(optarg);
+				break;
+			case 's':
+				__delay_ms = atoi(optarg);
+				break;
+			case 'd':
+				__dump = 1;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-p PORT] [-f N] [-e STATUS] [-s MS] [-d]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int one       = 1;
+
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+
+	struct sockaddr_in addr = { 0 };
+
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if( (listen_fd < 0) || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr) ) || listen(listen_fd, 64) )
+	{
+		perror("listen");
+		return 1;
+	}
+
+	fprintf(stdout, "Receiving remote writes on port %d\n", port);
+	fflush(stdout);
+
+	while(1)
+	{
+		int fd = accept(listen_fd, NULL, NULL);
+
+		if(fd < 0)
+		{
+			continue;
+		}
+
+		pthread_t thread;
+
+		if(pthread_create(&thread, NULL, __connection, (void *)(intptr_t)fd) )
+		{
+			close(fd);
+			continue;
+		}
+
+		pthread_detach(thread);
+	}
+
+	return 0;
+}
@@ -0,0 +1,130 @@
+/* Histogram samples sent by the client library
+ *
+ * usage: test_client_histogram (run by make check)
+ *
+ * The client manager is connected to a socket of the test, which reads
+ * what a proxy would. Increments of a histogram sample are sent as
+ * those of a counter: they must add up to what was recorded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tau_metric_proxy_client.h"
+
+/* Manager of the client library, not part of its public interface */
+int tau_client_metric_manager_init(const char *unix_path);
+struct tau_client_metric_s *tau_client_metric_manager_register(const char *name, const char *doc, tau_metric_type_t type);
+
+#define TEST_SAMPLE "test_seconds_bucket{le=\"1\"}"
+
+static int __listen(const char *path)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un) );
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if( (fd < 0) || bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un) ) || listen(fd, 1) )
+	{
+		perror("socket");
+		return -1;
+	}
+
+	return fd;
+}
+
+static int __read_all(int fd, void *buff, size_t size)
+{
+	size_t done = 0;
+
+	while(done < size)
+	{
+		ssize_t ret = read(fd, (char *)buff + done, size - done);
+
+		if(ret <= 0)
+		{
+			return 1;
+		}
+
+		done += ret;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/tmp/test_client_histogram.%d.unix", getpid() );
+	unlink(path);
+
+	int listen_fd = __listen(path);
+
+	if(listen_fd < 0)
+	{
+		return 1;
+	}
+
+	if(tau_client_metric_manager_init(path) )
+	{
+		fprintf(stderr, "FAIL could not connect the client\n");
+		return 1;
+	}
+
+	int fd = accept(listen_fd, NULL, NULL);
+
+	tau_metric_counter_t sample = tau_client_metric_manager_register(TEST_SAMPLE, "A histogram", TAU_METRIC_HISTOGRAM);
+
+	tau_metric_counter_incr(sample, 2);
+	tau_metric_counter_incr(sample, 1);
+
+	/* Flushes the last values and closes the connection */
+	tau_metric_client_release();
+
+	tau_metric_msg_t msg;
+	int              type  = TAU_METRIC_NULL;
+	double           total = 0;
+
+	while( (0 <= fd) && !__read_all(fd, &msg, sizeof(tau_metric_msg_t) ) )
+	{
+		if(msg.type == TAU_METRIC_MSG_JOB_DESCRIPTION)
+		{
+			tau_metric_job_descriptor_t desc;
+
+			if(__read_all(fd, &desc, sizeof(tau_metric_job_descriptor_t) ) )
+			{
+				break;
+			}
+		}
+		else if( (msg.type == TAU_METRIC_MSG_DESC) && !strcmp(msg.payload.desc.name, TEST_SAMPLE) )
+		{
+			type = msg.payload.desc.type;
+		}
+		else if( (msg.type == TAU_METRIC_MSG_VAL) && !strcmp(msg.payload.event.name, TEST_SAMPLE) )
+		{
+			total += msg.payload.event.value;
+		}
+	}
+
+	close(fd);
+	close(listen_fd);
+	unlink(path);
+
+	if( (type != TAU_METRIC_HISTOGRAM) || (total != 3) )
+	{
+		fprintf(stderr, "FAIL histogram sample: type %d sum %g, expected %d and 3\n", type, total, TAU_METRIC_HISTOGRAM);
+		return 1;
+	}
+
+	fprintf(stdout, "PASS histogram sample increments\n");
+
+	return 0;
+}
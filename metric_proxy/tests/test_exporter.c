@@ -0,0 +1,353 @@
+/* Series names of histogram samples in the expositions
+ *
+ * usage: test_exporter (run by make check)
+ *
+ * A histogram is registered along with a gauge. Its samples keep their
+ * _bucket, _sum and _count suffix in remote write requests and once a
+ * job label is added, each with its own label set.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "exporter.h"
+#include "metrics.h"
+
+#define TEST_MAX_SERIES 16
+
+static const char *const __histogram[] =
+{
+	"test_seconds_bucket{le=\"0.5\"}",
+	"test_seconds_bucket{le=\"+Inf\"}",
+	"test_seconds_sum",
+	"test_seconds_count",
+	NULL
+};
+
+/*************************
+* WRITE REQUEST DECODING *
+*************************/
+
+typedef struct
+{
+	const uint8_t *p;
+	const uint8_t *end;
+}pb_reader_t;
+
+static int __pb_varint(pb_reader_t *r, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+
+	while( (r->p < r->end) && (shift < 64) )
+	{
+		uint8_t b = *(r->p++);
+
+		*v    |= (uint64_t)(b & 0x7F) << shift;
+		shift += 7;
+
+		if(!(b & 0x80) )
+		{
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Next length delimited field (the only ones holding labels), others are skipped */
+static int __pb_field(pb_reader_t *r, int *field, pb_reader_t *sub)
+{
+	uint64_t tag, value;
+
+	if(__pb_varint(r, &tag) )
+	{
+		return -1;
+	}
+
+	*field = tag >> 3;
+
+	switch(tag & 7)
+	{
+		case 0:
+			sub->p = sub->end = NULL;
+			return __pb_varint(r, &value);
+
+		case 1:
+			if(r->end - r->p < 8)
+			{
+				return -1;
+			}
+
+			sub->p = sub->end = NULL;
+			r->p  += 8;
+			return 0;
+
+		case 2:
+			if(__pb_varint(r, &value) || ( (uint64_t)(r->end - r->p) < value) )
+			{
+				return -1;
+			}
+
+			sub->p   = r->p;
+			sub->end = r->p + value;
+			r->p    += value;
+			return 0;
+	}
+
+	return -1;
+}
+
+/* Name of a TimeSeries as in the text exposition (labels are sorted) */
+static int __pb_series(pb_reader_t *r, char *out, size_t size)
+{
+	char        name[METRIC_STRING_SIZE] = "";
+	char        labels[METRIC_STRING_SIZE] = "";
+	size_t      labels_len = 0;
+	int         field;
+	pb_reader_t sub;
+
+	while(r->p < r->end)
+	{
+		if(__pb_field(r, &field, &sub) )
+		{
+			return -1;
+		}
+
+		if(field != 1)
+		{
+			continue;
+		}
+
+		char key[METRIC_STRING_SIZE] = "";
+		char val[METRIC_STRING_SIZE] = "";
+
+		while(sub.p < sub.end)
+		{
+			pb_reader_t str;
+
+			if(__pb_field(&sub, &field, &str) || !str.p)
+			{
+				return -1;
+			}
+
+			snprintf( (field == 1) ? key : val, METRIC_STRING_SIZE, "%.*s", (int)(str.end - str.p), str.p);
+		}
+
+		if(!strcmp(key, "__name__") )
+		{
+			snprintf(name, sizeof(name), "%s", val);
+		}
+		else if(labels_len < sizeof(labels) )
+		{
+			labels_len += snprintf(labels + labels_len, sizeof(labels) - labels_len, "%s%s=\"%s\"",
+			                       labels_len ? "," : "", key, val);
+		}
+	}
+
+	snprintf(out, size, "%s{%s}", name, labels);
+
+	return 0;
+}
+
+/* Series of a WriteRequest, returns their count (-1 if invalid) */
+static int __pb_write_request(const char *body, size_t len, char series[][METRIC_STRING_SIZE * 3])
+{
+	pb_reader_t r     = { (const uint8_t *)body, (const uint8_t *)body + len };
+	int         count = 0;
+	int         field;
+	pb_reader_t sub;
+
+	while(r.p < r.end)
+	{
+		if(__pb_field(&r, &field, &sub) || (field != 1) || (count == TEST_MAX_SERIES) ||
+		   __pb_series(&sub, series[count], METRIC_STRING_SIZE * 3) )
+		{
+			return -1;
+		}
+
+		count++;
+	}
+
+	return count;
+}
+
+/*********
+* TESTS *
+*********/
+
+static int __has(char series[][METRIC_STRING_SIZE * 3], int count, const char *expected)
+{
+	int i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(!strcmp(series[i], expected) )
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int __test_remote_write(metric_array_t *ma)
+{
+	static const char *const expected[] =
+	{
+		"test_seconds_bucket{instance=\"node1\",le=\"0.5\"}",
+		"test_seconds_bucket{instance=\"node1\",le=\"+Inf\"}",
+		"test_seconds_sum{instance=\"node1\"}",
+		"test_seconds_count{instance=\"node1\"}",
+		"test_gauge{instance=\"node1\",rank=\"0\"}",
+		NULL
+	};
+
+	char                    series[TEST_MAX_SERIES][METRIC_STRING_SIZE * 3];
+	metric_array_snapshot_t snap;
+	uint64_t                cursor = 0;
+	uint64_t                samples;
+	size_t                  len;
+	int                     fails = 0;
+	int                     i;
+
+	memset(&snap, 0, sizeof(metric_array_snapshot_t) );
+
+	if(metric_array_snapshot_take(ma, &snap) )
+	{
+		fprintf(stderr, "FAIL could not take a snapshot\n");
+		return 1;
+	}
+
+	char *body = tau_metric_exporter_render_remote_write(&snap, &cursor, 0, 0, 1, "instance=\"node1\"", TEST_MAX_SERIES,
+	                                                     &len, &samples);
+
+	metric_array_snapshot_free(&snap);
+
+	int count = body ? __pb_write_request(body, len, series) : -1;
+
+	free(body);
+
+	if(count != (int)samples)
+	{
+		fprintf(stderr, "FAIL remote write: %d series decoded, %lu rendered\n", count, samples);
+		return 1;
+	}
+
+	for(i = 0; expected[i]; i++)
+	{
+		if(!__has(series, count, expected[i]) )
+		{
+			fprintf(stderr, "FAIL remote write: no %s\n", expected[i]);
+			fails++;
+		}
+	}
+
+	if(count != i)
+	{
+		fprintf(stderr, "FAIL remote write: %d series, expected %d\n", count, i);
+		fails++;
+	}
+
+	if(!fails)
+	{
+		fprintf(stdout, "PASS remote write of a histogram\n");
+	}
+
+	return fails;
+}
+
+static int __test_job_label(metric_array_t *ma, tau_metric_format_t format, const char *what)
+{
+	static const char *const expected[] =
+	{
+		"\ntest_seconds_bucket{jobid=\"42\",le=\"0.5\"} ",
+		"\ntest_seconds_bucket{jobid=\"42\",le=\"+Inf\"} ",
+		"\ntest_seconds_sum{jobid=\"42\"} ",
+		"\ntest_seconds_count{jobid=\"42\"} ",
+		"\ntest_gauge{jobid=\"42\",rank=\"0\"} ",
+		NULL
+	};
+
+	metric_array_snapshot_t snap;
+	size_t                  len;
+	int                     fails = 0;
+	int                     i;
+
+	memset(&snap, 0, sizeof(metric_array_snapshot_t) );
+
+	char *body = tau_metric_exporter_render(ma, &snap, NULL, "jobid=\"42\"", format, 4096, &len);
+
+	metric_array_snapshot_free(&snap);
+
+	if(!body)
+	{
+		fprintf(stderr, "FAIL job label (%s): could not render\n", what);
+		return 1;
+	}
+
+	for(i = 0; expected[i]; i++)
+	{
+		if(!strstr(body, expected[i]) )
+		{
+			fprintf(stderr, "FAIL job label (%s): no%s\n", what, expected[i]);
+			fails++;
+		}
+	}
+
+	if(fails)
+	{
+		fprintf(stderr, "%s", body);
+	}
+	else
+	{
+		fprintf(stdout, "PASS job label on a histogram (%s)\n", what);
+	}
+
+	free(body);
+
+	return fails;
+}
+
+int main(void)
+{
+	metric_array_t ma;
+	int            fails = 0;
+	int            i;
+
+	metric_array_init_sized(&ma, 64, 0);
+	metric_array_set_families(&ma, METRIC_FAMILY_TABLE_SIZE);
+
+	for(i = 0; __histogram[i]; i++)
+	{
+		metric_t *m = metric_array_get_or_register(&ma, __histogram[i], "A histogram", TAU_METRIC_HISTOGRAM);
+
+		if(!m)
+		{
+			fprintf(stderr, "FAIL could not register %s\n", __histogram[i]);
+			return 1;
+		}
+
+		metric_set(m, i + 1);
+	}
+
+	metric_t *gauge = metric_array_get_or_register(&ma, "test_gauge{rank=\"0\"}", "A gauge", TAU_METRIC_GAUGE);
+
+	if(!gauge)
+	{
+		fprintf(stderr, "FAIL could not register the gauge\n");
+		return 1;
+	}
+
+	metric_set(gauge, 2.0);
+
+	fails += __test_remote_write(&ma);
+	fails += __test_job_label(&ma, TAU_METRIC_FORMAT_TEXT, "text");
+	fails += __test_job_label(&ma, TAU_METRIC_FORMAT_OPENMETRICS, "openmetrics");
+
+	metric_array_release(&ma);
+
+	return fails ? 1 : 0;
+}
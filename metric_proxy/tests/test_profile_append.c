@@ -0,0 +1,187 @@
+/* Appending to profiles with a torn or corrupted tail
+ *
+ * usage: test_profile_append (run by make check)
+ *
+ * A profile holding one counter is grown by appending the same dump,
+ * its last segment being first zeroed then cut in the middle. The
+ * damaged segment must be dropped before appending: the counter then
+ * counts the segments which are still readable.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "profile.h"
+
+#define TEST_COUNTER 7.5
+
+static tau_metric_dump_t *__dump(void)
+{
+	tau_metric_dump_t *dump = calloc(1, sizeof(tau_metric_dump_t) + 2 * sizeof(tau_metric_snapshot_t) );
+
+	if(!dump)
+	{
+		return NULL;
+	}
+
+	snprintf(dump->desc.jobid, sizeof(dump->desc.jobid), "1234");
+	snprintf(dump->desc.command, sizeof(dump->desc.command), "test");
+	dump->metric_count = 2;
+
+	dump->metrics[0].type = TAU_METRIC_COUNTER;
+	snprintf(dump->metrics[0].event.name, METRIC_STRING_SIZE, "test_counter");
+	snprintf(dump->metrics[0].doc, METRIC_STRING_SIZE, "A counter");
+	dump->metrics[0].event.value = TEST_COUNTER;
+
+	dump->metrics[1].type = TAU_METRIC_GAUGE;
+	snprintf(dump->metrics[1].event.name, METRIC_STRING_SIZE, "test_gauge");
+	snprintf(dump->metrics[1].doc, METRIC_STRING_SIZE, "A gauge");
+	dump->metrics[1].event.value = 2.0;
+
+	return dump;
+}
+
+/* Counter value and segments of the profile, -1 if unreadable */
+static double __counter(const char *path, uint64_t *segments)
+{
+	tau_metric_dump_view_t  view;
+	tau_metric_dump_entry_t e;
+	uint64_t                i;
+	double                  ret = -1;
+
+	if(tau_metric_dump_view_open(&view, path) )
+	{
+		return -1;
+	}
+
+	for(i = 0; i < view.count; i++)
+	{
+		if(!tau_metric_dump_view_get(&view, i, &e) && !strcmp(e.name, "test_counter") )
+		{
+			ret = e.value;
+		}
+	}
+
+	*segments = view.segments;
+	tau_metric_dump_view_close(&view);
+
+	return ret;
+}
+
+static int __append(const char *profile, const char *dump_path)
+{
+	tau_metric_dump_view_t view;
+
+	if(tau_metric_dump_view_open(&view, dump_path) )
+	{
+		return 1;
+	}
+
+	int ret = tau_metric_profile_append( (char *)profile, &view);
+
+	tau_metric_dump_view_close(&view);
+
+	return ret;
+}
+
+static int __check(const char *what, const char *codec, const char *profile, uint64_t segments)
+{
+	uint64_t found = 0;
+	double   value = __counter(profile, &found);
+
+	if( (found != segments) || (value != segments * TEST_COUNTER) )
+	{
+		fprintf(stderr, "FAIL %s (%s): %lu segments counter %g, expected %lu and %g\n", what, codec, found, value,
+		        segments, segments * TEST_COUNTER);
+		return 1;
+	}
+
+	fprintf(stdout, "PASS %s (%s)\n", what, codec);
+
+	return 0;
+}
+
+/* Zeroes the payload of the last segment, its header stays valid */
+static int __zero_tail(const char *profile, size_t segment_len)
+{
+	struct stat st;
+	int         fd = open(profile, O_WRONLY);
+
+	if( (fd < 0) || fstat(fd, &st) )
+	{
+		return 1;
+	}
+
+	size_t payload_len = segment_len - sizeof(tau_metric_dump_header_t);
+	char * zeros       = calloc(1, payload_len);
+	int    ret         = !zeros || (pwrite(fd, zeros, payload_len, st.st_size - payload_len) != (ssize_t)payload_len);
+
+	free(zeros);
+	close(fd);
+
+	return ret;
+}
+
+static int __test(const char *codec, tau_metric_dump_t *dump, const char *dump_path, const char *profile)
+{
+	struct stat st;
+	int         fails = 0;
+
+	tau_metric_dump_set_codec(codec);
+
+	if(tau_metric_dump_write(dump_path, dump) || tau_metric_dump_write(profile, dump) || stat(dump_path, &st) )
+	{
+		fprintf(stderr, "FAIL could not write the dump (%s)\n", codec);
+		return 1;
+	}
+
+	size_t segment_len = st.st_size;
+
+	fails += __append(profile, dump_path) || __check("append", codec, profile, 2);
+
+	/* A header followed by a bad payload */
+	fails += __zero_tail(profile, segment_len) || __append(profile, dump_path) ||
+	         __check("append after a zeroed segment", codec, profile, 2);
+
+	/* A segment cut in the middle */
+	fails += truncate(profile, 2 * segment_len - segment_len / 2) || __append(profile, dump_path) ||
+	         __check("append after a torn segment", codec, profile, 2);
+
+	/* Only a part of its header */
+	fails += truncate(profile, segment_len + sizeof(tau_metric_dump_header_t) / 2) || __append(profile, dump_path) ||
+	         __check("append after a torn header", codec, profile, 2);
+
+	return fails;
+}
+
+int main(void)
+{
+	char dump_path[64];
+	char profile[64];
+
+	snprintf(dump_path, sizeof(dump_path), "/tmp/test_profile_append.%d.taumetric", getpid() );
+	snprintf(profile, sizeof(profile), "/tmp/test_profile_append.%d.profile", getpid() );
+
+	tau_metric_dump_t *dump = __dump();
+
+	if(!dump)
+	{
+		return 1;
+	}
+
+	int fails = __test("none", dump, dump_path, profile) + __test("snappy", dump, dump_path, profile);
+
+#ifdef TAU_METRIC_PROXY_ZLIB_ENABLED
+	fails += __test("zlib", dump, dump_path, profile);
+#endif
+
+	free(dump);
+	unlink(dump_path);
+	unlink(profile);
+
+	return fails ? 1 : 0;
+}